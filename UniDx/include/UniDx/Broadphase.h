@@ -0,0 +1,293 @@
+﻿#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include "Bounds.h"
+#include "DynamicAABBTree.h"
+
+
+namespace UniDx
+{
+
+// ブロードフェーズが抽出するペア（シェイプのインデクス、a < b）
+struct BroadphasePair
+{
+    int a;
+    int b;
+};
+
+
+// ペアを作るかどうかの条件
+// 互いのレイヤーのビットが相手の collisionMask に含まれるときだけペアにする
+struct BroadphaseFilter
+{
+    uint32_t layerBit = 1;          // 1 << レイヤー
+    uint32_t collisionMask = ~0u;   // 衝突するレイヤーのビット
+    bool isStatic = false;          // Rigidbody がない。静的なもの同士はペアにしない
+
+    static bool shouldPair(const BroadphaseFilter& a, const BroadphaseFilter& b)
+    {
+        if (a.isStatic && b.isStatic) return false;
+        return (a.layerBit & b.collisionMask) != 0 && (b.layerBit & a.collisionMask) != 0;
+    }
+};
+
+
+// 範囲検索の結果を受け取るコールバック
+class BroadphaseQueryCallback
+{
+public:
+    // 範囲が重なるシェイプのインデクスを受け取る。false を返すと検索を打ち切る
+    virtual bool reportShape(int shapeIndex) = 0;
+};
+
+
+// レイキャストの結果を受け取るコールバック
+class BroadphaseRaycastCallback
+{
+public:
+    // 線分と範囲が重なるシェイプのインデクスを受け取り、以降の最大距離を返す。0以下で打ち切り
+    virtual float reportShape(int shapeIndex, float maxDistance) = 0;
+};
+
+
+// --------------------
+// Broadphase基底クラス
+//
+// プロキシ（シェイプごとの登録情報）の管理を共通で行い、
+// ペアの抽出方法を派生クラスで実装する
+// --------------------
+class Broadphase
+{
+public:
+    virtual ~Broadphase() {}
+
+    // プロキシを作成してIDを返す
+    int createProxy(const Bounds& bounds, int shapeIndex);
+
+    // プロキシを削除
+    void destroyProxy(int proxyId);
+
+    // プロキシの範囲とシェイプのインデクスを更新
+    void updateProxy(int proxyId, const Bounds& bounds, int shapeIndex);
+
+    // プロキシのペアの条件を設定。条件を満たさないペアは findPairs で列挙されない
+    void setFilter(int proxyId, const BroadphaseFilter& filter) { proxies[proxyId].filter = filter; }
+
+    // 範囲が重なっている可能性のあるペアを列挙する
+    // ペアの順序は不定なので、必要なら呼び出し側で並べ替える
+    virtual void findPairs(std::vector<BroadphasePair>& pairs) = 0;
+
+    // 範囲と重なる可能性のあるシェイプを列挙する。基底クラスでは総当たり
+    virtual void query(const Bounds& bounds, BroadphaseQueryCallback& callback) const;
+
+    // 線分と重なる可能性のあるシェイプを列挙する。基底クラスでは総当たり
+    // direction は正規化されていること。radius を指定すると、その半径の球を動かした範囲で調べる
+    virtual void raycast(Vector3 origin, Vector3 direction, float maxDistance, BroadphaseRaycastCallback& callback, float radius = 0.0f) const;
+
+protected:
+    struct Proxy
+    {
+        Bounds bounds;
+        int shapeIndex;
+        bool active;
+        BroadphaseFilter filter;
+    };
+    std::vector<Proxy> proxies;
+    std::vector<int> freeProxies;
+
+    // 派生クラスへの通知
+    virtual void onCreateProxy(int proxyId) {}
+    virtual void onDestroyProxy(int proxyId) {}
+    virtual void onUpdateProxy(int proxyId) {}
+
+    // ペアを追加。条件で除外されるペアは追加しない
+    void addPair(std::vector<BroadphasePair>& pairs, int proxyA, int proxyB) const
+    {
+        if (!BroadphaseFilter::shouldPair(proxies[proxyA].filter, proxies[proxyB].filter)) return;
+
+        int a = proxies[proxyA].shapeIndex;
+        int b = proxies[proxyB].shapeIndex;
+        pairs.push_back(a < b ? BroadphasePair{ a, b } : BroadphasePair{ b, a });
+    }
+};
+
+
+// --------------------
+// BruteForceBroadphase
+//
+// 全組み合わせを調べる O(n^2) の比較用実装
+// --------------------
+class BruteForceBroadphase : public Broadphase
+{
+public:
+    virtual void findPairs(std::vector<BroadphasePair>& pairs) override;
+};
+
+
+// --------------------
+// SweepAndPruneBroadphase
+//
+// 1軸に射影した端点リストをステップ間で保持し、挿入ソートで並べ直す。
+// 物体は1ステップでわずかしか動かないので、ほぼ O(n) で整列が終わる。
+// 範囲検索とレイキャストは、最後の findPairs で整列した端点を二分探索して候補を絞る
+// その後に追加したプロキシと動いたプロキシは並んでいないので、別に順に調べる
+// --------------------
+class SweepAndPruneBroadphase : public Broadphase
+{
+public:
+    virtual void findPairs(std::vector<BroadphasePair>& pairs) override;
+    virtual void query(const Bounds& bounds, BroadphaseQueryCallback& callback) const override;
+    virtual void raycast(Vector3 origin, Vector3 direction, float maxDistance, BroadphaseRaycastCallback& callback, float radius = 0.0f) const override;
+
+protected:
+    virtual void onCreateProxy(int proxyId) override;
+    virtual void onDestroyProxy(int proxyId) override;
+    virtual void onUpdateProxy(int proxyId) override { markMoved(proxyId); }
+
+private:
+    // 端点。上位ビットにプロキシID、最下位ビットに最大側かどうか
+    struct Endpoint
+    {
+        float value;
+        uint32_t data;
+
+        int proxyId() const { return int(data >> 1); }
+        bool isMax() const { return (data & 1) != 0; }
+    };
+    std::vector<Endpoint> endpoints;
+    std::vector<int> active;
+    std::vector<int> activeIndex;
+    int axis = 0;
+    bool needsRemove = false;
+    size_t addedCount = 0;
+    float maxAxisSize = 0.0f;   // 整列したときの軸上の区間の最大の長さ
+
+    // 最後の findPairs より後に動いたプロキシ。並んだ端点の値が古いので、検索では順に調べる
+    std::vector<int> movedProxies;
+    std::vector<uint8_t> isMoved;
+
+    void markMoved(int proxyId);
+    bool moved(int proxyId) const { return size_t(proxyId) < isMoved.size() && isMoved[proxyId]; }
+
+    float axisValue(int proxyId, bool isMax) const;
+    void selectAxis();
+    void removeDestroyedEndpoints();
+    void sortEndpoints();
+
+    // 整列済みの端点の数と、値が value 以上・value より大きい最初の端点
+    size_t sortedCount() const { return endpoints.size() - std::min(addedCount, endpoints.size()); }
+    size_t lowerBound(float value) const;
+    size_t upperBound(float value) const;
+};
+
+
+// --------------------
+// AABBTreeBroadphase
+//
+// 太いBoundsの動的AABB木。大きさの違う物体が混在していても性能が落ちにくい。
+// 太いBoundsが重なるペアを覚えておき、木に挿入し直したプロキシ（move buffer）だけを木で検索して更新する。
+// 範囲検索とレイキャストにも同じ木を使う
+// --------------------
+class AABBTreeBroadphase : public Broadphase
+{
+public:
+    explicit AABBTreeBroadphase(float margin) : tree(margin) {}
+
+    virtual void findPairs(std::vector<BroadphasePair>& pairs) override;
+    virtual void query(const Bounds& bounds, BroadphaseQueryCallback& callback) const override;
+    virtual void raycast(Vector3 origin, Vector3 direction, float maxDistance, BroadphaseRaycastCallback& callback, float radius = 0.0f) const override;
+
+    const DynamicAABBTree& getTree() const { return tree; }
+
+protected:
+    virtual void onCreateProxy(int proxyId) override;
+    virtual void onDestroyProxy(int proxyId) override;
+    virtual void onUpdateProxy(int proxyId) override;
+
+private:
+    struct FatPair
+    {
+        int a;      // プロキシID。a < b
+        int b;
+    };
+
+    DynamicAABBTree tree;
+    std::vector<int> treeProxies;   // プロキシIDから木の葉へ
+    std::vector<int> moveBuffer;    // 前の findPairs から木に挿入し直したか削除したプロキシ
+    std::vector<uint8_t> moved;     // プロキシIDごとに moveBuffer に入っているか
+    std::vector<FatPair> fatPairs;  // 太いBoundsが重なるペア
+
+    void markMoved(int proxyId);
+};
+
+
+// --------------------
+// SpatialHashBroadphase
+//
+// 一様グリッドのセルをハッシュ表に格納する。同じくらいの大きさの物体が密集している場合に速い。
+// セルの大きさは登録された物体の大きさの分布から自動で決める。
+// 大きな物体はセルを levelScale 倍ずつ粗くした階層に入れ、細かい階層の物体から粗い階層のセルを引いてペアにする。
+// 作業用の配列はステップ間で使い回すので、要素数が増えない限りヒープ確保は起きない
+// --------------------
+class SpatialHashBroadphase : public Broadphase
+{
+public:
+    virtual void findPairs(std::vector<BroadphasePair>& pairs) override;
+    virtual void query(const Bounds& bounds, BroadphaseQueryCallback& callback) const override;
+    virtual void raycast(Vector3 origin, Vector3 direction, float maxDistance, BroadphaseRaycastCallback& callback, float radius = 0.0f) const override;
+
+    float getCellSize() const { return cellSizes[0]; }
+
+protected:
+    virtual void onCreateProxy(int proxyId) override { markDirty(proxyId); }
+    virtual void onDestroyProxy(int proxyId) override { markDirty(proxyId); }
+    virtual void onUpdateProxy(int proxyId) override { markDirty(proxyId); }
+
+private:
+    // 1軸あたりこのセル数を超える物体は、セルが levelScale 倍の次の階層に入れる
+    static constexpr int maxCellsPerAxis = 3;
+    static constexpr int levelCount = 8;
+    static constexpr float levelScale = 4.0f;
+
+    struct Cell
+    {
+        int x, y, z;
+        int level;
+        bool operator==(const Cell& c) const { return x == c.x && y == c.y && z == c.z && level == c.level; }
+    };
+    struct Entry
+    {
+        Cell cell;
+        int proxyId;
+    };
+
+    float cellSizes[levelCount] = { 1.0f };     // 階層ごとのセルの大きさ
+    float invCellSizes[levelCount] = { 1.0f };
+    uint32_t tableMask = 0;
+
+    std::vector<float> sizes;       // セルの大きさを決めるための作業用
+    std::vector<Entry> entries;     // 物体が重なるセルの一覧
+    std::vector<Entry> sorted;      // entries をバケット順に並べたもの
+    std::vector<uint32_t> bucketStart;
+    std::vector<int8_t> levels;     // プロキシIDごとの階層。-1 は一番粗い階層にも入らない物体
+    std::vector<int> oversized;     // 一番粗い階層にも入らない物体。総当たりで調べる
+    uint32_t usedLevels = 0;        // 物体が入っている階層のビット
+    Bounds gridBounds;              // グリッドに入れた物体全体の範囲
+
+    // 表を作ったあとに作成、削除、更新したプロキシ。シーンクエリでは表のエントリを使わず個別に調べる
+    std::vector<int> dirtyProxies;
+    std::vector<uint8_t> isDirty;
+
+    void updateCellSize();
+    void buildTable();
+    void markDirty(int proxyId);
+    bool dirty(int proxyId) const { return size_t(proxyId) < isDirty.size() && isDirty[proxyId]; }
+    int levelOf(const Bounds& bounds) const;
+    Cell cellOf(Vector3 point, int level = 0) const;
+    uint32_t bucketOf(const Cell& cell) const;
+};
+
+} // namespace UniDx
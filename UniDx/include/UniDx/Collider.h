@@ -4,13 +4,14 @@
 #include "Component.h"
 #include "Bounds.h"
 #include "Physics.h"
+#include "ConvexGeometry.h"
+#include "TriangleMeshBVH.h"
+#include "Heightfield.h"
 
 namespace UniDx
 {
 
 class Rigidbody;
-class SphereCollider;
-class AABBCollider;
 
 // --------------------
 // Collider基底クラス
@@ -19,37 +20,101 @@ class Collider : public Component
 {
 public:
     Rigidbody* attachedRigidbody = nullptr;
+    // Rigidbody のないコライダーどうしは判定しないので、静的なトリガーは静的なコライダーに Enter を呼ばない
+    // 静的なものを検知するトリガーには isKinematic の Rigidbody を付ける
     bool isTrigger = false;
 
     // 物理マテリアル
     float bounciness = 0.75f;
+    float friction = 0.4f;
 
     virtual void OnEnable() override
     {
         attachedRigidbody = findNearestRigidbody(transform);
-        Physics::getInstance()->register3d(this);
+        shapeHandle_ = Physics::getInstance()->register3d(this);
+        updateWorldShape();
     }
 
     virtual void OnDisable() override
     {
-        Physics::getInstance()->unregister3d(this);
+        Physics::getInstance()->unregister3d(shapeHandle_);
+        shapeHandle_ = PhysicsShapeHandle();
     }
 
+    // Physics 上のハンドル。登録されていなければ無効
+    PhysicsShapeHandle getShapeHandle() const { return shapeHandle_; }
+
+    // ステップの間に Transform を動かしたことを知らせる。次のシーンクエリはこのコライダーだけ形状を求め直して動かした位置で判定する
+    void markTransformChanged() { Physics::getInstance()->markShapeMoved(shapeHandle_); }
+
     // ワールド空間における空間境界を取得
     virtual Bounds getBounds() const = 0;
 
+    // ワールド空間の凸形状。専用の判定がない組み合わせは GJK/EPA で判定する
+    virtual ConvexGeometry getGeometry() const = 0;
+
+    // ステップ中のワールド空間の行列と形状と境界
+    // Physics がステップの始めに updateWorldShape() でまとめて求め、衝突判定と CCD はこれを読む。
+    // ステップは別スレッドで進むことがあるので、ステップの中から Transform は読まない。
+    // ステップの終わりに動いた剛体の分だけ求め直し、シーンクエリはそれを読む。
+    // ステップの間に Transform を動かしたら markTransformChanged() で知らせる
+    const Matrix& getWorldMatrix() const { return worldMatrix_; }
+    const ConvexGeometry& getWorldGeometry() const { return worldGeometry_; }
+    const Bounds& getWorldBounds() const { return worldBounds_; }
+    void updateWorldShape();
+
+    // 形状の種類
+    ColliderType getType() const { return type_; }
+
+    // 形状の組み合わせごとの判定関数。a が typeA、b が typeB のコライダーで呼ぶ
+    using TriggerFunc = bool(*)(Collider* a, Collider* b);
+    using IntersectFunc = bool(*)(Collider* a, Collider* b, const PhysicsShape* shapeA, const PhysicsShape* shapeB, NarrowphaseBuffer& buffer);
+    using ContactsFunc = bool(*)(Collider* a, Collider* b, ContactManifold& m);
+    static TriggerFunc getTriggerFunc(ColliderType typeA, ColliderType typeB);
+    static IntersectFunc getIntersectFunc(ColliderType typeA, ColliderType typeB);
+    static ContactsFunc getContactsFunc(ColliderType typeA, ColliderType typeB);
+
     // トリガーチェック
-    virtual bool checkTrigger(Collider* other) = 0;
-    virtual bool checkTrigger(SphereCollider* other) = 0;
-    virtual bool checkTrigger(AABBCollider* other) = 0;
+    bool checkTrigger(Collider* other) { return getTriggerFunc(type_, other->type_)(this, other); }
 
     // 衝突チェック
-    // 衝突していれば attachedRigidbody に addCorrectPosition(), addCorrectVelocity() で補正する
-    virtual bool checkIntersect(Collider* other, PhysicsActor* myActor, PhysicsActor* otherActor) = 0;
-    virtual bool checkIntersect(SphereCollider* other, PhysicsActor* myActor, PhysicsActor* otherActor) = 0;
-    virtual bool checkIntersect(AABBCollider* other, PhysicsActor* myActor, PhysicsActor* otherActor) = 0;
+    // 衝突していれば buffer に addCorrectPosition(), addCorrectVelocity() で補正を記録する
+    // 速度と質量はシェイプの bodyIndex で buffer.bodies から読む
+    bool checkIntersect(Collider* other, const PhysicsShape* myShape, const PhysicsShape* otherShape, NarrowphaseBuffer& buffer)
+    {
+        return getIntersectFunc(type_, other->type_)(this, other, myShape, otherShape, buffer);
+    }
+
+    // バッチ判定（PhysicsKernels）で見つけた球と球、球と AABB の接触から、衝突チェックと同じ補正を buffer に記録する
+    // sphere は球、other は球か AABB で、contact の法線は球から相手向き
+    static bool correctContact(Collider* sphere, Collider* other, const PhysicsShape* sphereShape, const PhysicsShape* otherShape, const KernelContact& contact, NarrowphaseBuffer& buffer);
+
+    // 接触点の作成
+    // 重なっていれば m の contacts, numContacts に自分から相手への法線で接触点を書き込む
+    bool getContacts(Collider* other, ContactManifold& m) { return getContactsFunc(type_, other->type_)(this, other, m); }
+
+    // シーンクエリ。形状は getWorldGeometry(), getWorldBounds() など最後に求めた状態を使う
+    // 線分 origin + direction * t (0 <= t <= maxDistance) との最初の交点。direction は正規化されていること
+    // 始点がコライダーの内側にある場合は当たらない
+    virtual bool raycast(Vector3 origin, Vector3 direction, float maxDistance, RaycastHit& hit) const = 0;
+
+    // 半径 radius の球を動かしたときに最初に触れる点。始点で重なっている場合は当たらない
+    virtual bool sphereCast(Vector3 origin, float radius, Vector3 direction, float maxDistance, RaycastHit& hit) const = 0;
+
+    // 球、AABB と重なっているか
+    virtual bool overlapSphere(Vector3 center, float radius) const = 0;
+    virtual bool overlapBox(const Bounds& box) const = 0;
+
+protected:
+    explicit Collider(ColliderType type) : type_(type) {}
 
 private:
+    const ColliderType type_;
+    PhysicsShapeHandle shapeHandle_;
+    Matrix worldMatrix_ = Matrix::Identity;
+    ConvexGeometry worldGeometry_ = {};
+    Bounds worldBounds_;
+
     Rigidbody* findNearestRigidbody(Transform* t) const;
 };
 
@@ -60,24 +125,22 @@ private:
 class AABBCollider : public Collider
 {
 public:
+    static constexpr ColliderType colliderType = ColliderType::AABB;
+
     Vector3 center;
     Vector3 size;
 
-    AABBCollider() : center(Vector3::Zero), size(Vector3(0.5f,0.5f,0.5f)) {}
+    AABBCollider() : Collider(colliderType), center(Vector3::Zero), size(Vector3(0.5f,0.5f,0.5f)) {}
 
     // ワールド空間における空間境界を取得
     virtual Bounds getBounds() const override;
+    virtual ConvexGeometry getGeometry() const override;
 
-    // トリガーチェック
-    virtual bool checkTrigger(Collider* other) { return other->checkTrigger(this); };
-    virtual bool checkTrigger(SphereCollider* other);
-    virtual bool checkTrigger(AABBCollider* other);
-
-    // 衝突チェック
-    // 衝突していれば attachedRigidbody に addCorrectPosition(), addCorrectVelocity() で補正する
-    virtual bool checkIntersect(Collider* other, PhysicsActor* myActor, PhysicsActor* otherActor) { return other->checkIntersect(this, otherActor, myActor); }
-    virtual bool checkIntersect(SphereCollider* other, PhysicsActor* myActor, PhysicsActor* otherActor);
-    virtual bool checkIntersect(AABBCollider* other, PhysicsActor* myActor, PhysicsActor* otherActor);
+    // シーンクエリ
+    virtual bool raycast(Vector3 origin, Vector3 direction, float maxDistance, RaycastHit& hit) const override;
+    virtual bool sphereCast(Vector3 origin, float radius, Vector3 direction, float maxDistance, RaycastHit& hit) const override;
+    virtual bool overlapSphere(Vector3 center, float radius) const override;
+    virtual bool overlapBox(const Bounds& box) const override;
 };
 
 
@@ -87,24 +150,197 @@ public:
 class SphereCollider : public Collider
 {
 public:
+    static constexpr ColliderType colliderType = ColliderType::Sphere;
+
     Vector3 center;
     float radius;
 
-    SphereCollider() : center(Vector3::Zero), radius(0.5) {}
+    SphereCollider() : Collider(colliderType), center(Vector3::Zero), radius(0.5) {}
 
     // ワールド空間における空間境界を取得
     virtual Bounds getBounds() const override;
+    virtual ConvexGeometry getGeometry() const override;
 
-    // トリガーチェック
-    virtual bool checkTrigger(Collider* other) { return other->checkTrigger(this); };
-    virtual bool checkTrigger(SphereCollider* other);
-    virtual bool checkTrigger(AABBCollider* other);
+    // シーンクエリ
+    virtual bool raycast(Vector3 origin, Vector3 direction, float maxDistance, RaycastHit& hit) const override;
+    virtual bool sphereCast(Vector3 origin, float radius, Vector3 direction, float maxDistance, RaycastHit& hit) const override;
+    virtual bool overlapSphere(Vector3 center, float radius) const override;
+    virtual bool overlapBox(const Bounds& box) const override;
+};
 
-    // 衝突チェック
-    // 衝突していれば attachedRigidbody に addCorrectPosition(), addCorrectVelocity() で補正する
-    virtual bool checkIntersect(Collider* other, PhysicsActor* myActor, PhysicsActor* otherActor) { return other->checkIntersect(this, otherActor, myActor); }
-    virtual bool checkIntersect(SphereCollider* other, PhysicsActor* myActor, PhysicsActor* otherActor);
-    virtual bool checkIntersect(AABBCollider* other, PhysicsActor* myActor, PhysicsActor* otherActor);
+
+// --------------------
+// BoxCollider
+//
+// Transform の回転に合わせて向きが変わる箱
+// --------------------
+class BoxCollider : public Collider
+{
+public:
+    static constexpr ColliderType colliderType = ColliderType::Box;
+
+    Vector3 center;
+    Vector3 size;   // 全長
+
+    BoxCollider() : Collider(colliderType), center(Vector3::Zero), size(Vector3(1.0f, 1.0f, 1.0f)) {}
+
+    // ワールド空間における空間境界を取得
+    virtual Bounds getBounds() const override;
+    virtual ConvexGeometry getGeometry() const override;
+
+    // シーンクエリ
+    virtual bool raycast(Vector3 origin, Vector3 direction, float maxDistance, RaycastHit& hit) const override;
+    virtual bool sphereCast(Vector3 origin, float radius, Vector3 direction, float maxDistance, RaycastHit& hit) const override;
+    virtual bool overlapSphere(Vector3 center, float radius) const override;
+    virtual bool overlapBox(const Bounds& box) const override;
+};
+
+
+// --------------------
+// CapsuleCollider
+//
+// direction の軸に沿った線分の周りに半径 radius の厚みを付けた形状
+// --------------------
+class CapsuleCollider : public Collider
+{
+public:
+    static constexpr ColliderType colliderType = ColliderType::Capsule;
+
+    Vector3 center;
+    float radius;
+    float height;   // 両端の半球を含めた全長
+    int direction;  // 0:X軸 1:Y軸 2:Z軸
+
+    CapsuleCollider() : Collider(colliderType), center(Vector3::Zero), radius(0.5f), height(2.0f), direction(1) {}
+
+    // ワールド空間における空間境界を取得
+    virtual Bounds getBounds() const override;
+    virtual ConvexGeometry getGeometry() const override;
+
+    // シーンクエリ
+    virtual bool raycast(Vector3 origin, Vector3 direction, float maxDistance, RaycastHit& hit) const override;
+    virtual bool sphereCast(Vector3 origin, float radius, Vector3 direction, float maxDistance, RaycastHit& hit) const override;
+    virtual bool overlapSphere(Vector3 center, float radius) const override;
+    virtual bool overlapBox(const Bounds& box) const override;
+};
+
+
+// --------------------
+// MeshCollider
+//
+// 三角形メッシュの形状。Rigidbody のない、動かないゲームオブジェクトに付ける。
+// 球、カプセルとは接触点を作って衝突し、箱とはトリガーの判定だけ行う
+// --------------------
+class MeshCollider : public Collider
+{
+public:
+    static constexpr ColliderType colliderType = ColliderType::Mesh;
+
+    // 判定に使う BVH。同じメッシュのコライダーどうしで共有できる
+    std::shared_ptr<const TriangleMeshBVH> sharedMesh;
+
+    MeshCollider() : Collider(colliderType) {}
+
+    // sharedMesh がなければ、同じゲームオブジェクトの MeshRenderer のメッシュから作る
+    virtual void OnEnable() override;
+
+    // サブメッシュから BVH を作って sharedMesh にする
+    void build(const std::vector<std::shared_ptr<SubMesh>>& submeshes);
+
+    // ワールド空間における空間境界を取得
+    virtual Bounds getBounds() const override;
+
+    // 凸形状としては境界の箱で近似する
+    virtual ConvexGeometry getGeometry() const override;
+
+    // シーンクエリ
+    virtual bool raycast(Vector3 origin, Vector3 direction, float maxDistance, RaycastHit& hit) const override;
+    virtual bool sphereCast(Vector3 origin, float radius, Vector3 direction, float maxDistance, RaycastHit& hit) const override;
+    virtual bool overlapSphere(Vector3 center, float radius) const override;
+    virtual bool overlapBox(const Bounds& box) const override;
+
+    // 範囲と重なる可能性のある三角形ごとに、ワールド座標の頂点で func(a, b, c, 三角形の番号) を呼ぶ
+    // func が false を返したら打ち切る
+    template<typename Func>
+    void forEachTriangle(const Bounds& worldBounds, Func&& func) const
+    {
+        if (sharedMesh == nullptr) return;
+
+        const Matrix& toWorld = getLocalToWorldMatrix();
+        sharedMesh->query(transformBounds(worldBounds, toWorld.Invert()), [&](int triangle) {
+            Vector3 a, b, c;
+            sharedMesh->getTriangle(triangle, a, b, c);
+            return func(Vector3::Transform(a, toWorld), Vector3::Transform(b, toWorld), Vector3::Transform(c, toWorld), triangle);
+            });
+    }
+
+    // 行列で移した箱を含む軸平行な箱
+    static Bounds transformBounds(const Bounds& bounds, const Matrix& matrix);
+
+private:
+    // 最後に updateWorldShape() で求めた行列
+    const Matrix& getLocalToWorldMatrix() const { return getWorldMatrix(); }
+};
+
+
+// --------------------
+// HeightfieldCollider
+//
+// 地形の高さの格子の形状。Rigidbody のない、動かないゲームオブジェクトに付ける。
+// transform->position が格子の (0, 0) で標本値 0 の位置になり、回転と拡大縮小は使わない。
+// 地面の下は中身が詰まっているものとして、下に潜った球は上へ押し出す
+// --------------------
+class HeightfieldCollider : public Collider
+{
+public:
+    static constexpr ColliderType colliderType = ColliderType::Heightfield;
+
+    // 高さの格子。同じ地形のコライダーどうしで共有できる
+    std::shared_ptr<const Heightfield> sharedHeightfield;
+
+    float cellSize = 1.0f;              // 標本の間隔
+    float heightScale = 1.0f / 256.0f;  // 標本値 1 あたりの高さ
+
+    HeightfieldCollider() : Collider(colliderType) {}
+
+    // ワールド座標 (x, z) の地面の高さ
+    float getHeight(float x, float z) const;
+
+    // ワールド空間における空間境界を取得
+    virtual Bounds getBounds() const override;
+
+    // 凸形状としては境界の箱で近似する
+    virtual ConvexGeometry getGeometry() const override;
+
+    // シーンクエリ
+    virtual bool raycast(Vector3 origin, Vector3 direction, float maxDistance, RaycastHit& hit) const override;
+    virtual bool sphereCast(Vector3 origin, float radius, Vector3 direction, float maxDistance, RaycastHit& hit) const override;
+    virtual bool overlapSphere(Vector3 center, float radius) const override;
+    virtual bool overlapBox(const Bounds& box) const override;
+
+    // 範囲と重なる可能性のある三角形ごとに、ワールド座標の頂点で func(a, b, c, 三角形の番号) を呼ぶ
+    // 範囲の真下のセルだけを見るので、調べる数は範囲の広さだけで決まる。func が false を返したら打ち切る
+    template<typename Func>
+    void forEachTriangle(const Bounds& worldBounds, Func&& func) const
+    {
+        if (sharedHeightfield == nullptr) return;
+
+        const Vector3 origin = getOrigin();
+        const Vector3 scale = getGridScale();
+        sharedHeightfield->query((worldBounds.min() - origin) / scale, (worldBounds.max() - origin) / scale, [&](int triangle) {
+            Vector3 a, b, c;
+            sharedHeightfield->getTriangle(triangle, a, b, c);
+            return func(origin + a * scale, origin + b * scale, origin + c * scale, triangle);
+            });
+    }
+
+    // ワールド座標 (x, z) の真上・真下にある三角形の番号と頂点。格子の外なら -1
+    int findTriangle(float x, float z, Vector3& a, Vector3& b, Vector3& c) const;
+
+private:
+    // 格子の原点と、格子座標からワールド座標への倍率。原点は最後に updateWorldShape() で求めた位置
+    Vector3 getOrigin() const { return getWorldMatrix().Translation(); }
+    Vector3 getGridScale() const { return Vector3(cellSize, heightScale, cellSize); }
 };
 
 
@@ -31,4 +31,16 @@ public:
 };
 
 
+// --------------------
+// RaycastHit情報
+// --------------------
+struct RaycastHit
+{
+    Collider* collider = nullptr;       // 当たったコライダー。当たらなければ nullptr
+    Vector3 point;                      // 当たった点
+    Vector3 normal;                     // 当たった面の法線
+    float distance = 0.0f;              // 始点からの距離
+};
+
+
 } // namespace UniDx
@@ -0,0 +1,102 @@
+﻿#pragma once
+
+#include <vector>
+#include <array>
+#include <cstdint>
+
+#include "Collision.h"
+
+
+namespace UniDx
+{
+
+class Collider;
+class PhysicsSnapshot;
+class PhysicsSnapshotReader;
+
+// --------------------
+// ContactPairTable
+//
+// 触れているコライダーのペアをステップをまたいで保持する表。
+// キーはシェイプIDの組で、オープンアドレス法のハッシュ表から要素の配列を引く。
+// ステップごとに触れたペアへ番号（stamp）を打ち、配列を1回なめるだけで Enter/Stay/Exit を決める
+// --------------------
+class ContactPairTable
+{
+public:
+    static constexpr int maxContacts = 4;
+
+    // ステップの開始。以降に touch されたペアが今回触れているペア
+    void beginStep() { ++stamp; }
+
+    // 触れているペアを記録。normals は a から b 向き
+    void touch(uint32_t idA, Collider* a, uint32_t idB, Collider* b, bool trigger,
+        const ContactPoint* contacts = nullptr, int numContacts = 0);
+
+    // Enter/Stay/Exit のコールバックを呼び、離れたペアを取り除く。呼んだコールバックの数を返す
+    // 今回 touch されなくても、どちらも動かない（Rigidbody がないか眠っている）ペアは前の接触点のまま Stay を呼ぶ
+    int dispatch();
+
+    // シェイプを含むペアをコールバックなしで取り除く
+    void removeShape(uint32_t id);
+
+    // isRemoved(id) が true になるシェイプを含むペアをコールバックなしで取り除く
+    template<typename Func>
+    void removeShapesIf(Func&& isRemoved)
+    {
+        assert(!dispatching);
+        for (auto& r : records)
+        {
+            if (isRemoved(uint32_t(r.key >> 32)) || isRemoved(uint32_t(r.key)))
+            {
+                r.removed = true;
+                needsCompact = true;
+            }
+        }
+        if (needsCompact) compact();
+    }
+
+    // スナップショットへの保存と復元。ハッシュ表は復元したあとに作り直す
+    void save(PhysicsSnapshot& snapshot) const;
+    void restore(PhysicsSnapshotReader& reader);
+
+    void clear();
+
+    // 保持しているペアの数
+    size_t size() const { return records.size(); }
+
+private:
+    static constexpr int32_t emptySlot = -1;
+
+    struct Record
+    {
+        uint64_t key;
+        Collider* a;        // IDの小さい方
+        Collider* b;
+        uint32_t stamp;     // 最後に触れたステップ
+        bool trigger;
+        bool entered;       // まだ Enter を呼んでいない
+        bool removed;
+        int numContacts;
+        std::array<ContactPoint, maxContacts> contacts;    // 法線は a から b 向き
+    };
+
+    std::vector<Record> records;    // 追加した順
+    std::vector<int32_t> slots;     // ハッシュ表。records のインデクス
+    uint32_t stamp = 0;
+    bool dispatching = false;
+    bool needsCompact = false;
+
+    // コールバックに渡す作業用。contacts の領域を使い回す
+    Collision collisionA;
+    Collision collisionB;
+
+    static uint64_t makeKey(uint32_t idA, uint32_t idB) { return (uint64_t(idA) << 32) | idB; }
+    size_t slotOf(uint64_t key) const;
+    int find(uint64_t key) const;
+    void rebuildSlots(size_t capacity);
+    void compact();
+    void fillCollisions(const Record& r);
+};
+
+} // namespace UniDx
@@ -0,0 +1,67 @@
+﻿#pragma once
+
+#include "UniDxDefine.h"
+#include "Bounds.h"
+
+
+namespace UniDx
+{
+
+// --------------------
+// ConvexContact
+//
+// 凸形状どうしの接触。法線は A から B 向き、point は2つの表面の中間
+// --------------------
+struct ConvexContact
+{
+    Vector3 point;
+    Vector3 normal;
+    float penetration;
+};
+
+
+// --------------------
+// ConvexGeometry
+//
+// ワールド空間の凸形状を「芯」と厚み（半径）で表したもの。
+// 芯は中心と3軸、軸ごとの半分の大きさで決まる箱で、大きさを全て0にすると点（球）、
+// 1軸だけにすると線分（カプセル）、厚みを0にすると向きのある箱になる。
+// 判定は GJK で芯どうしの最近点を求め、芯まで重なっている深い接触だけ EPA でめり込みを求める
+// --------------------
+struct ConvexGeometry
+{
+    Vector3 center;
+    Vector3 axes[3];        // 正規化された軸
+    Vector3 halfExtents;    // 芯の箱の軸ごとの半分の大きさ
+    float radius;           // 芯の周りの厚み
+
+    static ConvexGeometry sphere(Vector3 center, float radius);
+    static ConvexGeometry box(Vector3 center, const Vector3 axes[3], Vector3 halfExtents);
+    static ConvexGeometry aabb(const Bounds& bounds);
+    static ConvexGeometry capsule(Vector3 pointA, Vector3 pointB, float radius);
+
+    // 方向 dir に一番遠い芯の点、厚みを含めた表面の点
+    Vector3 supportCore(Vector3 dir) const;
+    Vector3 support(Vector3 dir) const;
+
+    // ワールド空間の境界
+    Bounds getBounds() const;
+
+    // 芯どうしの最近点を GJK で求める。芯が重なっていれば false
+    static bool closestCorePoints(const ConvexGeometry& a, const ConvexGeometry& b, Vector3& pointA, Vector3& pointB);
+
+    // 厚みを含めて重なっているか
+    static bool intersects(const ConvexGeometry& a, const ConvexGeometry& b);
+
+    // 接触を求める。浅い接触は芯の最近点から、深い接触は EPA で求める
+    static bool getContact(const ConvexGeometry& a, const ConvexGeometry& b, ConvexContact& contact);
+
+    // 半径 castRadius の球を origin から direction へ動かしたときに最初に触れる距離（保守的前進法）
+    // normal は形状から球の中心へ向く。始点で重なっている場合は当たらない
+    bool cast(Vector3 origin, float castRadius, Vector3 direction, float maxDistance, float& distance, Vector3& normal, Vector3& point) const;
+
+private:
+    static bool penetrationEPA(const ConvexGeometry& a, const ConvexGeometry& b, ConvexContact& contact);
+};
+
+} // namespace UniDx
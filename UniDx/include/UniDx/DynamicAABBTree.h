@@ -0,0 +1,158 @@
+﻿#pragma once
+
+#include <vector>
+#include <assert.h>
+
+#include "Bounds.h"
+
+
+namespace UniDx
+{
+
+// --------------------
+// DynamicAABBTree
+//
+// 葉に余裕（margin）を持たせた太いBoundsを格納する二分木。
+// 葉の範囲を出たときだけ挿入し直し、回転で高さのバランスを保つ
+// --------------------
+class DynamicAABBTree
+{
+public:
+    static constexpr int nullNode = -1;
+
+    explicit DynamicAABBTree(float margin = 0.1f) : margin_(margin) {}
+
+    // 葉を作成してIDを返す。userData は検索時に返される値
+    int createProxy(const Bounds& bounds, int userData);
+
+    // 葉を削除
+    void destroyProxy(int proxyId);
+
+    // 葉の範囲を更新。太いBoundsからはみ出したときだけ挿入し直して true を返す
+    bool moveProxy(int proxyId, const Bounds& bounds);
+
+    // 全ての葉を削除
+    void clear();
+
+    int getUserData(int proxyId) const { return nodes[proxyId].userData; }
+    void setUserData(int proxyId, int userData) { nodes[proxyId].userData = userData; }
+    const Bounds& getFatBounds(int proxyId) const { return nodes[proxyId].bounds; }
+    int getHeight() const { return root == nullNode ? 0 : nodes[root].height; }
+    float getMargin() const { return margin_; }
+
+    // 範囲と重なる葉を列挙する。callback(proxyId) が false を返すと打ち切り
+    template<typename Callback>
+    void query(const Bounds& bounds, Callback&& callback) const
+    {
+        if (root == nullNode) return;
+
+        TraversalStack stack;
+        stack.push(root);
+        while (!stack.empty())
+        {
+            int id = stack.pop();
+            const Node& node = nodes[id];
+            if (!node.bounds.Intersects(bounds)) continue;
+
+            if (node.isLeaf())
+            {
+                if (!callback(id)) return;
+            }
+            else
+            {
+                stack.push(node.child1);
+                stack.push(node.child2);
+            }
+        }
+    }
+
+    // 線分 origin + direction * t (0 <= t <= maxDistance) と重なる葉を列挙する
+    // direction は正規化されていること。radius を指定すると、その半径の球を動かした範囲と重なる葉を列挙する
+    // callback(proxyId, maxDistance) は以降の探索に使う最大距離を返す。0 以下なら打ち切り
+    template<typename Callback>
+    void raycast(Vector3 origin, Vector3 direction, float maxDistance, Callback&& callback, float radius = 0.0f) const
+    {
+        if (root == nullNode) return;
+
+        const Vector3 invDir = inverseDirection(direction);
+
+        TraversalStack stack;
+        stack.push(root);
+        while (!stack.empty())
+        {
+            int id = stack.pop();
+            const Node& node = nodes[id];
+            if (!rayIntersects(node.bounds, origin, invDir, maxDistance, radius)) continue;
+
+            if (node.isLeaf())
+            {
+                maxDistance = callback(id, maxDistance);
+                if (maxDistance <= 0.0f) return;
+            }
+            else
+            {
+                stack.push(node.child1);
+                stack.push(node.child2);
+            }
+        }
+    }
+
+    // 線分とBoundsの交差判定（スラブ法）。radius の分だけ Bounds を広げて判定する
+    static bool rayIntersects(const Bounds& bounds, Vector3 origin, Vector3 invDir, float maxDistance, float radius = 0.0f);
+    static Vector3 inverseDirection(Vector3 direction);
+
+private:
+    // 回転でバランスを取るので、高さはおおよそ 1.44 log2(n) に収まる
+    static constexpr int stackSize = 256;
+
+    // 探索用のスタック。固定長の配列からあふれた分は std::vector に積む
+    struct TraversalStack
+    {
+        int fixed[stackSize];
+        std::vector<int> overflow;
+        int count = 0;
+
+        bool empty() const { return count == 0; }
+
+        void push(int id)
+        {
+            if (count < stackSize) fixed[count] = id;
+            else overflow.push_back(id);
+            ++count;
+        }
+
+        int pop()
+        {
+            --count;
+            if (count < stackSize) return fixed[count];
+            const int id = overflow.back();
+            overflow.pop_back();
+            return id;
+        }
+    };
+
+    struct Node
+    {
+        Bounds bounds;
+        int parent;     // 空きノードのときは次の空きノード
+        int child1;
+        int child2;
+        int height;     // 葉は0、空きノードは-1
+        int userData;
+
+        bool isLeaf() const { return child1 == nullNode; }
+    };
+
+    std::vector<Node> nodes;
+    int root = nullNode;
+    int freeList = nullNode;
+    float margin_;
+
+    int allocateNode();
+    void freeNode(int id);
+    void insertLeaf(int leaf);
+    void removeLeaf(int leaf);
+    int balance(int a);
+};
+
+} // namespace UniDx
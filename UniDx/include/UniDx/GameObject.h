@@ -26,6 +26,9 @@ class GameObject : public Object
 public:
     Transform* transform;
 
+    // レイヤー（0～31）。Physics のレイヤー衝突マトリクスとクエリのマスクで使う
+    int layer = 0;
+
     const std::vector<std::unique_ptr<Component>>& GetComponents() { return components; }
 
     GameObject(const wstring& name = L"GameObject") : Object([this](){return name_;}), name_(name)
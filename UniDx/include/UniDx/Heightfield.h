@@ -0,0 +1,127 @@
+﻿#pragma once
+
+#include <vector>
+#include <string>
+#include <span>
+#include <cstdint>
+#include <algorithm>
+#include <cmath>
+
+#include "UniDxDefine.h"
+
+
+namespace UniDx
+{
+
+// --------------------
+// Heightfield
+//
+// 地形の当たり判定用の高さの格子。標本は16ビットで、1標本2バイト。
+// 座標は格子の単位で、x, z は標本の番号、y は標本の値そのまま。
+// セル（隣り合う4標本の間）ごとの最小・最大の高さを2x2ずつまとめたミップの階層を持ち、
+// レイキャストは上の階層から当たりうるところだけ降りていく
+// --------------------
+class Heightfield
+{
+public:
+    // columns x rows 個の標本から作る。heights は z の行ごとに columns 個ずつ並べる
+    void build(int columns, int rows, std::span<const uint16_t> heights);
+
+    // 16ビットのリトルエンディアンを並べただけのファイル（.raw, .r16）から作る
+    bool loadRawFile(const std::wstring& filePath, int columns, int rows);
+
+    bool empty() const { return samples.empty(); }
+    int getColumns() const { return columns; }
+    int getRows() const { return rows; }
+
+    // セルの数
+    int getCellColumns() const { return columns - 1; }
+    int getCellRows() const { return rows - 1; }
+
+    uint16_t getSample(int x, int z) const { return samples[size_t(z) * columns + x]; }
+
+    // 全体の最小・最大の高さ
+    uint16_t getMinHeight() const { return levels.empty() ? 0 : levels.back().minHeights[0]; }
+    uint16_t getMaxHeight() const { return levels.empty() ? 0 : levels.back().maxHeights[0]; }
+
+    // 格子座標 (x, z) の地面の高さ。格子の外は最も近い縁の高さ
+    float getHeight(float x, float z) const;
+
+    // 三角形の頂点（格子座標）。三角形の番号は セル * 2 + 0 or 1 で、セルは z * getCellColumns() + x
+    // セルは (x, z) から (x + 1, z + 1) への対角線で分け、(b - a).Cross(c - a) が上を向く順に並べる
+    void getTriangle(int triangle, Vector3& a, Vector3& b, Vector3& c) const
+    {
+        const int cell = triangle >> 1;
+        const int x = cell % getCellColumns();
+        const int z = cell / getCellColumns();
+        a = Vector3(float(x), getSample(x, z), float(z));
+        if (triangle & 1)
+        {
+            b = Vector3(float(x), getSample(x, z + 1), float(z + 1));
+            c = Vector3(float(x + 1), getSample(x + 1, z + 1), float(z + 1));
+        }
+        else
+        {
+            b = Vector3(float(x + 1), getSample(x + 1, z + 1), float(z + 1));
+            c = Vector3(float(x + 1), getSample(x + 1, z), float(z));
+        }
+    }
+
+    // 格子座標 (x, z) の真上・真下にある三角形の番号。格子の外なら -1
+    int findTriangle(float x, float z) const
+    {
+        if (empty() || x < 0.0f || z < 0.0f || x > float(getCellColumns()) || z > float(getCellRows())) return -1;
+        const int cx = std::min(int(x), getCellColumns() - 1);
+        const int cz = std::min(int(z), getCellRows() - 1);
+        return (cz * getCellColumns() + cx) * 2 + (z - cz > x - cx ? 1 : 0);
+    }
+
+    // 格子座標の範囲と重なる可能性のある三角形ごとに func(三角形の番号) を呼ぶ。func が false を返したら打ち切る
+    template<typename Func>
+    void query(Vector3 mn, Vector3 mx, Func&& func) const
+    {
+        if (empty()) return;
+
+        // 範囲が格子から外れているときに int へ変換してあふれないよう、先に float で切り詰める
+        const float lastX = float(getCellColumns() - 1);
+        const float lastZ = float(getCellRows() - 1);
+        const int x0 = int(std::clamp(std::floor(mn.x), 0.0f, lastX + 1.0f));
+        const int z0 = int(std::clamp(std::floor(mn.z), 0.0f, lastZ + 1.0f));
+        const int x1 = int(std::clamp(std::floor(mx.x), -1.0f, lastX));
+        const int z1 = int(std::clamp(std::floor(mx.z), -1.0f, lastZ));
+        const Level& cells = levels[0];
+        for (int z = z0; z <= z1; ++z)
+        {
+            for (int x = x0; x <= x1; ++x)
+            {
+                const int cell = z * cells.width + x;
+                if (cells.minHeights[cell] > mx.y || cells.maxHeights[cell] < mn.y) continue;
+                if (!func(cell * 2) || !func(cell * 2 + 1)) return;
+            }
+        }
+    }
+
+    // 線分 origin + direction * t (0 <= t <= maxDistance) と最初に交わる三角形（格子座標）。両面とも当たる
+    // direction は正規化しなくてよく、t は direction の長さを単位とする
+    bool raycast(Vector3 origin, Vector3 direction, float maxDistance, float& t, int& triangle) const;
+
+private:
+    // ミップの1段。levels[0] がセルごとで、最後の段は 1x1
+    struct Level
+    {
+        int width = 0;
+        int height = 0;
+        std::vector<uint16_t> minHeights;
+        std::vector<uint16_t> maxHeights;
+    };
+
+    int columns = 0;
+    int rows = 0;
+    std::vector<uint16_t> samples;
+    std::vector<Level> levels;
+
+    void buildLevels();
+    void clear();
+};
+
+} // namespace UniDx
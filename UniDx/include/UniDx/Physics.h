@@ -2,12 +2,22 @@
 
 #include <vector>
 #include <array>
-#include <map>
+#include <memory>
+#include <utility>
+#include <cstdint>
+#include <limits>
 
 #include "Property.h"
 #include "Singleton.h"
 #include "Bounds.h"
 #include "Collision.h"
+#include "Broadphase.h"
+#include "StaticAABBTree.h"
+#include "ThreadPool.h"
+#include "PhysicsBodyStore.h"
+#include "PhysicsKernels.h"
+#include "ContactPairTable.h"
+#include "PhysicsSnapshot.h"
 
 namespace UniDx
 {
@@ -17,11 +27,32 @@ class Rigidbody;
 class PhysicsShape;
 
 
+// コライダーの形状の種類。形状の組み合わせごとの判定関数の表の添字になる
+enum class ColliderType : uint8_t
+{
+    Sphere,
+    AABB,
+    Box,
+    Capsule,
+    Mesh,
+    Heightfield,
+};
+constexpr int ColliderTypeCount = 6;
+
+
 struct Contact
 {
-//    Vector3 point;
+    Vector3 point;
     Vector3 normal;     // from A to B
     float   penetration;
+    uint32_t feature = 0;   // 前のステップの接触点と対応付けるための番号
+
+    // ステップをまたいで引き継ぐ蓄積インパルス（ウォームスタート用）
+    float normalImpulse = 0.0f;
+    float tangentImpulse[2] = { 0.0f, 0.0f };
+
+    // ソルバの作業用
+    float velocityBias = 0.0f;
 };
 
 struct ContactManifold
@@ -30,8 +61,36 @@ struct ContactManifold
     PhysicsShape* b;
     std::array<Contact, 4> contacts;  // 1〜4点
     int numContacts;
+
+    // ソルバの作業用
+    uint64_t key;       // シェイプIDの組。前のステップの接触と対応付ける
+    int bodyA;          // PhysicsBodyStore のインデクス。-1 なら静的
+    int bodyB;
+    float invMassA;
+    float invMassB;
+    float friction;
+    float restitution;
+    Vector3 tangent1;
+    Vector3 tangent2;
+};
+
+// --------------------
+// PhysicsShapeHandle
+//
+// Physics に登録したコライダーを指すハンドル。
+// スロットが再利用されても世代番号で古いハンドルと見分けられる
+// --------------------
+struct PhysicsShapeHandle
+{
+    static constexpr uint32_t invalidIndex = UINT32_MAX;
+
+    uint32_t index = invalidIndex;
+    uint32_t generation = 0;
+
+    bool isValid() const { return index != invalidIndex; }
 };
 
+
 class AABBGeometory;
 class SpheresGeometory;
 class CapsulesGeometory;
@@ -44,18 +103,6 @@ class BoxGeometory;
 class  PhysicsActor
 {
 public:
-    struct Less {
-        bool operator()(const PhysicsActor& lhs, const PhysicsActor& rhs) const {
-            return lhs.getRigidbody() < rhs.getRigidbody();
-        }
-    };
-
-    explicit PhysicsActor(Rigidbody* rigidbody) : rigidbody_(rigidbody) {}
-
-    Rigidbody* getRigidbody() const { return rigidbody_; }
-    bool isValid() const { return rigidbody_ != nullptr; }
-    void setInvalid() { rigidbody_ = nullptr; }
-
     Bounds getCorrectPositionBounds() const { return correctPositionBounds; }
     Bounds getCorrectVelocityBounds() const { return correctVelocityBounds; }
 
@@ -81,38 +128,169 @@ public:
     }
 
 private:
-    Rigidbody* rigidbody_;
     Bounds correctPositionBounds;
     Bounds correctVelocityBounds;
 };
 
 
+// シェイプの動き方
+enum class PhysicsMotionType : uint8_t
+{
+    Static,     // Rigidbody がない。静的な木に入れ、静的なもの同士はペアにしない
+    Kinematic,  // isKinematic の Rigidbody。スクリプトで動かす
+    Dynamic,    // 物理で動く Rigidbody
+};
+
+
 // --------------------
 // PhysicsShape
 // --------------------
 class  PhysicsShape
 {
 public:
-    void initialize(Collider* collider);
+    void initialize(Collider* collider, uint32_t id, uint32_t slot);
 
     Bounds moveBounds;  // コライダーの bounds に移動量を広げた範囲
     PhysicsActor* actor;
+    int bodyIndex = -1; // PhysicsBodyStore のインデクス。Rigidbody がなければ -1
+    int proxyId = -1;   // ブロードフェーズのプロキシID。静的なシェイプは持たない
+    PhysicsMotionType motionType = PhysicsMotionType::Static;
+    bool inStaticTree = false;  // 静的な木に入っている
+    bool worldShapeDirty = false;   // Transform を動かしたと知らされ、まだ形状を求め直していない
+    BroadphaseFilter filter;    // ペアを作る条件。シーンクエリのレイヤーの判定にも使う
+    bool layerLogged = false;   // 範囲外のレイヤーをログに出した
+    Vector3 bodyTransformPosition;  // ステップ開始時の Rigidbody の Transform の位置。連続衝突判定でずれを直すのに使う
+
+    // 登録ごとに振られる番号。シェイプの並びが変わっても変わらない
+    uint32_t getId() const { return id_; }
+
+    // ハンドルのスロット
+    uint32_t getSlot() const { return slot_; }
 
     Collider* getCollider() const { return collider_; }
     bool isValid() const { return collider_ != nullptr; }
     void setInvalid() { collider_ = nullptr; }
-    void initOtherNew() { othersNew_.clear(); collisionsNew_.clear(); }
-    void addCollide(const Collision& col) { collisionsNew_.push_back(col); }
-    void addTrigger(Collider* other) { othersNew_.push_back(other); }
-    void collideCallback();
+
+    // コライダーの形状の種類。ナローフェーズで組み合わせごとに分けるときにコライダーを読まずに済むよう持っておく
+    ColliderType getType() const { return type_; }
 
 private:
     Collider* collider_;
+    ColliderType type_ = ColliderType::Sphere;
+    uint32_t id_ = 0;
+    uint32_t slot_ = 0;
+};
+
 
-    std::vector<Collision> collisions_;
-    std::vector<Collision> collisionsNew_;
-    std::vector<Collider*> others_;
-    std::vector<Collider*> othersNew_;
+// --------------------
+// NarrowphaseBuffer
+//
+// ナローフェーズの結果を記録しておき、あとで決まった順序で PhysicsActor と接触ペアの表に反映する。
+// 並列に判定したときもバッファごとに分けて記録し、順番に反映すればスレッド数によらず同じ結果になる
+// --------------------
+class NarrowphaseBuffer
+{
+public:
+    void clear() { corrections.clear(); hits.clear(); manifolds.clear(); }
+
+    // 位置を補正する差分ベクトルを記録
+    void addCorrectPosition(PhysicsActor* actor, Vector3 vec)
+    {
+        if (actor != nullptr) corrections.push_back({ actor, vec, false });
+    }
+
+    // 速度を補正する差分ベクトルを記録
+    void addCorrectVelocity(PhysicsActor* actor, Vector3 vec)
+    {
+        if (actor != nullptr) corrections.push_back({ actor, vec, true });
+    }
+
+    // 衝突したペアを記録
+    void addCollide(PhysicsShape* a, PhysicsShape* b) { hits.push_back({ a, b, false }); }
+
+    // トリガーに入っているペアを記録
+    void addTrigger(PhysicsShape* a, PhysicsShape* b) { hits.push_back({ a, b, true }); }
+
+    // 接触点を記録（インパルス法のソルバで解く）
+    void addManifold(const ContactManifold& m) { manifolds.push_back(m); }
+    const std::vector<ContactManifold>& getManifolds() const { return manifolds; }
+
+    // 記録した順に反映
+    void apply(ContactPairTable& pairs) const;
+
+    // 衝突の補正に使う剛体の速度と質量。シミュレーション中の状態を指す
+    // Rigidbody のプロパティは非同期のステップ中にメインスレッド用の複製を読むので、判定からは使わない
+    const PhysicsBodyStore* bodies = nullptr;
+
+    // バッチ判定の作業用
+    SpherePairBatch spherePairs;
+    SphereAABBBatch sphereAABBs;
+    std::vector<KernelContact> kernelContacts;
+    std::vector<KernelContact> verifyContacts;
+    std::vector<int> pairContacts;
+
+    // 形状の組み合わせごとに分ける作業用
+    std::vector<uint32_t> pairOrder;    // 区間内の位置を組み合わせの順に並べたもの
+    std::array<uint32_t, ColliderTypeCount * ColliderTypeCount + 1> bucketBegin = {};  // 組み合わせごとの pairOrder の開始位置
+    std::vector<uint8_t> pairHits;
+    std::vector<ContactManifold> pairManifolds;
+
+    // 衝突したペアを記録した順に列挙する
+    template<typename Func>
+    void forEachCollide(Func&& func) const
+    {
+        for (const auto& hit : hits)
+        {
+            if (!hit.trigger) func(hit.a, hit.b);
+        }
+    }
+
+private:
+    struct Correction
+    {
+        PhysicsActor* actor;
+        Vector3 vec;
+        bool velocity;
+    };
+    struct Hit
+    {
+        PhysicsShape* a;
+        PhysicsShape* b;
+        bool trigger;
+    };
+    std::vector<Correction> corrections;
+    std::vector<Hit> hits;
+    std::vector<ContactManifold> manifolds;
+};
+
+
+// --------------------
+// シーンクエリのバッチ用コマンド
+//
+// Physics::RaycastBatch などにまとめて渡し、並列に実行する。direction は正規化しなくてよい
+// --------------------
+struct RaycastCommand
+{
+    Vector3 from;
+    Vector3 direction;
+    float distance = std::numeric_limits<float>::infinity();
+    uint32_t layerMask = ~0u;
+};
+
+struct SpherecastCommand
+{
+    Vector3 origin;
+    float radius = 0.0f;
+    Vector3 direction;
+    float distance = std::numeric_limits<float>::infinity();
+    uint32_t layerMask = ~0u;
+};
+
+struct OverlapSphereCommand
+{
+    Vector3 point;
+    float radius = 0.0f;
+    uint32_t layerMask = ~0u;
 };
 
 
@@ -122,15 +300,218 @@ private:
 class Physics : public Singleton<Physics>
 {
 public:
+    // ブロードフェーズの種類
+    enum class BroadphaseType
+    {
+        BruteForce,     // 全組み合わせ（比較用）
+        SweepAndPrune,  // ソート＆スイープ
+        AABBTree,       // 動的AABB木
+        SpatialHash,    // 一様グリッドのハッシュ（同じ大きさの物体が密集している場合向け）
+    };
+
+    // 衝突の解き方
+    enum class SolverType
+    {
+        PositionCorrection, // 位置補正法（射影法）
+        SequentialImpulse,  // 逐次インパルス法。積み重ねた物体も低いステップレートで安定する
+        XPBD,               // 拡張位置ベース法。1ステップを細かく分け、分けたステップごとに接触を1回ずつ解く
+    };
+
     static inline float gravity = -9.81f;
 
-    void simulate(float setp);
+    // レイヤーの数と、全てのレイヤーを表すマスク
+    static constexpr int layerCount = 32;
+    static constexpr uint32_t AllLayers = ~0u;
+
+    SolverType solverType = SolverType::PositionCorrection;
+
+    // 逐次インパルス法の反復回数
+    int velocityIterations = 8;
+    int positionIterations = 3;
+
+    // 前のステップの蓄積インパルスを初期値に使う
+    bool warmStarting = true;
+
+    // XPBD で1ステップを分ける数と、接触の柔らかさ（コンプライアンス。0 なら硬い）
+    // ブロードフェーズとナローフェーズはステップごとに1回なので、反復を増やすより分割を増やす方が積み重ねに効く
+    int substepCount = 8;
+    float contactCompliance = 0.0f;
+
+    // 球と球、球と AABB の接触を SIMD のバッチ判定で求める。位置補正法では求めた接触から補正する
+    bool useNarrowphaseKernels = true;
+
+    // バッチ判定の結果を1ペアずつの判定と比べて、違っていればログに出す
+    bool verifyNarrowphaseKernels = false;
+
+    // スリープ。接触でつながった島の全員が sleepThreshold より遅い状態で
+    // timeToSleep 秒たつと、島ごと眠らせて積分と衝突判定を省く
+    bool allowSleep = true;
+    float sleepThreshold = 0.05f;   // 速さ (m/s)
+    float timeToSleep = 0.5f;
+
+    // 直前のステップのスリープの状況
+    struct SleepStats
+    {
+        int awakeBodies = 0;
+        int sleepingBodies = 0;
+        int islands = 0;        // 起きている島の数
+        int fellAsleep = 0;     // 眠った剛体の数
+        int wokeUp = 0;         // 起きた剛体の数
+    };
+
+    // 1ステップの処理ごとの時間（ミリ秒）と数
+    struct StepProfile
+    {
+        uint64_t step = 0;          // 何ステップ目か
+        float initializeMs = 0.0f;  // シェイプと剛体の準備
+        float broadphaseMs = 0.0f;
+        float narrowphaseMs = 0.0f;
+        float solveMs = 0.0f;       // 衝突を解いて位置と速度を決め、眠らせるまで
+        float callbacksMs = 0.0f;   // OnTrigger～, OnCollision～
+        int shapes = 0;
+        int actors = 0;             // 登録されている剛体
+        int potentialPairs = 0;     // ブロードフェーズで残った衝突の候補
+        int triggerPairs = 0;       // ブロードフェーズで残ったトリガーの候補
+        int contacts = 0;           // 実際に衝突したペア
+        int contactPoints = 0;      // 接触点（接触点を作る解き方のみ）
+        int callbacks = 0;          // 呼んだコールバックの数
+    };
+
+    // シーンクエリがトリガーにも当たるか
+    bool queriesHitTriggers = true;
+
+    // 決定論モード。ロックステップやリプレイの検証用
+    // ステップ中は浮動小数点の丸めと非正規化数の扱いを既定に固定し、ステップごとに剛体の状態のチェックサムを求める
+    bool deterministic = false;
+
+    // AABB木の葉に持たせる余裕。次に setBroadphaseType したときに反映される
+    float aabbTreeMargin = 0.1f;
+
+    // 非同期シミュレーション。step() はステップを専用のスレッドで始めてすぐに戻る
+    // ステップ中のメインスレッドからは、剛体の状態は直前に完了したステップの複製に見え、書き込みは完了時に反映される
+    // Transform への書き込みと OnCollision～ などのコールバックは、完了させたときにメインスレッドで行う
+    // 登録と解除、シーンクエリ、設定の変更は実行中のステップを完了させてから行う
+    // ステップ中にコライダーの形や isTrigger、静的なコライダーの Transform を変えてはいけない
+    bool asyncSimulation = false;
+
+    Physics();
+
+    // ブロードフェーズの切り替え。実行中でも変更できる
+    void setBroadphaseType(BroadphaseType type);
+    BroadphaseType getBroadphaseType() const { return broadphaseType; }
+
+    // 範囲検索などに使う現在のブロードフェーズ。静的なシェイプは含まない
+    const Broadphase* getBroadphase() const { return broadphase.get(); }
+
+    // 静的なシェイプの木と、作り直した回数
+    const StaticAABBTree& getStaticTree() const { return staticTree; }
+    int getStaticTreeBuildCount() const { return staticTreeBuildCount; }
+
+    // ナローフェーズなどの並列処理に使うスレッド数（呼び出し元を含む）。0 ならハードウェアのスレッド数
+    void setThreadCount(int count);
+    int getThreadCount() const { return threadPool->getThreadCount(); }
+
+    // 剛体の状態。非同期のステップ中のメインスレッドからは、直前に完了したステップの複製を返す
+    PhysicsBodyStore& getBodyStore() { return asyncStepRunning && !onSimulationThread ? publishedBodies : bodies; }
+    const PhysicsBodyStore& getBodyStore() const { return asyncStepRunning && !onSimulationThread ? publishedBodies : bodies; }
+
+    // getBodyStore() の剛体に書き込んだ値の種類（PhysicsBodyStore::Field）を知らせる
+    // 非同期のステップ中なら覚えておき、ステップの完了時にシミュレーションの状態へ写す
+    void markBodyWritten(PhysicsBodyHandle handle, uint32_t fields)
+    {
+        if (asyncStepRunning && !onSimulationThread) pendingBodyWrites.push_back({ handle, fields });
+    }
+
+    // 剛体を眠らせる、島ごと起こす
+    void sleepBody(PhysicsBodyHandle handle);
+    void wakeUpBody(PhysicsBodyHandle handle);
+    const SleepStats& getSleepStats() const { return sleepStats; }
+
+    // solverType に応じて1ステップ進める。asyncSimulation なら実行中のステップを完了させてから次を始める
+    void step(float deltaTime);
+
+    // 非同期のステップが実行中なら終わるまで待ち、結果を Transform に書き込んでコールバックを呼ぶ
+    void completeStep();
+    bool isStepRunning() const { return asyncStepRunning; }
+
+    // 描画用に、interpolation を設定した剛体の Transform を最後のステップから restTime 経った姿勢にする
+    // 補間した Transform は次の step() か restoreInterpolatedTransforms() で物理の姿勢に戻る
+    void interpolateTransforms(float restTime);
+    void restoreInterpolatedTransforms();
+
+    // 直前に完了したステップのプロファイル
+    const StepProfile& getStepProfile() const { return lastProfile; }
+
+    // プロファイルを直近 steps ステップ分残す。0 なら残さない
+    void setProfileHistory(int steps);
+    int getProfileHistory() const { return int(profileHistory.size()); }
+
+    // 残っているプロファイルの数と、古い方から index 番目
+    int getProfileCount() const { return int(profileCount); }
+    const StepProfile& getProfile(int index) const;
+
+    // 進めたステップ数と、直前のステップ後のチェックサム（deterministic のときだけ更新される）
+    uint64_t getStepCount() const { return stepCount; }
+    uint64_t getStepChecksum() const { return stepChecksum; }
+
+    // 使用中の剛体の位置、姿勢、速度とフラグから求める64ビットのチェックサム
+    uint64_t computeChecksum() const;
+
+    // スナップショット。剛体の状態、ウォームスタート用の接触キャッシュ、触れているペアの表を保存する
+    // 復元できるのは保存したときから登録されたままの剛体とシェイプで、以降に登録したものは今の状態のまま
+    void saveSnapshot(PhysicsSnapshot& snapshot) const;
+    void restoreSnapshot(const PhysicsSnapshot& snapshot);
+
+    // ステップごとに直近 steps ステップ分のスナップショットを自動で保存する。0 なら保存しない
+    void setSnapshotHistory(int steps);
+    int getSnapshotHistory() const { return snapshotHistory.getCapacity(); }
+
+    // step ステップ目を終えた直後の状態に巻き戻す。履歴になければ false
+    bool rollback(uint64_t step);
+
+    void simulate(float step);
     void simulatePositionCorrection(float step);
+    void simulateXPBD(float step);
+
+    // Rigidbodyを登録して PhysicsBodyStore 上のハンドルを返す
+    PhysicsBodyHandle registerRigidbody(Rigidbody* rigidbody, const PhysicsBodyState& state);
+    void unregisterRigidbody(PhysicsBodyHandle handle);
+
+    // コライダーを登録してハンドルを返す。シェイプに加わるのは次のステップの開始時
+    PhysicsShapeHandle register3d(Collider* collider);
+    void unregister3d(PhysicsShapeHandle handle);
+
+    // ステップの間に Transform を動かしたシェイプを知らせる。次のシーンクエリの前にそのシェイプだけ形状と範囲を求め直す
+    void markShapeMoved(PhysicsShapeHandle handle);
+
+    // レイヤー衝突マトリクス。無視する組み合わせのペアはブロードフェーズで除外される
+    void IgnoreLayerCollision(int layer1, int layer2, bool ignore = true);
+    bool GetIgnoreLayerCollision(int layer1, int layer2) const;
+
+    // layer と衝突するレイヤーのビット
+    uint32_t getLayerCollisionMask(int layer) const
+    {
+        assert(layer >= 0 && layer < layerCount);
+        return layerCollisionMasks[layer];
+    }
+
+    // シーンクエリ。ブロードフェーズで候補を絞ってからコライダーの形状と判定する
+    // 対象は直前のステップで登録済みのシェイプで、形状はステップの後の姿勢で求めたもの。始点で重なっているコライダーには当たらない
+    // layerMask のビットが立っているレイヤーのコライダーだけを対象にする
+    bool Raycast(Vector3 origin, Vector3 direction, RaycastHit& hit, float maxDistance = std::numeric_limits<float>::infinity(), uint32_t layerMask = AllLayers);
+    bool SphereCast(Vector3 origin, float radius, Vector3 direction, RaycastHit& hit, float maxDistance = std::numeric_limits<float>::infinity(), uint32_t layerMask = AllLayers);
+
+    // 重なっているコライダーを results に最大 maxResults 個まで書き込み、その数を返す
+    int OverlapSphere(Vector3 position, float radius, Collider** results, int maxResults, uint32_t layerMask = AllLayers);
+    int OverlapBox(Vector3 center, Vector3 halfExtents, Collider** results, int maxResults, uint32_t layerMask = AllLayers);
 
-    void registerRigidbody(Rigidbody* rigidbody);
-    void unregisterRigidbody(Rigidbody* rigidbody);
-    void register3d(Collider* collider);
-    void unregister3d(Collider* collider);
+    // まとめて並列に実行する。results は commands と同じ数だけ用意しておく
+    // 当たらなかったものは RaycastHit::collider が nullptr になる
+    void RaycastBatch(const RaycastCommand* commands, RaycastHit* results, int count);
+    void SphereCastBatch(const SpherecastCommand* commands, RaycastHit* results, int count);
+
+    // results はコマンドごとに maxHits 個ずつの領域。counts に見つかった数を書き込む
+    void OverlapSphereBatch(const OverlapSphereCommand* commands, Collider** results, int* counts, int count, int maxHits);
 
 private:
     struct PotentialPair {
@@ -142,12 +523,160 @@ private:
 
     std::vector<ContactManifold> manifolds;
 
-    std::map<Rigidbody*, PhysicsActor> physicsActors;
+    // ウォームスタート用に前のステップの蓄積インパルスを覚えておく。key順
+    struct CachedContact
+    {
+        uint32_t feature;
+        float normalImpulse;
+        float tangentImpulse[2];
+    };
+    struct CachedManifold
+    {
+        uint64_t key;
+        int numContacts;
+        std::array<CachedContact, 4> contacts;
+    };
+    std::vector<CachedManifold> contactCache;
+    std::vector<Vector3> solverStartPositions;
+    std::vector<Vector3> substepStartPositions;
+
+    // 島の構築用
+    std::vector<PotentialPair> contactPairs;    // 実際に衝突したペア
+    std::vector<uint32_t> islandParents;
+    std::vector<float> islandSleepTimes;
+    std::vector<int> islandFirstBodies;
+    SleepStats sleepStats;
+
+    // レイヤーごとに衝突するレイヤーのビット
+    std::array<uint32_t, layerCount> layerCollisionMasks;
+
+    // 触れているペアと Enter/Stay/Exit の状態
+    ContactPairTable contactPairTable;
+    int fellAsleepCount = 0;
+    int wokeUpCount = 0;
+
+    uint64_t stepCount = 0;
+    uint64_t stepChecksum = 0;
+
+    // 作成中のプロファイルと、直前に完了したステップのもの。履歴はリングバッファ
+    static constexpr int defaultProfileHistory = 300;
+    StepProfile profile;
+    StepProfile lastProfile;
+    std::vector<StepProfile> profileHistory;
+    size_t profileNext = 0;
+    size_t profileCount = 0;
+
+    PhysicsSnapshotRing snapshotHistory;
+    bool refreshAllProxies = false;     // 復元したあと、眠っているものを含めてプロキシを更新する
+    bool transformsInterpolated = false;    // Transform に描画用の補間した姿勢が入っている
+
+    PhysicsBodyStore bodies;
+    std::vector<PhysicsActor> physicsActors;    // bodies と同じインデクスで補正を集める
     std::vector<PhysicsShape> physicsShapes;
+    uint32_t nextShapeId = 0;
 
+    // ハンドルのスロット。index は physicsShapes のインデクスで、追加待ちの間は -1
+    struct ShapeSlot
+    {
+        int index;
+        uint32_t generation;
+        bool used;
+    };
+    std::vector<ShapeSlot> shapeSlots;
+    std::vector<uint32_t> freeShapeSlots;
+
+    // 追加待ちのコライダー。ステップ中にシェイプの配列が伸びてポインタが無効にならないようにする
+    struct PendingShape
+    {
+        Collider* collider;
+        PhysicsShapeHandle handle;
+    };
+    std::vector<PendingShape> pendingShapes;
+
+    // ステップの間に Transform を動かしたと知らされたシェイプ。シーンクエリの前に形状を求め直す
+    std::vector<PhysicsShapeHandle> dirtyShapes;
+
+    BroadphaseType broadphaseType;
+    std::unique_ptr<Broadphase> broadphase;
+    std::vector<BroadphasePair> broadphasePairs;
+
+    // 静的なシェイプはブロードフェーズとは別の木に入れ、追加、削除、移動があったステップだけ作り直す
+    StaticAABBTree staticTree;
+    std::vector<StaticAABBTree::Item> staticItems;
+    bool staticTreeDirty = false;
+    int staticTreeBuildCount = 0;
+
+    // 非同期シミュレーション
+    // ステップ中にメインスレッドが読み書きする剛体の複製と、書き込まれた剛体と値の種類
+    // 起こす、眠らせる要求も同じ列に並べ、書き込みと同じ順に反映する
+    static constexpr uint32_t pendingWakeUp = 1u << 30;
+    static constexpr uint32_t pendingSleep = 1u << 31;
+    struct PendingBodyWrite
+    {
+        PhysicsBodyHandle handle;
+        uint32_t fields;
+    };
+    PhysicsBodyStore publishedBodies;
+    std::vector<PendingBodyWrite> pendingBodyWrites;
+    bool asyncStepRunning = false;
+    bool shapesPrepared = false;    // prepareShapes() を済ませてある
+    static inline thread_local bool onSimulationThread = false;
+
+    // ナローフェーズを分割する単位。スレッド数に関係なく同じ分け方にする
+    static constexpr int narrowphaseChunkSize = 64;
+    std::unique_ptr<ThreadPool> threadPool;
+    std::vector<NarrowphaseBuffer> narrowphaseBuffers;
+
+    // シーンクエリのバッチを分割する単位
+    static constexpr int queryChunkSize = 64;
+
+    bool isValid(PhysicsShapeHandle handle) const
+    {
+        return handle.index < shapeSlots.size() && shapeSlots[handle.index].used && shapeSlots[handle.index].generation == handle.generation;
+    }
+    void addPendingShapes();
+    void removeInvalidShapes();
+    void prepareShapes();
     void initializeSimulate(float step);
-    void solveVelocityConstraint(Rigidbody* A, Rigidbody* B, const ContactManifold& m);
-    void solvePositionConstraint(Rigidbody* A, Rigidbody* B, const ContactManifold& m);
+    void simulateStep(float step);
+    void finishStep();
+    void recordProfile();
+    void rebuildStaticTree();
+    void physicsUpdateBodies();
+    void applyMoveBodies(float step);
+    void solveContinuousBodies(float step, bool scaleVelocities = false);
+    void solveCorrectionBodies();
+    void writeTransformBodies();
+    void syncBodyShapes(bool includeSleeping = false);
+    void refreshShape(int index);
+    void refreshDirtyShapes();
+    void findPotentialPairs();
+    void narrowphase(bool makeManifolds);
+    void narrowphasePositionCorrection() { narrowphase(false); }
+    void narrowphaseCorrections(NarrowphaseBuffer& buffer, size_t begin, size_t end);
+    void narrowphaseManifolds(NarrowphaseBuffer& buffer, size_t begin, size_t end);
+    void runNarrowphaseKernels(NarrowphaseBuffer& buffer);
+    void prepareContacts(ContactManifold& m);
+    void warmStart(ContactManifold& m);
+    void solveVelocityConstraint(ContactManifold& m);
+    void solvePositionConstraint(ContactManifold& m);
+    void solveContactXPBD(ContactManifold& m, float substep);
+    void solveContactVelocityXPBD(ContactManifold& m);
+    void storeContactCache();
+    void addCollisions(const ContactManifold& m);
+    bool isResting(const PhysicsShape& shape) const;
+    void wakeUpIsland(uint32_t index);
+    void wakeUpOverlapping(const Bounds& bounds);
+    uint32_t findIsland(uint32_t index);
+    void updateSleep(float step);
+
+    // シーンクエリの本体。複数のスレッドから同時に呼べるよう、シェイプとブロードフェーズは読むだけにする
+    void prepareQueries();
+    bool castShapes(Vector3 origin, float radius, Vector3 direction, float maxDistance, uint32_t layerMask, bool hitTriggers, const Rigidbody* ignoreBody, RaycastHit& hit) const;
+    int overlapShapes(const Bounds& bounds, const Vector3* sphereCenter, float sphereRadius, uint32_t layerMask, Collider** results, int maxResults) const;
+
+    // 非同期のステップを実行するスレッド。破棄するときに実行中のステップを待つよう最後に置く
+    std::unique_ptr<WorkerThread> stepThread;
 };
 
 }
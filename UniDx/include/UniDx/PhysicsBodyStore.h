@@ -0,0 +1,140 @@
+﻿#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include "UniDxDefine.h"
+
+
+namespace UniDx
+{
+
+class Rigidbody;
+class PhysicsSnapshot;
+class PhysicsSnapshotReader;
+
+// --------------------
+// PhysicsBodyHandle
+//
+// PhysicsBodyStore のスロットを指すハンドル。
+// スロットが再利用されても世代番号で古いハンドルと見分けられる
+// --------------------
+struct PhysicsBodyHandle
+{
+    static constexpr uint32_t invalidIndex = UINT32_MAX;
+
+    uint32_t index = invalidIndex;
+    uint32_t generation = 0;
+
+    bool isValid() const { return index != invalidIndex; }
+};
+
+
+// --------------------
+// PhysicsBodyState
+//
+// 剛体1つ分の状態。登録前の Rigidbody が値を保持したり、ストアとの出し入れに使う
+// --------------------
+struct PhysicsBodyState
+{
+    Vector3 position{ 0, 0, 0 };
+    DirectX::SimpleMath::Quaternion rotation;
+    Vector3 velocity{ 0, 0, 0 };
+    Vector3 move{ 0, 0, 0 };
+    float gravityScale = 1.0f;
+    float mass = 1.0f;
+    uint32_t flags = 0;
+};
+
+
+// --------------------
+// PhysicsBodyStore
+//
+// 剛体の状態を種類ごとの連続した配列（Structure of Arrays）で持つ。
+// 積分や補正はこの配列に対する単純なループで処理する
+// --------------------
+class PhysicsBodyStore
+{
+public:
+    enum Flag : uint32_t
+    {
+        Active = 1 << 0,        // スロットが使用中
+        Kinematic = 1 << 1,     // isKinematic
+        HasMovePos = 1 << 2,    // 位置が直接指定された
+        HasMoveRot = 1 << 3,    // 姿勢が直接指定された
+        Sleeping = 1 << 4,      // 眠っているので積分や衝突判定を省く
+        Continuous = 1 << 5,    // 球コライダーを移動方向に掃引してすり抜けを防ぐ
+        Interpolate = 1 << 6,   // 描画時に直前のステップとの間を補間する
+        Extrapolate = 1 << 7,   // 描画時に速度から先の位置を予測する
+    };
+
+    // 書き込んだ値の種類。非同期のステップ中に書き込んだ値をあとでまとめて移すときに使う
+    enum Field : uint32_t
+    {
+        FieldPosition = 1 << 0,
+        FieldRotation = 1 << 1,     // HasMoveRot を含む
+        FieldVelocity = 1 << 2,
+        FieldMove = 1 << 3,         // HasMovePos を含む
+        FieldGravityScale = 1 << 4,
+        FieldMass = 1 << 5,         // 逆質量と Kinematic を含む
+        FieldFlags = 1 << 6,        // Continuous, Interpolate, Extrapolate
+    };
+
+    std::vector<Vector3> positions;
+    std::vector<DirectX::SimpleMath::Quaternion> rotations;
+    std::vector<Vector3> velocities;
+    std::vector<Vector3> moves;
+    std::vector<float> gravityScales;
+    std::vector<float> masses;
+    std::vector<float> inverseMasses;   // 動かないものは0
+    std::vector<uint32_t> flags;
+    std::vector<Rigidbody*> owners;
+    std::vector<float> sleepTimes;      // 速度がしきい値を下回り続けている時間
+    std::vector<uint32_t> islandIds;    // 眠っている間は同時に眠った島の番号
+
+    // 直前のステップを始めたときの位置と姿勢。描画の補間に使い、スナップショットには保存しない
+    std::vector<Vector3> previousPositions;
+    std::vector<DirectX::SimpleMath::Quaternion> previousRotations;
+
+    // スロットを確保して状態を書き込む
+    PhysicsBodyHandle create(Rigidbody* owner, const PhysicsBodyState& state);
+
+    // スロットを解放
+    void destroy(PhysicsBodyHandle handle);
+
+    // ハンドルが現在も有効か
+    bool isValid(PhysicsBodyHandle handle) const
+    {
+        return handle.index < generations.size() && generations[handle.index] == handle.generation && (flags[handle.index] & Active) != 0;
+    }
+
+    // 状態の読み書き
+    PhysicsBodyState getState(uint32_t index) const;
+    void setState(uint32_t index, const PhysicsBodyState& state);
+
+    // 質量と isKinematic から逆質量を設定
+    void setMass(uint32_t index, float mass, bool kinematic);
+
+    // from の index の値のうち fields の種類だけを写す。Active と Sleeping は写さない
+    void copyFields(const PhysicsBodyStore& from, uint32_t index, uint32_t fields);
+
+    // 未使用を含めたスロット数
+    uint32_t size() const { return uint32_t(flags.size()); }
+
+    // 使用中のスロット数
+    uint32_t activeCount() const { return size() - uint32_t(freeSlots.size()); }
+
+    // 質量から逆質量を求める（0以下は1.0f扱い、無限大と kinematic は0）
+    static float inverseMass(float mass, bool kinematic);
+
+    // スナップショットへの保存と復元。owners は保存しない
+    // 復元するのは保存したときと同じ世代のまま使われているスロットだけで、それ以外のスロットは今の状態のまま
+    void save(PhysicsSnapshot& snapshot) const;
+    void restore(PhysicsSnapshotReader& reader);
+
+private:
+    std::vector<uint32_t> generations;
+    std::vector<uint32_t> freeSlots;
+};
+
+} // namespace UniDx
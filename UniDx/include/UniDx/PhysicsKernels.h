@@ -0,0 +1,92 @@
+﻿#pragma once
+
+#include <vector>
+
+#include "UniDxDefine.h"
+
+
+namespace UniDx
+{
+
+// --------------------
+// KernelContact
+//
+// バッチ判定で見つかった接触。pair は追加時に渡した呼び出し側の番号
+// 法線は A（球）から B 向き
+// --------------------
+struct KernelContact
+{
+    int pair;
+    Vector3 point;
+    Vector3 normal;
+    float penetration;
+};
+
+
+// --------------------
+// SpherePairBatch
+//
+// 球と球のペアを成分ごとの配列（SoA）に詰めたもの
+// --------------------
+class SpherePairBatch
+{
+public:
+    std::vector<float> ax, ay, az, ar;
+    std::vector<float> bx, by, bz, br;
+    std::vector<int> pairs;
+
+    void clear();
+    void add(int pair, Vector3 centerA, float radiusA, Vector3 centerB, float radiusB);
+    int size() const { return int(pairs.size()); }
+};
+
+
+// --------------------
+// SphereAABBBatch
+//
+// 球と AABB のペアを成分ごとの配列（SoA）に詰めたもの
+// --------------------
+class SphereAABBBatch
+{
+public:
+    std::vector<float> sx, sy, sz, sr;
+    std::vector<float> minX, minY, minZ;
+    std::vector<float> maxX, maxY, maxZ;
+    std::vector<int> pairs;
+
+    void clear();
+    void add(int pair, Vector3 center, float radius, Vector3 boxMin, Vector3 boxMax);
+    int size() const { return int(pairs.size()); }
+};
+
+
+// --------------------
+// PhysicsKernels
+//
+// 多数のペアをまとめて判定するナローフェーズのカーネル。
+// SSE で4ペア、AVX が有効なビルドでは8ペアずつ判定し、接触したものだけを out に追加する。
+// Scalar 版は同じ計算を1ペアずつ行うもので、検証用に残している
+// --------------------
+class PhysicsKernels
+{
+public:
+    // 球と球
+    static void sphereSphere(const SpherePairBatch& batch, std::vector<KernelContact>& out);
+    static void sphereSphereScalar(const SpherePairBatch& batch, std::vector<KernelContact>& out);
+
+    // 球と AABB
+    static void sphereAABB(const SphereAABBBatch& batch, std::vector<KernelContact>& out);
+    static void sphereAABBScalar(const SphereAABBBatch& batch, std::vector<KernelContact>& out);
+
+    // SIMD 版と Scalar 版の結果が許容誤差内で一致するか
+    static bool sameContacts(const std::vector<KernelContact>& a, const std::vector<KernelContact>& b, float tolerance = 1e-4f);
+
+    // ビルドで使われる命令セットの名前
+    static const char* getInstructionSet();
+
+private:
+    static void sphereSphereRange(const SpherePairBatch& batch, int begin, int end, std::vector<KernelContact>& out);
+    static void sphereAABBRange(const SphereAABBBatch& batch, int begin, int end, std::vector<KernelContact>& out);
+};
+
+} // namespace UniDx
@@ -0,0 +1,161 @@
+﻿#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <type_traits>
+
+
+namespace UniDx
+{
+
+// --------------------
+// PhysicsSnapshot
+//
+// 物理の状態を保存した平坦なバイト列。中身はそのまま memcpy できる値だけで、
+// 保存し直すときも領域を使い回すので、容量が足りていればメモリ確保は起こらない
+// --------------------
+class PhysicsSnapshot
+{
+public:
+    // 保存したときのステップ数
+    uint64_t getStep() const { return step; }
+
+    // 保存済みか
+    bool isValid() const { return valid; }
+
+    const uint8_t* data() const { return buffer.data(); }
+    size_t size() const { return buffer.size(); }
+
+    // 書き込みを始める。以前の中身は捨てる
+    void begin(uint64_t s)
+    {
+        step = s;
+        valid = true;
+        buffer.clear();
+    }
+
+    void clear()
+    {
+        valid = false;
+        buffer.clear();
+    }
+
+    // 値を末尾に書き込む
+    template<typename T>
+    void write(const T* values, size_t count)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "snapshot values must be trivially copyable");
+        const size_t offset = buffer.size();
+        buffer.resize(offset + sizeof(T) * count);
+        if (count > 0) std::memcpy(buffer.data() + offset, values, sizeof(T) * count);
+    }
+
+    template<typename T>
+    void write(const T& value) { write(&value, 1); }
+
+    // 要素数をつけて配列を書き込む
+    template<typename T>
+    void writeVector(const std::vector<T>& values)
+    {
+        write(uint32_t(values.size()));
+        write(values.data(), values.size());
+    }
+
+private:
+    std::vector<uint8_t> buffer;
+    uint64_t step = 0;
+    bool valid = false;
+};
+
+
+// --------------------
+// PhysicsSnapshotReader
+//
+// PhysicsSnapshot を書き込んだ順に読み出す
+// --------------------
+class PhysicsSnapshotReader
+{
+public:
+    explicit PhysicsSnapshotReader(const PhysicsSnapshot& snapshot) : data(snapshot.data()), size(snapshot.size()) {}
+
+    template<typename T>
+    void read(T* values, size_t count)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "snapshot values must be trivially copyable");
+        assert(offset + sizeof(T) * count <= size);
+        if (count > 0) std::memcpy(values, data + offset, sizeof(T) * count);
+        offset += sizeof(T) * count;
+    }
+
+    template<typename T>
+    T read()
+    {
+        T value;
+        read(&value, 1);
+        return value;
+    }
+
+    // 読まずに進める
+    template<typename T>
+    void skip(size_t count)
+    {
+        assert(offset + sizeof(T) * count <= size);
+        offset += sizeof(T) * count;
+    }
+
+    // writeVector で書き込んだ配列を読み出す。vector の容量は使い回す
+    template<typename T>
+    void readVector(std::vector<T>& values)
+    {
+        values.resize(read<uint32_t>());
+        read(values.data(), values.size());
+    }
+
+    // 最後まで読んだか
+    bool isEnd() const { return offset == size; }
+
+private:
+    const uint8_t* data;
+    size_t size;
+    size_t offset = 0;
+};
+
+
+// --------------------
+// PhysicsSnapshotRing
+//
+// 直近のスナップショットを決まった数だけ保持するリングバッファ。
+// 一杯になると一番古いものの領域を使って上書きする
+// --------------------
+class PhysicsSnapshotRing
+{
+public:
+    explicit PhysicsSnapshotRing(int capacity = 0) { setCapacity(capacity); }
+
+    // 保持する数を変える。保持していたものは捨てる
+    void setCapacity(int capacity);
+    int getCapacity() const { return int(snapshots.size()); }
+
+    // 保持している数
+    int count() const { return count_; }
+
+    // 新しいスナップショットの領域を用意する。中身は呼び出し側で書き込む
+    PhysicsSnapshot& push(uint64_t step);
+
+    // 指定したステップのスナップショット。なければ nullptr
+    const PhysicsSnapshot* find(uint64_t step) const;
+
+    // 指定したステップより後のスナップショットを捨てる（巻き戻したあと用）
+    void discardAfter(uint64_t step);
+
+    void clear();
+
+private:
+    std::vector<PhysicsSnapshot> snapshots;
+    int head = 0;       // 次に書き込む位置
+    int count_ = 0;
+};
+
+} // namespace UniDx
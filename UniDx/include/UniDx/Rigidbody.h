@@ -11,8 +11,28 @@
 namespace UniDx {
 
 
+// 衝突判定の方法
+enum class CollisionDetectionMode
+{
+    Discrete,       // 移動後の位置だけで判定する
+    Continuous,     // 球コライダーを移動方向に掃引し、最初に当たる位置で止める。薄い壁をすり抜けない
+};
+
+
+// 描画時の Transform の決め方。固定ステップの間隔が画面の更新より長いときのカクつきを抑える
+enum class RigidbodyInterpolation
+{
+    None,           // 最後のステップの位置のまま
+    Interpolate,    // 直前のステップと最後のステップの間を補間する。1ステップ分遅れて見える
+    Extrapolate,    // 最後のステップから速度で先の位置を予測する。遅れはないが、衝突の直後に行き過ぎて見えることがある
+};
+
+
 // --------------------
 // Rigidbodyクラス
+//
+// 状態は Physics の PhysicsBodyStore に置かれ、このクラスはその窓口になる。
+// Physics に登録されていない間は自身の中に値を保持する
 // --------------------
 class Rigidbody : public Component
 {
@@ -24,24 +44,83 @@ public:
     Property<Quaternion> rotation;
 
     // 速度
-    Vector3 linearVelocity{ 0, 0, 0 };
+    Property<Vector3> linearVelocity;
 
     // 重力スケール（1.0fで標準重力、0で無重力、負値で逆重力）
-    float gravityScale = 1.0f;
+    Property<float> gravityScale;
 
     // 質量（0以下は1.0fとして扱う）
-    float mass = 1.0f;
+    Property<float> mass;
+
+    Property<bool> isKinematic;
+
+    // 衝突判定の方法。速い球がすり抜ける場合は Continuous にする
+    Property<CollisionDetectionMode> collisionDetectionMode;
 
-    bool isKinematic = false;
+    // 描画時の補間
+    Property<RigidbodyInterpolation> interpolation;
 
     Rigidbody() :
         position(
-            [this]() { return position_; },
-            [this](Vector3 v) { position_ = v; move_ = Vector3::Zero; hasMovePos_ = true; }
+            [this]() { return ref(&PhysicsBodyStore::positions, local_.position); },
+            [this](Vector3 v) {
+                write(&PhysicsBodyStore::positions, local_.position, PhysicsBodyStore::FieldPosition) = v;
+                write(&PhysicsBodyStore::moves, local_.move, PhysicsBodyStore::FieldMove) = Vector3::Zero;
+                write(&PhysicsBodyStore::flags, local_.flags, PhysicsBodyStore::FieldMove) |= PhysicsBodyStore::HasMovePos;
+                WakeUp();
+            }
         ),
         rotation(
-            [this]() { return rotation_; },
-            [this](Quaternion q) { rotation_ = q; hasMoveRot_ = true; }
+            [this]() { return ref(&PhysicsBodyStore::rotations, local_.rotation); },
+            [this](Quaternion q) {
+                write(&PhysicsBodyStore::rotations, local_.rotation, PhysicsBodyStore::FieldRotation) = q;
+                write(&PhysicsBodyStore::flags, local_.flags, PhysicsBodyStore::FieldRotation) |= PhysicsBodyStore::HasMoveRot;
+                WakeUp();
+            }
+        ),
+        linearVelocity(
+            [this]() { return ref(&PhysicsBodyStore::velocities, local_.velocity); },
+            [this](Vector3 v) {
+                write(&PhysicsBodyStore::velocities, local_.velocity, PhysicsBodyStore::FieldVelocity) = v;
+                WakeUp();
+            }
+        ),
+        gravityScale(
+            [this]() { return ref(&PhysicsBodyStore::gravityScales, local_.gravityScale); },
+            [this](float v) { write(&PhysicsBodyStore::gravityScales, local_.gravityScale, PhysicsBodyStore::FieldGravityScale) = v; }
+        ),
+        mass(
+            [this]() { return ref(&PhysicsBodyStore::masses, local_.mass); },
+            [this](float v) { setMass(v, isKinematic); }
+        ),
+        isKinematic(
+            [this]() { return (ref(&PhysicsBodyStore::flags, local_.flags) & PhysicsBodyStore::Kinematic) != 0; },
+            [this](bool v) { setMass(mass, v); }
+        ),
+        collisionDetectionMode(
+            [this]() {
+                return (ref(&PhysicsBodyStore::flags, local_.flags) & PhysicsBodyStore::Continuous) != 0
+                    ? CollisionDetectionMode::Continuous : CollisionDetectionMode::Discrete;
+            },
+            [this](CollisionDetectionMode v) {
+                uint32_t& f = write(&PhysicsBodyStore::flags, local_.flags, PhysicsBodyStore::FieldFlags);
+                if (v == CollisionDetectionMode::Continuous) f |= PhysicsBodyStore::Continuous;
+                else f &= ~PhysicsBodyStore::Continuous;
+            }
+        ),
+        interpolation(
+            [this]() {
+                const uint32_t f = ref(&PhysicsBodyStore::flags, local_.flags);
+                if (f & PhysicsBodyStore::Interpolate) return RigidbodyInterpolation::Interpolate;
+                if (f & PhysicsBodyStore::Extrapolate) return RigidbodyInterpolation::Extrapolate;
+                return RigidbodyInterpolation::None;
+            },
+            [this](RigidbodyInterpolation v) {
+                uint32_t& f = write(&PhysicsBodyStore::flags, local_.flags, PhysicsBodyStore::FieldFlags);
+                f &= ~(PhysicsBodyStore::Interpolate | PhysicsBodyStore::Extrapolate);
+                if (v == RigidbodyInterpolation::Interpolate) f |= PhysicsBodyStore::Interpolate;
+                else if (v == RigidbodyInterpolation::Extrapolate) f |= PhysicsBodyStore::Extrapolate;
+            }
         )
     {
     }
@@ -49,88 +128,94 @@ public:
     // 初期化
     virtual void Awake() override
     {
-        position_ = transform->position;
+        local_.position = transform->position;
     }
 
     virtual void OnEnable() override
     {
-        Physics::getInstance()->registerRigidbody(this);
+        handle_ = Physics::getInstance()->registerRigidbody(this, local_);
     }
 
     virtual void OnDisable() override
     {
-        Physics::getInstance()->unregisterRigidbody(this);
+        // 登録を解除する前に状態を手元に戻しておく。非同期のステップ中なら結果を待つ
+        Physics::getInstance()->completeStep();
+        local_ = store().getState(handle_.index);
+        Physics::getInstance()->unregisterRigidbody(handle_);
+        handle_ = PhysicsBodyHandle();
     }
 
     // 指定位置に移動。補間が有効な場合は間の衝突判定を行う。
     void MovePosition(Vector3 pos)
     {
-        move_ = pos - position_;
-        hasMovePos_ = true;
+        write(&PhysicsBodyStore::moves, local_.move, PhysicsBodyStore::FieldMove) = pos - position;
+        write(&PhysicsBodyStore::flags, local_.flags, PhysicsBodyStore::FieldMove) |= PhysicsBodyStore::HasMovePos;
+        WakeUp();
     }
 
     // 姿勢を指定。補間が有効な場合は間の衝突判定を行う。
     void MoveRotation(const Quaternion& rot)
     {
         // TODO:補間は未実装
-        rotation_ = rot;
-        hasMoveRot_ = true;
+        rotation = rot;
     }
 
     // ステップ時間を指定して移動ベクトルを取得
-    Vector3 getMoveVector(float step) { return move_ * (Time::fixedDeltaTime > 0 ? step / Time::fixedDeltaTime : 1); }
+    Vector3 getMoveVector(float step) { return ref(&PhysicsBodyStore::moves, local_.move) * (Time::fixedDeltaTime > 0 ? step / Time::fixedDeltaTime : 1); }
 
-    // 衝突前の物理更新
-    // ここで移動量などを設定しておくが、位置や速度の更新はコリジョン処理の後
-    virtual void physicsUpdate()
-    {
-        if (!enabled) return;
+    // 眠っているか。眠っている間は積分と衝突判定が省かれる
+    bool IsSleeping() { return (ref(&PhysicsBodyStore::flags, local_.flags) & PhysicsBodyStore::Sleeping) != 0; }
 
-        // 重力適用
-        if (gravityScale != 0.0f)
-        {
-            linearVelocity.y += Physics::gravity * gravityScale * Time::fixedDeltaTime;
-        }
-
-        // 位置の直接指定がなければ、移動ベクトルに速度を入れる
-        if (!hasMovePos_)
-        {
-            move_ = linearVelocity * Time::fixedDeltaTime;
-        }
+    // 眠らせる。触れられるか、位置や速度を設定すると起きる
+    void Sleep()
+    {
+        if (handle_.isValid()) Physics::getInstance()->sleepBody(handle_);
     }
 
-    // 移動ベクトルを位置に適用
-    virtual void applyMove(float step)
+    // 同じ島で眠っている剛体ごと起こす
+    void WakeUp()
     {
-        position_ += getMoveVector(step);
-
-        move_ = Vector3::Zero;
-        hasMovePos_ = false;
-        hasMoveRot_ = false;
+        if (handle_.isValid()) Physics::getInstance()->wakeUpBody(handle_);
     }
 
-    // 位置と速度の補正を適用してTransformに反映
-    virtual void solveCorrection(Bounds correctPosition, Bounds correctVelocity)
-    {
-        // 位置と速度の補正
-        position_ += correctPosition.min();
-        position_ += correctPosition.max();
+    // PhysicsBodyStore 上のハンドル。登録されていなければ無効
+    PhysicsBodyHandle getBodyHandle() const { return handle_; }
+
+private:
+    PhysicsBodyHandle handle_;
+    PhysicsBodyState local_;
 
-        linearVelocity += correctVelocity.min();
-        linearVelocity += correctVelocity.max();
+    static PhysicsBodyStore& store() { return Physics::getInstance()->getBodyStore(); }
 
-        // Transformに位置と姿勢を反映
-        transform->position = position_;
-        transform->rotation = rotation_;
+    // 登録されていればストアの要素、されていなければ手元の値を参照する
+    template<typename T>
+    T& ref(std::vector<T> PhysicsBodyStore::* array, T& local)
+    {
+        return handle_.isValid() ? (store().*array)[handle_.index] : local;
     }
 
-private:
-    Vector3 position_;
-    Quaternion rotation_;
-    Vector3 move_{ 0, 0, 0 };
+    // 書き込み用の ref。書き込む値の種類を Physics に知らせ、非同期のステップ中でも完了時に反映されるようにする
+    template<typename T>
+    T& write(std::vector<T> PhysicsBodyStore::* array, T& local, uint32_t field)
+    {
+        if (handle_.isValid()) Physics::getInstance()->markBodyWritten(handle_, field);
+        return ref(array, local);
+    }
 
-    bool hasMovePos_ = false;
-    bool hasMoveRot_ = false;
+    void setMass(float m, bool kinematic)
+    {
+        if (handle_.isValid())
+        {
+            store().setMass(handle_.index, m, kinematic);
+            Physics::getInstance()->markBodyWritten(handle_, PhysicsBodyStore::FieldMass);
+        }
+        else
+        {
+            local_.mass = m;
+            if (kinematic) local_.flags |= PhysicsBodyStore::Kinematic;
+            else local_.flags &= ~PhysicsBodyStore::Kinematic;
+        }
+    }
 };
 
 
@@ -0,0 +1,118 @@
+﻿#pragma once
+
+#include <vector>
+#include <assert.h>
+
+#include "Bounds.h"
+#include "DynamicAABBTree.h"
+
+
+namespace UniDx
+{
+
+// --------------------
+// StaticAABBTree
+//
+// 動かない物体の範囲をまとめて上から作る二分木。
+// 中心の広がりが一番大きい軸の中央値で分けるので高さは log2(n) 程度に収まる。
+// 左の子はすぐ後ろに置く深さ優先の並びで、作ったあとは読むだけ。
+// 中身が変わったときは部分的に直さずに作り直す
+// --------------------
+class StaticAABBTree
+{
+public:
+    struct Item
+    {
+        Bounds bounds;
+        int userData;
+    };
+
+    // items から作る。items は並べ替えられる
+    void build(std::vector<Item>& items);
+
+    // 全ての葉を削除
+    void clear() { nodes.clear(); }
+
+    bool empty() const { return nodes.empty(); }
+    int getNodeCount() const { return int(nodes.size()); }
+
+    // 範囲と重なる葉を列挙する。callback(userData) が false を返すと打ち切り
+    template<typename Callback>
+    void query(const Bounds& bounds, Callback&& callback) const
+    {
+        if (nodes.empty()) return;
+
+        int stack[stackSize];
+        int count = 0;
+        stack[count++] = 0;
+        while (count > 0)
+        {
+            const int id = stack[--count];
+            const Node& node = nodes[id];
+            if (!node.bounds.Intersects(bounds)) continue;
+
+            if (node.isLeaf())
+            {
+                if (!callback(node.userData)) return;
+            }
+            else
+            {
+                assert(count + 2 <= stackSize);
+                stack[count++] = node.right;
+                stack[count++] = id + 1;
+            }
+        }
+    }
+
+    // 線分 origin + direction * t (0 <= t <= maxDistance) と重なる葉を列挙する
+    // direction は正規化されていること。radius を指定すると、その半径の球を動かした範囲と重なる葉を列挙する
+    // callback(userData, maxDistance) は以降の探索に使う最大距離を返す。0 以下なら打ち切り
+    template<typename Callback>
+    void raycast(Vector3 origin, Vector3 direction, float maxDistance, Callback&& callback, float radius = 0.0f) const
+    {
+        if (nodes.empty()) return;
+
+        const Vector3 invDir = DynamicAABBTree::inverseDirection(direction);
+
+        int stack[stackSize];
+        int count = 0;
+        stack[count++] = 0;
+        while (count > 0)
+        {
+            const int id = stack[--count];
+            const Node& node = nodes[id];
+            if (!DynamicAABBTree::rayIntersects(node.bounds, origin, invDir, maxDistance, radius)) continue;
+
+            if (node.isLeaf())
+            {
+                maxDistance = callback(node.userData, maxDistance);
+                if (maxDistance <= 0.0f) return;
+            }
+            else
+            {
+                assert(count + 2 <= stackSize);
+                stack[count++] = node.right;
+                stack[count++] = id + 1;
+            }
+        }
+    }
+
+private:
+    // 中央値で分けるので、高さは葉の数の log2 を超えない
+    static constexpr int stackSize = 64;
+    static constexpr int nullNode = -1;
+
+    struct Node
+    {
+        Bounds bounds;
+        int right;      // 右の子。葉なら nullNode
+        int userData;
+
+        bool isLeaf() const { return right == nullNode; }
+    };
+    std::vector<Node> nodes;
+
+    int buildNode(std::vector<Item>& items, int begin, int end);
+};
+
+} // namespace UniDx
@@ -0,0 +1,91 @@
+﻿#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+
+namespace UniDx
+{
+
+// --------------------
+// ThreadPool
+//
+// 常駐するワーカースレッドでインデクス付きのジョブを並列に実行する。
+// 呼び出し元のスレッドも処理に加わり、全てのジョブが終わるまで戻らない
+// --------------------
+class ThreadPool
+{
+public:
+    // threadCount は呼び出し元を含めたスレッド数
+    explicit ThreadPool(int threadCount);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int getThreadCount() const { return int(workers.size()) + 1; }
+
+    // func(0) 〜 func(count - 1) を並列に実行する
+    // どのジョブがどのスレッドで実行されるかは不定
+    void parallelFor(int count, const std::function<void(int)>& func);
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex_;
+    std::condition_variable startCondition;
+    std::condition_variable doneCondition;
+
+    const std::function<void(int)>* job = nullptr;
+    int jobCount = 0;
+    std::atomic<int> nextIndex{ 0 };
+    int runningWorkers = 0;
+    uint64_t generation = 0;
+    bool quit = false;
+
+    void workerMain();
+    void runJobs();
+};
+
+
+// --------------------
+// WorkerThread
+//
+// 常駐する1本のスレッドでジョブを1つずつ実行する。
+// run() はジョブを渡してすぐ戻り、wait() でそのジョブが終わるまで待つ
+// --------------------
+class WorkerThread
+{
+public:
+    WorkerThread();
+    ~WorkerThread();
+
+    WorkerThread(const WorkerThread&) = delete;
+    WorkerThread& operator=(const WorkerThread&) = delete;
+
+    // ジョブを渡して実行させる。前のジョブが終わっていなければ終わるまで待つ
+    void run(std::function<void()> func);
+
+    // 渡したジョブが終わるまで待つ
+    void wait();
+
+    // ジョブを実行中か
+    bool isBusy();
+
+private:
+    std::thread thread;
+    std::mutex mutex_;
+    std::condition_variable startCondition;
+    std::condition_variable doneCondition;
+
+    std::function<void()> job;
+    bool busy = false;
+    bool quit = false;
+
+    void threadMain();
+};
+
+} // namespace UniDx
@@ -0,0 +1,128 @@
+﻿#pragma once
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <span>
+#include <cstdint>
+
+#include "UniDxDefine.h"
+#include "Bounds.h"
+
+
+namespace UniDx
+{
+
+struct SubMesh;
+
+// --------------------
+// TriangleMeshBVH
+//
+// 動かない三角形メッシュの当たり判定用の境界ボリューム階層。
+// ノードはメッシュ全体の境界を基準に16ビットへ量子化した箱で、1ノード16バイト。
+// 左の子はすぐ後ろに置く深さ優先の並びにして、たどるときのキャッシュミスを減らす。
+// 一度作ったものはバイト列に保存して、起動のたびに作り直さずに読み込める
+// --------------------
+class TriangleMeshBVH
+{
+public:
+    static constexpr int maxLeafTriangles = 4;
+
+    struct Node
+    {
+        uint16_t min[3];    // 量子化した範囲。最小は切り捨て、最大は切り上げ
+        uint16_t max[3];
+        uint32_t data;      // 葉なら leafFlag | 最初の三角形 << 4 | 三角形の数。内部なら右の子のインデクス
+    };
+    static constexpr uint32_t leafFlag = 0x80000000u;
+
+    // サブメッシュの三角形から作る。インデクスがないサブメッシュは頂点を3つずつ三角形とする
+    void build(const std::vector<std::shared_ptr<SubMesh>>& submeshes);
+    void build(std::span<const Vector3> positions, std::span<const uint32_t> indices);
+
+    // 保存と読み込み。読み込めなければ false で、中身は空になる
+    void save(std::vector<uint8_t>& out) const;
+    bool load(const uint8_t* data, size_t size);
+    bool saveFile(const std::wstring& filePath) const;
+    bool loadFile(const std::wstring& filePath);
+
+    bool empty() const { return nodes.empty(); }
+    int getTriangleCount() const { return int(triangles.size() / 3); }
+    int getNodeCount() const { return int(nodes.size()); }
+
+    // ローカル空間の境界
+    Bounds getBounds() const { return Bounds(Vector3(boundsMin + boundsMax) * 0.5f, Vector3(boundsMax - boundsMin) * 0.5f); }
+
+    // 三角形の頂点
+    void getTriangle(int triangle, Vector3& a, Vector3& b, Vector3& c) const
+    {
+        const uint32_t* t = &triangles[size_t(triangle) * 3];
+        a = vertices[t[0]];
+        b = vertices[t[1]];
+        c = vertices[t[2]];
+    }
+
+    // 範囲と重なる可能性のある三角形ごとに func(三角形の番号) を呼ぶ。func が false を返したら打ち切る
+    template<typename Func>
+    void query(const Bounds& bounds, Func&& func) const
+    {
+        if (nodes.empty()) return;
+
+        uint16_t qmin[3], qmax[3];
+        if (!quantize(bounds, qmin, qmax)) return;
+
+        uint32_t stack[maxDepth];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            const Node& node = nodes[stack[--top]];
+            if (node.min[0] > qmax[0] || node.max[0] < qmin[0] ||
+                node.min[1] > qmax[1] || node.max[1] < qmin[1] ||
+                node.min[2] > qmax[2] || node.max[2] < qmin[2]) continue;
+
+            if (node.data & leafFlag)
+            {
+                const int first = int((node.data & ~leafFlag) >> 4);
+                const int count = int(node.data & 0xF);
+                for (int i = first; i < first + count; ++i)
+                {
+                    if (!func(i)) return;
+                }
+            }
+            else
+            {
+                stack[top++] = node.data;
+                stack[top++] = uint32_t(&node - nodes.data()) + 1;
+            }
+        }
+    }
+
+    // 線分 origin + direction * t (0 <= t <= maxDistance) と最初に交わる三角形。両面とも当たる
+    // direction は正規化しなくてよく、t は direction の長さを単位とする
+    bool raycast(Vector3 origin, Vector3 direction, float maxDistance, float& t, int& triangle) const;
+
+    // 三角形の上で point に一番近い点（Ericson の ClosestPtPointTriangle）
+    static Vector3 closestPointOnTriangle(Vector3 point, Vector3 a, Vector3 b, Vector3 c);
+
+    // 線分と三角形の交差（Moller-Trumbore）。両面とも当たる
+    static bool raycastTriangle(Vector3 origin, Vector3 direction, Vector3 a, Vector3 b, Vector3 c, float maxDistance, float& t);
+
+private:
+    static constexpr int maxDepth = 128;
+
+    std::vector<Vector3> vertices;
+    std::vector<uint32_t> triangles;    // 3つずつ頂点のインデクス。葉の順に並べ替えてある
+    std::vector<Node> nodes;
+    Vector3 boundsMin;
+    Vector3 boundsMax;
+    Vector3 quantizeScale;              // ローカル座標から量子化した座標への倍率
+
+    void addTriangles(std::span<const Vector3> positions, std::span<const uint32_t> indices);
+    void buildTree();
+    bool quantize(const Bounds& bounds, uint16_t qmin[3], uint16_t qmax[3]) const;
+    void dequantize(const Node& node, Vector3& mn, Vector3& mx) const;
+    void clear();
+};
+
+} // namespace UniDx
@@ -0,0 +1,942 @@
+﻿#include "pch.h"
+#include <UniDx/Broadphase.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+
+namespace UniDx
+{
+
+using namespace std;
+
+// プロキシを作成してIDを返す
+int Broadphase::createProxy(const Bounds& bounds, int shapeIndex)
+{
+    int id;
+    if (!freeProxies.empty())
+    {
+        // 削除済みのIDを再利用
+        id = freeProxies.back();
+        freeProxies.pop_back();
+    }
+    else
+    {
+        id = int(proxies.size());
+        proxies.push_back(Proxy());
+    }
+    proxies[id].bounds = bounds;
+    proxies[id].shapeIndex = shapeIndex;
+    proxies[id].active = true;
+    proxies[id].filter = BroadphaseFilter();
+
+    onCreateProxy(id);
+    return id;
+}
+
+
+// プロキシを削除
+void Broadphase::destroyProxy(int proxyId)
+{
+    assert(proxies[proxyId].active);
+    onDestroyProxy(proxyId);
+
+    proxies[proxyId].active = false;
+    freeProxies.push_back(proxyId);
+}
+
+
+// プロキシの範囲とシェイプのインデクスを更新
+void Broadphase::updateProxy(int proxyId, const Bounds& bounds, int shapeIndex)
+{
+    proxies[proxyId].bounds = bounds;
+    proxies[proxyId].shapeIndex = shapeIndex;
+    onUpdateProxy(proxyId);
+}
+
+
+// 範囲と重なる可能性のあるシェイプを総当たりで列挙
+void Broadphase::query(const Bounds& bounds, BroadphaseQueryCallback& callback) const
+{
+    for (const auto& p : proxies)
+    {
+        if (!p.active) continue;
+        if (p.bounds.Intersects(bounds))
+        {
+            if (!callback.reportShape(p.shapeIndex)) return;
+        }
+    }
+}
+
+
+// 線分と重なる可能性のあるシェイプを総当たりで列挙
+void Broadphase::raycast(Vector3 origin, Vector3 direction, float maxDistance, BroadphaseRaycastCallback& callback, float radius) const
+{
+    const Vector3 invDir = DynamicAABBTree::inverseDirection(direction);
+    for (const auto& p : proxies)
+    {
+        if (!p.active) continue;
+        if (DynamicAABBTree::rayIntersects(p.bounds, origin, invDir, maxDistance, radius))
+        {
+            maxDistance = callback.reportShape(p.shapeIndex, maxDistance);
+            if (maxDistance <= 0.0f) return;
+        }
+    }
+}
+
+
+// --------------------
+// BruteForceBroadphase
+// --------------------
+
+// 全組み合わせを調べてペアを列挙
+void BruteForceBroadphase::findPairs(vector<BroadphasePair>& pairs)
+{
+    for (size_t i = 0; i < proxies.size(); ++i)
+    {
+        if (!proxies[i].active) continue;
+        for (size_t j = i + 1; j < proxies.size(); ++j)
+        {
+            if (!proxies[j].active) continue;
+            if (proxies[i].bounds.Intersects(proxies[j].bounds))
+            {
+                addPair(pairs, int(i), int(j));
+            }
+        }
+    }
+}
+
+
+// --------------------
+// SweepAndPruneBroadphase
+// --------------------
+
+// プロキシ作成時に端点を末尾に追加。並べ替えは次の findPairs で行う
+void SweepAndPruneBroadphase::onCreateProxy(int proxyId)
+{
+    endpoints.push_back({ axisValue(proxyId, false), uint32_t(proxyId) << 1 });
+    endpoints.push_back({ axisValue(proxyId, true), (uint32_t(proxyId) << 1) | 1 });
+    if (activeIndex.size() < proxies.size())
+    {
+        activeIndex.resize(proxies.size());
+    }
+    addedCount += 2;
+}
+
+
+// プロキシ削除時は印だけ付けておき、次の findPairs でまとめて取り除く
+void SweepAndPruneBroadphase::onDestroyProxy(int proxyId)
+{
+    for (auto& e : endpoints)
+    {
+        if (e.proxyId() == proxyId)
+        {
+            // 以降の createProxy で同じIDが再利用されても区別できるよう無効値にする
+            e.data = UINT32_MAX;
+        }
+    }
+    needsRemove = true;
+}
+
+
+// 動いたプロキシとして覚える。次の findPairs で端点を並べ直すまで検索では順に調べる
+void SweepAndPruneBroadphase::markMoved(int proxyId)
+{
+    if (isMoved.size() < proxies.size())
+    {
+        isMoved.resize(proxies.size(), 0);
+    }
+    if (isMoved[proxyId]) return;
+
+    isMoved[proxyId] = 1;
+    movedProxies.push_back(proxyId);
+}
+
+
+// 現在の軸に射影した端点の値
+float SweepAndPruneBroadphase::axisValue(int proxyId, bool isMax) const
+{
+    const Bounds& b = proxies[proxyId].bounds;
+    const float center = (&b.Center.x)[axis];
+    const float extent = (&b.Extents.x)[axis];
+    return isMax ? center + extent : center - extent;
+}
+
+
+// 中心の分散が最も大きい軸を選ぶ。頻繁に切り替わらないよう余裕を持たせる
+void SweepAndPruneBroadphase::selectAxis()
+{
+    Vector3 sum = Vector3::Zero;
+    Vector3 sumSq = Vector3::Zero;
+    int count = 0;
+    for (const auto& p : proxies)
+    {
+        if (!p.active) continue;
+        Vector3 c = p.bounds.Center;
+        sum += c;
+        sumSq += c * c;
+        ++count;
+    }
+    if (count < 2) return;
+
+    Vector3 mean = sum / float(count);
+    Vector3 variance = sumSq / float(count) - mean * mean;
+    const float* v = &variance.x;
+
+    int best = axis;
+    for (int i = 0; i < 3; ++i)
+    {
+        if (v[i] > v[best] * 1.5f) best = i;
+    }
+
+    if (best != axis)
+    {
+        // 軸が変わったら値をすべて取り直すので全体をソートし直す
+        axis = best;
+        addedCount = endpoints.size();
+    }
+}
+
+
+// 削除済みプロキシの端点を取り除く
+void SweepAndPruneBroadphase::removeDestroyedEndpoints()
+{
+    if (!needsRemove) return;
+
+    auto it = std::remove_if(endpoints.begin(), endpoints.end(), [](const Endpoint& e) { return e.data == UINT32_MAX; });
+    endpoints.erase(it, endpoints.end());
+    needsRemove = false;
+}
+
+
+// 端点の値を更新して並べ替え
+void SweepAndPruneBroadphase::sortEndpoints()
+{
+    maxAxisSize = 0.0f;
+    for (auto& e : endpoints)
+    {
+        e.value = axisValue(e.proxyId(), e.isMax());
+        if (!e.isMax())
+        {
+            maxAxisSize = std::max(maxAxisSize, 2.0f * (&proxies[e.proxyId()].bounds.Extents.x)[axis]);
+        }
+    }
+
+    // 同じ値なら最小側を先にして、接しているだけのペアも拾う
+    auto less = [](const Endpoint& a, const Endpoint& b) {
+        return a.value < b.value || (a.value == b.value && (a.data & 1) < (b.data & 1));
+    };
+
+    if (addedCount * 8 > endpoints.size())
+    {
+        // 大量に追加された直後や軸の切り替え時は通常のソート
+        std::sort(endpoints.begin(), endpoints.end(), less);
+    }
+    else
+    {
+        // 前回の順序がほぼ保たれているので挿入ソート
+        for (size_t i = 1; i < endpoints.size(); ++i)
+        {
+            Endpoint e = endpoints[i];
+            size_t j = i;
+            while (j > 0 && less(e, endpoints[j - 1]))
+            {
+                endpoints[j] = endpoints[j - 1];
+                --j;
+            }
+            endpoints[j] = e;
+        }
+    }
+    addedCount = 0;
+}
+
+
+// 端点リストを走査して区間が重なるペアを列挙
+void SweepAndPruneBroadphase::findPairs(vector<BroadphasePair>& pairs)
+{
+    removeDestroyedEndpoints();
+    selectAxis();
+    sortEndpoints();
+    for (int id : movedProxies)
+    {
+        isMoved[id] = 0;
+    }
+    movedProxies.clear();
+
+    active.clear();
+    for (const auto& e : endpoints)
+    {
+        const int id = e.proxyId();
+        if (!e.isMax())
+        {
+            // 区間の開始。現在開いている区間すべてと残りの軸を調べる
+            for (int other : active)
+            {
+                if (proxies[id].bounds.Intersects(proxies[other].bounds))
+                {
+                    addPair(pairs, id, other);
+                }
+            }
+            activeIndex[id] = int(active.size());
+            active.push_back(id);
+        }
+        else
+        {
+            // 区間の終了。末尾と入れ替えて取り除く
+            int index = activeIndex[id];
+            int last = active.back();
+            active[index] = last;
+            activeIndex[last] = index;
+            active.pop_back();
+        }
+    }
+}
+
+
+// 整列済みの端点で値が value 以上の最初の位置
+size_t SweepAndPruneBroadphase::lowerBound(float value) const
+{
+    auto end = endpoints.begin() + sortedCount();
+    return size_t(std::lower_bound(endpoints.begin(), end, value, [](const Endpoint& e, float v) { return e.value < v; }) - endpoints.begin());
+}
+
+
+// 整列済みの端点で値が value より大きい最初の位置
+size_t SweepAndPruneBroadphase::upperBound(float value) const
+{
+    auto end = endpoints.begin() + sortedCount();
+    return size_t(std::upper_bound(endpoints.begin(), end, value, [](float v, const Endpoint& e) { return v < e.value; }) - endpoints.begin());
+}
+
+
+// 軸上で最小側の端点が [範囲の最小 - 最大の長さ, 範囲の最大] にあるプロキシだけを調べる
+// 削除済みの端点は最大側として読めるので、最小側の端点だけを見れば飛ばせる
+void SweepAndPruneBroadphase::query(const Bounds& bounds, BroadphaseQueryCallback& callback) const
+{
+    auto testProxy = [&](int id) {
+        const Proxy& p = proxies[id];
+        if (!p.active || !p.bounds.Intersects(bounds)) return true;
+        return callback.reportShape(p.shapeIndex);
+    };
+    auto test = [&](const Endpoint& e) {
+        if (e.isMax() || moved(e.proxyId())) return true;
+        return testProxy(e.proxyId());
+    };
+
+    // 最後の findPairs より後に動いたプロキシと追加された端点は並んでいないので順に調べる
+    for (int id : movedProxies)
+    {
+        if (!testProxy(id)) return;
+    }
+    const size_t count = sortedCount();
+    for (size_t i = count; i < endpoints.size(); ++i)
+    {
+        if (!test(endpoints[i])) return;
+    }
+
+    const float center = (&bounds.Center.x)[axis];
+    const float extent = (&bounds.Extents.x)[axis];
+    for (size_t i = lowerBound(center - extent - maxAxisSize); i < count && endpoints[i].value <= center + extent; ++i)
+    {
+        if (!test(endpoints[i])) return;
+    }
+}
+
+
+// 線分の軸上の区間で query と同じように絞る。線分の進む向きに端点をたどり、当たるたびに区間を縮める
+void SweepAndPruneBroadphase::raycast(Vector3 origin, Vector3 direction, float maxDistance, BroadphaseRaycastCallback& callback, float radius) const
+{
+    const Vector3 invDir = DynamicAABBTree::inverseDirection(direction);
+    auto testProxy = [&](int id) {
+        const Proxy& p = proxies[id];
+        if (!p.active || !DynamicAABBTree::rayIntersects(p.bounds, origin, invDir, maxDistance, radius)) return true;
+        maxDistance = callback.reportShape(p.shapeIndex, maxDistance);
+        return maxDistance > 0.0f;
+    };
+    auto test = [&](const Endpoint& e) {
+        if (e.isMax() || moved(e.proxyId())) return true;
+        return testProxy(e.proxyId());
+    };
+
+    for (int id : movedProxies)
+    {
+        if (!testProxy(id)) return;
+    }
+    const size_t count = sortedCount();
+    for (size_t i = count; i < endpoints.size(); ++i)
+    {
+        if (!test(endpoints[i])) return;
+    }
+
+    // 軸上の始点と終点。direction が軸と垂直なら終点は始点と同じ（無限遠の距離を掛けない）
+    const float start = (&origin.x)[axis];
+    const float d = (&direction.x)[axis];
+    auto end = [&]() { return d == 0.0f ? start : start + d * maxDistance; };
+
+    if (d >= 0.0f)
+    {
+        for (size_t i = lowerBound(start - radius - maxAxisSize); i < count && endpoints[i].value <= end() + radius; ++i)
+        {
+            if (!test(endpoints[i])) return;
+        }
+    }
+    else
+    {
+        for (size_t i = upperBound(start + radius); i > 0 && endpoints[i - 1].value >= end() - radius - maxAxisSize; --i)
+        {
+            if (!test(endpoints[i - 1])) return;
+        }
+    }
+}
+
+
+// --------------------
+// AABBTreeBroadphase
+// --------------------
+
+// 次の findPairs で太いBoundsのペアを作り直すプロキシとして覚える
+void AABBTreeBroadphase::markMoved(int proxyId)
+{
+    if (moved.size() < proxies.size())
+    {
+        moved.resize(proxies.size(), 0);
+    }
+    if (moved[proxyId]) return;
+
+    moved[proxyId] = 1;
+    moveBuffer.push_back(proxyId);
+}
+
+
+// プロキシ作成時に木に葉を追加
+void AABBTreeBroadphase::onCreateProxy(int proxyId)
+{
+    if (treeProxies.size() < proxies.size())
+    {
+        treeProxies.resize(proxies.size(), DynamicAABBTree::nullNode);
+    }
+    treeProxies[proxyId] = tree.createProxy(proxies[proxyId].bounds, proxyId);
+    markMoved(proxyId);
+}
+
+
+// プロキシ削除時に木から葉を取り除く
+void AABBTreeBroadphase::onDestroyProxy(int proxyId)
+{
+    tree.destroyProxy(treeProxies[proxyId]);
+    treeProxies[proxyId] = DynamicAABBTree::nullNode;
+    markMoved(proxyId);
+}
+
+
+// 太いBoundsからはみ出したときだけ木が挿入し直す
+void AABBTreeBroadphase::onUpdateProxy(int proxyId)
+{
+    if (tree.moveProxy(treeProxies[proxyId], proxies[proxyId].bounds))
+    {
+        markMoved(proxyId);
+    }
+}
+
+
+// 挿入し直したプロキシだけを木で検索して太いBoundsのペアを更新し、実際の範囲が重なるものを列挙する
+void AABBTreeBroadphase::findPairs(vector<BroadphasePair>& pairs)
+{
+    if (!moveBuffer.empty())
+    {
+        // 動いたプロキシを含むペアを捨てる
+        fatPairs.erase(std::remove_if(fatPairs.begin(), fatPairs.end(), [&](const FatPair& p) {
+            return moved[p.a] || moved[p.b];
+            }), fatPairs.end());
+
+        // 動いたプロキシの太いBoundsで木を検索する。どちらも動いたペアは IDの小さい方からだけ数える
+        for (int i : moveBuffer)
+        {
+            if (!proxies[i].active) continue;
+
+            const Bounds& fat = tree.getFatBounds(treeProxies[i]);
+            tree.query(fat, [&](int leaf) {
+                const int other = tree.getUserData(leaf);
+                if (other == i || (moved[other] && other < i)) return true;
+
+                fatPairs.push_back(i < other ? FatPair{ i, other } : FatPair{ other, i });
+                return true;
+                });
+        }
+
+        for (int i : moveBuffer)
+        {
+            moved[i] = 0;
+        }
+        moveBuffer.clear();
+    }
+
+    for (const FatPair& p : fatPairs)
+    {
+        if (proxies[p.a].bounds.Intersects(proxies[p.b].bounds))
+        {
+            addPair(pairs, p.a, p.b);
+        }
+    }
+}
+
+
+// 木を使って範囲検索
+void AABBTreeBroadphase::query(const Bounds& bounds, BroadphaseQueryCallback& callback) const
+{
+    tree.query(bounds, [&](int leaf) {
+        const Proxy& p = proxies[tree.getUserData(leaf)];
+        if (!p.bounds.Intersects(bounds)) return true;
+        return callback.reportShape(p.shapeIndex);
+        });
+}
+
+
+// 木を使ってレイキャスト
+void AABBTreeBroadphase::raycast(Vector3 origin, Vector3 direction, float maxDistance, BroadphaseRaycastCallback& callback, float radius) const
+{
+    tree.raycast(origin, direction, maxDistance, [&](int leaf, float distance) {
+        return callback.reportShape(proxies[tree.getUserData(leaf)].shapeIndex, distance);
+        }, radius);
+}
+
+
+// --------------------
+// SpatialHashBroadphase
+// --------------------
+
+// 点を含むセル
+SpatialHashBroadphase::Cell SpatialHashBroadphase::cellOf(Vector3 point, int level) const
+{
+    const float inv = invCellSizes[level];
+    return Cell{
+        int(std::floor(point.x * inv)),
+        int(std::floor(point.y * inv)),
+        int(std::floor(point.z * inv)),
+        level };
+}
+
+
+// セルのハッシュからバケットを求める
+uint32_t SpatialHashBroadphase::bucketOf(const Cell& cell) const
+{
+    uint32_t h = uint32_t(cell.x) * 73856093u ^ uint32_t(cell.y) * 19349663u ^ uint32_t(cell.z) * 83492791u ^ uint32_t(cell.level) * 2654435761u;
+    return h & tableMask;
+}
+
+
+// 1軸あたり maxCellsPerAxis セルに収まる一番細かい階層。どこにも収まらなければ -1
+int SpatialHashBroadphase::levelOf(const Bounds& bounds) const
+{
+    for (int level = 0; level < levelCount; ++level)
+    {
+        const Cell c0 = cellOf(bounds.min(), level);
+        const Cell c1 = cellOf(bounds.max(), level);
+        if (c1.x - c0.x < maxCellsPerAxis && c1.y - c0.y < maxCellsPerAxis && c1.z - c0.z < maxCellsPerAxis)
+        {
+            return level;
+        }
+    }
+    return -1;
+}
+
+
+// 表を作ったあとに変わったプロキシとして覚える
+void SpatialHashBroadphase::markDirty(int proxyId)
+{
+    if (isDirty.size() < proxies.size())
+    {
+        isDirty.resize(proxies.size(), 0);
+    }
+    if (isDirty[proxyId]) return;
+
+    isDirty[proxyId] = 1;
+    dirtyProxies.push_back(proxyId);
+}
+
+
+// 物体の大きさの分布からセルの大きさを決める
+// 大多数の物体が1軸あたり1〜2セルに収まるよう、大きさの3/4分位点を使う
+void SpatialHashBroadphase::updateCellSize()
+{
+    sizes.clear();
+    for (const auto& p : proxies)
+    {
+        if (!p.active) continue;
+        const auto& e = p.bounds.Extents;
+        sizes.push_back(2.0f * std::max(e.x, std::max(e.y, e.z)));
+    }
+    if (sizes.empty()) return;
+
+    auto quartile = sizes.begin() + sizes.size() * 3 / 4;
+    std::nth_element(sizes.begin(), quartile, sizes.end());
+    cellSizes[0] = std::max(*quartile, 1e-3f);
+    invCellSizes[0] = 1.0f / cellSizes[0];
+    for (int level = 1; level < levelCount; ++level)
+    {
+        cellSizes[level] = cellSizes[level - 1] * levelScale;
+        invCellSizes[level] = 1.0f / cellSizes[level];
+    }
+}
+
+
+// 物体を階層ごとのセルに振り分けてバケット順に並べる（計数ソート）
+void SpatialHashBroadphase::buildTable()
+{
+    entries.clear();
+    oversized.clear();
+    levels.assign(proxies.size(), -1);
+    usedLevels = 0;
+    bool hasGridBounds = false;
+    for (int id = 0; id < int(proxies.size()); ++id)
+    {
+        if (!proxies[id].active) continue;
+
+        const Bounds& bounds = proxies[id].bounds;
+        const int level = levelOf(bounds);
+        if (level < 0)
+        {
+            oversized.push_back(id);
+            continue;
+        }
+        levels[id] = int8_t(level);
+        usedLevels |= 1u << level;
+
+        if (hasGridBounds) gridBounds.Encapsulate(bounds);
+        else gridBounds = bounds;
+        hasGridBounds = true;
+
+        const Cell c0 = cellOf(bounds.min(), level);
+        const Cell c1 = cellOf(bounds.max(), level);
+        for (int z = c0.z; z <= c1.z; ++z)
+            for (int y = c0.y; y <= c1.y; ++y)
+                for (int x = c0.x; x <= c1.x; ++x)
+                {
+                    entries.push_back({ Cell{ x, y, z, level }, id });
+                }
+    }
+
+    // 表は作り直したので、変わったプロキシはない
+    for (int id : dirtyProxies)
+    {
+        isDirty[id] = 0;
+    }
+    dirtyProxies.clear();
+
+    // バケット数はエントリ数の2倍以上の2の累乗
+    uint32_t tableSize = 16;
+    while (tableSize < entries.size() * 2) tableSize <<= 1;
+    tableMask = tableSize - 1;
+
+    bucketStart.assign(tableSize + 1, 0);
+    for (const auto& e : entries)
+    {
+        bucketStart[bucketOf(e.cell) + 1]++;
+    }
+    for (uint32_t i = 0; i < tableSize; ++i)
+    {
+        bucketStart[i + 1] += bucketStart[i];
+    }
+
+    sorted.resize(entries.size());
+    for (const auto& e : entries)
+    {
+        // bucketStart[b] を書き込み位置として進め、最後に1つずらして元に戻す
+        sorted[bucketStart[bucketOf(e.cell)]++] = e;
+    }
+    for (uint32_t i = tableSize; i > 0; --i)
+    {
+        bucketStart[i] = bucketStart[i - 1];
+    }
+    bucketStart[0] = 0;
+}
+
+
+// 同じセルに入っている物体同士と、細かい階層の物体と粗い階層のセルの物体を調べてペアを列挙
+void SpatialHashBroadphase::findPairs(vector<BroadphasePair>& pairs)
+{
+    updateCellSize();
+    buildTable();
+
+    const uint32_t bucketCount = tableMask + 1;
+    for (uint32_t b = 0; b < bucketCount; ++b)
+    {
+        const uint32_t begin = bucketStart[b];
+        const uint32_t end = bucketStart[b + 1];
+        for (uint32_t i = begin; i < end; ++i)
+        {
+            const Entry& ei = sorted[i];
+            const Bounds& bi = proxies[ei.proxyId].bounds;
+            for (uint32_t j = i + 1; j < end; ++j)
+            {
+                const Entry& ej = sorted[j];
+
+                // ハッシュの衝突で別のセルが混ざっていることがある
+                if (!(ei.cell == ej.cell)) continue;
+
+                const Bounds& bj = proxies[ej.proxyId].bounds;
+                if (!bi.Intersects(bj)) continue;
+
+                // 複数のセルで重複して数えないよう、重なり領域の最小角を含むセルでだけ報告する
+                if (cellOf(Vector3::Max(bi.min(), bj.min()), ei.cell.level) == ei.cell)
+                {
+                    addPair(pairs, ei.proxyId, ej.proxyId);
+                }
+            }
+        }
+    }
+
+    // 階層をまたぐペアは、細かい階層の物体が覆う粗い階層のセルを引いて調べる
+    // 細かい階層の物体は粗いセルでは1軸あたり高々 maxCellsPerAxis セルしか覆わない
+    for (int id = 0; id < int(proxies.size()); ++id)
+    {
+        if (levels[id] < 0) continue;
+
+        const Bounds& bi = proxies[id].bounds;
+        for (int level = levels[id] + 1; level < levelCount; ++level)
+        {
+            if ((usedLevels & (1u << level)) == 0) continue;
+
+            const Cell c0 = cellOf(bi.min(), level);
+            const Cell c1 = cellOf(bi.max(), level);
+            for (int z = c0.z; z <= c1.z; ++z)
+                for (int y = c0.y; y <= c1.y; ++y)
+                    for (int x = c0.x; x <= c1.x; ++x)
+                    {
+                        const Cell cell{ x, y, z, level };
+                        const uint32_t b = bucketOf(cell);
+                        for (uint32_t i = bucketStart[b]; i < bucketStart[b + 1]; ++i)
+                        {
+                            const Entry& e = sorted[i];
+                            if (!(e.cell == cell)) continue;
+
+                            const Bounds& bj = proxies[e.proxyId].bounds;
+                            if (!bi.Intersects(bj)) continue;
+                            if (!(cellOf(Vector3::Max(bi.min(), bj.min()), level) == cell)) continue;
+
+                            addPair(pairs, id, e.proxyId);
+                        }
+                    }
+        }
+    }
+
+    // 一番粗い階層にも入らない物体は総当たり
+    for (size_t i = 0; i < oversized.size(); ++i)
+    {
+        const int a = oversized[i];
+
+        // 大きな物体同士
+        for (size_t j = i + 1; j < oversized.size(); ++j)
+        {
+            const int b = oversized[j];
+            if (proxies[a].bounds.Intersects(proxies[b].bounds))
+            {
+                addPair(pairs, a, b);
+            }
+        }
+
+        // グリッドに入っている物体
+        for (int b = 0; b < int(proxies.size()); ++b)
+        {
+            if (levels[b] < 0) continue;
+            if (proxies[a].bounds.Intersects(proxies[b].bounds))
+            {
+                addPair(pairs, a, b);
+            }
+        }
+    }
+}
+
+
+// 範囲が覆う各階層のセルと、表を作ったあとに変わったプロキシ、大きな物体を調べる
+// 範囲が広すぎる場合は総当たりのほうが速いので基底クラスに任せる
+void SpatialHashBroadphase::query(const Bounds& bounds, BroadphaseQueryCallback& callback) const
+{
+    int64_t cellCount = 0;
+    for (int level = 0; level < levelCount; ++level)
+    {
+        if ((usedLevels & (1u << level)) == 0) continue;
+        const Cell c0 = cellOf(bounds.min(), level);
+        const Cell c1 = cellOf(bounds.max(), level);
+        cellCount += int64_t(c1.x - c0.x + 1) * (c1.y - c0.y + 1) * (c1.z - c0.z + 1);
+    }
+    if (entries.empty() || cellCount > int64_t(entries.size()))
+    {
+        Broadphase::query(bounds, callback);
+        return;
+    }
+
+    for (int level = 0; level < levelCount; ++level)
+    {
+        if ((usedLevels & (1u << level)) == 0) continue;
+
+        const Cell c0 = cellOf(bounds.min(), level);
+        const Cell c1 = cellOf(bounds.max(), level);
+        for (int z = c0.z; z <= c1.z; ++z)
+            for (int y = c0.y; y <= c1.y; ++y)
+                for (int x = c0.x; x <= c1.x; ++x)
+                {
+                    const Cell cell{ x, y, z, level };
+                    const uint32_t b = bucketOf(cell);
+                    for (uint32_t i = bucketStart[b]; i < bucketStart[b + 1]; ++i)
+                    {
+                        const Entry& e = sorted[i];
+                        if (!(e.cell == cell) || dirty(e.proxyId)) continue;
+
+                        const Proxy& p = proxies[e.proxyId];
+                        if (!p.active || !p.bounds.Intersects(bounds)) continue;
+
+                        // 重なり領域の最小角を含むセルでだけ報告する
+                        if (!(cellOf(Vector3::Max(p.bounds.min(), bounds.min()), level) == cell)) continue;
+
+                        if (!callback.reportShape(p.shapeIndex)) return;
+                    }
+                }
+    }
+
+    for (int id : oversized)
+    {
+        const Proxy& p = proxies[id];
+        if (!dirty(id) && p.active && p.bounds.Intersects(bounds))
+        {
+            if (!callback.reportShape(p.shapeIndex)) return;
+        }
+    }
+
+    for (int id : dirtyProxies)
+    {
+        const Proxy& p = proxies[id];
+        if (p.active && p.bounds.Intersects(bounds))
+        {
+            if (!callback.reportShape(p.shapeIndex)) return;
+        }
+    }
+}
+
+
+// 各階層で線分に沿ってセルをたどり（3D DDA）、radius の分だけ周りのセルも調べる
+// たどるセルが物体の数より多くなりそうな場合は総当たりのほうが速いので基底クラスに任せる
+void SpatialHashBroadphase::raycast(Vector3 origin, Vector3 direction, float maxDistance, BroadphaseRaycastCallback& callback, float radius) const
+{
+    if (entries.empty())
+    {
+        Broadphase::raycast(origin, direction, maxDistance, callback, radius);
+        return;
+    }
+
+    // グリッドの範囲に線分を切り詰める
+    const Vector3 invDir = DynamicAABBTree::inverseDirection(direction);
+    const Vector3 gridMin = gridBounds.min() - Vector3(radius, radius, radius);
+    const Vector3 gridMax = gridBounds.max() + Vector3(radius, radius, radius);
+    float tEnter = 0.0f;
+    float tExit = maxDistance;
+    for (int i = 0; i < 3 && tEnter <= tExit; ++i)
+    {
+        const float o = (&origin.x)[i];
+        if (std::isinf((&invDir.x)[i]))
+        {
+            if (o < (&gridMin.x)[i] || o > (&gridMax.x)[i]) tExit = -1.0f;
+            continue;
+        }
+        float t1 = ((&gridMin.x)[i] - o) * (&invDir.x)[i];
+        float t2 = ((&gridMax.x)[i] - o) * (&invDir.x)[i];
+        if (t1 > t2) std::swap(t1, t2);
+        tEnter = std::max(tEnter, t1);
+        tExit = std::min(tExit, t2);
+    }
+    const bool hitsGrid = tEnter <= tExit;
+
+    if (hitsGrid)
+    {
+        float cells = 0.0f;
+        for (int level = 0; level < levelCount; ++level)
+        {
+            if ((usedLevels & (1u << level)) == 0) continue;
+            const float span = float(2 * int(std::ceil(radius * invCellSizes[level])) + 1);
+            cells += ((tExit - tEnter) * (std::abs(direction.x) + std::abs(direction.y) + std::abs(direction.z)) * invCellSizes[level] + 3.0f) * span * span * span;
+        }
+        if (cells > float(entries.size()))
+        {
+            Broadphase::raycast(origin, direction, maxDistance, callback, radius);
+            return;
+        }
+    }
+
+    // 一番粗い階層にも入らない物体と、表を作ったあとに変わったプロキシは個別に調べる
+    for (int id : oversized)
+    {
+        const Proxy& p = proxies[id];
+        if (dirty(id) || !p.active || !DynamicAABBTree::rayIntersects(p.bounds, origin, invDir, maxDistance, radius)) continue;
+        maxDistance = callback.reportShape(p.shapeIndex, maxDistance);
+        if (maxDistance <= 0.0f) return;
+    }
+    for (int id : dirtyProxies)
+    {
+        const Proxy& p = proxies[id];
+        if (!p.active || !DynamicAABBTree::rayIntersects(p.bounds, origin, invDir, maxDistance, radius)) continue;
+        maxDistance = callback.reportShape(p.shapeIndex, maxDistance);
+        if (maxDistance <= 0.0f) return;
+    }
+    if (!hitsGrid) return;
+
+    // 複数のセルに入っている物体を二度報告しないよう、報告したものを覚えておく
+    // クエリは複数のスレッドから同時に呼ばれるので作業用の配列はスレッドごとに持つ
+    static thread_local vector<int> reported;
+    reported.clear();
+
+    for (int level = 0; level < levelCount; ++level)
+    {
+        if ((usedLevels & (1u << level)) == 0) continue;
+
+        // 次の境界までの距離と、1セル進むごとの距離
+        const float size = cellSizes[level];
+        const int reach = int(std::ceil(radius * invCellSizes[level]));
+        Cell cell = cellOf(origin + direction * tEnter, level);
+        int stepDir[3];
+        float tNext[3];
+        float tDelta[3];
+        for (int i = 0; i < 3; ++i)
+        {
+            const float d = (&direction.x)[i];
+            const float o = (&origin.x)[i];
+            const int c = (&cell.x)[i];
+            stepDir[i] = d > 0.0f ? 1 : d < 0.0f ? -1 : 0;
+            tNext[i] = d > 0.0f ? (float(c + 1) * size - o) / d : d < 0.0f ? (float(c) * size - o) / d : std::numeric_limits<float>::infinity();
+            tDelta[i] = d != 0.0f ? size / std::abs(d) : std::numeric_limits<float>::infinity();
+        }
+
+        float t = tEnter;
+        while (t <= std::min(tExit, maxDistance))
+        {
+            for (int z = cell.z - reach; z <= cell.z + reach; ++z)
+                for (int y = cell.y - reach; y <= cell.y + reach; ++y)
+                    for (int x = cell.x - reach; x <= cell.x + reach; ++x)
+                    {
+                        const Cell c{ x, y, z, level };
+                        const uint32_t b = bucketOf(c);
+                        for (uint32_t i = bucketStart[b]; i < bucketStart[b + 1]; ++i)
+                        {
+                            const Entry& e = sorted[i];
+                            if (!(e.cell == c) || dirty(e.proxyId)) continue;
+
+                            const Proxy& p = proxies[e.proxyId];
+                            if (!p.active || std::find(reported.begin(), reported.end(), e.proxyId) != reported.end()) continue;
+                            if (!DynamicAABBTree::rayIntersects(p.bounds, origin, invDir, maxDistance, radius)) continue;
+
+                            reported.push_back(e.proxyId);
+                            maxDistance = callback.reportShape(p.shapeIndex, maxDistance);
+                            if (maxDistance <= 0.0f) return;
+                        }
+                    }
+
+            // 一番近い境界を越えて隣のセルへ
+            const int a = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+            t = tNext[a];
+            (&cell.x)[a] += stepDir[a];
+            tNext[a] += tDelta[a];
+        }
+    }
+}
+
+} // namespace UniDx
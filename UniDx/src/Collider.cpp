@@ -1,10 +1,13 @@
 ﻿#include "Collider.h"
 
 #include <limits>
+#include <algorithm>
 
 #include "pch.h"
 #include <UniDx/Rigidbody.h>
 #include <UniDx/Collider.h>
+#include <UniDx/GameObject.h>
+#include <UniDx/Renderer.h>
 
 namespace
 {
@@ -19,11 +22,11 @@ constexpr float infinity = numeric_limits<float>::infinity();
 bool checkTrigger_(SphereCollider* sphere, AABBCollider* aabb)
 {
     // 球の中心（ワールド座標）
-    Vector3 sphereCenter = sphere->transform->TransformPoint(sphere->center);
+    Vector3 sphereCenter = sphere->getWorldGeometry().center;
     float sphereRadius = sphere->radius;
 
     // AABBのBounds
-    Bounds aabbBounds = aabb->getBounds();
+    Bounds aabbBounds = aabb->getWorldBounds();
 
     // AABB上で球中心に最も近い点
     Vector3 closest = aabbBounds.ClosestPoint(sphereCenter);
@@ -36,83 +39,1587 @@ bool checkTrigger_(SphereCollider* sphere, AABBCollider* aabb)
     return distSqr <= sphereRadius * sphereRadius;
 }
 
-// 衝突していれば attachedRigidbody に addCorrectPosition(), addCorrectVelocity() で補正する
-bool checkIntersect_(SphereCollider* sphere, AABBCollider* aabb, PhysicsActor* sphereActor, PhysicsActor* aabbActor)
+// 位置補正法で使う剛体の速度と質量
+// シミュレーション中の剛体の状態から読む。動かないもの（Rigidbody がない、kinematic）の質量は無限大
+struct BodyMotion_
+{
+    Vector3 velocity = Vector3::Zero;
+    float mass = infinity;
+    PhysicsActor* actor = nullptr;
+
+    bool isDynamic() const { return mass != infinity; }
+};
+
+BodyMotion_ bodyMotion_(const PhysicsShape* shape, const NarrowphaseBuffer& buffer)
+{
+    BodyMotion_ motion;
+    const int i = shape->bodyIndex;
+    if (i < 0) return motion;
+
+    const PhysicsBodyStore& bodies = *buffer.bodies;
+    motion.velocity = bodies.velocities[i];
+    if ((bodies.flags[i] & PhysicsBodyStore::Kinematic) == 0)
+    {
+        motion.mass = bodies.masses[i] > 0.0f ? bodies.masses[i] : 1.0f;
+    }
+    motion.actor = shape->actor;
+    return motion;
+}
+
+
+// 球と AABB の補正を buffer に addCorrectPosition(), addCorrectVelocity() で記録する
+// contactNormal は AABB から球向き
+bool correctSphereAABB_(SphereCollider* sphere, AABBCollider* aabb, const PhysicsShape* sphereShape, const PhysicsShape* aabbShape, Vector3 contactNormal, float penetration, NarrowphaseBuffer& buffer)
+{
+    // 剛体の速度と質量
+    const BodyMotion_ bodyA = bodyMotion_(sphereShape, buffer);
+    const BodyMotion_ bodyB = bodyMotion_(aabbShape, buffer);
+
+    // 相対速度
+    Vector3 relVel = bodyA.velocity - bodyB.velocity;
+
+    // 相対速度が法線方向（離れようとしている）場合は無視
+    if (relVel.Dot(contactNormal) > 0)
+        return false;
+
+    // 質量（0以下は1.0f扱い）
+    float massA = bodyA.mass;
+    float massB = bodyB.mass;
+    float totalMass = massA + massB;
+
+    float massAPerTotal = massA != infinity ? massA / totalMass : 1;
+    float massBPerTotal = massB != infinity ? massB / totalMass : 1;
+
+    // 補正ベクトル
+    Vector3 correctionA = contactNormal * (penetration * massBPerTotal);
+    Vector3 correctionB = -contactNormal * (penetration * massAPerTotal);
+
+    // 位置補正
+    if (bodyA.isDynamic()) buffer.addCorrectPosition(bodyA.actor, correctionA);
+    if (bodyB.isDynamic()) buffer.addCorrectPosition(bodyB.actor, correctionB);
+
+    // 跳ね返り係数
+    float bounce = sphere->bounciness * aabb->bounciness;
+
+    // 法線方向の速度成分
+    float relVelN = relVel.Dot(contactNormal);
+
+    // 反射させる
+    Vector3 impulse = -(1.0f + bounce) * relVelN * contactNormal;
+
+    if (bodyA.isDynamic()) buffer.addCorrectVelocity(bodyA.actor, impulse * massBPerTotal);
+    if (bodyB.isDynamic()) buffer.addCorrectVelocity(bodyB.actor, -impulse * massAPerTotal);
+
+    return true;
+}
+
+
+// 衝突していれば buffer に addCorrectPosition(), addCorrectVelocity() で補正を記録する
+bool checkIntersect_(SphereCollider* sphere, AABBCollider* aabb, const PhysicsShape* sphereShape, const PhysicsShape* aabbShape, NarrowphaseBuffer& buffer)
 {
     // 球の中心（ワールド座標）
-    Vector3 sphereCenter = sphere->transform->TransformPoint(sphere->center);
+    Vector3 sphereCenter = sphere->getWorldGeometry().center;
     float sphereRadius = sphere->radius;
 
-    // AABBのBounds
-    Bounds aabbBounds = aabb->getBounds();
+    // AABBのBounds
+    Bounds aabbBounds = aabb->getWorldBounds();
+
+    // AABB上で球中心に最も近い点
+    Vector3 closest = aabbBounds.ClosestPoint(sphereCenter);
+
+    // 最近点と球中心のベクトル
+    Vector3 normal = sphereCenter - closest;
+    float distSqr = normal.LengthSquared();
+
+    // 衝突していない
+    if (distSqr > sphereRadius * sphereRadius)
+        return false;
+
+    float dist = std::sqrt(distSqr);
+    // 法線（dist==0のときは適当な軸にする）
+    Vector3 contactNormal = (dist > 1e-6f) ? (normal / dist) : Vector3(1, 0, 0);
+
+    // penetration（めり込み量）
+    float penetration = sphereRadius - dist;
+
+    return correctSphereAABB_(sphere, aabb, sphereShape, aabbShape, contactNormal, penetration, buffer);
+}
+
+
+// 球と球の接触点を作成。法線は A から B 向き
+bool getContacts_(Vector3 centerA, float radiusA, Vector3 centerB, float radiusB, ContactManifold& m)
+{
+    Vector3 sub = centerB - centerA;
+    float distSqr = sub.LengthSquared();
+    float radiusAB = radiusA + radiusB;
+    if (distSqr > radiusAB * radiusAB)
+        return false;
+
+    // 中心が重なっているときは上向きで押し出す
+    float dist = std::sqrt(distSqr);
+    Vector3 normal = dist > 1e-6f ? sub / dist : Vector3(0, 1, 0);
+
+    Contact& c = m.contacts[0];
+    c.normal = normal;
+    c.penetration = radiusAB - dist;
+    c.point = centerA + normal * (radiusA - c.penetration * 0.5f);
+    c.feature = 0;
+    m.numContacts = 1;
+    return true;
+}
+
+
+// 球と AABB の接触点を作成。法線は球から AABB 向き
+bool getContacts_(Vector3 sphereCenter, float sphereRadius, const Bounds& aabb, ContactManifold& m)
+{
+    Vector3 closest = aabb.ClosestPoint(sphereCenter);
+    Vector3 sub = closest - sphereCenter;
+    float distSqr = sub.LengthSquared();
+    if (distSqr > sphereRadius * sphereRadius)
+        return false;
+
+    Contact& c = m.contacts[0];
+    if (distSqr > 1e-12f)
+    {
+        float dist = std::sqrt(distSqr);
+        c.normal = sub / dist;
+        c.penetration = sphereRadius - dist;
+        c.point = closest;
+    }
+    else
+    {
+        // 中心が AABB の内側にあるときは、一番近い面から押し出す
+        const Vector3 mn = aabb.min();
+        const Vector3 mx = aabb.max();
+        const float toMin[3] = { sphereCenter.x - mn.x, sphereCenter.y - mn.y, sphereCenter.z - mn.z };
+        const float toMax[3] = { mx.x - sphereCenter.x, mx.y - sphereCenter.y, mx.z - sphereCenter.z };
+        int axis = 0;
+        bool minSide = true;
+        float depth = toMin[0];
+        for (int i = 0; i < 3; ++i)
+        {
+            if (toMin[i] < depth) { depth = toMin[i]; axis = i; minSide = true; }
+            if (toMax[i] < depth) { depth = toMax[i]; axis = i; minSide = false; }
+        }
+
+        // 球は面の外側へ出たいので、法線（球から AABB）は面の内向き
+        Vector3 normal = Vector3::Zero;
+        (&normal.x)[axis] = minSide ? 1.0f : -1.0f;
+        c.normal = normal;
+        c.penetration = sphereRadius + depth;
+        c.point = sphereCenter - normal * depth;
+    }
+    c.feature = 0;
+    m.numContacts = 1;
+    return true;
+}
+
+
+// AABB 同士の接触点を作成。法線は A から B 向き
+// めり込みが一番浅い軸で押し出し、重なった面の四隅を接触点にする
+bool getContacts_(const Bounds& a, const Bounds& b, ContactManifold& m)
+{
+    const Vector3 minA = a.min(), maxA = a.max();
+    const Vector3 minB = b.min(), maxB = b.max();
+    const float* mnA = &minA.x;
+    const float* mxA = &maxA.x;
+    const float* mnB = &minB.x;
+    const float* mxB = &maxB.x;
+
+    int axis = 0;
+    float depth = infinity;
+    for (int i = 0; i < 3; ++i)
+    {
+        float overlap = std::min(mxA[i], mxB[i]) - std::max(mnA[i], mnB[i]);
+        if (overlap < 0)
+            return false;
+        if (overlap < depth)
+        {
+            depth = overlap;
+            axis = i;
+        }
+    }
+
+    const float* centerA = &a.Center.x;
+    const float* centerB = &b.Center.x;
+    const float sign = centerB[axis] >= centerA[axis] ? 1.0f : -1.0f;
+    Vector3 normal = Vector3::Zero;
+    (&normal.x)[axis] = sign;
+
+    // 接触面は重なった範囲の中央
+    const float plane = sign > 0 ? (mxA[axis] + mnB[axis]) * 0.5f : (mnA[axis] + mxB[axis]) * 0.5f;
+    const int u = (axis + 1) % 3;
+    const int v = (axis + 2) % 3;
+    const float lo[2] = { std::max(mnA[u], mnB[u]), std::max(mnA[v], mnB[v]) };
+    const float hi[2] = { std::min(mxA[u], mxB[u]), std::min(mxA[v], mxB[v]) };
+
+    for (int i = 0; i < 4; ++i)
+    {
+        Contact& c = m.contacts[i];
+        float* p = &c.point.x;
+        p[axis] = plane;
+        p[u] = (i & 1) ? hi[0] : lo[0];
+        p[v] = (i & 2) ? hi[1] : lo[1];
+        c.normal = normal;
+        c.penetration = depth;
+        c.feature = uint32_t(axis * 4 + i);
+    }
+    m.numContacts = 4;
+    return true;
+}
+
+
+// 半直線と球の交差。始点が球の内側なら当たらない
+bool raySphere_(Vector3 origin, Vector3 direction, Vector3 center, float radius, float maxDistance, float& t)
+{
+    const Vector3 m = origin - center;
+    const float b = m.Dot(direction);
+    const float c = m.LengthSquared() - radius * radius;
+    if (c <= 0.0f || b > 0.0f)
+        return false;
+
+    const float disc = b * b - c;
+    if (disc < 0.0f)
+        return false;
+
+    t = -b - std::sqrt(disc);
+    return t <= maxDistance;
+}
+
+
+// 半直線と AABB の交差（スラブ法）。始点が AABB の内側なら当たらない
+// 当たれば入った面の軸と向きを axis, sign に返す
+bool rayAABB_(Vector3 origin, Vector3 direction, const Vector3& mn, const Vector3& mx, float maxDistance, float& t, int& axis, float& sign)
+{
+    const float* o = &origin.x;
+    const float* d = &direction.x;
+    const float* bmin = &mn.x;
+    const float* bmax = &mx.x;
+
+    float tmin = -infinity;
+    float tmax = infinity;
+    axis = 0;
+    sign = 0.0f;
+    for (int i = 0; i < 3; ++i)
+    {
+        if (std::abs(d[i]) < 1e-12f)
+        {
+            // 軸に平行な場合はスラブの内側にあるかだけ調べる
+            if (o[i] < bmin[i] || o[i] > bmax[i]) return false;
+            continue;
+        }
+        const float inv = 1.0f / d[i];
+        float t1 = (bmin[i] - o[i]) * inv;
+        float t2 = (bmax[i] - o[i]) * inv;
+        float s = -1.0f;
+        if (t1 > t2)
+        {
+            std::swap(t1, t2);
+            s = 1.0f;
+        }
+        if (t1 > tmin)
+        {
+            tmin = t1;
+            axis = i;
+            sign = s;
+        }
+        tmax = std::min(tmax, t2);
+        if (tmin > tmax) return false;
+    }
+
+    // 始点が内側
+    if (tmin < 0.0f || sign == 0.0f)
+        return false;
+
+    t = tmin;
+    return t <= maxDistance;
+}
+
+
+// 半径 radius の球を動かしたときに AABB に最初に触れる距離
+// AABB を半径で広げた角の丸い箱と半直線の交差を、面、辺（円柱）、頂点（球）に分けて調べる
+bool sweepSphereAABB_(Vector3 origin, float radius, Vector3 direction, const Bounds& box, float maxDistance, float& t)
+{
+    const Vector3 mn = box.min();
+    const Vector3 mx = box.max();
+
+    // 始点で重なっていれば当たらない
+    if (Vector3::DistanceSquared(box.ClosestPoint(origin), origin) <= radius * radius)
+        return false;
+
+    // 広げた箱に入る点が元の箱の面の範囲にあれば、そこが答え
+    const Vector3 r(radius, radius, radius);
+    int axis;
+    float sign;
+    float tEnter;
+    const bool enter = rayAABB_(origin, direction, mn - r, mx + r, maxDistance, tEnter, axis, sign);
+    if (enter)
+    {
+        const Vector3 p = origin + direction * tEnter;
+        const float* pp = &p.x;
+        int outside = 0;
+        for (int i = 0; i < 3; ++i)
+        {
+            if (i != axis && (pp[i] < (&mn.x)[i] || pp[i] > (&mx.x)[i])) outside++;
+        }
+        if (outside == 0)
+        {
+            t = tEnter;
+            return true;
+        }
+    }
+    else
+    {
+        // 広げた箱の内側から始まる場合は角の近くにいるので、辺と頂点を調べる
+        const Vector3 e0 = mn - r;
+        const Vector3 e1 = mx + r;
+        const bool inside = origin.x >= e0.x && origin.x <= e1.x && origin.y >= e0.y && origin.y <= e1.y && origin.z >= e0.z && origin.z <= e1.z;
+        if (!inside) return false;
+    }
+
+    // 辺（軸に平行な円柱）と頂点（球）の中で一番近いもの
+    const float* o = &origin.x;
+    const float* d = &direction.x;
+    const float* bmin = &mn.x;
+    const float* bmax = &mx.x;
+    bool hit = false;
+    float best = maxDistance;
+    for (int k = 0; k < 3; ++k)
+    {
+        const int u = (k + 1) % 3;
+        const int v = (k + 2) % 3;
+        const float a = d[u] * d[u] + d[v] * d[v];
+        if (a < 1e-12f) continue;
+
+        for (int corner = 0; corner < 4; ++corner)
+        {
+            const float cu = (corner & 1) ? bmax[u] : bmin[u];
+            const float cv = (corner & 2) ? bmax[v] : bmin[v];
+            const float ou = o[u] - cu;
+            const float ov = o[v] - cv;
+            const float b = ou * d[u] + ov * d[v];
+            const float c = ou * ou + ov * ov - radius * radius;
+            const float disc = b * b - a * c;
+            if (c <= 0.0f || b > 0.0f || disc < 0.0f) continue;
+
+            const float tc = (-b - std::sqrt(disc)) / a;
+            const float pk = o[k] + d[k] * tc;
+            if (tc < best && pk >= bmin[k] && pk <= bmax[k])
+            {
+                best = tc;
+                hit = true;
+            }
+        }
+    }
+    for (int corner = 0; corner < 8; ++corner)
+    {
+        const Vector3 c((corner & 1) ? mx.x : mn.x, (corner & 2) ? mx.y : mn.y, (corner & 4) ? mx.z : mn.z);
+        float tc;
+        if (raySphere_(origin, direction, c, radius, best, tc))
+        {
+            best = tc;
+            hit = true;
+        }
+    }
+
+    if (hit) t = best;
+    return hit;
+}
+
+
+// 線分 a-b 上で point に一番近い点
+Vector3 closestPointOnSegment_(Vector3 point, Vector3 a, Vector3 b)
+{
+    const Vector3 ab = b - a;
+    const float lengthSq = ab.LengthSquared();
+    if (lengthSq < 1e-12f) return a;
+    const float t = std::clamp((point - a).Dot(ab) / lengthSq, 0.0f, 1.0f);
+    return a + ab * t;
+}
+
+
+// 2つの線分の最近点（Ericson の ClosestPtSegmentSegment）
+void closestPointsSegmentSegment_(Vector3 p1, Vector3 q1, Vector3 p2, Vector3 q2, Vector3& c1, Vector3& c2)
+{
+    const Vector3 d1 = q1 - p1;
+    const Vector3 d2 = q2 - p2;
+    const Vector3 r = p1 - p2;
+    const float a = d1.LengthSquared();
+    const float e = d2.LengthSquared();
+    const float f = d2.Dot(r);
+
+    float s = 0.0f;
+    float t = 0.0f;
+    if (a < 1e-12f && e < 1e-12f)
+    {
+        // どちらも点
+    }
+    else if (a < 1e-12f)
+    {
+        t = std::clamp(f / e, 0.0f, 1.0f);
+    }
+    else
+    {
+        const float c = d1.Dot(r);
+        if (e < 1e-12f)
+        {
+            s = std::clamp(-c / a, 0.0f, 1.0f);
+        }
+        else
+        {
+            const float b = d1.Dot(d2);
+            const float denom = a * e - b * b;
+
+            // 平行なときは適当な点から始める
+            s = denom > 1e-12f ? std::clamp((b * f - c * e) / denom, 0.0f, 1.0f) : 0.0f;
+            t = (b * s + f) / e;
+            if (t < 0.0f)
+            {
+                t = 0.0f;
+                s = std::clamp(-c / a, 0.0f, 1.0f);
+            }
+            else if (t > 1.0f)
+            {
+                t = 1.0f;
+                s = std::clamp((b - c) / a, 0.0f, 1.0f);
+            }
+        }
+    }
+    c1 = p1 + d1 * s;
+    c2 = p2 + d2 * t;
+}
+
+
+// カプセルの線分の両端
+void capsuleSegment_(const ConvexGeometry& capsule, Vector3& a, Vector3& b)
+{
+    a = capsule.center - capsule.axes[0] * capsule.halfExtents.x;
+    b = capsule.center + capsule.axes[0] * capsule.halfExtents.x;
+}
+
+
+// 一般の凸形状どうしの接触点を GJK/EPA で作成。法線は A から B 向き
+bool getContacts_(const ConvexGeometry& a, const ConvexGeometry& b, ContactManifold& m)
+{
+    ConvexContact contact;
+    if (!ConvexGeometry::getContact(a, b, contact))
+        return false;
+
+    Contact& c = m.contacts[0];
+    c.point = contact.point;
+    c.normal = contact.normal;
+    c.penetration = contact.penetration;
+    c.feature = 0;
+    m.numContacts = 1;
+    return true;
+}
+
+
+// 球と向きのある箱の接触点を作成。法線は球から箱向き
+bool getContacts_(Vector3 sphereCenter, float sphereRadius, const ConvexGeometry& box, ContactManifold& m)
+{
+    // 箱のローカル座標で最近点を求める
+    const Vector3 d = sphereCenter - box.center;
+    const float* he = &box.halfExtents.x;
+    float local[3];
+    Vector3 closest = box.center;
+    bool inside = true;
+    for (int i = 0; i < 3; ++i)
+    {
+        local[i] = d.Dot(box.axes[i]);
+        const float clamped = std::clamp(local[i], -he[i], he[i]);
+        if (clamped != local[i]) inside = false;
+        closest += box.axes[i] * clamped;
+    }
+
+    Contact& c = m.contacts[0];
+    if (!inside)
+    {
+        const Vector3 sub = closest - sphereCenter;
+        const float distSq = sub.LengthSquared();
+        if (distSq > sphereRadius * sphereRadius)
+            return false;
+
+        const float dist = std::sqrt(distSq);
+        c.normal = dist > 1e-6f ? sub / dist : -box.axes[0];
+        c.penetration = sphereRadius - dist;
+        c.point = closest;
+    }
+    else
+    {
+        // 中心が箱の内側にあるときは、一番近い面から押し出す
+        int axis = 0;
+        float depth = he[0] - std::abs(local[0]);
+        for (int i = 1; i < 3; ++i)
+        {
+            const float di = he[i] - std::abs(local[i]);
+            if (di < depth) { depth = di; axis = i; }
+        }
+        c.normal = box.axes[axis] * (local[axis] >= 0.0f ? -1.0f : 1.0f);
+        c.penetration = sphereRadius + depth;
+        c.point = sphereCenter - c.normal * depth;
+    }
+    c.feature = 0;
+    m.numContacts = 1;
+    return true;
+}
+
+
+// 凸多角形を平面 dot(p, normal) <= offset で切り取る（Sutherland-Hodgman）
+int clipPolygon_(const Vector3* in, int count, Vector3 normal, float offset, Vector3* out)
+{
+    int n = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        const Vector3& p = in[i];
+        const Vector3& q = in[(i + 1) % count];
+        const float dp = p.Dot(normal) - offset;
+        const float dq = q.Dot(normal) - offset;
+        if (dp <= 0.0f) out[n++] = p;
+        if ((dp < 0.0f && dq > 0.0f) || (dp > 0.0f && dq < 0.0f))
+        {
+            out[n++] = p + (q - p) * (dp / (dp - dq));
+        }
+    }
+    return n;
+}
+
+
+// 向きのある箱どうしの接触点を作成。法線は A から B 向き
+// 15軸の分離軸判定でめり込みが一番浅い軸を選び、面なら相手の面を切り取って最大4点、辺どうしなら1点にする
+bool getContactsBoxBox_(const ConvexGeometry& a, const ConvexGeometry& b, ContactManifold& m)
+{
+    const Vector3 d = b.center - a.center;
+    auto project = [](const ConvexGeometry& g, Vector3 n) {
+        return g.halfExtents.x * std::abs(g.axes[0].Dot(n)) + g.halfExtents.y * std::abs(g.axes[1].Dot(n)) + g.halfExtents.z * std::abs(g.axes[2].Dot(n));
+    };
+
+    int bestAxis = -1;
+    float bestDepth = infinity;
+    Vector3 bestNormal;
+    auto testAxis = [&](int axis, Vector3 n) {
+        const float length = n.Length();
+        if (length < 1e-6f) return true;    // 平行な辺の組は面の軸で調べられる
+        n /= length;
+
+        const float dist = d.Dot(n);
+        const float depth = project(a, n) + project(b, n) - std::abs(dist);
+        if (depth < 0.0f) return false;
+
+        // 同じくらいなら面の軸を選び、接触点を安定させる
+        const bool better = axis < 6 ? depth < bestDepth : depth * 1.05f + 1e-3f < bestDepth;
+        if (better)
+        {
+            bestAxis = axis;
+            bestDepth = depth;
+            bestNormal = dist >= 0.0f ? n : -n;
+        }
+        return true;
+    };
+
+    for (int i = 0; i < 3; ++i)
+    {
+        if (!testAxis(i, a.axes[i])) return false;
+    }
+    for (int i = 0; i < 3; ++i)
+    {
+        if (!testAxis(3 + i, b.axes[i])) return false;
+    }
+    for (int i = 0; i < 3; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            if (!testAxis(6 + i * 3 + j, a.axes[i].Cross(b.axes[j]))) return false;
+        }
+    }
+    if (bestAxis < 0) return getContacts_(a, b, m);
+
+    if (bestAxis >= 6)
+    {
+        // 辺どうし。それぞれの箱で法線方向に一番出ている辺の最近点
+        const int i = (bestAxis - 6) / 3;
+        const int j = (bestAxis - 6) % 3;
+        const float* ea = &a.halfExtents.x;
+        const float* eb = &b.halfExtents.x;
+        Vector3 pa = a.center;
+        Vector3 pb = b.center;
+        for (int k = 0; k < 3; ++k)
+        {
+            if (k != i) pa += a.axes[k] * (a.axes[k].Dot(bestNormal) > 0.0f ? ea[k] : -ea[k]);
+            if (k != j) pb += b.axes[k] * (b.axes[k].Dot(bestNormal) > 0.0f ? -eb[k] : eb[k]);
+        }
+        Vector3 ca, cb;
+        closestPointsSegmentSegment_(pa - a.axes[i] * ea[i], pa + a.axes[i] * ea[i], pb - b.axes[j] * eb[j], pb + b.axes[j] * eb[j], ca, cb);
+
+        Contact& c = m.contacts[0];
+        c.point = (ca + cb) * 0.5f;
+        c.normal = bestNormal;
+        c.penetration = bestDepth;
+        c.feature = uint32_t(bestAxis * 8);
+        m.numContacts = 1;
+        return true;
+    }
+
+    // 基準面を持つ箱と、それに当たる面を持つ箱
+    const bool referenceA = bestAxis < 3;
+    const ConvexGeometry& ref = referenceA ? a : b;
+    const ConvexGeometry& inc = referenceA ? b : a;
+    const Vector3 refNormal = referenceA ? bestNormal : -bestNormal;     // 基準の箱から相手へ
+    const int refAxis = bestAxis % 3;
+    const float* refHe = &ref.halfExtents.x;
+    const float* incHe = &inc.halfExtents.x;
+
+    // 相手の箱で基準面と一番向かい合っている面
+    int incAxis = 0;
+    float incDot = 0.0f;
+    for (int k = 0; k < 3; ++k)
+    {
+        const float dk = inc.axes[k].Dot(refNormal);
+        if (std::abs(dk) > std::abs(incDot)) { incDot = dk; incAxis = k; }
+    }
+    const Vector3 incCenter = inc.center + inc.axes[incAxis] * (incDot > 0.0f ? -incHe[incAxis] : incHe[incAxis]);
+    const int iu = (incAxis + 1) % 3;
+    const int iv = (incAxis + 2) % 3;
+    const Vector3 u = inc.axes[iu] * incHe[iu];
+    const Vector3 v = inc.axes[iv] * incHe[iv];
+
+    Vector3 polygon[8] = { incCenter + u + v, incCenter - u + v, incCenter - u - v, incCenter + u - v };
+    Vector3 clipped[8];
+    int count = 4;
+
+    // 基準面の4辺で切り取る
+    for (int k = 1; k <= 2; ++k)
+    {
+        const int side = (refAxis + k) % 3;
+        const Vector3 n = ref.axes[side];
+        const float c = ref.center.Dot(n);
+        count = clipPolygon_(polygon, count, n, c + refHe[side], clipped);
+        count = clipPolygon_(clipped, count, -n, -c + refHe[side], polygon);
+    }
+
+    // 基準面より下にある点を接触点にする
+    const Vector3 refCenter = ref.center + refNormal * refHe[refAxis];
+    Vector3 points[8];
+    float depths[8];
+    int numPoints = 0;
+    for (int k = 0; k < count; ++k)
+    {
+        const float separation = (polygon[k] - refCenter).Dot(refNormal);
+        if (separation > 0.0f) continue;
+        points[numPoints] = polygon[k] - refNormal * (separation * 0.5f);
+        depths[numPoints] = -separation;
+        numPoints++;
+    }
+    if (numPoints == 0) return getContacts_(a, b, m);
+
+    // 4点より多ければ、一番深い点から順に広がるように選ぶ
+    int selected[4] = { 0, -1, -1, -1 };
+    int numSelected = std::min(numPoints, 4);
+    if (numPoints > 4)
+    {
+        for (int k = 1; k < numPoints; ++k)
+        {
+            if (depths[k] > depths[selected[0]]) selected[0] = k;
+        }
+        for (int s = 1; s < 4; ++s)
+        {
+            float best = -1.0f;
+            for (int k = 0; k < numPoints; ++k)
+            {
+                float nearest = infinity;
+                for (int t = 0; t < s; ++t)
+                {
+                    if (selected[t] == k) nearest = -1.0f;
+                    else nearest = std::min(nearest, Vector3::DistanceSquared(points[k], points[selected[t]]));
+                }
+                if (nearest > best) { best = nearest; selected[s] = k; }
+            }
+        }
+    }
+    else
+    {
+        for (int k = 0; k < numPoints; ++k) selected[k] = k;
+    }
+
+    for (int k = 0; k < numSelected; ++k)
+    {
+        Contact& c = m.contacts[k];
+        c.point = points[selected[k]];
+        c.normal = bestNormal;
+        c.penetration = depths[selected[k]];
+        c.feature = uint32_t(bestAxis * 8 + selected[k]);
+    }
+    m.numContacts = numSelected;
+    return true;
+}
+
+
+// カプセルと箱の接触点を作成。法線はカプセルから箱向き
+// 一番深い点に加えて、両端の球が触れていればそれも接触点にし、寝かせたカプセルが転がらないようにする
+bool getContactsCapsuleBox_(const ConvexGeometry& capsule, const ConvexGeometry& box, ContactManifold& m)
+{
+    if (!getContacts_(capsule, box, m))
+        return false;
+
+    Vector3 ends[2];
+    capsuleSegment_(capsule, ends[0], ends[1]);
+    for (int i = 0; i < 2; ++i)
+    {
+        ContactManifold end;
+        if (!getContacts_(ends[i], capsule.radius, box, end)) continue;
+        if (Vector3::DistanceSquared(end.contacts[0].point, m.contacts[0].point) < capsule.radius * capsule.radius * 0.0625f) continue;
+
+        Contact& c = m.contacts[m.numContacts++];
+        c = end.contacts[0];
+        c.feature = uint32_t(1 + i);
+    }
+    return true;
+}
+
+
+// カプセルどうしの接触点を作成。法線は A から B 向き
+bool getContactsCapsuleCapsule_(const ConvexGeometry& a, const ConvexGeometry& b, ContactManifold& m)
+{
+    Vector3 a0, a1, b0, b1, ca, cb;
+    capsuleSegment_(a, a0, a1);
+    capsuleSegment_(b, b0, b1);
+    closestPointsSegmentSegment_(a0, a1, b0, b1, ca, cb);
+    return getContacts_(ca, a.radius, cb, b.radius, m);
+}
+
+
+// 凸形状どうしのトリガーチェック
+bool checkTriggerConvex_(const Collider* a, const Collider* b)
+{
+    return ConvexGeometry::intersects(a->getWorldGeometry(), b->getWorldGeometry());
+}
+
+
+// 接触点から位置と速度の補正を記録する。checkIntersect_ と同じ考え方で、一番深い接触点を使う
+bool checkIntersectConvex_(Collider* a, Collider* b, const PhysicsShape* shapeA, const PhysicsShape* shapeB, NarrowphaseBuffer& buffer)
+{
+    ContactManifold m;
+    m.numContacts = 0;
+    if (!a->getContacts(b, m))
+        return false;
+
+    const Contact* deepest = &m.contacts[0];
+    for (int i = 1; i < m.numContacts; ++i)
+    {
+        if (m.contacts[i].penetration > deepest->penetration) deepest = &m.contacts[i];
+    }
+    const Vector3 normal = deepest->normal;     // A から B 向き
+
+    const BodyMotion_ bodyA = bodyMotion_(shapeA, buffer);
+    const BodyMotion_ bodyB = bodyMotion_(shapeB, buffer);
+
+    // 離れようとしている場合は無視
+    Vector3 relVel = bodyA.velocity - bodyB.velocity;
+    if (relVel.Dot(normal) < 0)
+        return false;
+
+    float massA = bodyA.mass;
+    float massB = bodyB.mass;
+    float totalMass = massA + massB;
+    float massAPerTotal = massA != infinity ? massA / totalMass : 1;
+    float massBPerTotal = massB != infinity ? massB / totalMass : 1;
+
+    // 位置補正
+    const float penetration = deepest->penetration;
+    if (bodyA.isDynamic()) buffer.addCorrectPosition(bodyA.actor, -normal * (penetration * massBPerTotal));
+    if (bodyB.isDynamic()) buffer.addCorrectPosition(bodyB.actor, normal * (penetration * massAPerTotal));
+
+    // 反射させる
+    float bounce = a->bounciness * b->bounciness;
+    Vector3 impulse = -(1.0f + bounce) * relVel.Dot(normal) * normal;
+    if (bodyA.isDynamic()) buffer.addCorrectVelocity(bodyA.actor, impulse * massBPerTotal);
+    if (bodyB.isDynamic()) buffer.addCorrectVelocity(bodyB.actor, -impulse * massAPerTotal);
+
+    return true;
+}
+
+
+// 凸形状に対するスフィアキャスト。castRadius が0ならレイキャスト
+bool castConvex_(const Collider* collider, const ConvexGeometry& g, Vector3 origin, float castRadius, Vector3 direction, float maxDistance, RaycastHit& hit)
+{
+    float t;
+    Vector3 normal, point;
+    if (!g.cast(origin, castRadius, direction, maxDistance, t, normal, point))
+        return false;
+
+    hit.collider = const_cast<Collider*>(collider);
+    hit.distance = t;
+    hit.normal = normal;
+    hit.point = point;
+    return true;
+}
+
+
+// 線分と三角形の最近点。線分が三角形を貫いていれば、どちらも交点になる
+void closestPointsSegmentTriangle_(Vector3 p, Vector3 q, Vector3 a, Vector3 b, Vector3 c, Vector3& onSegment, Vector3& onTriangle)
+{
+    float t;
+    if (TriangleMeshBVH::raycastTriangle(p, q - p, a, b, c, 1.0f, t))
+    {
+        onSegment = onTriangle = p + (q - p) * t;
+        return;
+    }
+
+    // 両端と三角形、線分と3辺のうち一番近い組
+    float bestSq = infinity;
+    auto consider = [&](Vector3 s, Vector3 tri) {
+        const float d = Vector3::DistanceSquared(s, tri);
+        if (d < bestSq)
+        {
+            bestSq = d;
+            onSegment = s;
+            onTriangle = tri;
+        }
+    };
+    consider(p, TriangleMeshBVH::closestPointOnTriangle(p, a, b, c));
+    consider(q, TriangleMeshBVH::closestPointOnTriangle(q, a, b, c));
+    const Vector3 edges[3][2] = { { a, b }, { b, c }, { c, a } };
+    for (const auto& e : edges)
+    {
+        Vector3 s, tri;
+        closestPointsSegmentSegment_(p, q, e[0], e[1], s, tri);
+        consider(s, tri);
+    }
+}
+
+
+// 三角形と向きのある箱が重なっているか（13軸の分離軸判定）
+bool triangleIntersectsBox_(Vector3 a, Vector3 b, Vector3 c, const ConvexGeometry& box)
+{
+    // 箱のローカル座標に移す
+    Vector3 v[3];
+    const Vector3 world[3] = { a, b, c };
+    for (int i = 0; i < 3; ++i)
+    {
+        const Vector3 d = world[i] - box.center;
+        v[i] = Vector3(d.Dot(box.axes[0]), d.Dot(box.axes[1]), d.Dot(box.axes[2]));
+    }
+    const Vector3 he = box.halfExtents;
+
+    // 投影した区間が [-r, r] と重なるか
+    auto overlaps = [&](Vector3 axis) {
+        const float p0 = v[0].Dot(axis);
+        const float p1 = v[1].Dot(axis);
+        const float p2 = v[2].Dot(axis);
+        const float r = he.x * std::abs(axis.x) + he.y * std::abs(axis.y) + he.z * std::abs(axis.z);
+        return std::min({ p0, p1, p2 }) <= r && std::max({ p0, p1, p2 }) >= -r;
+    };
+
+    // 箱の3軸
+    if (!overlaps(Vector3::UnitX) || !overlaps(Vector3::UnitY) || !overlaps(Vector3::UnitZ))
+        return false;
+
+    // 三角形の法線
+    const Vector3 edges[3] = { v[1] - v[0], v[2] - v[1], v[0] - v[2] };
+    if (!overlaps(edges[0].Cross(edges[1])))
+        return false;
+
+    // 辺と箱の軸の外積
+    const Vector3 units[3] = { Vector3::UnitX, Vector3::UnitY, Vector3::UnitZ };
+    for (const auto& e : edges)
+    {
+        for (const auto& u : units)
+        {
+            const Vector3 axis = u.Cross(e);
+            if (axis.LengthSquared() < 1e-12f) continue;
+            if (!overlaps(axis))
+                return false;
+        }
+    }
+    return true;
+}
+
+
+// メッシュの接触点を加える。近い点は深い方だけ残し、4点を超えたら一番浅いものと入れ替える
+void addMeshContact_(ContactManifold& m, const Contact& c, float mergeDistance)
+{
+    for (int i = 0; i < m.numContacts; ++i)
+    {
+        if (Vector3::DistanceSquared(m.contacts[i].point, c.point) < mergeDistance * mergeDistance)
+        {
+            if (c.penetration > m.contacts[i].penetration) m.contacts[i] = c;
+            return;
+        }
+    }
+
+    if (m.numContacts < int(m.contacts.size()))
+    {
+        m.contacts[m.numContacts++] = c;
+        return;
+    }
+
+    int shallowest = 0;
+    for (int i = 1; i < m.numContacts; ++i)
+    {
+        if (m.contacts[i].penetration < m.contacts[shallowest].penetration) shallowest = i;
+    }
+    if (c.penetration > m.contacts[shallowest].penetration) m.contacts[shallowest] = c;
+}
+
+
+// 球と三角形の接触点。法線は球から三角形向き
+bool getContactSphereTriangle_(Vector3 center, float radius, Vector3 a, Vector3 b, Vector3 c, Contact& contact)
+{
+    const Vector3 closest = TriangleMeshBVH::closestPointOnTriangle(center, a, b, c);
+    const Vector3 sub = closest - center;
+    const float distSq = sub.LengthSquared();
+    if (distSq > radius * radius)
+        return false;
+
+    // 中心が面の上にあるときは表側から押し出す
+    const float dist = std::sqrt(distSq);
+    if (dist > 1e-6f)
+    {
+        contact.normal = sub / dist;
+    }
+    else
+    {
+        contact.normal = (c - a).Cross(b - a);
+        contact.normal.Normalize();
+    }
+    contact.penetration = radius - dist;
+    contact.point = closest;
+    return true;
+}
+
+
+// 地形の下に潜った点の接触。真上の三角形の面から上へ押し出す
+// MeshCollider には表裏がないので、潜ったとはみなさない
+bool undergroundContact_(const MeshCollider* mesh, Vector3 point, float radius, Contact& contact)
+{
+    return false;
+}
+
+
+bool undergroundContact_(const HeightfieldCollider* heightfield, Vector3 point, float radius, Contact& contact)
+{
+    Vector3 a, b, c;
+    const int triangle = heightfield->findTriangle(point.x, point.z, a, b, c);
+    if (triangle < 0)
+        return false;
+
+    Vector3 n = (b - a).Cross(c - a);
+    n.Normalize();
+    const float d = (point - a).Dot(n);
+    if (d >= 0.0f)
+        return false;
+
+    contact.normal = -n;
+    contact.penetration = radius - d;
+    contact.point = point - n * d;
+    contact.feature = uint32_t(triangle);
+    return true;
+}
+
+
+// 線分が貫いた三角形の法線を、押し出す側へ向ける。地形は常に上へ押し出す
+Vector3 outsideNormal_(const MeshCollider* mesh, Vector3 n, Vector3 a, Vector3 center)
+{
+    return (center - a).Dot(n) < 0.0f ? -n : n;
+}
+
+
+Vector3 outsideNormal_(const HeightfieldCollider* heightfield, Vector3 n, Vector3 a, Vector3 center)
+{
+    return n;
+}
+
+
+// 球とメッシュの接触点を作成。法線は球からメッシュ向き
+// 触れている三角形ごとに最近点を接触点にし、隣の三角形と同じ点になるものはまとめる
+// メッシュは forEachTriangle を持つ MeshCollider か HeightfieldCollider
+template<typename TriangleShape>
+bool getContactsSphereMesh_(Vector3 center, float radius, const TriangleShape* mesh, ContactManifold& m)
+{
+    m.numContacts = 0;
+    Contact underground;
+    if (undergroundContact_(mesh, center, radius, underground))
+    {
+        m.contacts[m.numContacts++] = underground;
+        return true;
+    }
+
+    mesh->forEachTriangle(Bounds(center, Vector3(radius, radius, radius)), [&](Vector3 a, Vector3 b, Vector3 c, int triangle) {
+        Contact contact;
+        if (getContactSphereTriangle_(center, radius, a, b, c, contact))
+        {
+            contact.feature = uint32_t(triangle);
+            addMeshContact_(m, contact, radius * 0.25f);
+        }
+        return true;
+        });
+    return m.numContacts > 0;
+}
+
+
+// カプセルとメッシュの接触点を作成。法線はカプセルからメッシュ向き
+// 三角形ごとに線分の最近点に加えて両端の球の接触も調べ、寝かせたカプセルが転がらないようにする
+template<typename TriangleShape>
+bool getContactsCapsuleMesh_(const ConvexGeometry& capsule, const TriangleShape* mesh, ContactManifold& m)
+{
+    Vector3 p, q;
+    capsuleSegment_(capsule, p, q);
+    const float radius = capsule.radius;
+    const Vector3 ends[2] = { p, q };
+
+    // 地形の下に潜った端は、その場で上へ押し出す
+    m.numContacts = 0;
+    bool underground[2] = { false, false };
+    for (int i = 0; i < 2; ++i)
+    {
+        Contact contact;
+        if (!undergroundContact_(mesh, ends[i], radius, contact)) continue;
+        underground[i] = true;
+        contact.feature = contact.feature * 3 + 1 + i;
+        addMeshContact_(m, contact, radius * 0.25f);
+    }
+
+    mesh->forEachTriangle(capsule.getBounds(), [&](Vector3 a, Vector3 b, Vector3 c, int triangle) {
+        Vector3 onSegment, onTriangle;
+        closestPointsSegmentTriangle_(p, q, a, b, c, onSegment, onTriangle);
+
+        Contact contact;
+        contact.feature = uint32_t(triangle) * 3;
+        const Vector3 sub = onTriangle - onSegment;
+        const float distSq = sub.LengthSquared();
+        if (distSq <= 1e-12f)
+        {
+            // 線分が三角形を貫いている。深く沈んだ側の端を面の外へ押し出す
+            Vector3 n = (b - a).Cross(c - a);
+            n.Normalize();
+            n = outsideNormal_(mesh, n, a, capsule.center);
+            contact.normal = -n;
+            contact.penetration = radius - std::min((p - a).Dot(n), (q - a).Dot(n));
+            contact.point = onTriangle;
+            addMeshContact_(m, contact, radius * 0.25f);
+        }
+        else if (distSq <= radius * radius)
+        {
+            const float dist = std::sqrt(distSq);
+            contact.normal = sub / dist;
+            contact.penetration = radius - dist;
+            contact.point = onTriangle;
+            addMeshContact_(m, contact, radius * 0.25f);
+        }
+
+        for (int i = 0; i < 2; ++i)
+        {
+            Contact end;
+            if (underground[i] || !getContactSphereTriangle_(ends[i], radius, a, b, c, end)) continue;
+            end.feature = uint32_t(triangle) * 3 + 1 + i;
+            addMeshContact_(m, end, radius * 0.25f);
+        }
+        return true;
+        });
+    return m.numContacts > 0;
+}
+
+
+// カプセルとメッシュが重なっているか
+template<typename TriangleShape>
+bool overlapCapsuleMesh_(const ConvexGeometry& capsule, const TriangleShape* mesh)
+{
+    Vector3 p, q;
+    capsuleSegment_(capsule, p, q);
+
+    Contact underground;
+    if (undergroundContact_(mesh, p, capsule.radius, underground) || undergroundContact_(mesh, q, capsule.radius, underground))
+        return true;
+
+    bool hit = false;
+    mesh->forEachTriangle(capsule.getBounds(), [&](Vector3 a, Vector3 b, Vector3 c, int) {
+        Vector3 onSegment, onTriangle;
+        closestPointsSegmentTriangle_(p, q, a, b, c, onSegment, onTriangle);
+        hit = Vector3::DistanceSquared(onSegment, onTriangle) <= capsule.radius * capsule.radius;
+        return !hit;
+        });
+    return hit;
+}
+
+
+// 球とメッシュが重なっているか
+template<typename TriangleShape>
+bool overlapSphereMesh_(Vector3 center, float radius, const TriangleShape* mesh)
+{
+    Contact underground;
+    if (undergroundContact_(mesh, center, radius, underground))
+        return true;
+
+    bool hit = false;
+    mesh->forEachTriangle(Bounds(center, Vector3(radius, radius, radius)), [&](Vector3 a, Vector3 b, Vector3 c, int) {
+        hit = Vector3::DistanceSquared(center, TriangleMeshBVH::closestPointOnTriangle(center, a, b, c)) <= radius * radius;
+        return !hit;
+        });
+    return hit;
+}
+
+
+// 向きのある箱とメッシュが重なっているか
+template<typename TriangleShape>
+bool overlapBoxMesh_(const ConvexGeometry& box, const TriangleShape* mesh)
+{
+    Contact underground;
+    if (undergroundContact_(mesh, box.center, 0.0f, underground))
+        return true;
+
+    bool hit = false;
+    mesh->forEachTriangle(box.getBounds(), [&](Vector3 a, Vector3 b, Vector3 c, int) {
+        hit = triangleIntersectsBox_(a, b, c, box);
+        return !hit;
+        });
+    return hit;
+}
+
+
+// 球を動かして最初に触れる点。hit.collider 以外を書き込む
+// 通り道の三角形ごとに、最近点までの距離だけ進める保守的前進法で触れる距離を求める
+template<typename TriangleShape>
+bool sphereCastMesh_(const TriangleShape* mesh, Vector3 origin, float castRadius, Vector3 direction, float maxDistance, RaycastHit& hit)
+{
+    // 通り道をメッシュの範囲で切り詰める。範囲はステップの準備で求めたものを使い、Transform は読まない
+    Bounds range = mesh->getWorldBounds();
+    range.Extents = Vector3(range.Extents) + Vector3(castRadius, castRadius, castRadius);
+    float enter = 0.0f;
+    float exit = maxDistance;
+    for (int i = 0; i < 3; ++i)
+    {
+        const float o = (&origin.x)[i];
+        const float d = (&direction.x)[i];
+        const float lo = (&range.Center.x)[i] - (&range.Extents.x)[i];
+        const float hi = (&range.Center.x)[i] + (&range.Extents.x)[i];
+        if (std::abs(d) < 1e-12f)
+        {
+            if (o < lo || o > hi) return false;
+            continue;
+        }
+        float t1 = (lo - o) / d;
+        float t2 = (hi - o) / d;
+        if (t1 > t2) std::swap(t1, t2);
+        enter = std::max(enter, t1);
+        exit = std::min(exit, t2);
+    }
+    if (enter > exit) return false;
+
+    Bounds sweep(origin + direction * enter, Vector3(castRadius, castRadius, castRadius));
+    sweep.Encapsulate(origin + direction * exit - Vector3(castRadius, castRadius, castRadius));
+    sweep.Encapsulate(origin + direction * exit + Vector3(castRadius, castRadius, castRadius));
+
+    constexpr int maxIterations = 32;
+    constexpr float tolerance = 1e-4f;
+    float best = exit;
+    bool found = false;
+    mesh->forEachTriangle(sweep, [&](Vector3 a, Vector3 b, Vector3 c, int) {
+        // 始点で重なっている三角形には当たらない
+        if (Vector3::DistanceSquared(origin, TriangleMeshBVH::closestPointOnTriangle(origin, a, b, c)) <= castRadius * castRadius)
+            return true;
+
+        float t = enter;
+        for (int i = 0; i < maxIterations && t <= best; ++i)
+        {
+            const Vector3 p = origin + direction * t;
+            const Vector3 closest = TriangleMeshBVH::closestPointOnTriangle(p, a, b, c);
+            const float gap = Vector3::Distance(p, closest) - castRadius;
+            if (gap < tolerance)
+            {
+                best = t;
+                found = true;
+                hit.point = closest;
+                hit.normal = p - closest;
+                hit.normal.Normalize();
+                break;
+            }
+            t += gap;
+        }
+        return true;
+        });
+    if (!found) return false;
+
+    hit.distance = best;
+    return true;
+}
+
+
+// --------------------
+// 形状の組み合わせごとの判定
+//
+// 種類の番号が小さい方を a にした組み合わせだけを書き、逆の組み合わせは表に登録するときに入れ替える。
+// 表にない組み合わせは当たらないものとする
+// --------------------
+
+// 接触点を逆の組み合わせから見た向きにする
+bool flipContacts_(bool hit, ContactManifold& m)
+{
+    if (!hit) return false;
+    for (int i = 0; i < m.numContacts; ++i)
+    {
+        m.contacts[i].normal = -m.contacts[i].normal;
+    }
+    return true;
+}
+
+
+// トリガーチェック
+bool triggerSphereSphere_(SphereCollider* a, SphereCollider* b)
+{
+    Vector3 centerA = a->getWorldGeometry().center;
+    Vector3 centerB = b->getWorldGeometry().center;
+    float radiusAB = a->radius + b->radius;
+
+    // 中心距離が半径の合計より離れていれば当たっていない
+    return Vector3::DistanceSquared(centerA, centerB) <= radiusAB * radiusAB;
+}
+
+
+// トリガーチェック
+bool triggerSphereAABB_(SphereCollider* a, AABBCollider* b)
+{
+    return checkTrigger_(a, b);
+}
+
+
+// トリガーチェック
+bool triggerAABBAABB_(AABBCollider* a, AABBCollider* b)
+{
+    return a->getWorldBounds().Intersects(b->getWorldBounds());
+}
+
+
+// トリガーチェック。凸形状どうしは GJK で判定する
+template<typename A, typename B>
+bool triggerConvex_(A* a, B* b)
+{
+    return checkTriggerConvex_(a, b);
+}
+
+
+// トリガーチェック
+template<typename Mesh>
+bool triggerSphereMesh_(SphereCollider* a, Mesh* b)
+{
+    return b->overlapSphere(a->getWorldGeometry().center, a->radius);
+}
+
+
+// トリガーチェック
+template<typename Box, typename Mesh>
+bool triggerBoxMesh_(Box* a, Mesh* b)
+{
+    return overlapBoxMesh_(a->getWorldGeometry(), b);
+}
+
+
+// トリガーチェック
+template<typename Mesh>
+bool triggerCapsuleMesh_(CapsuleCollider* a, Mesh* b)
+{
+    return overlapCapsuleMesh_(a->getWorldGeometry(), b);
+}
+
+
+// 球と球の補正を buffer に記録する。normal は A から B 向き
+bool correctSphereSphere_(SphereCollider* a, SphereCollider* b, const PhysicsShape* shapeA, const PhysicsShape* shapeB, Vector3 normal, float penetration, NarrowphaseBuffer& buffer)
+{
+    // それぞれの位置補正
+    buffer.addCorrectPosition(shapeB->actor, normal * (penetration * 0.5f));
+    buffer.addCorrectPosition(shapeA->actor, -normal * (penetration * 0.5f));
+
+    // 跳ね返り計算
+    Vector3 va = bodyMotion_(shapeA, buffer).velocity;
+    Vector3 vb = bodyMotion_(shapeB, buffer).velocity;
+
+    // 相対速度
+    Vector3 relV = va - vb;
+    if (relV.Dot(normal) < 0)
+    {
+        return false;
+    }
+
+    // 跳ね返り係数
+    float bounce = a->bounciness * b->bounciness;
+
+    Vector3 relVNormal = normal * relV.Dot(normal);
+    buffer.addCorrectVelocity(shapeA->actor, relVNormal * -bounce);
+    buffer.addCorrectVelocity(shapeB->actor, relVNormal * bounce);
+
+    return false;
+}
+
+
+// 衝突チェック
+bool intersectSphereSphere_(SphereCollider* a, SphereCollider* b, const PhysicsShape* shapeA, const PhysicsShape* shapeB, NarrowphaseBuffer& buffer)
+{
+    Vector3 centerA = a->getWorldGeometry().center;
+    float radiusA = a->radius;
+    Vector3 centerB = b->getWorldGeometry().center;
+    float radiusB = b->radius;
+
+    // 中心距離が半径の合計より離れていれば当たっていない
+    if (Vector3::Distance(centerA, centerB) > radiusA + radiusB)
+        return false;
+
+    // めり込みの深さ
+    float penetration = radiusA + radiusB - Vector3::Distance(centerA, centerB);
+
+    // 中心の差の向き
+    Vector3 normal = centerB - centerA;
+    normal.Normalize();
+
+    return correctSphereSphere_(a, b, shapeA, shapeB, normal, penetration, buffer);
+}
+
+
+// 衝突チェック
+bool intersectSphereAABB_(SphereCollider* a, AABBCollider* b, const PhysicsShape* shapeA, const PhysicsShape* shapeB, NarrowphaseBuffer& buffer)
+{
+    return checkIntersect_(a, b, shapeA, shapeB, buffer);
+}
+
+
+// 衝突チェック。接触点の一番深いところで補正する
+template<typename A, typename B>
+bool intersectConvex_(A* a, B* b, const PhysicsShape* shapeA, const PhysicsShape* shapeB, NarrowphaseBuffer& buffer)
+{
+    return checkIntersectConvex_(a, b, shapeA, shapeB, buffer);
+}
+
+
+// 接触点の作成
+bool contactsSphereSphere_(SphereCollider* a, SphereCollider* b, ContactManifold& m)
+{
+    return getContacts_(a->getWorldGeometry().center, a->radius, b->getWorldGeometry().center, b->radius, m);
+}
+
+
+// 接触点の作成
+bool contactsSphereAABB_(SphereCollider* a, AABBCollider* b, ContactManifold& m)
+{
+    return getContacts_(a->getWorldGeometry().center, a->radius, b->getWorldBounds(), m);
+}
+
+
+// 接触点の作成
+bool contactsAABBAABB_(AABBCollider* a, AABBCollider* b, ContactManifold& m)
+{
+    return getContacts_(a->getWorldBounds(), b->getWorldBounds(), m);
+}
+
+
+// 接触点の作成
+bool contactsSphereBox_(SphereCollider* a, BoxCollider* b, ContactManifold& m)
+{
+    return getContacts_(a->getWorldGeometry().center, a->radius, b->getWorldGeometry(), m);
+}
+
+
+// 接触点の作成。カプセルの線分上の最近点を中心とする球との判定になる
+bool contactsSphereCapsule_(SphereCollider* a, CapsuleCollider* b, ContactManifold& m)
+{
+    const Vector3 c = a->getWorldGeometry().center;
+    const ConvexGeometry capsule = b->getWorldGeometry();
+    Vector3 p, q;
+    capsuleSegment_(capsule, p, q);
+    return getContacts_(c, a->radius, closestPointOnSegment_(c, p, q), capsule.radius, m);
+}
+
+
+// 接触点の作成。AABB も向きのある箱として扱う
+template<typename A, typename B>
+bool contactsBoxBox_(A* a, B* b, ContactManifold& m)
+{
+    return getContactsBoxBox_(a->getWorldGeometry(), b->getWorldGeometry(), m);
+}
+
+
+// 接触点の作成
+template<typename Box>
+bool contactsBoxCapsule_(Box* a, CapsuleCollider* b, ContactManifold& m)
+{
+    return flipContacts_(getContactsCapsuleBox_(b->getWorldGeometry(), a->getWorldGeometry(), m), m);
+}
+
+
+// 接触点の作成
+bool contactsCapsuleCapsule_(CapsuleCollider* a, CapsuleCollider* b, ContactManifold& m)
+{
+    return getContactsCapsuleCapsule_(a->getWorldGeometry(), b->getWorldGeometry(), m);
+}
+
+
+// 接触点の作成
+template<typename Mesh>
+bool contactsSphereMesh_(SphereCollider* a, Mesh* b, ContactManifold& m)
+{
+    return getContactsSphereMesh_(a->getWorldGeometry().center, a->radius, b, m);
+}
+
+
+// 接触点の作成
+template<typename Mesh>
+bool contactsCapsuleMesh_(CapsuleCollider* a, Mesh* b, ContactManifold& m)
+{
+    return getContactsCapsuleMesh_(a->getWorldGeometry(), b, m);
+}
+
 
-    // AABB上で球中心に最も近い点
-    Vector3 closest = aabbBounds.ClosestPoint(sphereCenter);
+// 表に載せる形の関数。Flip なら a と b を入れ替えて F を呼ぶ
+template<typename A, typename B, auto F, bool Flip>
+bool triggerEntry_(Collider* a, Collider* b)
+{
+    if constexpr (Flip) return F(static_cast<A*>(b), static_cast<B*>(a));
+    else return F(static_cast<A*>(a), static_cast<B*>(b));
+}
 
-    // 最近点と球中心のベクトル
-    Vector3 normal = sphereCenter - closest;
-    float distSqr = normal.LengthSquared();
 
-    // 衝突していない
-    if (distSqr > sphereRadius * sphereRadius)
-        return false;
+template<typename A, typename B, auto F, bool Flip>
+bool intersectEntry_(Collider* a, Collider* b, const PhysicsShape* shapeA, const PhysicsShape* shapeB, NarrowphaseBuffer& buffer)
+{
+    if constexpr (Flip) return F(static_cast<A*>(b), static_cast<B*>(a), shapeB, shapeA, buffer);
+    else return F(static_cast<A*>(a), static_cast<B*>(b), shapeA, shapeB, buffer);
+}
 
-    // Rigidbody取得
-    Rigidbody* rbA = sphere->attachedRigidbody;
-    Rigidbody* rbB = aabb->attachedRigidbody;
 
-    // 相対速度
-    Vector3 velA = rbA ? rbA->linearVelocity : Vector3::Zero;
-    Vector3 velB = rbB ? rbB->linearVelocity : Vector3::Zero;
-    Vector3 relVel = velA - velB;
+template<typename A, typename B, auto F, bool Flip>
+bool contactsEntry_(Collider* a, Collider* b, ContactManifold& m)
+{
+    if constexpr (Flip) return flipContacts_(F(static_cast<A*>(b), static_cast<B*>(a), m), m);
+    else return F(static_cast<A*>(a), static_cast<B*>(b), m);
+}
 
-    // 相対速度が法線方向（離れようとしている）場合は無視
-    if (relVel.Dot(normal) > 0)
-        return false;
 
-    float dist = std::sqrt(distSqr);
-    // 法線（dist==0のときは適当な軸にする）
-    Vector3 contactNormal = (dist > 1e-6f) ? (normal / dist) : Vector3(1, 0, 0);
+// 当たらない組み合わせ
+bool noTrigger_(Collider*, Collider*) { return false; }
+bool noIntersect_(Collider*, Collider*, const PhysicsShape*, const PhysicsShape*, NarrowphaseBuffer&) { return false; }
+bool noContacts_(Collider*, Collider*, ContactManifold&) { return false; }
 
-    // penetration（めり込み量）
-    float penetration = sphereRadius - dist;
 
-    // 質量取得（0以下は1.0f扱い）
-    float massA = (rbA && !rbA->isKinematic) ? (rbA->mass > 0.0f ? rbA->mass : 1.0f) : infinity;
-    float massB = (rbB && !rbB->isKinematic) ? (rbB->mass > 0.0f ? rbB->mass : 1.0f) : infinity;
-    float totalMass = massA + massB;
+// 形状の種類の組み合わせ (typeA, typeB) を添字とする判定関数の表
+struct DispatchTable
+{
+    Collider::TriggerFunc trigger[ColliderTypeCount][ColliderTypeCount] = {};
+    Collider::IntersectFunc intersect[ColliderTypeCount][ColliderTypeCount] = {};
+    Collider::ContactsFunc contacts[ColliderTypeCount][ColliderTypeCount] = {};
 
-    float massAPerTotal = massA != infinity ? massA / totalMass : 1;
-    float massBPerTotal = massB != infinity ? massB / totalMass : 1;
+    // (A, B) と (B, A) の両方に登録する
+    template<typename A, typename B, auto F>
+    constexpr void setTrigger()
+    {
+        trigger[int(A::colliderType)][int(B::colliderType)] = &triggerEntry_<A, B, F, false>;
+        trigger[int(B::colliderType)][int(A::colliderType)] = &triggerEntry_<A, B, F, true>;
+    }
 
-    // 補正ベクトル
-    Vector3 correctionA = contactNormal * (penetration * massBPerTotal);
-    Vector3 correctionB = -contactNormal * (penetration * massAPerTotal);
+    template<typename A, typename B, auto F>
+    constexpr void setIntersect()
+    {
+        intersect[int(A::colliderType)][int(B::colliderType)] = &intersectEntry_<A, B, F, false>;
+        intersect[int(B::colliderType)][int(A::colliderType)] = &intersectEntry_<A, B, F, true>;
+    }
 
-    // 位置補正
-    if (rbA && !rbA->isKinematic && massA != infinity) sphereActor->addCorrectPosition(correctionA);
-    if (rbB && !rbB->isKinematic && massB != infinity) aabbActor->addCorrectPosition(correctionB);
+    template<typename A, typename B, auto F>
+    constexpr void setContacts()
+    {
+        contacts[int(A::colliderType)][int(B::colliderType)] = &contactsEntry_<A, B, F, false>;
+        contacts[int(B::colliderType)][int(A::colliderType)] = &contactsEntry_<A, B, F, true>;
+    }
 
-    // 跳ね返り係数
-    float bounce = sphere->bounciness * aabb->bounciness;
+    // 同じ種類どうしは入れ替えなくてよい
+    template<typename A, auto Trigger, auto Intersect, auto Contacts>
+    constexpr void setSame()
+    {
+        trigger[int(A::colliderType)][int(A::colliderType)] = &triggerEntry_<A, A, Trigger, false>;
+        intersect[int(A::colliderType)][int(A::colliderType)] = &intersectEntry_<A, A, Intersect, false>;
+        contacts[int(A::colliderType)][int(A::colliderType)] = &contactsEntry_<A, A, Contacts, false>;
+    }
 
-    // 法線方向の速度成分
-    float relVelN = relVel.Dot(contactNormal);
+    template<typename A, typename B, auto Trigger, auto Intersect, auto Contacts>
+    constexpr void set()
+    {
+        setTrigger<A, B, Trigger>();
+        setIntersect<A, B, Intersect>();
+        setContacts<A, B, Contacts>();
+    }
 
-    // 反射させる
-    Vector3 impulse = -(1.0f + bounce) * relVelN * contactNormal;
+    constexpr DispatchTable()
+    {
+        for (int a = 0; a < ColliderTypeCount; ++a)
+        {
+            for (int b = 0; b < ColliderTypeCount; ++b)
+            {
+                trigger[a][b] = &noTrigger_;
+                intersect[a][b] = &noIntersect_;
+                contacts[a][b] = &noContacts_;
+            }
+        }
+
+        // 球、AABB は専用の判定。AABB どうしの補正は接触点の作成（AABB どうしの4点の判定）の一番深い点で行う
+        setSame<SphereCollider, &triggerSphereSphere_, &intersectSphereSphere_, &contactsSphereSphere_>();
+        set<SphereCollider, AABBCollider, &triggerSphereAABB_, &intersectSphereAABB_, &contactsSphereAABB_>();
+        setSame<AABBCollider, &triggerAABBAABB_, &intersectConvex_<AABBCollider, AABBCollider>, &contactsAABBAABB_>();
+
+        // 箱、カプセルが関わる組み合わせは、トリガーは GJK、接触点は形状ごとの判定で、補正はその一番深い点で行う
+        set<SphereCollider, BoxCollider, &triggerConvex_<SphereCollider, BoxCollider>, &intersectConvex_<SphereCollider, BoxCollider>, &contactsSphereBox_>();
+        set<SphereCollider, CapsuleCollider, &triggerConvex_<SphereCollider, CapsuleCollider>, &intersectConvex_<SphereCollider, CapsuleCollider>, &contactsSphereCapsule_>();
+        set<AABBCollider, BoxCollider, &triggerConvex_<AABBCollider, BoxCollider>, &intersectConvex_<AABBCollider, BoxCollider>, &contactsBoxBox_<AABBCollider, BoxCollider>>();
+        set<AABBCollider, CapsuleCollider, &triggerConvex_<AABBCollider, CapsuleCollider>, &intersectConvex_<AABBCollider, CapsuleCollider>, &contactsBoxCapsule_<AABBCollider>>();
+        setSame<BoxCollider, &triggerConvex_<BoxCollider, BoxCollider>, &intersectConvex_<BoxCollider, BoxCollider>, &contactsBoxBox_<BoxCollider, BoxCollider>>();
+        set<BoxCollider, CapsuleCollider, &triggerConvex_<BoxCollider, CapsuleCollider>, &intersectConvex_<BoxCollider, CapsuleCollider>, &contactsBoxCapsule_<BoxCollider>>();
+        setSame<CapsuleCollider, &triggerConvex_<CapsuleCollider, CapsuleCollider>, &intersectConvex_<CapsuleCollider, CapsuleCollider>, &contactsCapsuleCapsule_>();
+
+        // メッシュと地形は、球、カプセルとは衝突し、箱とはトリガーの判定だけ行う
+        set<SphereCollider, MeshCollider, &triggerSphereMesh_<MeshCollider>, &intersectConvex_<SphereCollider, MeshCollider>, &contactsSphereMesh_<MeshCollider>>();
+        set<CapsuleCollider, MeshCollider, &triggerCapsuleMesh_<MeshCollider>, &intersectConvex_<CapsuleCollider, MeshCollider>, &contactsCapsuleMesh_<MeshCollider>>();
+        setTrigger<AABBCollider, MeshCollider, &triggerBoxMesh_<AABBCollider, MeshCollider>>();
+        setTrigger<BoxCollider, MeshCollider, &triggerBoxMesh_<BoxCollider, MeshCollider>>();
+        set<SphereCollider, HeightfieldCollider, &triggerSphereMesh_<HeightfieldCollider>, &intersectConvex_<SphereCollider, HeightfieldCollider>, &contactsSphereMesh_<HeightfieldCollider>>();
+        set<CapsuleCollider, HeightfieldCollider, &triggerCapsuleMesh_<HeightfieldCollider>, &intersectConvex_<CapsuleCollider, HeightfieldCollider>, &contactsCapsuleMesh_<HeightfieldCollider>>();
+        setTrigger<AABBCollider, HeightfieldCollider, &triggerBoxMesh_<AABBCollider, HeightfieldCollider>>();
+        setTrigger<BoxCollider, HeightfieldCollider, &triggerBoxMesh_<BoxCollider, HeightfieldCollider>>();
+    }
+};
 
-    if (rbA && !rbA->isKinematic && massA != infinity) sphereActor->addCorrectVelocity(impulse * massBPerTotal);
-    if (rbB && !rbB->isKinematic && massB != infinity) aabbActor->addCorrectVelocity(-impulse * massAPerTotal);
+constexpr DispatchTable dispatchTable;
 
-    return true;
 }
 
+
+namespace UniDx
+{
+
+// 形状の組み合わせごとのトリガーチェックの関数
+Collider::TriggerFunc Collider::getTriggerFunc(ColliderType typeA, ColliderType typeB)
+{
+    return dispatchTable.trigger[int(typeA)][int(typeB)];
+}
+
+
+// 形状の組み合わせごとの衝突チェックの関数
+Collider::IntersectFunc Collider::getIntersectFunc(ColliderType typeA, ColliderType typeB)
+{
+    return dispatchTable.intersect[int(typeA)][int(typeB)];
 }
 
 
-namespace UniDx
+// 形状の組み合わせごとの接触点の作成の関数
+Collider::ContactsFunc Collider::getContactsFunc(ColliderType typeA, ColliderType typeB)
+{
+    return dispatchTable.contacts[int(typeA)][int(typeB)];
+}
+
+
+// バッチ判定の接触から補正する。球と AABB の補正は AABB から球向きの法線で行う
+bool Collider::correctContact(Collider* sphere, Collider* other, const PhysicsShape* sphereShape, const PhysicsShape* otherShape, const KernelContact& contact, NarrowphaseBuffer& buffer)
 {
+    auto a = static_cast<SphereCollider*>(sphere);
+    if (other->getType() == ColliderType::Sphere)
+    {
+        return correctSphereSphere_(a, static_cast<SphereCollider*>(other), sphereShape, otherShape, contact.normal, contact.penetration, buffer);
+    }
+    return correctSphereAABB_(a, static_cast<AABBCollider*>(other), sphereShape, otherShape, -contact.normal, contact.penetration, buffer);
+}
 
 
 // TransformをたどってRigidbodyを探す
@@ -136,6 +1643,15 @@ Rigidbody* Collider::findNearestRigidbody(Transform* t) const
 }
 
 
+// Transform からワールド空間の行列と形状と境界を求めておく。メインスレッドから呼ぶ
+void Collider::updateWorldShape()
+{
+    worldMatrix_ = transform->getLocalToWorldMatrix();
+    worldGeometry_ = getGeometry();
+    worldBounds_ = worldGeometry_.getBounds();
+}
+
+
 // ワールド空間における空間境界を取得
 Bounds SphereCollider::getBounds() const
 {
@@ -150,120 +1666,474 @@ Bounds AABBCollider::getBounds() const
 }
 
 
-// トリガーチェック
-bool AABBCollider::checkTrigger(AABBCollider* other)
+// レイキャスト
+bool AABBCollider::raycast(Vector3 origin, Vector3 direction, float maxDistance, RaycastHit& hit) const
 {
-    return getBounds().Intersects(other->getBounds());
+    const Bounds box = getWorldBounds();
+    float t;
+    int axis;
+    float sign;
+    if (!rayAABB_(origin, direction, box.min(), box.max(), maxDistance, t, axis, sign))
+        return false;
+
+    hit.collider = const_cast<AABBCollider*>(this);
+    hit.distance = t;
+    hit.point = origin + direction * t;
+    hit.normal = Vector3::Zero;
+    (&hit.normal.x)[axis] = sign;
+    return true;
 }
 
 
-// トリガーチェック
-bool AABBCollider::checkTrigger(SphereCollider* other)
+// 球を動かして最初に触れる点
+bool AABBCollider::sphereCast(Vector3 origin, float radius, Vector3 direction, float maxDistance, RaycastHit& hit) const
 {
-    return checkTrigger_(other, this);
+    const Bounds box = getWorldBounds();
+    float t;
+    if (!sweepSphereAABB_(origin, radius, direction, box, maxDistance, t))
+        return false;
+
+    // 触れたときの球の中心から一番近い箱の上の点
+    const Vector3 center = origin + direction * t;
+    hit.collider = const_cast<AABBCollider*>(this);
+    hit.distance = t;
+    hit.point = box.ClosestPoint(center);
+    hit.normal = center - hit.point;
+    hit.normal.Normalize();
+    return true;
 }
 
 
-// 衝突チェック
-// 衝突していれば attachedRigidbody に addCorrectPosition(), addCorrectVelocity() で補正する
-bool AABBCollider::checkIntersect(AABBCollider* other, PhysicsActor* myActor, PhysicsActor* otherActor)
+// 球と重なっているか
+bool AABBCollider::overlapSphere(Vector3 center, float radius) const
 {
-    return false;
+    return Vector3::DistanceSquared(getWorldBounds().ClosestPoint(center), center) <= radius * radius;
 }
 
 
-// 衝突チェック
-// 衝突していれば attachedRigidbody に addCorrectPosition(), addCorrectVelocity() で補正する
-bool AABBCollider::checkIntersect(SphereCollider* other, PhysicsActor* myActor, PhysicsActor* otherActor)
+// AABB と重なっているか
+bool AABBCollider::overlapBox(const Bounds& box) const
 {
-    return checkIntersect_(other, this, otherActor, myActor);
+    return getWorldBounds().Intersects(box);
 }
 
 
-// トリガーチェック
-bool SphereCollider::checkTrigger(AABBCollider* other)
+// レイキャスト
+bool SphereCollider::raycast(Vector3 origin, Vector3 direction, float maxDistance, RaycastHit& hit) const
 {
-    return checkTrigger_(this, other);
+    const Vector3 c = getWorldGeometry().center;
+    float t;
+    if (!raySphere_(origin, direction, c, radius, maxDistance, t))
+        return false;
+
+    hit.collider = const_cast<SphereCollider*>(this);
+    hit.distance = t;
+    hit.point = origin + direction * t;
+    hit.normal = (hit.point - c) / radius;
+    return true;
 }
 
 
-// トリガーチェック
-bool SphereCollider::checkTrigger(SphereCollider* other)
+// 球を動かして最初に触れる点
+bool SphereCollider::sphereCast(Vector3 origin, float castRadius, Vector3 direction, float maxDistance, RaycastHit& hit) const
 {
-    Vector3 centerA = transform->TransformPoint(center);
-    Vector3 centerB = other->transform->TransformPoint(other->center);
-    float radiusAB = radius + other->radius;
+    const Vector3 c = getWorldGeometry().center;
+    float t;
+    if (!raySphere_(origin, direction, c, radius + castRadius, maxDistance, t))
+        return false;
 
-    // 中心距離が半径の合計より離れていれば当たっていない
-    return Vector3::DistanceSquared(centerA, centerB) <= radiusAB * radiusAB;
+    hit.collider = const_cast<SphereCollider*>(this);
+    hit.distance = t;
+    hit.normal = (origin + direction * t - c) / (radius + castRadius);
+    hit.point = c + hit.normal * radius;
+    return true;
 }
 
 
-// 衝突チェック
-// 衝突していれば attachedRigidbody に addCorrectPosition(), addCorrectVelocity() で補正する
-bool SphereCollider::checkIntersect(AABBCollider* other, PhysicsActor* myActor, PhysicsActor* otherActor)
+// 球と重なっているか
+bool SphereCollider::overlapSphere(Vector3 c, float r) const
 {
-    return checkIntersect_(this, other, myActor, otherActor);
+    const float radiusAB = radius + r;
+    return Vector3::DistanceSquared(getWorldGeometry().center, c) <= radiusAB * radiusAB;
 }
 
 
-// 衝突チェック
-// 衝突していれば attachedRigidbody に addCorrectPosition(), addCorrectVelocity() で補正する
-bool SphereCollider::checkIntersect(SphereCollider* other, PhysicsActor* myActor, PhysicsActor* otherShap)
-{
-    Vector3 centerA = transform->TransformPoint(center);
-    float radiusA = radius;
-    Vector3 centerB = other->transform->TransformPoint(other->center);
-    float radiusB = other->radius;
-    
-    // 中心距離が半径の合計より離れていれば当たっていない
-    if (Vector3::Distance(centerA, centerB) > radiusA + radiusB)
+// AABB と重なっているか
+bool SphereCollider::overlapBox(const Bounds& box) const
+{
+    const Vector3 c = getWorldGeometry().center;
+    return Vector3::DistanceSquared(box.ClosestPoint(c), c) <= radius * radius;
+}
+
+
+// 判定用の凸形状
+ConvexGeometry SphereCollider::getGeometry() const
+{
+    return ConvexGeometry::sphere(transform->TransformPoint(center), radius);
+}
+
+
+// 判定用の凸形状
+ConvexGeometry AABBCollider::getGeometry() const
+{
+    return ConvexGeometry::aabb(getBounds());
+}
+
+
+// --------------------
+// BoxCollider
+// --------------------
+
+// 判定用の凸形状。Transform のスケールは軸ごとに大きさへ反映する
+ConvexGeometry BoxCollider::getGeometry() const
+{
+    static const Vector3 units[3] = { Vector3(1, 0, 0), Vector3(0, 1, 0), Vector3(0, 0, 1) };
+    Vector3 axes[3];
+    float halfExtents[3];
+    const float* s = &size.x;
+    for (int i = 0; i < 3; ++i)
+    {
+        const Vector3 axis = transform->TransformVector(units[i]);
+        const float scale = axis.Length();
+        axes[i] = scale > 1e-6f ? axis / scale : units[i];
+        halfExtents[i] = s[i] * 0.5f * scale;
+    }
+    return ConvexGeometry::box(transform->TransformPoint(center), axes, Vector3(halfExtents[0], halfExtents[1], halfExtents[2]));
+}
+
+
+// ワールド空間における空間境界を取得
+Bounds BoxCollider::getBounds() const
+{
+    return getGeometry().getBounds();
+}
+
+
+// レイキャスト。箱のローカル座標でスラブ法を使う
+bool BoxCollider::raycast(Vector3 origin, Vector3 direction, float maxDistance, RaycastHit& hit) const
+{
+    const ConvexGeometry box = getWorldGeometry();
+    const Vector3 o = origin - box.center;
+    const Vector3 localOrigin(o.Dot(box.axes[0]), o.Dot(box.axes[1]), o.Dot(box.axes[2]));
+    const Vector3 localDirection(direction.Dot(box.axes[0]), direction.Dot(box.axes[1]), direction.Dot(box.axes[2]));
+    float t;
+    int axis;
+    float sign;
+    if (!rayAABB_(localOrigin, localDirection, -box.halfExtents, box.halfExtents, maxDistance, t, axis, sign))
         return false;
 
-    // めり込みの深さ
-    float penetration = radiusA + radiusB - Vector3::Distance(centerA, centerB);
+    hit.collider = const_cast<BoxCollider*>(this);
+    hit.distance = t;
+    hit.point = origin + direction * t;
+    hit.normal = box.axes[axis] * sign;
+    return true;
+}
 
-    // 中心の差
-    Vector3 sub = centerB - centerA;
 
-    // それぞれの位置補正
-    Vector3 addB = sub;
-    addB.Normalize();
-    addB *= penetration * 0.5f;
+// 球を動かして最初に触れる点
+bool BoxCollider::sphereCast(Vector3 origin, float castRadius, Vector3 direction, float maxDistance, RaycastHit& hit) const
+{
+    return castConvex_(this, getWorldGeometry(), origin, castRadius, direction, maxDistance, hit);
+}
 
-    otherShap->addCorrectPosition(addB);
 
-    Vector3 addA = -sub;
-    addA.Normalize();
-    addA *= penetration * 0.5f;
+// 球と重なっているか
+bool BoxCollider::overlapSphere(Vector3 c, float r) const
+{
+    return ConvexGeometry::intersects(getWorldGeometry(), ConvexGeometry::sphere(c, r));
+}
 
-    myActor->addCorrectPosition(addA);
 
-    // 跳ね返り計算
-    Vector3 va = attachedRigidbody->linearVelocity;
-    Vector3 vb = other->attachedRigidbody->linearVelocity;
+// AABB と重なっているか
+bool BoxCollider::overlapBox(const Bounds& box) const
+{
+    return ConvexGeometry::intersects(getWorldGeometry(), ConvexGeometry::aabb(box));
+}
 
-    // 相対速度
-    Vector3 relV = va - vb;
 
-    Vector3 normal = sub;
-    normal.Normalize();
-    if (relV.Dot(normal) < 0)
+// --------------------
+// CapsuleCollider
+// --------------------
+
+// 判定用の凸形状。半径は direction 以外の軸の大きい方のスケールに合わせる
+ConvexGeometry CapsuleCollider::getGeometry() const
+{
+    static const Vector3 units[3] = { Vector3(1, 0, 0), Vector3(0, 1, 0), Vector3(0, 0, 1) };
+    const int axisIndex = std::clamp(direction, 0, 2);
+    const Vector3 axis = transform->TransformVector(units[axisIndex]);
+    const float axisScale = axis.Length();
+    const float radiusScale = std::max(transform->TransformVector(units[(axisIndex + 1) % 3]).Length(), transform->TransformVector(units[(axisIndex + 2) % 3]).Length());
+
+    const float r = radius * radiusScale;
+    const float halfLength = std::max(0.0f, height * 0.5f * axisScale - r);
+    const Vector3 c = transform->TransformPoint(center);
+    const Vector3 dir = axisScale > 1e-6f ? axis / axisScale : units[axisIndex];
+    return ConvexGeometry::capsule(c - dir * halfLength, c + dir * halfLength, r);
+}
+
+
+// ワールド空間における空間境界を取得
+Bounds CapsuleCollider::getBounds() const
+{
+    return getGeometry().getBounds();
+}
+
+
+// レイキャスト
+bool CapsuleCollider::raycast(Vector3 origin, Vector3 direction, float maxDistance, RaycastHit& hit) const
+{
+    return castConvex_(this, getWorldGeometry(), origin, 0.0f, direction, maxDistance, hit);
+}
+
+
+// 球を動かして最初に触れる点
+bool CapsuleCollider::sphereCast(Vector3 origin, float castRadius, Vector3 direction, float maxDistance, RaycastHit& hit) const
+{
+    return castConvex_(this, getWorldGeometry(), origin, castRadius, direction, maxDistance, hit);
+}
+
+
+// 球と重なっているか
+bool CapsuleCollider::overlapSphere(Vector3 c, float r) const
+{
+    return ConvexGeometry::intersects(getWorldGeometry(), ConvexGeometry::sphere(c, r));
+}
+
+
+// AABB と重なっているか
+bool CapsuleCollider::overlapBox(const Bounds& box) const
+{
+    return ConvexGeometry::intersects(getWorldGeometry(), ConvexGeometry::aabb(box));
+}
+
+
+// --------------------
+// MeshCollider
+// --------------------
+
+// メッシュがなければ MeshRenderer から作ってから登録する
+void MeshCollider::OnEnable()
+{
+    if (sharedMesh == nullptr)
+    {
+        if (auto renderer = gameObject->GetComponent<MeshRenderer>())
+        {
+            build(renderer->mesh.submesh);
+        }
+    }
+    Collider::OnEnable();
+}
+
+
+// サブメッシュから BVH を作る
+void MeshCollider::build(const std::vector<std::shared_ptr<SubMesh>>& submeshes)
+{
+    auto mesh = std::make_shared<TriangleMeshBVH>();
+    mesh->build(submeshes);
+    sharedMesh = mesh;
+}
+
+
+// 行列で移した箱を含む軸平行な箱
+Bounds MeshCollider::transformBounds(const Bounds& bounds, const Matrix& matrix)
+{
+    const Vector3 center = Vector3::Transform(Vector3(bounds.Center), matrix);
+    const Vector3 e = bounds.Extents;
+    Vector3 extents;
+    for (int j = 0; j < 3; ++j)
     {
+        (&extents.x)[j] = e.x * std::abs(matrix.m[0][j]) + e.y * std::abs(matrix.m[1][j]) + e.z * std::abs(matrix.m[2][j]);
+    }
+    return Bounds(center, extents);
+}
+
+
+// ワールド空間における空間境界を取得
+Bounds MeshCollider::getBounds() const
+{
+    if (sharedMesh == nullptr || sharedMesh->empty())
+    {
+        return Bounds(transform->position, Vector3::Zero);
+    }
+    return transformBounds(sharedMesh->getBounds(), transform->getLocalToWorldMatrix());
+}
+
+
+// 判定用の凸形状
+ConvexGeometry MeshCollider::getGeometry() const
+{
+    return ConvexGeometry::aabb(getBounds());
+}
+
+
+// レイキャスト。メッシュのローカル座標で BVH をたどる
+bool MeshCollider::raycast(Vector3 origin, Vector3 direction, float maxDistance, RaycastHit& hit) const
+{
+    if (sharedMesh == nullptr) return false;
+
+    // direction は変換後も正規化しないので、t はワールド空間の距離のまま
+    const Matrix& toWorld = getLocalToWorldMatrix();
+    const Matrix toLocal = toWorld.Invert();
+    float t;
+    int triangle;
+    if (!sharedMesh->raycast(Vector3::Transform(origin, toLocal), Vector3::TransformNormal(direction, toLocal), maxDistance, t, triangle))
         return false;
+
+    // 法線はワールド空間の三角形から求め、レイの来た側へ向ける
+    Vector3 a, b, c;
+    sharedMesh->getTriangle(triangle, a, b, c);
+    a = Vector3::Transform(a, toWorld);
+    b = Vector3::Transform(b, toWorld);
+    c = Vector3::Transform(c, toWorld);
+    Vector3 normal = (b - a).Cross(c - a);
+    normal.Normalize();
+    if (normal.Dot(direction) > 0.0f) normal = -normal;
+
+    hit.collider = const_cast<MeshCollider*>(this);
+    hit.distance = t;
+    hit.point = origin + direction * t;
+    hit.normal = normal;
+    return true;
+}
+
+
+// 球を動かして最初に触れる点
+bool MeshCollider::sphereCast(Vector3 origin, float castRadius, Vector3 direction, float maxDistance, RaycastHit& hit) const
+{
+    if (castRadius <= 0.0f) return raycast(origin, direction, maxDistance, hit);
+    if (sharedMesh == nullptr) return false;
+
+    if (!sphereCastMesh_(this, origin, castRadius, direction, maxDistance, hit))
+        return false;
+
+    hit.collider = const_cast<MeshCollider*>(this);
+    return true;
+}
+
+
+// 球と重なっているか
+bool MeshCollider::overlapSphere(Vector3 c, float r) const
+{
+    return overlapSphereMesh_(c, r, this);
+}
+
+
+// AABB と重なっているか
+bool MeshCollider::overlapBox(const Bounds& box) const
+{
+    return overlapBoxMesh_(ConvexGeometry::aabb(box), this);
+}
+
+
+// --------------------
+// HeightfieldCollider
+// --------------------
+
+// ワールド座標 (x, z) の地面の高さ
+float HeightfieldCollider::getHeight(float x, float z) const
+{
+    const Vector3 origin = getOrigin();
+    if (sharedHeightfield == nullptr || sharedHeightfield->empty()) return origin.y;
+
+    return origin.y + sharedHeightfield->getHeight((x - origin.x) / cellSize, (z - origin.z) / cellSize) * heightScale;
+}
+
+
+// ワールド座標 (x, z) の真上・真下にある三角形
+int HeightfieldCollider::findTriangle(float x, float z, Vector3& a, Vector3& b, Vector3& c) const
+{
+    if (sharedHeightfield == nullptr) return -1;
+
+    const Vector3 origin = getOrigin();
+    const int triangle = sharedHeightfield->findTriangle((x - origin.x) / cellSize, (z - origin.z) / cellSize);
+    if (triangle < 0) return -1;
+
+    const Vector3 scale = getGridScale();
+    sharedHeightfield->getTriangle(triangle, a, b, c);
+    a = origin + a * scale;
+    b = origin + b * scale;
+    c = origin + c * scale;
+    return triangle;
+}
+
+
+// ワールド空間における空間境界を取得
+Bounds HeightfieldCollider::getBounds() const
+{
+    const Vector3 origin = getOrigin();
+    if (sharedHeightfield == nullptr || sharedHeightfield->empty())
+    {
+        return Bounds(origin, Vector3::Zero);
     }
 
-    // 跳ね返り係数
-    float bounce = bounciness * other->bounciness;
+    Bounds bounds;
+    bounds.SetMinMax(
+        origin + Vector3(0.0f, sharedHeightfield->getMinHeight() * heightScale, 0.0f),
+        origin + Vector3(sharedHeightfield->getCellColumns() * cellSize, sharedHeightfield->getMaxHeight() * heightScale, sharedHeightfield->getCellRows() * cellSize));
+    return bounds;
+}
 
-    Vector3 relVNormal = normal * relV.Dot(normal);
-    myActor->addCorrectVelocity(relVNormal * -bounce);
-    otherShap->addCorrectVelocity(relVNormal * bounce);
 
-    return false;
+// 判定用の凸形状
+ConvexGeometry HeightfieldCollider::getGeometry() const
+{
+    return ConvexGeometry::aabb(getBounds());
+}
+
+
+// レイキャスト。格子座標でミップの階層をたどる
+bool HeightfieldCollider::raycast(Vector3 origin, Vector3 direction, float maxDistance, RaycastHit& hit) const
+{
+    if (sharedHeightfield == nullptr) return false;
+
+    // 軸ごとの拡大なので、t はワールド空間の距離のまま
+    const Vector3 gridOrigin = getOrigin();
+    const Vector3 scale = getGridScale();
+    float t;
+    int triangle;
+    if (!sharedHeightfield->raycast((origin - gridOrigin) / scale, direction / scale, maxDistance, t, triangle))
+        return false;
+
+    Vector3 a, b, c;
+    sharedHeightfield->getTriangle(triangle, a, b, c);
+    Vector3 normal = (b - a).Cross(c - a) * Vector3(1.0f / scale.x, 1.0f / scale.y, 1.0f / scale.z);
+    normal.Normalize();
+    if (normal.Dot(direction) > 0.0f) normal = -normal;
+
+    hit.collider = const_cast<HeightfieldCollider*>(this);
+    hit.distance = t;
+    hit.point = origin + direction * t;
+    hit.normal = normal;
+    return true;
+}
+
+
+// 球を動かして最初に触れる点
+bool HeightfieldCollider::sphereCast(Vector3 origin, float castRadius, Vector3 direction, float maxDistance, RaycastHit& hit) const
+{
+    if (castRadius <= 0.0f) return raycast(origin, direction, maxDistance, hit);
+    if (sharedHeightfield == nullptr) return false;
+
+    if (!sphereCastMesh_(this, origin, castRadius, direction, maxDistance, hit))
+        return false;
+
+    hit.collider = const_cast<HeightfieldCollider*>(this);
+    return true;
+}
+
+
+// 球と重なっているか。地面の下に潜っていても重なっているとする
+bool HeightfieldCollider::overlapSphere(Vector3 c, float r) const
+{
+    return overlapSphereMesh_(c, r, this);
 }
 
 
+// AABB と重なっているか
+bool HeightfieldCollider::overlapBox(const Bounds& box) const
+{
+    return overlapBoxMesh_(ConvexGeometry::aabb(box), this);
+}
 
 
 }
@@ -0,0 +1,306 @@
+﻿#include "pch.h"
+#include <UniDx/ContactPairTable.h>
+
+#include <algorithm>
+
+#include <UniDx/Collider.h>
+#include <UniDx/Rigidbody.h>
+#include <UniDx/GameObject.h>
+#include <UniDx/PhysicsSnapshot.h>
+
+
+namespace
+{
+
+using namespace UniDx;
+
+// 動かないコライダーか（Rigidbody がないか、眠っている）
+// どちらも動かないペアは衝突判定を省くので、触れたままとして扱う
+bool isRestingCollider(Collider* collider)
+{
+    Rigidbody* rb = collider->attachedRigidbody;
+    return rb == nullptr || rb->IsSleeping();
+}
+
+}
+
+
+namespace UniDx
+{
+
+// 触れているペアを記録
+void ContactPairTable::touch(uint32_t idA, Collider* a, uint32_t idB, Collider* b, bool trigger,
+    const ContactPoint* contacts, int numContacts)
+{
+    assert(!dispatching);
+
+    // IDの小さい方を a にそろえる
+    bool flip = idA > idB;
+    if (flip)
+    {
+        std::swap(idA, idB);
+        std::swap(a, b);
+    }
+    const uint64_t key = makeKey(idA, idB);
+
+    int index = find(key);
+    if (index < 0)
+    {
+        // 表の使用率を半分以下に保つ
+        if ((records.size() + 1) * 2 > slots.size())
+        {
+            rebuildSlots(std::max<size_t>(64, slots.size() * 2));
+        }
+
+        index = int(records.size());
+        Record r;
+        r.key = key;
+        r.a = a;
+        r.b = b;
+        r.entered = true;
+        r.removed = false;
+        records.push_back(r);
+
+        size_t slot = slotOf(key);
+        while (slots[slot] != emptySlot)
+        {
+            slot = (slot + 1) & (slots.size() - 1);
+        }
+        slots[slot] = index;
+    }
+
+    Record& r = records[index];
+    r.stamp = stamp;
+    r.trigger = trigger;
+    r.numContacts = std::min(numContacts, maxContacts);
+    for (int i = 0; i < r.numContacts; ++i)
+    {
+        r.contacts[i].point = contacts[i].point;
+        r.contacts[i].normal = flip ? -contacts[i].normal : contacts[i].normal;
+    }
+}
+
+
+// Enter/Stay/Exit のコールバックを呼び、離れたペアを取り除く。呼んだコールバックの数を返す
+int ContactPairTable::dispatch()
+{
+    dispatching = true;
+    int calls = 0;
+
+    // コールバック中に追加はされないので、要素への参照は無効にならない
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        Record& r = records[i];
+        if (r.removed) continue;
+
+        // どちらも動かずに判定を省いたものは、前の接触点のまま触れているものとして引き継ぎ、Stay を呼ぶ
+        if (r.stamp != stamp && isRestingCollider(r.a) && isRestingCollider(r.b))
+        {
+            r.stamp = stamp;
+        }
+
+        if (r.stamp != stamp)
+        {
+            // 今回触れていない＝離れた
+            r.removed = true;
+            needsCompact = true;
+            if (r.entered) continue;
+
+            if (r.trigger)
+            {
+                r.a->gameObject->onTriggerExit(r.b);
+                r.b->gameObject->onTriggerExit(r.a);
+            }
+            else
+            {
+                fillCollisions(r);
+                r.a->gameObject->onCollisionExit(collisionA);
+                r.b->gameObject->onCollisionExit(collisionB);
+            }
+            calls += 2;
+            continue;
+        }
+
+        if (r.trigger)
+        {
+            // コールバックの中でコライダーが無効にされたら、そこで打ち切る
+            if (r.entered)
+            {
+                r.a->gameObject->onTriggerEnter(r.b);
+                calls++;
+                if (!r.removed)
+                {
+                    r.b->gameObject->onTriggerEnter(r.a);
+                    calls++;
+                }
+            }
+            if (!r.removed)
+            {
+                r.a->gameObject->onTriggerStay(r.b);
+                calls++;
+            }
+            if (!r.removed)
+            {
+                r.b->gameObject->onTriggerStay(r.a);
+                calls++;
+            }
+        }
+        else
+        {
+            fillCollisions(r);
+            if (r.entered)
+            {
+                r.a->gameObject->onCollisionEnter(collisionA);
+                calls++;
+                if (!r.removed)
+                {
+                    r.b->gameObject->onCollisionEnter(collisionB);
+                    calls++;
+                }
+            }
+            if (!r.removed)
+            {
+                r.a->gameObject->onCollisionStay(collisionA);
+                calls++;
+            }
+            if (!r.removed)
+            {
+                r.b->gameObject->onCollisionStay(collisionB);
+                calls++;
+            }
+        }
+        r.entered = false;
+    }
+
+    dispatching = false;
+    if (needsCompact)
+    {
+        compact();
+    }
+    return calls;
+}
+
+
+// シェイプを含むペアをコールバックなしで取り除く
+void ContactPairTable::removeShape(uint32_t id)
+{
+    for (auto& r : records)
+    {
+        if (uint32_t(r.key >> 32) == id || uint32_t(r.key) == id)
+        {
+            r.removed = true;
+            needsCompact = true;
+        }
+    }
+
+    // コールバック中なら dispatch の最後でまとめて詰める
+    if (needsCompact && !dispatching)
+    {
+        compact();
+    }
+}
+
+
+// 全て取り除く
+void ContactPairTable::clear()
+{
+    assert(!dispatching);
+    records.clear();
+    std::fill(slots.begin(), slots.end(), emptySlot);
+    needsCompact = false;
+}
+
+
+// スナップショットに保存
+void ContactPairTable::save(PhysicsSnapshot& snapshot) const
+{
+    snapshot.write(stamp);
+    snapshot.writeVector(records);
+}
+
+
+// スナップショットから復元
+void ContactPairTable::restore(PhysicsSnapshotReader& reader)
+{
+    assert(!dispatching);
+    stamp = reader.read<uint32_t>();
+    reader.readVector(records);
+
+    // コールバック中に保存されたものは取り除いたペアを含むことがある
+    records.erase(std::remove_if(records.begin(), records.end(), [](const Record& r) { return r.removed; }), records.end());
+    needsCompact = false;
+
+    // 使用率を半分以下に保つ大きさでハッシュ表を作り直す
+    size_t capacity = std::max<size_t>(64, slots.size());
+    while (records.size() * 2 > capacity)
+    {
+        capacity *= 2;
+    }
+    rebuildSlots(capacity);
+}
+
+
+// キーからハッシュ表の最初の位置を求める
+size_t ContactPairTable::slotOf(uint64_t key) const
+{
+    // フィボナッチハッシュ
+    return size_t((key * 0x9E3779B97F4A7C15ull) >> 32) & (slots.size() - 1);
+}
+
+
+// キーの要素を探す。なければ -1
+int ContactPairTable::find(uint64_t key) const
+{
+    if (slots.empty()) return -1;
+
+    for (size_t slot = slotOf(key); slots[slot] != emptySlot; slot = (slot + 1) & (slots.size() - 1))
+    {
+        if (records[slots[slot]].key == key) return slots[slot];
+    }
+    return -1;
+}
+
+
+// ハッシュ表を作り直す。capacity は2の累乗
+void ContactPairTable::rebuildSlots(size_t capacity)
+{
+    slots.assign(capacity, emptySlot);
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        size_t slot = slotOf(records[i].key);
+        while (slots[slot] != emptySlot)
+        {
+            slot = (slot + 1) & (slots.size() - 1);
+        }
+        slots[slot] = int32_t(i);
+    }
+}
+
+
+// 取り除いた要素を順序を保ったまま詰めて、ハッシュ表を作り直す
+void ContactPairTable::compact()
+{
+    records.erase(std::remove_if(records.begin(), records.end(), [](const Record& r) { return r.removed; }), records.end());
+    needsCompact = false;
+    if (!slots.empty())
+    {
+        rebuildSlots(slots.size());
+    }
+}
+
+
+// コールバックに渡す Collision を作る。法線は相手から自分へ向ける
+void ContactPairTable::fillCollisions(const Record& r)
+{
+    collisionA.collider = r.b;
+    collisionB.collider = r.a;
+    collisionA.contacts.clear();
+    collisionB.contacts.clear();
+    for (int i = 0; i < r.numContacts; ++i)
+    {
+        collisionA.contacts.push_back({ r.contacts[i].point, -r.contacts[i].normal });
+        collisionB.contacts.push_back(r.contacts[i]);
+    }
+}
+
+} // namespace UniDx
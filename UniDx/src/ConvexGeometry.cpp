@@ -0,0 +1,615 @@
+﻿#include "pch.h"
+#include <UniDx/ConvexGeometry.h>
+
+#include <cmath>
+#include <algorithm>
+#include <iterator>
+
+
+namespace
+{
+
+using namespace UniDx;
+
+constexpr int gjkMaxIterations = 32;
+constexpr int epaMaxIterations = 64;
+constexpr int epaMaxVertices = 64;
+constexpr int epaMaxFaces = 128;
+constexpr float gjkRelativeTolerance = 1e-6f;   // 最近点が収束したとみなす割合
+constexpr float gjkTouchDistanceSq = 1e-12f;    // これより原点に近ければ重なっているとみなす
+constexpr float epaTolerance = 1e-4f;
+constexpr float castTolerance = 1e-4f;
+constexpr int castMaxIterations = 32;
+
+
+// ミンコフスキー差 A - B の点と、それを作った A, B の点
+struct SupportPoint
+{
+    Vector3 a;
+    Vector3 b;
+    Vector3 w;
+};
+
+
+// ミンコフスキー差の方向 dir に一番遠い点。core なら厚みを含めない
+SupportPoint supportPoint(const ConvexGeometry& a, const ConvexGeometry& b, Vector3 dir, bool core)
+{
+    SupportPoint p;
+    p.a = core ? a.supportCore(dir) : a.support(dir);
+    p.b = core ? b.supportCore(-dir) : b.support(-dir);
+    p.w = p.a - p.b;
+    return p;
+}
+
+
+// GJK の単体。lambda は原点に一番近い点の重心座標
+struct Simplex
+{
+    SupportPoint points[4];
+    float lambda[4];
+    int count = 0;
+
+    void keep(int i0, float l0)
+    {
+        points[0] = points[i0];
+        lambda[0] = l0;
+        count = 1;
+    }
+    void keep(int i0, float l0, int i1, float l1)
+    {
+        const SupportPoint p0 = points[i0], p1 = points[i1];
+        points[0] = p0;
+        points[1] = p1;
+        lambda[0] = l0;
+        lambda[1] = l1;
+        count = 2;
+    }
+    void keep(int i0, float l0, int i1, float l1, int i2, float l2)
+    {
+        const SupportPoint p0 = points[i0], p1 = points[i1], p2 = points[i2];
+        points[0] = p0;
+        points[1] = p1;
+        points[2] = p2;
+        lambda[0] = l0;
+        lambda[1] = l1;
+        lambda[2] = l2;
+        count = 3;
+    }
+
+    Vector3 closest() const
+    {
+        Vector3 v = Vector3::Zero;
+        for (int i = 0; i < count; ++i) v += points[i].w * lambda[i];
+        return v;
+    }
+    void witness(Vector3& pointA, Vector3& pointB) const
+    {
+        pointA = Vector3::Zero;
+        pointB = Vector3::Zero;
+        for (int i = 0; i < count; ++i)
+        {
+            pointA += points[i].a * lambda[i];
+            pointB += points[i].b * lambda[i];
+        }
+    }
+};
+
+
+// 三角形 (i0, i1, i2) 上で原点に一番近い点を求め、その点を含む最小の単体に縮める
+// 縮める前の単体を壊さないよう、結果は out に書き込む
+void closestOnTriangle(const Simplex& s, int i0, int i1, int i2, Simplex& out)
+{
+    out = s;
+    const Vector3 a = s.points[i0].w, b = s.points[i1].w, c = s.points[i2].w;
+    const Vector3 ab = b - a, ac = c - a;
+
+    const float d1 = ab.Dot(-a), d2 = ac.Dot(-a);
+    if (d1 <= 0.0f && d2 <= 0.0f) { out.keep(i0, 1.0f); return; }
+
+    const float d3 = ab.Dot(-b), d4 = ac.Dot(-b);
+    if (d3 >= 0.0f && d4 <= d3) { out.keep(i1, 1.0f); return; }
+
+    const float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+    {
+        const float v = d1 / (d1 - d3);
+        out.keep(i0, 1.0f - v, i1, v);
+        return;
+    }
+
+    const float d5 = ab.Dot(-c), d6 = ac.Dot(-c);
+    if (d6 >= 0.0f && d5 <= d6) { out.keep(i2, 1.0f); return; }
+
+    const float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+    {
+        const float w = d2 / (d2 - d6);
+        out.keep(i0, 1.0f - w, i2, w);
+        return;
+    }
+
+    const float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+    {
+        const float w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+        out.keep(i1, 1.0f - w, i2, w);
+        return;
+    }
+
+    const float denom = 1.0f / (va + vb + vc);
+    const float v = vb * denom;
+    const float w = vc * denom;
+    out.keep(i0, 1.0f - v - w, i1, v, i2, w);
+}
+
+
+// 単体上で原点に一番近い点を求めて単体を縮める。四面体が原点を含めば true
+bool solveSimplex(Simplex& s)
+{
+    switch (s.count)
+    {
+    case 1:
+        s.lambda[0] = 1.0f;
+        return false;
+
+    case 2:
+    {
+        const Vector3 a = s.points[0].w;
+        const Vector3 ab = s.points[1].w - a;
+        const float lengthSq = ab.LengthSquared();
+        const float t = lengthSq > 0.0f ? -a.Dot(ab) / lengthSq : 0.0f;
+        if (t <= 0.0f) s.keep(0, 1.0f);
+        else if (t >= 1.0f) s.keep(1, 1.0f);
+        else s.keep(0, 1.0f - t, 1, t);
+        return false;
+    }
+
+    case 3:
+    {
+        Simplex out;
+        closestOnTriangle(s, 0, 1, 2, out);
+        s = out;
+        return false;
+    }
+
+    default:
+    {
+        // 原点が外側にある面だけを調べ、一番近いものを選ぶ
+        static constexpr int faces[4][4] = { { 0, 1, 2, 3 }, { 0, 2, 3, 1 }, { 0, 3, 1, 2 }, { 1, 3, 2, 0 } };
+        bool outside = false;
+        float best = 0.0f;
+        Simplex result;
+        for (const auto& f : faces)
+        {
+            const Vector3 a = s.points[f[0]].w;
+            const Vector3 n = (s.points[f[1]].w - a).Cross(s.points[f[2]].w - a);
+            const float signP = (-a).Dot(n);
+            const float signD = (s.points[f[3]].w - a).Dot(n);
+
+            // 潰れた四面体では全ての面を候補にする
+            if (signD * signD > 1e-12f && signP * signD >= 0.0f) continue;
+
+            Simplex out;
+            closestOnTriangle(s, f[0], f[1], f[2], out);
+            const float distSq = out.closest().LengthSquared();
+            if (!outside || distSq < best)
+            {
+                best = distSq;
+                result = out;
+                outside = true;
+            }
+        }
+        if (!outside) return true;
+        s = result;
+        return false;
+    }
+    }
+}
+
+
+// GJK。a と b が重なっていれば true。重なっていなければ s に最近点の単体が残る
+bool gjk(const ConvexGeometry& a, const ConvexGeometry& b, bool core, Simplex& s)
+{
+    Vector3 v = a.center - b.center;
+    if (v.LengthSquared() < gjkTouchDistanceSq) v = Vector3(1, 0, 0);
+
+    s.count = 1;
+    s.points[0] = supportPoint(a, b, -v, core);
+    s.lambda[0] = 1.0f;
+    v = s.points[0].w;
+
+    for (int iter = 0; iter < gjkMaxIterations; ++iter)
+    {
+        const float vv = v.LengthSquared();
+        if (vv < gjkTouchDistanceSq) return true;
+
+        const SupportPoint p = supportPoint(a, b, -v, core);
+
+        // これ以上原点に近づかなければ収束
+        if (vv - v.Dot(p.w) <= gjkRelativeTolerance * vv) return false;
+
+        bool duplicate = false;
+        for (int i = 0; i < s.count; ++i)
+        {
+            if (Vector3::DistanceSquared(s.points[i].w, p.w) < gjkTouchDistanceSq) duplicate = true;
+        }
+        if (duplicate) return false;
+
+        s.points[s.count++] = p;
+        if (solveSimplex(s)) return true;
+        v = s.closest();
+    }
+    return false;
+}
+
+
+// 原点を含む四面体になるまで、潰れた単体に点を足す
+bool blowUpSimplex(const ConvexGeometry& a, const ConvexGeometry& b, Simplex& s)
+{
+    static const Vector3 directions[6] = { Vector3(1, 0, 0), Vector3(-1, 0, 0), Vector3(0, 1, 0), Vector3(0, -1, 0), Vector3(0, 0, 1), Vector3(0, 0, -1) };
+
+    if (s.count == 1)
+    {
+        for (const auto& d : directions)
+        {
+            const SupportPoint p = supportPoint(a, b, d, false);
+            if (Vector3::DistanceSquared(p.w, s.points[0].w) > gjkTouchDistanceSq)
+            {
+                s.points[s.count++] = p;
+                break;
+            }
+        }
+        if (s.count < 2) return false;
+    }
+
+    if (s.count == 2)
+    {
+        // 線分に垂直な方向を回しながら、線分の上にない点を探す
+        Vector3 d = s.points[1].w - s.points[0].w;
+        d.Normalize();
+        const Vector3 basis = std::abs(d.x) < 0.57f ? Vector3(1, 0, 0) : (std::abs(d.y) < 0.57f ? Vector3(0, 1, 0) : Vector3(0, 0, 1));
+        Vector3 e = d.Cross(basis);
+        e.Normalize();
+        const Vector3 f = d.Cross(e);
+        for (int i = 0; i < 6; ++i)
+        {
+            const float angle = float(i) * DirectX::XM_PI / 3.0f;
+            const SupportPoint p = supportPoint(a, b, e * std::cos(angle) + f * std::sin(angle), false);
+            if ((p.w - s.points[0].w).Cross(d).LengthSquared() > gjkTouchDistanceSq)
+            {
+                s.points[s.count++] = p;
+                break;
+            }
+        }
+        if (s.count < 3) return false;
+    }
+
+    if (s.count == 3)
+    {
+        Vector3 n = (s.points[1].w - s.points[0].w).Cross(s.points[2].w - s.points[0].w);
+        SupportPoint p = supportPoint(a, b, n, false);
+        if (std::abs((p.w - s.points[0].w).Dot(n)) < 1e-8f) p = supportPoint(a, b, -n, false);
+        s.points[s.count++] = p;
+    }
+    return true;
+}
+
+
+// Ericson の重心座標
+void barycentric(Vector3 p, Vector3 a, Vector3 b, Vector3 c, float& u, float& v, float& w)
+{
+    const Vector3 v0 = b - a, v1 = c - a, v2 = p - a;
+    const float d00 = v0.Dot(v0), d01 = v0.Dot(v1), d11 = v1.Dot(v1);
+    const float d20 = v2.Dot(v0), d21 = v2.Dot(v1);
+    const float denom = d00 * d11 - d01 * d01;
+    if (std::abs(denom) < 1e-20f)
+    {
+        u = 1.0f; v = 0.0f; w = 0.0f;
+        return;
+    }
+    v = (d11 * d20 - d01 * d21) / denom;
+    w = (d00 * d21 - d01 * d20) / denom;
+    u = 1.0f - v - w;
+}
+
+}
+
+
+namespace UniDx
+{
+
+// 球
+ConvexGeometry ConvexGeometry::sphere(Vector3 center, float radius)
+{
+    ConvexGeometry g;
+    g.center = center;
+    g.axes[0] = Vector3(1, 0, 0);
+    g.axes[1] = Vector3(0, 1, 0);
+    g.axes[2] = Vector3(0, 0, 1);
+    g.halfExtents = Vector3::Zero;
+    g.radius = radius;
+    return g;
+}
+
+
+// 向きのある箱
+ConvexGeometry ConvexGeometry::box(Vector3 center, const Vector3 axes[3], Vector3 halfExtents)
+{
+    ConvexGeometry g;
+    g.center = center;
+    g.axes[0] = axes[0];
+    g.axes[1] = axes[1];
+    g.axes[2] = axes[2];
+    g.halfExtents = halfExtents;
+    g.radius = 0.0f;
+    return g;
+}
+
+
+// 軸に平行な箱
+ConvexGeometry ConvexGeometry::aabb(const Bounds& bounds)
+{
+    ConvexGeometry g = sphere(bounds.Center, 0.0f);
+    g.halfExtents = bounds.Extents;
+    return g;
+}
+
+
+// 線分 pointA-pointB の周りに厚み radius を付けたカプセル
+ConvexGeometry ConvexGeometry::capsule(Vector3 pointA, Vector3 pointB, float radius)
+{
+    ConvexGeometry g = sphere((pointA + pointB) * 0.5f, radius);
+    Vector3 axis = pointB - pointA;
+    const float length = axis.Length();
+    if (length < 1e-6f) return g;
+
+    axis /= length;
+    const Vector3 basis = std::abs(axis.x) < 0.57f ? Vector3(1, 0, 0) : Vector3(0, 1, 0);
+    g.axes[0] = axis;
+    g.axes[1] = axis.Cross(basis);
+    g.axes[1].Normalize();
+    g.axes[2] = axis.Cross(g.axes[1]);
+    g.halfExtents = Vector3(length * 0.5f, 0, 0);
+    return g;
+}
+
+
+// 方向 dir に一番遠い芯の点
+Vector3 ConvexGeometry::supportCore(Vector3 dir) const
+{
+    Vector3 p = center;
+    const float* he = &halfExtents.x;
+    for (int i = 0; i < 3; ++i)
+    {
+        p += axes[i] * (dir.Dot(axes[i]) >= 0.0f ? he[i] : -he[i]);
+    }
+    return p;
+}
+
+
+// 方向 dir に一番遠い表面の点
+Vector3 ConvexGeometry::support(Vector3 dir) const
+{
+    Vector3 p = supportCore(dir);
+    const float length = dir.Length();
+    if (radius > 0.0f && length > 0.0f) p += dir * (radius / length);
+    return p;
+}
+
+
+// ワールド空間の境界
+Bounds ConvexGeometry::getBounds() const
+{
+    Vector3 extents(radius, radius, radius);
+    const float* he = &halfExtents.x;
+    for (int i = 0; i < 3; ++i)
+    {
+        extents += Vector3(std::abs(axes[i].x), std::abs(axes[i].y), std::abs(axes[i].z)) * he[i];
+    }
+    return Bounds(center, extents);
+}
+
+
+// 芯どうしの最近点を GJK で求める。芯が重なっていれば false
+bool ConvexGeometry::closestCorePoints(const ConvexGeometry& a, const ConvexGeometry& b, Vector3& pointA, Vector3& pointB)
+{
+    Simplex s;
+    if (gjk(a, b, true, s)) return false;
+    s.witness(pointA, pointB);
+    return true;
+}
+
+
+// 厚みを含めて重なっているか
+bool ConvexGeometry::intersects(const ConvexGeometry& a, const ConvexGeometry& b)
+{
+    Vector3 pointA, pointB;
+    if (!closestCorePoints(a, b, pointA, pointB)) return true;
+    const float r = a.radius + b.radius;
+    return Vector3::DistanceSquared(pointA, pointB) <= r * r;
+}
+
+
+// 接触を求める。法線は a から b 向き
+bool ConvexGeometry::getContact(const ConvexGeometry& a, const ConvexGeometry& b, ConvexContact& contact)
+{
+    Vector3 pointA, pointB;
+    if (closestCorePoints(a, b, pointA, pointB))
+    {
+        const Vector3 sub = pointB - pointA;
+        const float dist = sub.Length();
+        const float r = a.radius + b.radius;
+        if (dist > r) return false;
+
+        // 芯が離れていれば、最近点を結ぶ向きが法線になる
+        if (dist > 1e-6f)
+        {
+            contact.normal = sub / dist;
+            contact.penetration = r - dist;
+            contact.point = ((pointA + contact.normal * a.radius) + (pointB - contact.normal * b.radius)) * 0.5f;
+            return true;
+        }
+    }
+
+    // 芯まで重なっている
+    return penetrationEPA(a, b, contact);
+}
+
+
+// 芯まで重なっている深い接触を EPA で求める
+bool ConvexGeometry::penetrationEPA(const ConvexGeometry& a, const ConvexGeometry& b, ConvexContact& contact)
+{
+    struct Face
+    {
+        int v[3];
+        Vector3 normal;
+        float distance;
+    };
+    struct Edge
+    {
+        int v[2];
+    };
+
+    // 厚みを含めた形状で原点を含む四面体を作る
+    Simplex s;
+    if (!gjk(a, b, false, s)) return false;
+    if (s.count < 4 && !blowUpSimplex(a, b, s)) return false;
+
+    SupportPoint vertices[epaMaxVertices];
+    Face faces[epaMaxFaces];
+    Edge edges[epaMaxFaces * 3 / 2];
+    int vertexCount = 4;
+    int faceCount = 0;
+    for (int i = 0; i < 4; ++i) vertices[i] = s.points[i];
+
+    // 外向きの面を追加
+    auto addFace = [&](int i0, int i1, int i2) {
+        const Vector3 a0 = vertices[i0].w;
+        Vector3 n = (vertices[i1].w - a0).Cross(vertices[i2].w - a0);
+        const float length = n.Length();
+        if (length < 1e-12f || faceCount >= epaMaxFaces) return;
+        n /= length;
+        faces[faceCount++] = { { i0, i1, i2 }, n, n.Dot(a0) };
+    };
+
+    static constexpr int tetra[4][4] = { { 0, 1, 2, 3 }, { 0, 3, 1, 2 }, { 0, 2, 3, 1 }, { 1, 3, 2, 0 } };
+    for (const auto& t : tetra)
+    {
+        // 残りの頂点と反対側を向くようにそろえる
+        const Vector3 a0 = vertices[t[0]].w;
+        const Vector3 n = (vertices[t[1]].w - a0).Cross(vertices[t[2]].w - a0);
+        if (n.Dot(vertices[t[3]].w - a0) > 0.0f) addFace(t[0], t[2], t[1]);
+        else addFace(t[0], t[1], t[2]);
+    }
+    if (faceCount == 0) return false;
+
+    int closest = 0;
+    for (int iter = 0; iter < epaMaxIterations; ++iter)
+    {
+        closest = 0;
+        for (int i = 1; i < faceCount; ++i)
+        {
+            if (faces[i].distance < faces[closest].distance) closest = i;
+        }
+
+        // 面の法線方向にそれ以上広がらなければ、その面が一番近い
+        const Face& f = faces[closest];
+        const SupportPoint p = supportPoint(a, b, f.normal, false);
+        if (p.w.Dot(f.normal) - f.distance < epaTolerance || vertexCount >= epaMaxVertices) break;
+
+        const int newVertex = vertexCount++;
+        vertices[newVertex] = p;
+
+        // 新しい点から見える面を取り除き、その境界の辺を集める
+        int edgeCount = 0;
+        for (int i = 0; i < faceCount;)
+        {
+            if (faces[i].normal.Dot(p.w - vertices[faces[i].v[0]].w) <= 0.0f)
+            {
+                ++i;
+                continue;
+            }
+            for (int e = 0; e < 3; ++e)
+            {
+                const int e0 = faces[i].v[e];
+                const int e1 = faces[i].v[(e + 1) % 3];
+
+                // 逆向きの辺が既にあれば、隣の面も見えているので境界ではない
+                bool shared = false;
+                for (int k = 0; k < edgeCount; ++k)
+                {
+                    if (edges[k].v[0] == e1 && edges[k].v[1] == e0)
+                    {
+                        edges[k] = edges[--edgeCount];
+                        shared = true;
+                        break;
+                    }
+                }
+                if (!shared && edgeCount < int(std::size(edges))) edges[edgeCount++] = { { e0, e1 } };
+            }
+            faces[i] = faces[--faceCount];
+        }
+        for (int k = 0; k < edgeCount; ++k)
+        {
+            addFace(edges[k].v[0], edges[k].v[1], newVertex);
+        }
+        if (faceCount == 0) return false;
+    }
+
+    // 原点を一番近い面に射影した点の重心座標から、それぞれの表面の点を求める
+    const Face& f = faces[closest];
+    const SupportPoint& v0 = vertices[f.v[0]];
+    const SupportPoint& v1 = vertices[f.v[1]];
+    const SupportPoint& v2 = vertices[f.v[2]];
+    float u, v, w;
+    barycentric(f.normal * f.distance, v0.w, v1.w, v2.w, u, v, w);
+    const Vector3 pointA = v0.a * u + v1.a * v + v2.a * w;
+    const Vector3 pointB = v0.b * u + v1.b * v + v2.b * w;
+
+    contact.normal = f.normal;
+    contact.penetration = std::max(0.0f, f.distance);
+    contact.point = (pointA + pointB) * 0.5f;
+    return true;
+}
+
+
+// 球を動かしたときに最初に触れる距離（保守的前進法）
+// 芯どうしの距離を毎回求め、その距離だけは当たらずに進めることを利用して近づけていく
+bool ConvexGeometry::cast(Vector3 origin, float castRadius, Vector3 direction, float maxDistance, float& distance, Vector3& normal, Vector3& point) const
+{
+    ConvexGeometry probe = sphere(origin, castRadius);
+    const float r = radius + castRadius;
+    float t = 0.0f;
+    for (int iter = 0; iter < castMaxIterations; ++iter)
+    {
+        probe.center = origin + direction * t;
+
+        Vector3 pointShape, pointProbe;
+        if (!closestCorePoints(*this, probe, pointShape, pointProbe)) return false;
+
+        const Vector3 sub = pointProbe - pointShape;
+        const float dist = sub.Length();
+        const float gap = dist - r;
+        if (gap <= castTolerance)
+        {
+            // 始点で触れている
+            if (iter == 0 || dist < 1e-6f) return false;
+
+            normal = sub / dist;
+            point = pointShape + normal * radius;
+            distance = t;
+            return true;
+        }
+
+        const Vector3 n = sub / dist;
+        const float approach = -direction.Dot(n);
+        if (approach <= 1e-6f) return false;
+
+        // 少し手前で止めて、最後の最近点から法線が求められるようにする
+        t += (gap - castTolerance * 0.5f) / approach;
+        if (t > maxDistance) return false;
+    }
+    return false;
+}
+
+} // namespace UniDx
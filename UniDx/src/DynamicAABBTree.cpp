@@ -0,0 +1,404 @@
+﻿#include "pch.h"
+#include <UniDx/DynamicAABBTree.h>
+
+#include <algorithm>
+#include <cmath>
+
+
+namespace
+{
+
+using namespace UniDx;
+
+// 2つのBoundsを含むBounds
+Bounds combine(const Bounds& a, const Bounds& b)
+{
+    Bounds r;
+    r.SetMinMax(Vector3::Min(a.min(), b.min()), Vector3::Max(a.max(), b.max()));
+    return r;
+}
+
+// 挿入コストの評価に使う表面積（定数倍は省略）
+float area(const Bounds& b)
+{
+    const auto& e = b.Extents;
+    return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+// outer が inner を完全に含んでいるか
+bool contains(const Bounds& outer, const Bounds& inner)
+{
+    Vector3 omin = outer.min();
+    Vector3 omax = outer.max();
+    Vector3 imin = inner.min();
+    Vector3 imax = inner.max();
+    return omin.x <= imin.x && omin.y <= imin.y && omin.z <= imin.z
+        && imax.x <= omax.x && imax.y <= omax.y && imax.z <= omax.z;
+}
+
+}
+
+
+namespace UniDx
+{
+
+using namespace std;
+
+// ノードを確保
+int DynamicAABBTree::allocateNode()
+{
+    int id;
+    if (freeList != nullNode)
+    {
+        id = freeList;
+        freeList = nodes[id].parent;
+    }
+    else
+    {
+        id = int(nodes.size());
+        nodes.push_back(Node());
+    }
+    Node& node = nodes[id];
+    node.parent = nullNode;
+    node.child1 = nullNode;
+    node.child2 = nullNode;
+    node.height = 0;
+    node.userData = -1;
+    return id;
+}
+
+
+// ノードを空きリストに戻す
+void DynamicAABBTree::freeNode(int id)
+{
+    nodes[id].parent = freeList;
+    nodes[id].height = -1;
+    freeList = id;
+}
+
+
+// 葉を作成してIDを返す
+int DynamicAABBTree::createProxy(const Bounds& bounds, int userData)
+{
+    int id = allocateNode();
+
+    // 余裕を持たせた太いBoundsを格納
+    Bounds fat = bounds;
+    fat.Extents = Vector3(fat.Extents) + Vector3(margin_, margin_, margin_);
+    nodes[id].bounds = fat;
+    nodes[id].userData = userData;
+
+    insertLeaf(id);
+    return id;
+}
+
+
+// 葉を削除
+void DynamicAABBTree::destroyProxy(int proxyId)
+{
+    assert(nodes[proxyId].isLeaf());
+    removeLeaf(proxyId);
+    freeNode(proxyId);
+}
+
+
+// 葉の範囲を更新
+bool DynamicAABBTree::moveProxy(int proxyId, const Bounds& bounds)
+{
+    assert(nodes[proxyId].isLeaf());
+
+    // 太いBoundsに収まっているうちは木を触らない
+    if (contains(nodes[proxyId].bounds, bounds))
+    {
+        return false;
+    }
+
+    removeLeaf(proxyId);
+
+    Bounds fat = bounds;
+    fat.Extents = Vector3(fat.Extents) + Vector3(margin_, margin_, margin_);
+    nodes[proxyId].bounds = fat;
+
+    insertLeaf(proxyId);
+    return true;
+}
+
+
+// 全ての葉を削除
+void DynamicAABBTree::clear()
+{
+    nodes.clear();
+    root = nullNode;
+    freeList = nullNode;
+}
+
+
+// 葉を挿入。表面積が最も増えない兄弟を探して新しい親を作る
+void DynamicAABBTree::insertLeaf(int leaf)
+{
+    if (root == nullNode)
+    {
+        root = leaf;
+        nodes[root].parent = nullNode;
+        return;
+    }
+
+    const Bounds leafBounds = nodes[leaf].bounds;
+    int index = root;
+    while (!nodes[index].isLeaf())
+    {
+        const Node& node = nodes[index];
+        const float nodeArea = area(node.bounds);
+        const float combinedArea = area(combine(node.bounds, leafBounds));
+
+        // このノードと新しい葉に新しい親を作るコスト
+        const float cost = 2.0f * combinedArea;
+
+        // さらに下に降りた場合に親が広がる分のコスト
+        const float inheritanceCost = 2.0f * (combinedArea - nodeArea);
+
+        // 子に降りた場合のコスト
+        auto descendCost = [&](int child) {
+            const Node& c = nodes[child];
+            float newArea = area(combine(leafBounds, c.bounds));
+            return c.isLeaf() ? newArea + inheritanceCost : (newArea - area(c.bounds)) + inheritanceCost;
+        };
+        const float cost1 = descendCost(node.child1);
+        const float cost2 = descendCost(node.child2);
+
+        if (cost < cost1 && cost < cost2) break;
+
+        index = cost1 < cost2 ? node.child1 : node.child2;
+    }
+    const int sibling = index;
+
+    // 新しい親を作って兄弟と葉をぶら下げる
+    const int oldParent = nodes[sibling].parent;
+    const int newParent = allocateNode();
+    nodes[newParent].parent = oldParent;
+    nodes[newParent].bounds = combine(leafBounds, nodes[sibling].bounds);
+    nodes[newParent].height = nodes[sibling].height + 1;
+    nodes[newParent].child1 = sibling;
+    nodes[newParent].child2 = leaf;
+    nodes[sibling].parent = newParent;
+    nodes[leaf].parent = newParent;
+
+    if (oldParent != nullNode)
+    {
+        if (nodes[oldParent].child1 == sibling) nodes[oldParent].child1 = newParent;
+        else nodes[oldParent].child2 = newParent;
+    }
+    else
+    {
+        root = newParent;
+    }
+
+    // 根までさかのぼって高さとBoundsを直しながらバランスを取る
+    index = nodes[leaf].parent;
+    while (index != nullNode)
+    {
+        index = balance(index);
+
+        Node& node = nodes[index];
+        node.height = 1 + std::max(nodes[node.child1].height, nodes[node.child2].height);
+        node.bounds = combine(nodes[node.child1].bounds, nodes[node.child2].bounds);
+
+        index = node.parent;
+    }
+}
+
+
+// 葉を取り外す。親を消して兄弟を祖父につなぐ
+void DynamicAABBTree::removeLeaf(int leaf)
+{
+    if (leaf == root)
+    {
+        root = nullNode;
+        return;
+    }
+
+    const int parent = nodes[leaf].parent;
+    const int grandParent = nodes[parent].parent;
+    const int sibling = nodes[parent].child1 == leaf ? nodes[parent].child2 : nodes[parent].child1;
+
+    if (grandParent == nullNode)
+    {
+        root = sibling;
+        nodes[sibling].parent = nullNode;
+        freeNode(parent);
+        return;
+    }
+
+    if (nodes[grandParent].child1 == parent) nodes[grandParent].child1 = sibling;
+    else nodes[grandParent].child2 = sibling;
+    nodes[sibling].parent = grandParent;
+    freeNode(parent);
+
+    int index = grandParent;
+    while (index != nullNode)
+    {
+        index = balance(index);
+
+        Node& node = nodes[index];
+        node.height = 1 + std::max(nodes[node.child1].height, nodes[node.child2].height);
+        node.bounds = combine(nodes[node.child1].bounds, nodes[node.child2].bounds);
+
+        index = node.parent;
+    }
+}
+
+
+// 左右の高さの差が2以上なら回転して、部分木の新しい根を返す
+// A の子を B, C、B の子を D, E、C の子を F, G とする
+int DynamicAABBTree::balance(int iA)
+{
+    Node& A = nodes[iA];
+    if (A.isLeaf() || A.height < 2)
+    {
+        return iA;
+    }
+
+    const int iB = A.child1;
+    const int iC = A.child2;
+    Node& B = nodes[iB];
+    Node& C = nodes[iC];
+
+    const int diff = C.height - B.height;
+
+    // C を持ち上げる
+    if (diff > 1)
+    {
+        const int iF = C.child1;
+        const int iG = C.child2;
+        Node& F = nodes[iF];
+        Node& G = nodes[iG];
+
+        // A と C を入れ替える
+        C.child1 = iA;
+        C.parent = A.parent;
+        A.parent = iC;
+
+        if (C.parent != nullNode)
+        {
+            if (nodes[C.parent].child1 == iA) nodes[C.parent].child1 = iC;
+            else nodes[C.parent].child2 = iC;
+        }
+        else
+        {
+            root = iC;
+        }
+
+        // F と G の高いほうを C に残す
+        if (F.height > G.height)
+        {
+            C.child2 = iF;
+            A.child2 = iG;
+            G.parent = iA;
+            A.bounds = combine(B.bounds, G.bounds);
+            C.bounds = combine(A.bounds, F.bounds);
+            A.height = 1 + std::max(B.height, G.height);
+            C.height = 1 + std::max(A.height, F.height);
+        }
+        else
+        {
+            C.child2 = iG;
+            A.child2 = iF;
+            F.parent = iA;
+            A.bounds = combine(B.bounds, F.bounds);
+            C.bounds = combine(A.bounds, G.bounds);
+            A.height = 1 + std::max(B.height, F.height);
+            C.height = 1 + std::max(A.height, G.height);
+        }
+        return iC;
+    }
+
+    // B を持ち上げる
+    if (diff < -1)
+    {
+        const int iD = B.child1;
+        const int iE = B.child2;
+        Node& D = nodes[iD];
+        Node& E = nodes[iE];
+
+        // A と B を入れ替える
+        B.child1 = iA;
+        B.parent = A.parent;
+        A.parent = iB;
+
+        if (B.parent != nullNode)
+        {
+            if (nodes[B.parent].child1 == iA) nodes[B.parent].child1 = iB;
+            else nodes[B.parent].child2 = iB;
+        }
+        else
+        {
+            root = iB;
+        }
+
+        // D と E の高いほうを B に残す
+        if (D.height > E.height)
+        {
+            B.child2 = iD;
+            A.child1 = iE;
+            E.parent = iA;
+            A.bounds = combine(C.bounds, E.bounds);
+            B.bounds = combine(A.bounds, D.bounds);
+            A.height = 1 + std::max(C.height, E.height);
+            B.height = 1 + std::max(A.height, D.height);
+        }
+        else
+        {
+            B.child2 = iE;
+            A.child1 = iD;
+            D.parent = iA;
+            A.bounds = combine(C.bounds, D.bounds);
+            B.bounds = combine(A.bounds, E.bounds);
+            A.height = 1 + std::max(C.height, D.height);
+            B.height = 1 + std::max(A.height, E.height);
+        }
+        return iB;
+    }
+
+    return iA;
+}
+
+
+// 方向ベクトルの逆数。0の成分は無限大になる
+Vector3 DynamicAABBTree::inverseDirection(Vector3 direction)
+{
+    return Vector3(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+}
+
+
+// 線分とBoundsの交差判定（スラブ法）
+bool DynamicAABBTree::rayIntersects(const Bounds& bounds, Vector3 origin, Vector3 invDir, float maxDistance, float radius)
+{
+    const Vector3 r(radius, radius, radius);
+    const Vector3 mn = bounds.min() - r;
+    const Vector3 mx = bounds.max() + r;
+    const float* o = &origin.x;
+    const float* inv = &invDir.x;
+    const float* bmin = &mn.x;
+    const float* bmax = &mx.x;
+
+    float tmin = 0.0f;
+    float tmax = maxDistance;
+    for (int i = 0; i < 3; ++i)
+    {
+        if (std::isinf(inv[i]))
+        {
+            // 軸に平行な場合はスラブの内側にあるかだけ調べる
+            if (o[i] < bmin[i] || o[i] > bmax[i]) return false;
+            continue;
+        }
+        float t1 = (bmin[i] - o[i]) * inv[i];
+        float t2 = (bmax[i] - o[i]) * inv[i];
+        if (t1 > t2) std::swap(t1, t2);
+        tmin = std::max(tmin, t1);
+        tmax = std::min(tmax, t2);
+        if (tmin > tmax) return false;
+    }
+    return true;
+}
+
+} // namespace UniDx
@@ -126,6 +126,9 @@ int Engine::PlayerLoop()
 
         while (restFixedUpdateTime > Time::fixedDeltaTime)
         {
+            // FixedUpdate には描画用に補間する前の物理の姿勢を見せる
+            Physics::getInstance()->restoreInterpolatedTransforms();
+
             // 固定時間更新更新
             fixedUpdate();
 
@@ -135,6 +138,9 @@ int Engine::PlayerLoop()
             restFixedUpdateTime -= Time::fixedDeltaTime;
         }
 
+        // 最後のステップからの残り時間で、補間を設定した剛体の描画用の姿勢を求める
+        Physics::getInstance()->interpolateTransforms(float(restFixedUpdateTime));
+
         Time::SetDeltaTimeFrame();
 
         // 入力更新
@@ -179,7 +185,7 @@ void Engine::fixedUpdate()
 // 物理計算
 void Engine::physics()
 {
-    Physics::getInstance()->simulatePositionCorrection(Time::fixedDeltaTime);
+    Physics::getInstance()->step(Time::fixedDeltaTime);
 }
 
 
@@ -0,0 +1,263 @@
+﻿#include "pch.h"
+#include <UniDx/Heightfield.h>
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+
+#include <UniDx/TriangleMeshBVH.h>
+#include <UniDx/Debug.h>
+
+
+namespace
+{
+
+using namespace UniDx;
+using namespace std;
+
+// 1辺の標本の数の上限と、そのときのミップの段数
+constexpr int maxSamples = 65537;
+constexpr int maxLevels = 17;
+
+
+// 線分と箱の交差（スラブ法）。入る距離を tEnter に返す
+bool segmentBox_(const float origin[3], const float direction[3], const float mn[3], const float mx[3], float maxDistance, float& tEnter)
+{
+    float tmin = 0.0f;
+    float tmax = maxDistance;
+    for (int i = 0; i < 3; ++i)
+    {
+        if (std::abs(direction[i]) < 1e-12f)
+        {
+            if (origin[i] < mn[i] || origin[i] > mx[i]) return false;
+            continue;
+        }
+        const float inv = 1.0f / direction[i];
+        float t1 = (mn[i] - origin[i]) * inv;
+        float t2 = (mx[i] - origin[i]) * inv;
+        if (t1 > t2) std::swap(t1, t2);
+        tmin = std::max(tmin, t1);
+        tmax = std::min(tmax, t2);
+        if (tmin > tmax) return false;
+    }
+    tEnter = tmin;
+    return true;
+}
+
+}
+
+
+namespace UniDx
+{
+
+// 標本から作る
+void Heightfield::build(int columns_, int rows_, std::span<const uint16_t> heights)
+{
+    clear();
+    if (columns_ < 2 || rows_ < 2 || columns_ > maxSamples || rows_ > maxSamples || heights.size() < size_t(columns_) * rows_)
+    {
+        Debug::Log(L"Heightfield: invalid size");
+        return;
+    }
+
+    columns = columns_;
+    rows = rows_;
+    samples.assign(heights.begin(), heights.begin() + size_t(columns) * rows);
+    buildLevels();
+}
+
+
+// 16ビットの生データのファイルから作る
+bool Heightfield::loadRawFile(const std::wstring& filePath, int columns_, int rows_)
+{
+    std::ifstream file(std::filesystem::path(filePath), std::ios::binary);
+    if (!file)
+    {
+        Debug::Log(L"Heightfield: failed to open " + filePath);
+        clear();
+        return false;
+    }
+
+    std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    const size_t count = size_t(std::max(columns_, 0)) * size_t(std::max(rows_, 0));
+    if (bytes.size() != count * 2)
+    {
+        Debug::Log(L"Heightfield: size mismatch in " + filePath);
+        clear();
+        return false;
+    }
+
+    std::vector<uint16_t> heights(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        heights[i] = uint16_t(bytes[i * 2] | (bytes[i * 2 + 1] << 8));
+    }
+    build(columns_, rows_, heights);
+    return !empty();
+}
+
+
+// 格子座標 (x, z) の地面の高さ
+float Heightfield::getHeight(float x, float z) const
+{
+    if (empty()) return 0.0f;
+
+    x = std::clamp(x, 0.0f, float(getCellColumns()));
+    z = std::clamp(z, 0.0f, float(getCellRows()));
+    const int triangle = findTriangle(x, z);
+
+    // 三角形の平面の上で高さを求める
+    Vector3 a, b, c;
+    getTriangle(triangle, a, b, c);
+    const Vector3 n = (b - a).Cross(c - a);
+    return a.y - (n.x * (x - a.x) + n.z * (z - a.z)) / n.y;
+}
+
+
+// レイキャスト。ミップの上の段から、箱に当たったところだけ近い順に降りていく
+bool Heightfield::raycast(Vector3 origin, Vector3 direction, float maxDistance, float& t, int& triangle) const
+{
+    if (empty()) return false;
+
+    struct Entry
+    {
+        int level;
+        int x;
+        int z;
+        float tEnter;
+    };
+    Entry stack[maxLevels * 3 + 1];
+    int top = 0;
+
+    const float o[3] = { origin.x, origin.y, origin.z };
+    const float d[3] = { direction.x, direction.y, direction.z };
+
+    // ミップの1要素が覆う範囲の箱に当たるか
+    auto hitNode = [&](int level, int x, int z, float maxT, float& tEnter) {
+        const Level& l = levels[level];
+        const int i = z * l.width + x;
+        const float mn[3] = { float(x << level), float(l.minHeights[i]), float(z << level) };
+        const float mx[3] = {
+            float(std::min((x + 1) << level, getCellColumns())),
+            float(l.maxHeights[i]),
+            float(std::min((z + 1) << level, getCellRows())) };
+        return segmentBox_(o, d, mn, mx, maxT, tEnter);
+    };
+
+    float best = maxDistance;
+    triangle = -1;
+
+    float tRoot;
+    const int rootLevel = int(levels.size()) - 1;
+    if (!hitNode(rootLevel, 0, 0, best, tRoot)) return false;
+    stack[top++] = { rootLevel, 0, 0, tRoot };
+
+    while (top > 0)
+    {
+        const Entry e = stack[--top];
+        if (e.tEnter > best) continue;
+
+        if (e.level == 0)
+        {
+            const int cell = e.z * getCellColumns() + e.x;
+            for (int half = 0; half < 2; ++half)
+            {
+                Vector3 a, b, c;
+                getTriangle(cell * 2 + half, a, b, c);
+                float hit;
+                if (TriangleMeshBVH::raycastTriangle(origin, direction, a, b, c, best, hit))
+                {
+                    best = hit;
+                    triangle = cell * 2 + half;
+                }
+            }
+            continue;
+        }
+
+        // 当たった子を遠い順に積んで、近い方から調べる
+        const int childLevel = e.level - 1;
+        const Level& child = levels[childLevel];
+        Entry children[4];
+        int count = 0;
+        for (int dz = 0; dz < 2; ++dz)
+        {
+            for (int dx = 0; dx < 2; ++dx)
+            {
+                const int cx = e.x * 2 + dx;
+                const int cz = e.z * 2 + dz;
+                if (cx >= child.width || cz >= child.height) continue;
+
+                float tEnter;
+                if (hitNode(childLevel, cx, cz, best, tEnter))
+                {
+                    children[count++] = { childLevel, cx, cz, tEnter };
+                }
+            }
+        }
+        std::sort(children, children + count, [](const Entry& l, const Entry& r) { return l.tEnter > r.tEnter; });
+        for (int i = 0; i < count; ++i)
+        {
+            stack[top++] = children[i];
+        }
+    }
+
+    if (triangle < 0) return false;
+    t = best;
+    return true;
+}
+
+
+// セルごとの最小・最大から、2x2 ずつまとめた段を 1x1 になるまで作る
+void Heightfield::buildLevels()
+{
+    Level cells;
+    cells.width = getCellColumns();
+    cells.height = getCellRows();
+    cells.minHeights.resize(size_t(cells.width) * cells.height);
+    cells.maxHeights.resize(cells.minHeights.size());
+    for (int z = 0; z < cells.height; ++z)
+    {
+        for (int x = 0; x < cells.width; ++x)
+        {
+            const uint16_t h[4] = { getSample(x, z), getSample(x + 1, z), getSample(x, z + 1), getSample(x + 1, z + 1) };
+            cells.minHeights[z * cells.width + x] = *std::min_element(h, h + 4);
+            cells.maxHeights[z * cells.width + x] = *std::max_element(h, h + 4);
+        }
+    }
+    levels.push_back(std::move(cells));
+
+    while (levels.back().width > 1 || levels.back().height > 1)
+    {
+        const Level& below = levels.back();
+        Level level;
+        level.width = (below.width + 1) / 2;
+        level.height = (below.height + 1) / 2;
+        level.minHeights.assign(size_t(level.width) * level.height, 0xFFFF);
+        level.maxHeights.assign(level.minHeights.size(), 0);
+        for (int z = 0; z < below.height; ++z)
+        {
+            for (int x = 0; x < below.width; ++x)
+            {
+                const int from = z * below.width + x;
+                const int to = (z / 2) * level.width + x / 2;
+                level.minHeights[to] = std::min(level.minHeights[to], below.minHeights[from]);
+                level.maxHeights[to] = std::max(level.maxHeights[to], below.maxHeights[from]);
+            }
+        }
+        levels.push_back(std::move(level));
+    }
+    assert(levels.size() <= maxLevels);
+}
+
+
+// 空にする
+void Heightfield::clear()
+{
+    columns = 0;
+    rows = 0;
+    samples.clear();
+    levels.clear();
+}
+
+} // namespace UniDx
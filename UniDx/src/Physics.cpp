@@ -2,9 +2,176 @@
 #include <UniDx/Physics.h>
 
 #include <algorithm>
+#include <bit>
+#include <chrono>
+#include <limits>
+#include <thread>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <immintrin.h>
+#define UNIDX_PHYSICS_MXCSR
+#endif
 
 #include <UniDx/Collider.h>
+#include <UniDx/Debug.h>
+#include <UniDx/GameObject.h>
 #include <UniDx/Rigidbody.h>
+#include <UniDx/UniDxTime.h>
+
+
+namespace
+{
+
+// 逐次インパルス法の定数
+constexpr float linearSlop = 0.005f;            // 許容するめり込み。接触を保ってがたつきを防ぐ
+constexpr float baumgarte = 0.2f;               // 1回の位置補正で戻すめり込みの割合
+constexpr float maxLinearCorrection = 0.2f;     // 1回の位置補正で動かす最大距離
+constexpr float restitutionThreshold = 1.0f;    // これより遅い衝突は跳ね返らせない
+
+// 連続衝突判定の定数
+constexpr float continuousMinMotion = 0.5f;     // 半径に対する移動量の割合。これより小さい移動は離散判定で十分
+
+// 浮動小数点の丸めを最近接に、非正規化数をそのまま扱う設定にして、スコープを抜けたら元に戻す
+// 他のライブラリが丸めモードや FTZ/DAZ を変えていても同じ結果になるようにする。設定はスレッドごと
+class FloatModeScope
+{
+public:
+    explicit FloatModeScope(bool enable) : enabled(enable)
+    {
+#if defined(UNIDX_PHYSICS_MXCSR)
+        if (!enabled) return;
+        saved = _mm_getcsr();
+        _mm_setcsr(saved & ~(_MM_ROUND_MASK | _MM_FLUSH_ZERO_MASK | _MM_DENORMALS_ZERO_MASK));
+#endif
+    }
+
+    ~FloatModeScope()
+    {
+#if defined(UNIDX_PHYSICS_MXCSR)
+        if (enabled) _mm_setcsr(saved);
+#endif
+    }
+
+    FloatModeScope(const FloatModeScope&) = delete;
+    FloatModeScope& operator=(const FloatModeScope&) = delete;
+
+private:
+    bool enabled;
+    unsigned int saved = 0;
+};
+
+
+// 経過時間を測る。lap() は前回からの時間をミリ秒で返す
+class Stopwatch
+{
+public:
+    Stopwatch() : start(std::chrono::steady_clock::now()) {}
+
+    float lap()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        const float ms = std::chrono::duration<float, std::milli>(now - start).count();
+        start = now;
+        return ms;
+    }
+
+private:
+    std::chrono::steady_clock::time_point start;
+};
+
+
+// 形状の組み合わせの数
+constexpr int pairTypeCount = UniDx::ColliderTypeCount * UniDx::ColliderTypeCount;
+
+
+// ペアの形状の組み合わせの番号。(typeA, typeB) の表の添字を1次元にしたもの
+int pairType_(const UniDx::PhysicsShape* a, const UniDx::PhysicsShape* b)
+{
+    return int(a->getType()) * UniDx::ColliderTypeCount + int(b->getType());
+}
+
+
+// 区間のペアを形状の組み合わせごとに並べる（計数ソート）
+// buffer.pairOrder に区間内の位置を組み合わせの順に、同じ組み合わせの中では元の順に並べ、
+// 組み合わせ k の範囲を buffer.bucketBegin[k] から buffer.bucketBegin[k + 1] とする
+template<typename Pair>
+void bucketPairs_(const Pair* pairs, size_t count, UniDx::NarrowphaseBuffer& buffer)
+{
+    auto& begin = buffer.bucketBegin;
+    begin.fill(0);
+    for (size_t i = 0; i < count; ++i)
+    {
+        begin[pairType_(pairs[i].a, pairs[i].b) + 1]++;
+    }
+    for (size_t k = 1; k < begin.size(); ++k)
+    {
+        begin[k] += begin[k - 1];
+    }
+
+    buffer.pairOrder.resize(count);
+    auto next = begin;
+    for (size_t i = 0; i < count; ++i)
+    {
+        buffer.pairOrder[next[pairType_(pairs[i].a, pairs[i].b)]++] = uint32_t(i);
+    }
+}
+
+
+// 組み合わせ (typeA, typeB) がバッチ判定できるなら、pairOrder[first, last) のペアをバッチに詰めて true を返す
+// 番号は区間内の位置*2 + 向きを反転するか（A が AABB で B が球）
+template<typename Pair>
+bool addKernelPairs_(const Pair* pairs, UniDx::ColliderType typeA, UniDx::ColliderType typeB, uint32_t first, uint32_t last, UniDx::NarrowphaseBuffer& buffer)
+{
+    using UniDx::ColliderType;
+    if (typeA == ColliderType::Sphere && typeB == ColliderType::Sphere)
+    {
+        for (uint32_t j = first; j < last; ++j)
+        {
+            const uint32_t local = buffer.pairOrder[j];
+            const UniDx::ConvexGeometry& a = pairs[local].a->getCollider()->getWorldGeometry();
+            const UniDx::ConvexGeometry& b = pairs[local].b->getCollider()->getWorldGeometry();
+            buffer.spherePairs.add(local * 2, a.center, a.radius, b.center, b.radius);
+        }
+        return true;
+    }
+    if (typeA == ColliderType::Sphere && typeB == ColliderType::AABB)
+    {
+        for (uint32_t j = first; j < last; ++j)
+        {
+            const uint32_t local = buffer.pairOrder[j];
+            const UniDx::ConvexGeometry& a = pairs[local].a->getCollider()->getWorldGeometry();
+            const UniDx::Bounds& b = pairs[local].b->getCollider()->getWorldBounds();
+            buffer.sphereAABBs.add(local * 2, a.center, a.radius, b.min(), b.max());
+        }
+        return true;
+    }
+    if (typeA == ColliderType::AABB && typeB == ColliderType::Sphere)
+    {
+        for (uint32_t j = first; j < last; ++j)
+        {
+            const uint32_t local = buffer.pairOrder[j];
+            const UniDx::Bounds& a = pairs[local].a->getCollider()->getWorldBounds();
+            const UniDx::ConvexGeometry& b = pairs[local].b->getCollider()->getWorldGeometry();
+            buffer.sphereAABBs.add(local * 2 + 1, b.center, b.radius, a.min(), a.max());
+        }
+        return true;
+    }
+    return false;
+}
+
+
+// outer が inner を完全に含んでいるか
+bool containsBounds_(const UniDx::Bounds& outer, const UniDx::Bounds& inner)
+{
+    const UniDx::Vector3 omin = outer.min();
+    const UniDx::Vector3 omax = outer.max();
+    const UniDx::Vector3 imin = inner.min();
+    const UniDx::Vector3 imax = inner.max();
+    return omin.x <= imin.x && omin.y <= imin.y && omin.z <= imin.z
+        && imax.x <= omax.x && imax.y <= omax.y && imax.z <= omax.z;
+}
+
+}
 
 
 namespace UniDx
@@ -13,330 +180,2145 @@ namespace UniDx
 using namespace std;
 
 // 初期化
-void PhysicsShape::initialize(Collider* collider)
+void PhysicsShape::initialize(Collider* collider, uint32_t id, uint32_t slot)
 {
     collider_ = collider;
+    type_ = collider->getType();
+    id_ = id;
+    slot_ = slot;
+    proxyId = -1;
+    bodyIndex = -1;
+    layerLogged = false;
     // moveBounds
 }
 
-// 衝突対象の新旧を調べて OnTrigger～, OnCollidion～ を呼ぶ
-void PhysicsShape::collideCallback()
+// 記録した順に PhysicsActor と接触ペアの表に反映
+void NarrowphaseBuffer::apply(ContactPairTable& pairs) const
 {
-    // トリガーコールバック
-    for (auto other : othersNew_)
+    for (const auto& c : corrections)
     {
-        auto inOld = std::ranges::find(others_, other);
-        if (inOld == others_.end())
+        if (c.velocity)
         {
-            // 以前のリストに含まれていない＝新規
-            getCollider()->gameObject->onTriggerEnter(other);
+            c.actor->addCorrectVelocity(c.vec);
         }
         else
         {
-            // 以前のリストに含まれていれば、一旦削除
-            others_.erase(inOld);
+            c.actor->addCorrectPosition(c.vec);
         }
-
-        // 新しいほうに含まれているので、Stay
-        getCollider()->gameObject->onTriggerStay(other);
     }
 
-    // 新しいリストになくて古いほうに残っている=離れた
-    for (auto other : others_)
+    for (const auto& hit : hits)
     {
-        getCollider()->gameObject->onTriggerExit(other);
+        pairs.touch(hit.a->getId(), hit.a->getCollider(), hit.b->getId(), hit.b->getCollider(), hit.trigger);
     }
+}
 
-    // 古いほうを削除して新しいほうを古いほうに
-    others_.clear();
-    std::swap(others_, othersNew_);
 
-    // 衝突コールバック
-    for (const auto& collision : collisionsNew_)
-    {
-        const auto& inOld = std::ranges::find_if(collisions_, [collision](auto i) {return i.collider == collision.collider; });
-        if (inOld == collisions_.end())
-        {
-        // 以前のリストに含まれていない＝新規
-            getCollider()->gameObject->onCollisionEnter(collision);
-        }
-        else
-        {
-        // 以前のリストに含まれていれば、一旦削除
-            collisions_.erase(inOld);
-        }
+// コンストラクタ
+Physics::Physics()
+{
+    layerCollisionMasks.fill(AllLayers);
+    setBroadphaseType(BroadphaseType::SweepAndPrune);
+    setThreadCount(0);
+    setProfileHistory(defaultProfileHistory);
+}
+
 
-        // 新しいほうに含まれているので、Stay
-        getCollider()->gameObject->onCollisionStay(collision);
+// 並列処理に使うスレッド数を設定
+void Physics::setThreadCount(int count)
+{
+    completeStep();
+    if (count <= 0)
+    {
+        count = std::max(1, int(std::thread::hardware_concurrency()));
     }
+    if (threadPool && threadPool->getThreadCount() == count) return;
+
+    threadPool = make_unique<ThreadPool>(count);
+}
 
-    // 新しいリストになくて古いほうに残っている=離れた
-    for (auto col : collisions_)
+
+// ブロードフェーズの切り替え
+void Physics::setBroadphaseType(BroadphaseType type)
+{
+    completeStep();
+    broadphaseType = type;
+    switch (type)
     {
-        getCollider()->gameObject->onCollisionExit(col);
+    case BroadphaseType::BruteForce:
+        broadphase = make_unique<BruteForceBroadphase>();
+        break;
+    case BroadphaseType::SweepAndPrune:
+        broadphase = make_unique<SweepAndPruneBroadphase>();
+        break;
+    case BroadphaseType::AABBTree:
+        broadphase = make_unique<AABBTreeBroadphase>(aabbTreeMargin);
+        break;
+    case BroadphaseType::SpatialHash:
+        broadphase = make_unique<SpatialHashBroadphase>();
+        break;
     }
 
-    // 古いほうを削除して新しいほうを古いほうに
-    collisions_.clear();
-    std::swap(collisions_, collisionsNew_);
+    // プロキシは次の initializeSimulate で新しいブロードフェーズに作り直す
+    for (auto& shape : physicsShapes)
+    {
+        shape.proxyId = -1;
+    }
 }
 
 
 // Rigidbodyを登録
-void Physics::registerRigidbody(Rigidbody* rigidbody)
+PhysicsBodyHandle Physics::registerRigidbody(Rigidbody* rigidbody, const PhysicsBodyState& state)
 {
-    PhysicsActor temp(rigidbody);
-    physicsActors.insert(std::make_pair(rigidbody, temp));
+    completeStep();
+    PhysicsBodyHandle handle = bodies.create(rigidbody, state);
+    bodies.flags[handle.index] &= ~PhysicsBodyStore::Sleeping;
+    if (physicsActors.size() < bodies.size())
+    {
+        physicsActors.resize(bodies.size());
+    }
+    return handle;
 }
 
 
-// 3D形状を持ったコライダーの登録を解除
-void Physics::unregisterRigidbody(Rigidbody* rigidbody)
+// Rigidbodyの登録を解除
+void Physics::unregisterRigidbody(PhysicsBodyHandle handle)
 {
-    physicsActors.erase(rigidbody);
+    completeStep();
+    // 同じ島で眠っている剛体は支えを失うかもしれないので起こす
+    wakeUpIsland(handle.index);
+    bodies.destroy(handle);
 }
 
 
 // 3D形状を持ったコライダーを登録
-void Physics::register3d(Collider* collider)
+PhysicsShapeHandle Physics::register3d(Collider* collider)
+{
+    completeStep();
+    if (isValid(collider->getShapeHandle()))
+    {
+        return collider->getShapeHandle(); // 登録済み
+    }
+
+    // 解放済みのスロットがあれば再利用
+    uint32_t slot;
+    if (!freeShapeSlots.empty())
+    {
+        slot = freeShapeSlots.back();
+        freeShapeSlots.pop_back();
+    }
+    else
+    {
+        slot = uint32_t(shapeSlots.size());
+        shapeSlots.push_back({ -1, 0, false });
+    }
+    shapeSlots[slot].index = -1;
+    shapeSlots[slot].used = true;
+
+    // シェイプの配列には次のステップの開始時に加える
+    PhysicsShapeHandle handle{ slot, shapeSlots[slot].generation };
+    pendingShapes.push_back({ collider, handle });
+    return handle;
+}
+
+
+// 3D形状を持ったコライダーの登録を解除
+void Physics::unregister3d(PhysicsShapeHandle handle)
 {
-    for(size_t i  = 0; i < physicsShapes.size(); ++i)
+    completeStep();
+    if (!isValid(handle)) return;
+
+    ShapeSlot& slot = shapeSlots[handle.index];
+    if (slot.index >= 0)
     {
-        if(!physicsShapes[i].isValid())
+        // 配列から取り除くのは次のステップの開始時。それまではポインタを有効にしておく
+        PhysicsShape& shape = physicsShapes[slot.index];
+        if (shape.proxyId >= 0)
         {
-            physicsShapes[i].initialize(collider);
-            return;
+            // 触れていた剛体は支えを失うかもしれないので起こす
+            wakeUpOverlapping(shape.moveBounds);
+            broadphase->destroyProxy(shape.proxyId);
+            shape.proxyId = -1;
         }
-        if (physicsShapes[i].getCollider() == collider)
+        if (shape.inStaticTree)
         {
-            return; // 登録済み
+            // 木からは次のステップの開始時に作り直して取り除く。それまではシーンクエリで無効なシェイプとして飛ばす
+            wakeUpOverlapping(shape.moveBounds);
+            staticTreeDirty = true;
         }
+        contactPairTable.removeShape(shape.getId());
+        shape.setInvalid();
     }
 
-    // 無効化されたものがなければ追加
-    physicsShapes.push_back(PhysicsShape());
-    physicsShapes.back().initialize(collider);
+    // 古いハンドルを無効にしてスロットを解放。追加待ちのものは addPendingShapes で捨てられる
+    slot.index = -1;
+    slot.used = false;
+    slot.generation++;
+    freeShapeSlots.push_back(handle.index);
 }
 
 
-// 3D形状を持ったコライダーの登録を解除
-void Physics::unregister3d(Collider* collider)
+// 追加待ちのコライダーをシェイプの配列に加える
+void Physics::addPendingShapes()
 {
-    for (size_t i = 0; i < physicsShapes.size(); ++i)
+    for (const auto& pending : pendingShapes)
     {
-        if (physicsShapes[i].getCollider() == collider)
-        {
-            physicsShapes[i].setInvalid();
-            return;
-        }
+        if (!isValid(pending.handle)) continue;
+
+        shapeSlots[pending.handle.index].index = int(physicsShapes.size());
+        physicsShapes.push_back(PhysicsShape());
+        physicsShapes.back().initialize(pending.collider, nextShapeId++, pending.handle.index);
     }
+    pendingShapes.clear();
 }
 
 
-// 物理計算準備
-void Physics::initializeSimulate(float step)
+// 無効になっているシェイプを末尾のシェイプと入れ替えて取り除く
+void Physics::removeInvalidShapes()
 {
-    // 無効になっているものをvectorから削除
-    for (auto it = physicsActors.begin(); it != physicsActors.end();)
+    for (size_t i = 0; i < physicsShapes.size();)
     {
-        if (!it->second.isValid())
+        if (physicsShapes[i].isValid())
         {
-            it = physicsActors.erase(it);
+            ++i;
+            continue;
         }
-        else
+
+        physicsShapes[i] = physicsShapes.back();
+        physicsShapes.pop_back();
+        if (i == physicsShapes.size()) break;
+
+        // 移動したシェイプのインデクスを付け替える
+        PhysicsShape& moved = physicsShapes[i];
+        if (moved.isValid())
         {
-            ++it;
+            shapeSlots[moved.getSlot()].index = int(i);
+            if (moved.proxyId >= 0)
+            {
+                broadphase->updateProxy(moved.proxyId, moved.moveBounds, int(i));
+            }
+            if (moved.inStaticTree)
+            {
+                staticTreeDirty = true;
+            }
         }
     }
+}
+
+
+// シェイプの追加と削除、ワールド空間の形状の更新など、コライダーと Transform を読む準備
+// 非同期のステップでは、スレッドに渡す前にメインスレッドで行う
+void Physics::prepareShapes()
+{
+    // シェイプの追加と削除はステップの間にまとめて行う
+    removeInvalidShapes();
+    addPendingShapes();
 
-    // 無効になっているシェイプを削除
-    for (vector<PhysicsShape>::iterator it = physicsShapes.begin(); it != physicsShapes.end();)
+    for (auto& shape : physicsShapes)
     {
-        if (!it->isValid())
+        // ワールド空間の行列と形状をここで1度だけ求め、このステップの判定と CCD はそれを読む
+        Collider* collider = shape.getCollider();
+        collider->updateWorldShape();
+        shape.worldShapeDirty = false;
+
+        Rigidbody* r = collider->attachedRigidbody;
+        if (r != nullptr && bodies.isValid(r->getBodyHandle()))
         {
-            it = physicsShapes.erase(it);
+            shape.bodyIndex = int(r->getBodyHandle().index);
+            shape.actor = &physicsActors[shape.bodyIndex];
+            shape.motionType = (bodies.flags[shape.bodyIndex] & PhysicsBodyStore::Kinematic) ? PhysicsMotionType::Kinematic : PhysicsMotionType::Dynamic;
+            shape.bodyTransformPosition = r->transform->position;
         }
         else
         {
-            ++it;
+            shape.bodyIndex = -1;
+            shape.actor = nullptr;
+            shape.motionType = PhysicsMotionType::Static;
+        }
+
+        // 範囲外のレイヤーは端に収め、シェイプごとに1度だけログに出す
+        int layer = collider->gameObject->layer;
+        if (layer < 0 || layer >= layerCount)
+        {
+            if (!shape.layerLogged)
+            {
+                Debug::Log("Physics: layer " + std::to_string(layer) + " is out of range [0, " + std::to_string(layerCount) + ")");
+                shape.layerLogged = true;
+            }
+            layer = std::clamp(layer, 0, layerCount - 1);
         }
+
+        // レイヤーの組み合わせと、静的なもの同士のペアはブロードフェーズで除外する
+        shape.filter.layerBit = 1u << layer;
+        shape.filter.collisionMask = layerCollisionMasks[layer];
+        shape.filter.isStatic = shape.motionType == PhysicsMotionType::Static;
+    }
+    dirtyShapes.clear();
+    shapesPrepared = true;
+}
+
+
+// 物理計算準備
+void Physics::initializeSimulate(float step)
+{
+    if (!shapesPrepared)
+    {
+        prepareShapes();
     }
+    shapesPrepared = false;
+
+    // 以降に記録される接触が今回のステップのもの
+    contactPairTable.beginStep();
 
     // Rigidbodyの更新
+    physicsUpdateBodies();
     for (auto& act : physicsActors)
     {
-        act.second.getRigidbody()->physicsUpdate();
-        act.second.initCorrectBounds();
+        act.initCorrectBounds();
     }
 
     // Shapeの移動Boundsと次に当たるコライダーを初期化を更新
-    for (auto& shape : physicsShapes)
+    const float moveScale = Time::fixedDeltaTime > 0 ? step / Time::fixedDeltaTime : 1;
+    for (size_t i = 0; i < physicsShapes.size(); ++i)
     {
-        shape.initOtherNew();
+        auto& shape = physicsShapes[i];
 
-        Bounds bounds = shape.getCollider()->getBounds();
-        auto rb = shape.getCollider()->attachedRigidbody;
-        if (rb != nullptr)
+        const Bounds lastBounds = shape.moveBounds;
+        Bounds bounds = shape.getCollider()->getWorldBounds();
+        if (shape.bodyIndex >= 0)
         {
-            bounds.Encapsulate(bounds.min() + rb->getMoveVector(step));
-            bounds.Encapsulate(bounds.max() + rb->getMoveVector(step));
+            const Vector3 move = bodies.moves[shape.bodyIndex] * moveScale;
+            bounds.Encapsulate(bounds.min() + move);
+            bounds.Encapsulate(bounds.max() + move);
         }
         shape.moveBounds = bounds;
-        Rigidbody* r = shape.getCollider()->attachedRigidbody;
-        if (r != nullptr)
+
+        if (shape.motionType == PhysicsMotionType::Static)
         {
-            shape.actor = &physicsActors.at(r);
+            // 静的なシェイプはブロードフェーズから出して静的な木に入れる。新しく入ったときと動いたときだけ作り直す
+            if (shape.proxyId >= 0)
+            {
+                broadphase->destroyProxy(shape.proxyId);
+                shape.proxyId = -1;
+            }
+            if (!shape.inStaticTree || Vector3(lastBounds.Center) != Vector3(bounds.Center) || Vector3(lastBounds.Extents) != Vector3(bounds.Extents))
+            {
+                staticTreeDirty = true;
+            }
+            continue;
         }
-        else
+
+        // Rigidbody が付いたシェイプは静的な木から取り除く
+        if (shape.inStaticTree)
         {
-            shape.actor = nullptr;
+            staticTreeDirty = true;
         }
+
+        // ブロードフェーズに反映
+        // 眠っている剛体は動かないので更新しない
+        if (shape.proxyId < 0)
+        {
+            shape.proxyId = broadphase->createProxy(shape.moveBounds, int(i));
+        }
+        else if (refreshAllProxies || (bodies.flags[shape.bodyIndex] & PhysicsBodyStore::Sleeping) == 0)
+        {
+            broadphase->updateProxy(shape.proxyId, shape.moveBounds, int(i));
+        }
+        broadphase->setFilter(shape.proxyId, shape.filter);
+    }
+    if (staticTreeDirty)
+    {
+        rebuildStaticTree();
     }
+    refreshAllProxies = false;
 }
 
 
-// 位置補正法（射影法）による物理計算のシミュレート
-void Physics::simulatePositionCorrection(float step)
+// 静的なシェイプの木を作り直す
+void Physics::rebuildStaticTree()
 {
-    initializeSimulate(step);
-
-    // まずは当たりそうなペアをAABBで判定して抽出
-    potentialPairs.clear();
-    potentialPairsTrigger.clear();
+    staticItems.clear();
     for (size_t i = 0; i < physicsShapes.size(); ++i)
     {
-        for (size_t j = i + 1; j < physicsShapes.size(); ++j)
+        PhysicsShape& shape = physicsShapes[i];
+        shape.inStaticTree = shape.isValid() && shape.motionType == PhysicsMotionType::Static;
+        if (shape.inStaticTree)
         {
-            if (physicsShapes[i].moveBounds.Intersects(physicsShapes[j].moveBounds))
-            {
-                // 同じ Rigidbody に属しているコンパウンド同士は自己衝突なのでスキップ
-                auto rbA = physicsShapes[i].getCollider()->attachedRigidbody;
-                auto rbB = physicsShapes[j].getCollider()->attachedRigidbody;
-                if (rbA && rbA == rbB) continue;
-
-                // ペアを記憶
-                if (physicsShapes[i].getCollider()->isTrigger || physicsShapes[j].getCollider()->isTrigger)
-                {
-                    // トリガー
-                    potentialPairsTrigger.push_back({ &physicsShapes[i], &physicsShapes[j] });
-                }
-                else
-                {
-                    // コリジョン
-                    potentialPairs.push_back({ &physicsShapes[i], &physicsShapes[j] });
-                }
-            }
+            staticItems.push_back({ shape.moveBounds, int(i) });
         }
     }
+    staticTree.build(staticItems);
+    staticTreeDirty = false;
+    staticTreeBuildCount++;
+}
 
-    // 先に位置を更新する
-    for (auto& act : physicsActors)
-    {
-        act.second.getRigidbody()->applyMove(step);
-    }
 
-    // トリガーチェックする
-    for (auto& pair : potentialPairsTrigger)
+// 衝突前の物理更新
+// ここで移動量などを設定しておくが、位置や速度の更新はコリジョン処理の後
+void Physics::physicsUpdateBodies()
+{
+    const float dt = Time::fixedDeltaTime;
+    const float g = gravity * dt;
+    const uint32_t n = bodies.size();
+    Vector3* velocities = bodies.velocities.data();
+    Vector3* moves = bodies.moves.data();
+    const float* gravityScales = bodies.gravityScales.data();
+    const uint32_t* flags = bodies.flags.data();
+
+    // XPBD は分けたステップごとに重力をかけるので、速度には足さずに移動範囲の見積もりにだけ含める
+    const bool substepGravity = solverType == SolverType::XPBD;
+
+    for (uint32_t i = 0; i < n; ++i)
     {
-        if (pair.a->getCollider()->checkTrigger(pair.b->getCollider()))
+        // 眠っている剛体は止まったまま
+        if (flags[i] & PhysicsBodyStore::Sleeping) continue;
+
+        // 重力適用
+        const Vector3 velocity = velocities[i] + Vector3(0.0f, g * gravityScales[i], 0.0f);
+        if (!substepGravity)
         {
-            pair.a->addTrigger(pair.b->getCollider());
-            pair.b->addTrigger(pair.a->getCollider());
+            velocities[i] = velocity;
         }
-    }
 
-    // 衝突をチェックする
-    for (auto& pair : potentialPairs)
-    {
-        if(pair.a->getCollider()->checkIntersect(pair.b->getCollider(), pair.a->actor, pair.b->actor))
+        // 位置の直接指定がなければ、移動ベクトルに速度を入れる
+        if ((flags[i] & PhysicsBodyStore::HasMovePos) == 0)
         {
-            Collision ca;
-            ca.collider = pair.b->getCollider();
-            pair.a->addCollide(ca);
-
-            Collision cb;
-            cb.collider = pair.a->getCollider();
-            pair.b->addCollide(cb);
+            moves[i] = velocity * dt;
         }
     }
+}
 
-    // 衝突で生じた補正を含めて位置と速度を解決する
-    for (auto& act : physicsActors)
+
+// 移動ベクトルを位置に適用
+void Physics::applyMoveBodies(float step)
+{
+    const float scale = Time::fixedDeltaTime > 0 ? step / Time::fixedDeltaTime : 1;
+    const uint32_t n = bodies.size();
+    Vector3* positions = bodies.positions.data();
+    Vector3* moves = bodies.moves.data();
+    uint32_t* flags = bodies.flags.data();
+
+    for (uint32_t i = 0; i < n; ++i)
     {
-        act.second.getRigidbody()->solveCorrection(act.second.getCorrectPositionBounds(), act.second.getCorrectVelocityBounds());
+        positions[i] += moves[i] * scale;
+        moves[i] = Vector3::Zero;
+        flags[i] &= ~(PhysicsBodyStore::HasMovePos | PhysicsBodyStore::HasMoveRot);
     }
+}
 
-    // OnTrigger～, OnCollision～等のコールバックを呼び出す
-    // TODO: 当たったRigidbodyがついているGameObjectでも呼び出す
-    for (auto& shape : physicsShapes)
+
+// 連続衝突判定が有効な剛体の球コライダーを移動方向に掃引し、最初に当たる面の法線方向の移動だけを止める
+// 相手はステップ開始時の位置にあるものとして判定する。接触の応答は通常の衝突判定に任せる
+// scaleVelocities が true なら、移動を縮めた割合で法線方向の速度も縮める
+void Physics::solveContinuousBodies(float step, bool scaleVelocities)
+{
+    const float scale = Time::fixedDeltaTime > 0 ? step / Time::fixedDeltaTime : 1;
+    for (const auto& shape : physicsShapes)
     {
-        shape.collideCallback();
+        const int i = shape.bodyIndex;
+        if (i < 0) continue;
+
+        const uint32_t flags = bodies.flags[i];
+        if ((flags & PhysicsBodyStore::Continuous) == 0) continue;
+        if (flags & (PhysicsBodyStore::Sleeping | PhysicsBodyStore::Kinematic)) continue;
+
+        if (shape.getType() != ColliderType::Sphere) continue;
+        auto sphere = static_cast<SphereCollider*>(shape.getCollider());
+        if (sphere->isTrigger) continue;
+
+        const Vector3 motion = bodies.moves[i] * scale;
+        const float distance = motion.Length();
+        if (distance <= sphere->radius * continuousMinMotion) continue;
+
+        // 位置が直接指定されているとTransformはまだ古いので、剛体の位置に合わせてずらす
+        Rigidbody* rb = bodies.owners[i];
+        const Vector3 origin = sphere->getWorldGeometry().center + bodies.positions[i] - shape.bodyTransformPosition;
+
+        RaycastHit hit;
+        if (!castShapes(origin, sphere->radius, motion / distance, distance, shape.filter.collisionMask, false, rb, hit)) continue;
+
+        // 法線方向に近づく分だけを、接触が検出されるよう許容するめり込みの分まで縮める
+        // 接線方向の動きは残すので、床の上を転がる球は止まらない。近づく量が許容範囲に収まるなら何もしない
+        const float approach = -motion.Dot(hit.normal);
+        const float allowed = hit.distance * approach / distance + linearSlop;
+        if (approach <= allowed) continue;
+
+        const float removed = 1.0f - allowed / approach;
+        bodies.moves[i] -= hit.normal * (bodies.moves[i].Dot(hit.normal) * removed);
+
+        // 速度から位置を進める解き方では、止めた分だけ法線方向の速度も縮める
+        if (scaleVelocities)
+        {
+            bodies.velocities[i] -= hit.normal * (bodies.velocities[i].Dot(hit.normal) * removed);
+        }
     }
 }
 
 
-// 物理計算のシミュレート
-void Physics::simulate(float step)
+// 位置と速度の補正を適用してTransformに反映
+void Physics::solveCorrectionBodies()
 {
-    initializeSimulate(step);
+    const uint32_t n = bodies.size();
+    Vector3* positions = bodies.positions.data();
+    Vector3* velocities = bodies.velocities.data();
 
-    // まずは当たりそうなペアをAABBで判定して抽出
-    potentialPairs.clear();
-    for (size_t i = 0; i < physicsShapes.size(); ++i)
+    // 位置と速度の補正
+    for (uint32_t i = 0; i < n; ++i)
     {
-        for (size_t j = i + 1; j < physicsShapes.size(); ++j)
-        {
-            if (physicsShapes[i].moveBounds.Intersects(physicsShapes[j].moveBounds))
-            {
-                // 同じ Rigidbody に属しているコンパウンド同士は自己衝突なのでスキップ
-                auto rbA = physicsShapes[i].getCollider()->attachedRigidbody;
-                auto rbB = physicsShapes[j].getCollider()->attachedRigidbody;
-                if (rbA && rbA == rbB) continue;
+        const PhysicsActor& act = physicsActors[i];
+        const Bounds p = act.getCorrectPositionBounds();
+        const Bounds v = act.getCorrectVelocityBounds();
+        positions[i] += p.min() + p.max();
+        velocities[i] += v.min() + v.max();
+    }
 
-                // ペアを記憶。ここでは詳細判定しない
-                potentialPairs.push_back({ &physicsShapes[i], &physicsShapes[j] });
-            }
-        }
+    // 非同期のステップでは completeStep() でメインスレッドから書き込む
+    if (!asyncStepRunning)
+    {
+        writeTransformBodies();
+        syncBodyShapes();
     }
+}
 
-    // 形状ごとに実衝突を確定する
-    manifolds.clear();
-    for (auto& pair : potentialPairs)
+
+// Transformに位置と姿勢を反映
+void Physics::writeTransformBodies()
+{
+    const PhysicsBodyStore& store = getBodyStore();
+    const uint32_t n = store.size();
+    for (uint32_t i = 0; i < n; ++i)
     {
-        ContactManifold m;
-//        if (intersectShapes(*pair.a, *pair.b, &m)) {  // ← ここが Narrow-phase
-//            manifolds.push_back(m);
-//        }
+        Rigidbody* rb = store.owners[i];
+        if (rb == nullptr) continue;
+
+        rb->transform->position = store.positions[i];
+        rb->transform->rotation = store.rotations[i];
     }
+}
 
-    // ソルバ
-    for (auto& m : manifolds)
+
+// ステップの後の剛体の姿勢でコライダーの形状を求め直し、シーンクエリがステップの後の位置で判定できるようにする
+// 眠っている剛体は動いていないので飛ばす。Transform に描画用の補間した姿勢を書く前に、メインスレッドから呼ぶ
+void Physics::syncBodyShapes(bool includeSleeping)
+{
+    for (int i = 0; i < int(physicsShapes.size()); ++i)
+    {
+        const PhysicsShape& shape = physicsShapes[i];
+        if (!shape.isValid() || shape.bodyIndex < 0 || uint32_t(shape.bodyIndex) >= bodies.size()) continue;
+        if (!includeSleeping && (bodies.flags[shape.bodyIndex] & PhysicsBodyStore::Sleeping)) continue;
+
+        refreshShape(i);
+    }
+    if (staticTreeDirty)
     {
-        Rigidbody* rbA = m.a->getCollider()->attachedRigidbody;
-        Rigidbody* rbB = m.b->getCollider()->attachedRigidbody;
+        rebuildStaticTree();
+    }
+}
+
+
+// シェイプの形状を Transform から求め直す。ブロードフェーズの範囲からはみ出したときだけ範囲を動かす
+void Physics::refreshShape(int index)
+{
+    PhysicsShape& shape = physicsShapes[index];
+    Collider* collider = shape.getCollider();
+    collider->updateWorldShape();
 
-        // 速度レベルの反発インパルス (Impulses) をかける
-        solveVelocityConstraint(rbA, rbB, m);
+    const Bounds& bounds = collider->getWorldBounds();
+    if (containsBounds_(shape.moveBounds, bounds)) return;
 
-        // 位置のめり込みを少し戻す (Baumgarte / Position correction)
-        solvePositionConstraint(rbA, rbB, m);
+    shape.moveBounds = bounds;
+    if (shape.proxyId >= 0)
+    {
+        broadphase->updateProxy(shape.proxyId, bounds, index);
+    }
+    else if (shape.inStaticTree)
+    {
+        staticTreeDirty = true;
     }
 }
 
 
-void Physics::solveVelocityConstraint(Rigidbody* A, Rigidbody* B, const ContactManifold& m)
+// Transform を動かしたシェイプとして覚える。形状は次のシーンクエリの前か次のステップの始めに求め直す
+void Physics::markShapeMoved(PhysicsShapeHandle handle)
 {
-    const float restitution = 0.2f;   // 反発係数
+    if (!isValid(handle)) return;
 
-    for (int i = 0; i < m.numContacts; ++i)
+    // 追加待ちのシェイプはシーンクエリの対象外で、次のステップの始めに形状を求める
+    const int index = shapeSlots[handle.index].index;
+    if (index < 0) return;
+
+    PhysicsShape& shape = physicsShapes[index];
+    if (shape.worldShapeDirty) return;
+
+    shape.worldShapeDirty = true;
+    dirtyShapes.push_back(handle);
+}
+
+
+// 動かしたシェイプの形状を求め直し、ブロードフェーズと静的な木の範囲を動かす
+// シーンクエリの前に呼ぶ。求め直したらリストを空にするので、同じフレームの2回目以降のクエリでは何もしない
+void Physics::refreshDirtyShapes()
+{
+    if (dirtyShapes.empty()) return;
+
+    for (const PhysicsShapeHandle handle : dirtyShapes)
+    {
+        if (!isValid(handle)) continue;
+        const int index = shapeSlots[handle.index].index;
+        if (index < 0) continue;
+
+        PhysicsShape& shape = physicsShapes[index];
+        if (!shape.worldShapeDirty || !shape.isValid()) continue;
+        shape.worldShapeDirty = false;
+
+        // Transform に描画用の補間した姿勢が入っている剛体は、ステップの後に求めた形状のまま使う
+        if (transformsInterpolated && shape.bodyIndex >= 0 && uint32_t(shape.bodyIndex) < bodies.size()
+            && (bodies.flags[shape.bodyIndex] & (PhysicsBodyStore::Interpolate | PhysicsBodyStore::Extrapolate)))
+        {
+            continue;
+        }
+        refreshShape(index);
+    }
+    dirtyShapes.clear();
+
+    if (staticTreeDirty)
     {
+        rebuildStaticTree();
     }
 }
 
 
-void Physics::solvePositionConstraint(Rigidbody* A, Rigidbody* B, const ContactManifold& m)
+// 当たりそうなペアをブロードフェーズで抽出して potentialPairs, potentialPairsTrigger に格納
+void Physics::findPotentialPairs()
 {
+    broadphasePairs.clear();
+    broadphase->findPairs(broadphasePairs);
+
+    // 動くシェイプと静的なシェイプのペアは静的な木から探す。静的なもの同士は調べない
+    // 眠っている剛体との組は下で除かれるので、木を調べる前に飛ばす
+    if (!staticTree.empty())
+    {
+        for (int i = 0; i < int(physicsShapes.size()); ++i)
+        {
+            const PhysicsShape& shape = physicsShapes[i];
+            if (shape.proxyId < 0 || isResting(shape)) continue;
+
+            staticTree.query(shape.moveBounds, [&](int other) {
+                if (BroadphaseFilter::shouldPair(shape.filter, physicsShapes[other].filter))
+                {
+                    broadphasePairs.push_back(i < other ? BroadphasePair{ i, other } : BroadphasePair{ other, i });
+                }
+                return true;
+                });
+        }
+    }
+
+    // どのブロードフェーズでも総当たりと同じ順序になるように並べる
+    std::sort(broadphasePairs.begin(), broadphasePairs.end(), [](const BroadphasePair& l, const BroadphasePair& r) {
+        return l.a < r.a || (l.a == r.a && l.b < r.b);
+        });
+
+    potentialPairs.clear();
+    potentialPairsTrigger.clear();
+    for (const auto& pair : broadphasePairs)
+    {
+        PhysicsShape& a = physicsShapes[pair.a];
+        PhysicsShape& b = physicsShapes[pair.b];
 
+        // 同じ Rigidbody に属しているコンパウンド同士は自己衝突なのでスキップ
+        auto rbA = a.getCollider()->attachedRigidbody;
+        auto rbB = b.getCollider()->attachedRigidbody;
+        if (rbA && rbA == rbB) continue;
+
+        // どちらも動かなければ前のステップから変わらないのでスキップ
+        // 触れていたペアは ContactPairTable::dispatch() が引き継いで Stay を呼び続ける
+        if (isResting(a) && isResting(b)) continue;
+
+        // ペアを記憶
+        if (a.getCollider()->isTrigger || b.getCollider()->isTrigger)
+        {
+            // トリガー
+            potentialPairsTrigger.push_back({ &a, &b });
+        }
+        else
+        {
+            // コリジョン
+            potentialPairs.push_back({ &a, &b });
+        }
+    }
+}
+
+
+// トリガーと衝突を並列にチェックして、結果を決まった順序で反映する
+// makeManifolds が true なら衝突は補正せずに接触点を作って manifolds に集める
+void Physics::narrowphase(bool makeManifolds)
+{
+    // ワールド空間の形状と Transform の行列は initializeSimulate() で求めてあるので、並列に読んでよい
+
+    // ペアを一定数ごとに区切り、区切りごとにバッファを用意する
+    const int triggerChunks = int((potentialPairsTrigger.size() + narrowphaseChunkSize - 1) / narrowphaseChunkSize);
+    const int collisionChunks = int((potentialPairs.size() + narrowphaseChunkSize - 1) / narrowphaseChunkSize);
+    const int chunkCount = triggerChunks + collisionChunks;
+    if (narrowphaseBuffers.size() < size_t(chunkCount))
+    {
+        narrowphaseBuffers.resize(chunkCount);
+    }
+
+    threadPool->parallelFor(chunkCount, [&](int chunk) {
+        FloatModeScope floatMode(deterministic);
+        NarrowphaseBuffer& buffer = narrowphaseBuffers[chunk];
+        buffer.clear();
+        buffer.bodies = &bodies;
+
+        if (chunk < triggerChunks)
+        {
+            // トリガーチェックする。形状の組み合わせごとに同じ判定関数でまとめて調べ、結果はペアの順に記録する
+            const size_t begin = size_t(chunk) * narrowphaseChunkSize;
+            const size_t end = std::min(begin + narrowphaseChunkSize, potentialPairsTrigger.size());
+            const PotentialPair* pairs = &potentialPairsTrigger[begin];
+            bucketPairs_(pairs, end - begin, buffer);
+            buffer.pairHits.assign(end - begin, 0);
+            for (int k = 0; k < pairTypeCount; ++k)
+            {
+                const uint32_t first = buffer.bucketBegin[k];
+                const uint32_t last = buffer.bucketBegin[k + 1];
+                if (first == last) continue;
+
+                const Collider::TriggerFunc check = Collider::getTriggerFunc(ColliderType(k / ColliderTypeCount), ColliderType(k % ColliderTypeCount));
+                for (uint32_t j = first; j < last; ++j)
+                {
+                    const uint32_t local = buffer.pairOrder[j];
+                    buffer.pairHits[local] = check(pairs[local].a->getCollider(), pairs[local].b->getCollider());
+                }
+            }
+            for (size_t i = 0; i < end - begin; ++i)
+            {
+                if (buffer.pairHits[i]) buffer.addTrigger(pairs[i].a, pairs[i].b);
+            }
+        }
+        else
+        {
+            // 衝突をチェックする
+            const size_t begin = size_t(chunk - triggerChunks) * narrowphaseChunkSize;
+            const size_t end = std::min(begin + narrowphaseChunkSize, potentialPairs.size());
+            if (makeManifolds)
+            {
+                narrowphaseManifolds(buffer, begin, end);
+            }
+            else
+            {
+                narrowphaseCorrections(buffer, begin, end);
+            }
+        }
+        });
+
+    // 区切りの順に反映するので、直列に処理した場合と同じ結果になる
+    manifolds.clear();
+    contactPairs.clear();
+    for (int chunk = 0; chunk < chunkCount; ++chunk)
+    {
+        narrowphaseBuffers[chunk].apply(contactPairTable);
+
+        const auto& m = narrowphaseBuffers[chunk].getManifolds();
+        manifolds.insert(manifolds.end(), m.begin(), m.end());
+
+        // 島の構築に使うペア
+        narrowphaseBuffers[chunk].forEachCollide([this](PhysicsShape* a, PhysicsShape* b) { contactPairs.push_back({ a, b }); });
+        for (const auto& manifold : m)
+        {
+            contactPairs.push_back({ manifold.a, manifold.b });
+        }
+    }
+}
+
+
+// 区間のペアを位置補正法で判定し、補正を buffer に記録する
+// 球と球、球と AABB の組はバッチ判定で接触を求めてから Collider::correctContact() で補正し、
+// それ以外は組み合わせごとの判定関数を1度だけ引いて、同じ組み合わせのペアをまとめて判定する
+void Physics::narrowphaseCorrections(NarrowphaseBuffer& buffer, size_t begin, size_t end)
+{
+    const PotentialPair* pairs = &potentialPairs[begin];
+    const size_t count = end - begin;
+    bucketPairs_(pairs, count, buffer);
+    buffer.pairHits.assign(count, 0);
+    buffer.pairContacts.assign(count, -1);
+    buffer.spherePairs.clear();
+    buffer.sphereAABBs.clear();
+
+    for (int k = 0; k < pairTypeCount; ++k)
+    {
+        const uint32_t first = buffer.bucketBegin[k];
+        const uint32_t last = buffer.bucketBegin[k + 1];
+        if (first == last) continue;
+
+        const ColliderType typeA = ColliderType(k / ColliderTypeCount);
+        const ColliderType typeB = ColliderType(k % ColliderTypeCount);
+        if (useNarrowphaseKernels && addKernelPairs_(pairs, typeA, typeB, first, last, buffer)) continue;
+
+        const Collider::IntersectFunc check = Collider::getIntersectFunc(typeA, typeB);
+        for (uint32_t j = first; j < last; ++j)
+        {
+            const PotentialPair& pair = pairs[buffer.pairOrder[j]];
+            buffer.pairHits[buffer.pairOrder[j]] = check(pair.a->getCollider(), pair.b->getCollider(), pair.a, pair.b, buffer);
+        }
+    }
+
+    // バッチ判定で接触したペアは、ペアの順に補正する。球を先にして渡す
+    runNarrowphaseKernels(buffer);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const int result = buffer.pairContacts[i];
+        if (result < 0) continue;
+
+        const KernelContact& c = buffer.kernelContacts[result];
+        const bool flip = (c.pair & 1) != 0;
+        PhysicsShape* sphere = flip ? pairs[i].b : pairs[i].a;
+        PhysicsShape* other = flip ? pairs[i].a : pairs[i].b;
+        buffer.pairHits[i] = Collider::correctContact(sphere->getCollider(), other->getCollider(), sphere, other, c, buffer);
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (buffer.pairHits[i]) buffer.addCollide(pairs[i].a, pairs[i].b);
+    }
+}
+
+
+// バッチに詰めたペアを判定して buffer.kernelContacts に集め、ペアの区間内の位置から接触の番号を引けるようにする
+void Physics::runNarrowphaseKernels(NarrowphaseBuffer& buffer)
+{
+    buffer.kernelContacts.clear();
+    PhysicsKernels::sphereSphere(buffer.spherePairs, buffer.kernelContacts);
+    PhysicsKernels::sphereAABB(buffer.sphereAABBs, buffer.kernelContacts);
+
+    if (verifyNarrowphaseKernels)
+    {
+        buffer.verifyContacts.clear();
+        PhysicsKernels::sphereSphereScalar(buffer.spherePairs, buffer.verifyContacts);
+        PhysicsKernels::sphereAABBScalar(buffer.sphereAABBs, buffer.verifyContacts);
+        if (!PhysicsKernels::sameContacts(buffer.kernelContacts, buffer.verifyContacts))
+        {
+            Debug::Log(std::string("Narrowphase kernel mismatch: ") + PhysicsKernels::getInstructionSet());
+        }
+    }
+
+    for (size_t k = 0; k < buffer.kernelContacts.size(); ++k)
+    {
+        buffer.pairContacts[buffer.kernelContacts[k].pair / 2] = int(k);
+    }
+}
+
+
+// 区間のペアの接触点を作って buffer に記録する
+// ペアを形状の組み合わせごとに分け、球と球、球と AABB の組はバッチ判定し、
+// それ以外は組み合わせごとの判定関数を1度だけ引いて、同じ組み合わせのペアをまとめて判定する
+void Physics::narrowphaseManifolds(NarrowphaseBuffer& buffer, size_t begin, size_t end)
+{
+    auto addManifold = [&](PhysicsShape* a, PhysicsShape* b, const KernelContact* c, bool flip) {
+        ContactManifold m;
+        m.a = a;
+        m.b = b;
+        m.contacts[0].point = c->point;
+        m.contacts[0].normal = flip ? -c->normal : c->normal;
+        m.contacts[0].penetration = c->penetration;
+        m.contacts[0].feature = 0;
+        m.numContacts = 1;
+        buffer.addManifold(m);
+    };
+
+    const PotentialPair* pairs = &potentialPairs[begin];
+    const size_t count = end - begin;
+    bucketPairs_(pairs, count, buffer);
+
+    // ペアごとの結果。バッチ判定の接触点の番号か、判定関数で pairManifolds に作ったか、接触なし
+    enum { Manifold = -2, NoContact = -1 };
+    buffer.pairContacts.assign(count, NoContact);
+    buffer.pairManifolds.resize(count);
+    buffer.spherePairs.clear();
+    buffer.sphereAABBs.clear();
+
+    for (int k = 0; k < pairTypeCount; ++k)
+    {
+        const uint32_t first = buffer.bucketBegin[k];
+        const uint32_t last = buffer.bucketBegin[k + 1];
+        if (first == last) continue;
+
+        const ColliderType typeA = ColliderType(k / ColliderTypeCount);
+        const ColliderType typeB = ColliderType(k % ColliderTypeCount);
+        if (useNarrowphaseKernels && addKernelPairs_(pairs, typeA, typeB, first, last, buffer)) continue;
+
+        const Collider::ContactsFunc getContacts = Collider::getContactsFunc(typeA, typeB);
+        for (uint32_t j = first; j < last; ++j)
+        {
+            const uint32_t local = buffer.pairOrder[j];
+            ContactManifold& m = buffer.pairManifolds[local];
+            m.a = pairs[local].a;
+            m.b = pairs[local].b;
+            m.numContacts = 0;
+            if (getContacts(m.a->getCollider(), m.b->getCollider(), m))
+            {
+                buffer.pairContacts[local] = Manifold;
+            }
+        }
+    }
+
+    runNarrowphaseKernels(buffer);
+
+    // ペアの順に記録するので、組み合わせごとに分けても順序は変わらない
+    for (size_t i = 0; i < count; ++i)
+    {
+        const int result = buffer.pairContacts[i];
+        if (result >= 0)
+        {
+            const KernelContact& c = buffer.kernelContacts[result];
+            addManifold(pairs[i].a, pairs[i].b, &c, (c.pair & 1) != 0);
+        }
+        else if (result == Manifold)
+        {
+            buffer.addManifold(buffer.pairManifolds[i]);
+        }
+    }
+}
+
+
+// solverType に応じて1ステップ進める
+void Physics::step(float deltaTime)
+{
+    completeStep();
+
+    FloatModeScope floatMode(deterministic);
+    profile = StepProfile();
+
+    // 描画用に補間した Transform を戻す
+    restoreInterpolatedTransforms();
+
+    // 非同期のステップ中にメインスレッドが読み書きする複製。補間の始点はひとつ前のステップの姿勢のまま残す
+    if (asyncSimulation)
+    {
+        publishedBodies = bodies;
+    }
+
+    // 補間の始点になる今の姿勢を覚えておく
+    std::copy(bodies.positions.begin(), bodies.positions.end(), bodies.previousPositions.begin());
+    std::copy(bodies.rotations.begin(), bodies.rotations.end(), bodies.previousRotations.begin());
+
+    if (!asyncSimulation)
+    {
+        simulateStep(deltaTime);
+        finishStep();
+        recordProfile();
+        return;
+    }
+
+    // コライダーと Transform はメインスレッドで読んでおき、残りをスレッドで進める
+    Stopwatch watch;
+    prepareShapes();
+    profile.initializeMs = watch.lap();
+    if (!stepThread)
+    {
+        stepThread = make_unique<WorkerThread>();
+    }
+    asyncStepRunning = true;
+    stepThread->run([this, deltaTime]() {
+        onSimulationThread = true;
+        FloatModeScope floatMode(deterministic);
+        simulateStep(deltaTime);
+        onSimulationThread = false;
+        });
+}
+
+
+// 実行中の非同期のステップを待ち、メインスレッドでの書き込みを反映してから結果を Transform に書き込む
+void Physics::completeStep()
+{
+    if (!asyncStepRunning) return;
+
+    stepThread->wait();
+    asyncStepRunning = false;
+    finishStep();
+
+    // ステップ中に書き込まれた値を写し、起こす、眠らせる要求を順に反映する
+    for (const auto& write : pendingBodyWrites)
+    {
+        if (!bodies.isValid(write.handle)) continue;
+
+        bodies.copyFields(publishedBodies, write.handle.index, write.fields);
+        if (write.fields & pendingWakeUp) wakeUpBody(write.handle);
+        if (write.fields & pendingSleep) sleepBody(write.handle);
+    }
+    pendingBodyWrites.clear();
+
+    writeTransformBodies();
+    syncBodyShapes();
+    transformsInterpolated = false;
+
+    // OnTrigger～, OnCollision～等のコールバックを呼び出す
+    Stopwatch watch;
+    profile.callbacks = contactPairTable.dispatch();
+    profile.callbacksMs = watch.lap();
+    recordProfile();
+}
+
+
+// solverType に応じたシミュレーションの本体
+void Physics::simulateStep(float deltaTime)
+{
+    switch (solverType)
+    {
+    case SolverType::PositionCorrection:
+        simulatePositionCorrection(deltaTime);
+        break;
+    case SolverType::SequentialImpulse:
+        simulate(deltaTime);
+        break;
+    case SolverType::XPBD:
+        simulateXPBD(deltaTime);
+        break;
+    }
+}
+
+
+// ステップを数え、チェックサムとスナップショットを残す
+void Physics::finishStep()
+{
+    stepCount++;
+
+    profile.step = stepCount;
+    profile.shapes = int(physicsShapes.size());
+    profile.actors = int(bodies.activeCount());
+    profile.potentialPairs = int(potentialPairs.size());
+    profile.triggerPairs = int(potentialPairsTrigger.size());
+    profile.contacts = int(contactPairs.size());
+    profile.contactPoints = 0;
+    for (const auto& m : manifolds)
+    {
+        profile.contactPoints += m.numContacts;
+    }
+
+    if (deterministic)
+    {
+        stepChecksum = computeChecksum();
+    }
+
+    if (snapshotHistory.getCapacity() > 0)
+    {
+        saveSnapshot(snapshotHistory.push(stepCount));
+    }
+}
+
+
+// コールバックまで終えたステップのプロファイルを履歴に残す
+void Physics::recordProfile()
+{
+    lastProfile = profile;
+    if (profileHistory.empty()) return;
+
+    profileHistory[profileNext] = profile;
+    profileNext = (profileNext + 1) % profileHistory.size();
+    profileCount = std::min(profileCount + 1, profileHistory.size());
+}
+
+
+// プロファイルを残すステップ数を設定。残っていた履歴は捨てる
+void Physics::setProfileHistory(int steps)
+{
+    profileHistory.assign(size_t(std::max(steps, 0)), StepProfile());
+    profileNext = 0;
+    profileCount = 0;
+}
+
+
+// 残っているプロファイルのうち、古い方から index 番目
+const Physics::StepProfile& Physics::getProfile(int index) const
+{
+    assert(index >= 0 && size_t(index) < profileCount);
+    const size_t oldest = (profileNext + profileHistory.size() - profileCount) % profileHistory.size();
+    return profileHistory[(oldest + size_t(index)) % profileHistory.size()];
+}
+
+
+// 最後のステップから restTime 経った描画用の姿勢を Transform に書き込む
+// Interpolate は直前のステップの始めの姿勢から最後のステップの後の姿勢へ、経った時間の割合で補間する
+void Physics::interpolateTransforms(float restTime)
+{
+    const float alpha = Time::fixedDeltaTime > 0 ? std::clamp(restTime / Time::fixedDeltaTime, 0.0f, 1.0f) : 1.0f;
+    const PhysicsBodyStore& store = getBodyStore();
+    const uint32_t n = store.size();
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        const uint32_t flags = store.flags[i];
+        if ((flags & (PhysicsBodyStore::Interpolate | PhysicsBodyStore::Extrapolate)) == 0) continue;
+
+        Rigidbody* rb = store.owners[i];
+        if (rb == nullptr) continue;
+
+        if (flags & PhysicsBodyStore::Interpolate)
+        {
+            rb->transform->position = Vector3::Lerp(store.previousPositions[i], store.positions[i], alpha);
+            rb->transform->rotation = Quaternion::Slerp(store.previousRotations[i], store.rotations[i], alpha);
+        }
+        else if ((flags & PhysicsBodyStore::Sleeping) == 0)
+        {
+            rb->transform->position = store.positions[i] + store.velocities[i] * restTime;
+        }
+        transformsInterpolated = true;
+    }
+}
+
+
+// 描画用に補間した Transform を物理の姿勢に戻す
+void Physics::restoreInterpolatedTransforms()
+{
+    if (!transformsInterpolated) return;
+
+    writeTransformBodies();
+    transformsInterpolated = false;
+}
+
+
+// 剛体の状態のチェックサム。値のビット列を32ビットずつ FNV-1a で混ぜる
+// スロットの順に混ぜるので、登録の順序が同じなら実行ごとに同じ値になる
+uint64_t Physics::computeChecksum() const
+{
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](uint32_t value) { hash = (hash ^ value) * 1099511628211ull; };
+    auto mixVector = [&mix](const float* v, int count) {
+        for (int k = 0; k < count; ++k) mix(std::bit_cast<uint32_t>(v[k]));
+    };
+
+    // 位置の直接指定などステップ内だけのフラグは含めない
+    const uint32_t stateFlags = PhysicsBodyStore::Kinematic | PhysicsBodyStore::Sleeping | PhysicsBodyStore::Continuous;
+    const uint32_t n = bodies.size();
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        const uint32_t flags = bodies.flags[i];
+        if ((flags & PhysicsBodyStore::Active) == 0) continue;
+
+        mix(i);
+        mix(flags & stateFlags);
+        mixVector(&bodies.positions[i].x, 3);
+        mixVector(&bodies.rotations[i].x, 4);
+        mixVector(&bodies.velocities[i].x, 3);
+    }
+    return hash;
+}
+
+
+// スナップショットに保存
+void Physics::saveSnapshot(PhysicsSnapshot& snapshot) const
+{
+    snapshot.begin(stepCount);
+    snapshot.write(stepCount);
+    snapshot.write(stepChecksum);
+    snapshot.write(sleepStats);
+    bodies.save(snapshot);
+    snapshot.writeVector(contactCache);
+    contactPairTable.save(snapshot);
+}
+
+
+// スナップショットから復元
+void Physics::restoreSnapshot(const PhysicsSnapshot& snapshot)
+{
+    completeStep();
+    assert(snapshot.isValid());
+
+    PhysicsSnapshotReader reader(snapshot);
+    stepCount = reader.read<uint64_t>();
+    stepChecksum = reader.read<uint64_t>();
+    sleepStats = reader.read<SleepStats>();
+    bodies.restore(reader);
+    reader.readVector(contactCache);
+    contactPairTable.restore(reader);
+    assert(reader.isEnd());
+
+    // 保存したあとに登録を解除したシェイプのペアは捨てる
+    std::vector<uint32_t> liveIds;
+    liveIds.reserve(physicsShapes.size());
+    for (const auto& shape : physicsShapes)
+    {
+        if (shape.isValid()) liveIds.push_back(shape.getId());
+    }
+    std::sort(liveIds.begin(), liveIds.end());
+    contactPairTable.removeShapesIf([&liveIds](uint32_t id) {
+        return !std::binary_search(liveIds.begin(), liveIds.end(), id);
+        });
+
+    // Transform に位置を書き戻し、次のステップで眠っているものも含めてブロードフェーズを更新する
+    writeTransformBodies();
+    syncBodyShapes(true);
+    refreshAllProxies = true;
+}
+
+
+// スナップショットを自動で保存するステップ数を設定
+void Physics::setSnapshotHistory(int steps)
+{
+    snapshotHistory.setCapacity(steps);
+}
+
+
+// 履歴のスナップショットに巻き戻す
+bool Physics::rollback(uint64_t step)
+{
+    completeStep();
+    const PhysicsSnapshot* snapshot = snapshotHistory.find(step);
+    if (snapshot == nullptr) return false;
+
+    restoreSnapshot(*snapshot);
+    snapshotHistory.discardAfter(step);
+    return true;
+}
+
+
+// 位置補正法（射影法）による物理計算のシミュレート
+void Physics::simulatePositionCorrection(float step)
+{
+    // 逐次インパルス法の蓄積インパルスは引き継がない
+    contactCache.clear();
+
+    Stopwatch watch;
+    initializeSimulate(step);
+    profile.initializeMs += watch.lap();
+
+    // まずは当たりそうなペアをブロードフェーズで抽出
+    findPotentialPairs();
+    profile.broadphaseMs = watch.lap();
+
+    // 先に位置を更新する。速い球は壁の手前で止める
+    solveContinuousBodies(step);
+    applyMoveBodies(step);
+    profile.solveMs = watch.lap();
+
+    // トリガーと衝突をチェックする
+    narrowphasePositionCorrection();
+    profile.narrowphaseMs = watch.lap();
+
+    // 衝突で生じた補正を含めて位置と速度を解決する
+    solveCorrectionBodies();
+    profile.solveMs += watch.lap();
+
+    // OnTrigger～, OnCollision～等のコールバックを呼び出す。非同期のステップでは completeStep() で呼ぶ
+    // TODO: 当たったRigidbodyがついているGameObjectでも呼び出す
+    if (!asyncStepRunning)
+    {
+        profile.callbacks = contactPairTable.dispatch();
+        profile.callbacksMs = watch.lap();
+    }
+
+    // 止まっている島を眠らせる
+    watch.lap();
+    updateSleep(step);
+    profile.solveMs += watch.lap();
+}
+
+
+// 逐次インパルス法による物理計算のシミュレート
+void Physics::simulate(float step)
+{
+    Stopwatch watch;
+    initializeSimulate(step);
+    profile.initializeMs += watch.lap();
+
+    // まずは当たりそうなペアをブロードフェーズで抽出。ここでは詳細判定しない
+    findPotentialPairs();
+    profile.broadphaseMs = watch.lap();
+
+    // 形状ごとに実衝突を確定して接触点を作る
+    narrowphase(true);
+    profile.narrowphaseMs = watch.lap();
+
+    // 接触ごとの準備と、前のステップのインパルスによるウォームスタート
+    for (auto& m : manifolds)
+    {
+        prepareContacts(m);
+    }
+    if (warmStarting)
+    {
+        for (auto& m : manifolds)
+        {
+            warmStart(m);
+        }
+    }
+
+    // 速度レベルの反発インパルス (Impulses) を反復してかける
+    for (int i = 0; i < velocityIterations; ++i)
+    {
+        for (auto& m : manifolds)
+        {
+            solveVelocityConstraint(m);
+        }
+    }
+
+    // 解いた速度で位置を進める
+    solverStartPositions.assign(bodies.positions.begin(), bodies.positions.end());
+    const uint32_t n = bodies.size();
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        if ((bodies.flags[i] & PhysicsBodyStore::HasMovePos) == 0)
+        {
+            bodies.moves[i] = bodies.velocities[i] * Time::fixedDeltaTime;
+        }
+    }
+    solveContinuousBodies(step);
+    applyMoveBodies(step);
+
+    // 残っためり込みを少し戻す (Baumgarte / Position correction)
+    for (int i = 0; i < positionIterations; ++i)
+    {
+        for (auto& m : manifolds)
+        {
+            solvePositionConstraint(m);
+        }
+    }
+
+    if (!asyncStepRunning)
+    {
+        writeTransformBodies();
+        syncBodyShapes();
+    }
+
+    // 衝突を記録して、蓄積インパルスを次のステップに引き継ぐ
+    for (const auto& m : manifolds)
+    {
+        addCollisions(m);
+    }
+    storeContactCache();
+    profile.solveMs = watch.lap();
+
+    // OnTrigger～, OnCollision～等のコールバックを呼び出す。非同期のステップでは completeStep() で呼ぶ
+    if (!asyncStepRunning)
+    {
+        profile.callbacks = contactPairTable.dispatch();
+        profile.callbacksMs = watch.lap();
+    }
+
+    // 止まっている島を眠らせる
+    watch.lap();
+    updateSleep(step);
+    profile.solveMs += watch.lap();
+}
+
+
+// 拡張位置ベース法 (XPBD) による物理計算のシミュレート
+// 接触点はステップの初めに1度だけ作り、分けたステップごとに位置を進めて接触を1回ずつ解き、動いた量から速度を求める
+void Physics::simulateXPBD(float step)
+{
+    // 蓄積インパルスは使わない
+    contactCache.clear();
+
+    Stopwatch watch;
+    initializeSimulate(step);
+    profile.initializeMs += watch.lap();
+
+    // ブロードフェーズとナローフェーズはステップごとに1回
+    findPotentialPairs();
+    profile.broadphaseMs = watch.lap();
+    narrowphase(true);
+    profile.narrowphaseMs = watch.lap();
+    for (auto& m : manifolds)
+    {
+        prepareContacts(m);
+    }
+
+    // 速い球は1ステップ分の移動で壁の手前で止める
+    solveContinuousBodies(step, true);
+
+    const int count = std::max(1, substepCount);
+    const float h = step / float(count);
+    const float moveScale = (Time::fixedDeltaTime > 0 ? step / Time::fixedDeltaTime : 1) / float(count);
+    const uint32_t n = bodies.size();
+    Vector3* positions = bodies.positions.data();
+    Vector3* velocities = bodies.velocities.data();
+    const Vector3* moves = bodies.moves.data();
+    const float* gravityScales = bodies.gravityScales.data();
+    const uint32_t* flags = bodies.flags.data();
+
+    solverStartPositions.assign(bodies.positions.begin(), bodies.positions.end());
+    substepStartPositions.resize(n);
+    for (int s = 0; s < count; ++s)
+    {
+        // 重力をかけて位置を進める。位置を直接指定された剛体は指定された移動を等分して進める
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            substepStartPositions[i] = positions[i];
+            if (flags[i] & PhysicsBodyStore::Sleeping) continue;
+
+            if (flags[i] & PhysicsBodyStore::HasMovePos)
+            {
+                positions[i] += moves[i] * moveScale;
+            }
+            else
+            {
+                velocities[i].y += gravity * gravityScales[i] * h;
+                positions[i] += velocities[i] * h;
+            }
+        }
+
+        // 接触を1回ずつ解く
+        for (auto& m : manifolds)
+        {
+            solveContactXPBD(m, h);
+        }
+
+        // 動いた量から速度を求め、跳ね返りをかける
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            if (flags[i] & (PhysicsBodyStore::Sleeping | PhysicsBodyStore::HasMovePos)) continue;
+            velocities[i] = (positions[i] - substepStartPositions[i]) / h;
+        }
+        for (auto& m : manifolds)
+        {
+            solveContactVelocityXPBD(m);
+        }
+    }
+
+    // 位置の直接指定を使い終える
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        bodies.moves[i] = Vector3::Zero;
+        bodies.flags[i] &= ~(PhysicsBodyStore::HasMovePos | PhysicsBodyStore::HasMoveRot);
+    }
+
+    if (!asyncStepRunning)
+    {
+        writeTransformBodies();
+        syncBodyShapes();
+    }
+
+    // 衝突を記録する
+    for (const auto& m : manifolds)
+    {
+        addCollisions(m);
+    }
+    profile.solveMs = watch.lap();
+
+    // OnTrigger～, OnCollision～等のコールバックを呼び出す。非同期のステップでは completeStep() で呼ぶ
+    if (!asyncStepRunning)
+    {
+        profile.callbacks = contactPairTable.dispatch();
+        profile.callbacksMs = watch.lap();
+    }
+
+    // 止まっている島を眠らせる
+    watch.lap();
+    updateSleep(step);
+    profile.solveMs += watch.lap();
+}
+
+
+// 接触ごとに質量や接線方向を求め、前のステップの蓄積インパルスを引き継ぐ
+void Physics::prepareContacts(ContactManifold& m)
+{
+    Collider* ca = m.a->getCollider();
+    Collider* cb = m.b->getCollider();
+
+    m.key = (uint64_t(m.a->getId()) << 32) | m.b->getId();
+    m.bodyA = m.a->bodyIndex;
+    m.bodyB = m.b->bodyIndex;
+    m.invMassA = m.bodyA >= 0 ? bodies.inverseMasses[m.bodyA] : 0.0f;
+    m.invMassB = m.bodyB >= 0 ? bodies.inverseMasses[m.bodyB] : 0.0f;
+    m.friction = (ca->friction + cb->friction) * 0.5f;
+    m.restitution = ca->bounciness * cb->bounciness;
+
+    // 法線に垂直な2軸
+    const Vector3 normal = m.contacts[0].normal;
+    if (std::abs(normal.x) >= 0.57735f)
+    {
+        m.tangent1 = Vector3(normal.y, -normal.x, 0.0f);
+    }
+    else
+    {
+        m.tangent1 = Vector3(0.0f, normal.z, -normal.y);
+    }
+    m.tangent1.Normalize();
+    m.tangent2 = normal.Cross(m.tangent1);
+
+    // 前のステップで同じ組み合わせの接触があれば、同じ特徴の接触点のインパルスを引き継ぐ
+    const CachedManifold* prev = nullptr;
+    if (warmStarting)
+    {
+        auto it = std::lower_bound(contactCache.begin(), contactCache.end(), m.key, [](const CachedManifold& l, uint64_t key) {
+            return l.key < key;
+            });
+        if (it != contactCache.end() && it->key == m.key)
+        {
+            prev = &*it;
+        }
+    }
+
+    const Vector3 va = m.bodyA >= 0 ? bodies.velocities[m.bodyA] : Vector3::Zero;
+    const Vector3 vb = m.bodyB >= 0 ? bodies.velocities[m.bodyB] : Vector3::Zero;
+    const float relVelN = (vb - va).Dot(normal);
+
+    for (int i = 0; i < m.numContacts; ++i)
+    {
+        Contact& c = m.contacts[i];
+        c.normalImpulse = 0.0f;
+        c.tangentImpulse[0] = 0.0f;
+        c.tangentImpulse[1] = 0.0f;
+        if (prev != nullptr)
+        {
+            for (int j = 0; j < prev->numContacts; ++j)
+            {
+                const CachedContact& pc = prev->contacts[j];
+                if (pc.feature == c.feature)
+                {
+                    c.normalImpulse = pc.normalImpulse;
+                    c.tangentImpulse[0] = pc.tangentImpulse[0];
+                    c.tangentImpulse[1] = pc.tangentImpulse[1];
+                    break;
+                }
+            }
+        }
+
+        // 近づく速さが十分にあるときだけ跳ね返らせる
+        c.velocityBias = relVelN < -restitutionThreshold ? -m.restitution * relVelN : 0.0f;
+    }
+}
+
+
+// 蓄積インパルスを先にかけておく
+void Physics::warmStart(ContactManifold& m)
+{
+    Vector3 dummy;
+    Vector3& va = m.bodyA >= 0 ? bodies.velocities[m.bodyA] : dummy;
+    Vector3& vb = m.bodyB >= 0 ? bodies.velocities[m.bodyB] : dummy;
+
+    for (int i = 0; i < m.numContacts; ++i)
+    {
+        const Contact& c = m.contacts[i];
+        const Vector3 impulse = c.normal * c.normalImpulse + m.tangent1 * c.tangentImpulse[0] + m.tangent2 * c.tangentImpulse[1];
+        va -= impulse * m.invMassA;
+        vb += impulse * m.invMassB;
+    }
+}
+
+
+// 速度の拘束を解く。摩擦と法線方向のインパルスを蓄積値でクランプしながらかける
+void Physics::solveVelocityConstraint(ContactManifold& m)
+{
+    const float invMassSum = m.invMassA + m.invMassB;
+    if (invMassSum <= 0.0f) return;
+    const float effectiveMass = 1.0f / invMassSum;
+
+    Vector3 dummy;
+    Vector3& va = m.bodyA >= 0 ? bodies.velocities[m.bodyA] : dummy;
+    Vector3& vb = m.bodyB >= 0 ? bodies.velocities[m.bodyB] : dummy;
+
+    for (int i = 0; i < m.numContacts; ++i)
+    {
+        Contact& c = m.contacts[i];
+
+        // 摩擦。法線方向の蓄積インパルスに比例した範囲に収める
+        const float maxFriction = m.friction * c.normalImpulse;
+        for (int k = 0; k < 2; ++k)
+        {
+            const Vector3 tangent = k == 0 ? m.tangent1 : m.tangent2;
+            float lambda = -(vb - va).Dot(tangent) * effectiveMass;
+            const float oldImpulse = c.tangentImpulse[k];
+            c.tangentImpulse[k] = std::clamp(oldImpulse + lambda, -maxFriction, maxFriction);
+            lambda = c.tangentImpulse[k] - oldImpulse;
+
+            const Vector3 impulse = tangent * lambda;
+            va -= impulse * m.invMassA;
+            vb += impulse * m.invMassB;
+        }
+
+        // 法線方向。引っ張る向きにはかけない
+        float lambda = -((vb - va).Dot(c.normal) - c.velocityBias) * effectiveMass;
+        const float oldImpulse = c.normalImpulse;
+        c.normalImpulse = std::max(oldImpulse + lambda, 0.0f);
+        lambda = c.normalImpulse - oldImpulse;
+
+        const Vector3 impulse = c.normal * lambda;
+        va -= impulse * m.invMassA;
+        vb += impulse * m.invMassB;
+    }
+}
+
+
+// 位置の拘束を解く。位置を進めた後のめり込みを見積もって少しずつ戻す
+void Physics::solvePositionConstraint(ContactManifold& m)
+{
+    const float invMassSum = m.invMassA + m.invMassB;
+    if (invMassSum <= 0.0f) return;
+
+    Vector3 dummy;
+    Vector3& pa = m.bodyA >= 0 ? bodies.positions[m.bodyA] : dummy;
+    Vector3& pb = m.bodyB >= 0 ? bodies.positions[m.bodyB] : dummy;
+    const Vector3 startA = m.bodyA >= 0 ? solverStartPositions[m.bodyA] : Vector3::Zero;
+    const Vector3 startB = m.bodyB >= 0 ? solverStartPositions[m.bodyB] : Vector3::Zero;
+
+    for (int i = 0; i < m.numContacts; ++i)
+    {
+        const Contact& c = m.contacts[i];
+
+        // 接触点を作ってからの移動でめり込みがどれだけ変わったか
+        const float separation = -c.penetration + ((pb - startB) - (pa - startA)).Dot(c.normal);
+        const float correction = std::clamp(baumgarte * (separation + linearSlop), -maxLinearCorrection, 0.0f);
+        const Vector3 impulse = c.normal * (-correction / invMassSum);
+        pa -= impulse * m.invMassA;
+        pb += impulse * m.invMassB;
+    }
+}
+
+
+// XPBD の接触の拘束を1回解く。分けたステップの初めからの動きで摩擦をかける
+// 法線方向の補正量 (λ) は normalImpulse に入れ、跳ね返りをかけるかの判断に使う
+void Physics::solveContactXPBD(ContactManifold& m, float substep)
+{
+    Vector3 dummy;
+    Vector3& pa = m.bodyA >= 0 ? bodies.positions[m.bodyA] : dummy;
+    Vector3& pb = m.bodyB >= 0 ? bodies.positions[m.bodyB] : dummy;
+    const Vector3 startA = m.bodyA >= 0 ? solverStartPositions[m.bodyA] : Vector3::Zero;
+    const Vector3 startB = m.bodyB >= 0 ? solverStartPositions[m.bodyB] : Vector3::Zero;
+    const Vector3 prevA = m.bodyA >= 0 ? substepStartPositions[m.bodyA] : Vector3::Zero;
+    const Vector3 prevB = m.bodyB >= 0 ? substepStartPositions[m.bodyB] : Vector3::Zero;
+
+    // 眠っている剛体は動かさない
+    const float wa = m.bodyA >= 0 && (bodies.flags[m.bodyA] & PhysicsBodyStore::Sleeping) == 0 ? m.invMassA : 0.0f;
+    const float wb = m.bodyB >= 0 && (bodies.flags[m.bodyB] & PhysicsBodyStore::Sleeping) == 0 ? m.invMassB : 0.0f;
+    const float alpha = contactCompliance / (substep * substep);
+    const float w = wa + wb;
+    if (w <= 0.0f) return;
+
+    for (int i = 0; i < m.numContacts; ++i)
+    {
+        Contact& c = m.contacts[i];
+        c.normalImpulse = 0.0f;
+
+        // 接触点を作ってからの移動でめり込みがどれだけ変わったか。許容するめり込みは残す
+        const float separation = -c.penetration + ((pb - startB) - (pa - startA)).Dot(c.normal) + linearSlop;
+        if (separation >= 0.0f) continue;
+
+        const float lambda = -separation / (w + alpha);
+        const Vector3 correction = c.normal * lambda;
+        pa -= correction * wa;
+        pb += correction * wb;
+        c.normalImpulse = lambda;
+
+        // 摩擦。分けたステップの間の接線方向のずれを、法線方向の補正量に比例した範囲で戻す
+        const Vector3 slide = (pb - prevB) - (pa - prevA);
+        Vector3 tangential = slide - c.normal * slide.Dot(c.normal);
+        const float length = tangential.Length();
+        if (length <= 0.0f) continue;
+
+        const float maxFriction = m.friction * lambda * w;
+        if (length > maxFriction) tangential *= maxFriction / length;
+        pa += tangential * (wa / w);
+        pb -= tangential * (wb / w);
+    }
+}
+
+
+// XPBD の跳ね返り。接触を解いた直後の近づく速さを、ステップの初めの速さから決めた跳ね返りの速さにする
+void Physics::solveContactVelocityXPBD(ContactManifold& m)
+{
+    Vector3 dummy;
+    Vector3& va = m.bodyA >= 0 ? bodies.velocities[m.bodyA] : dummy;
+    Vector3& vb = m.bodyB >= 0 ? bodies.velocities[m.bodyB] : dummy;
+    const float wa = m.bodyA >= 0 && (bodies.flags[m.bodyA] & PhysicsBodyStore::Sleeping) == 0 ? m.invMassA : 0.0f;
+    const float wb = m.bodyB >= 0 && (bodies.flags[m.bodyB] & PhysicsBodyStore::Sleeping) == 0 ? m.invMassB : 0.0f;
+    const float w = wa + wb;
+    if (w <= 0.0f) return;
+
+    for (int i = 0; i < m.numContacts; ++i)
+    {
+        Contact& c = m.contacts[i];
+        if (c.normalImpulse <= 0.0f || c.velocityBias <= 0.0f) continue;
+
+        const float dv = c.velocityBias - (vb - va).Dot(c.normal);
+        if (dv > 0.0f)
+        {
+            const Vector3 impulse = c.normal * (dv / w);
+            va -= impulse * wa;
+            vb += impulse * wb;
+        }
+
+        // 跳ね返りは1度だけ
+        c.velocityBias = 0.0f;
+    }
+}
+
+
+// 今回の接触を次のステップのウォームスタート用に残す
+void Physics::storeContactCache()
+{
+    contactCache.resize(manifolds.size());
+    for (size_t i = 0; i < manifolds.size(); ++i)
+    {
+        const ContactManifold& m = manifolds[i];
+        CachedManifold& cache = contactCache[i];
+        cache.key = m.key;
+        cache.numContacts = m.numContacts;
+        for (int j = 0; j < m.numContacts; ++j)
+        {
+            const Contact& c = m.contacts[j];
+            cache.contacts[j] = { c.feature, c.normalImpulse, { c.tangentImpulse[0], c.tangentImpulse[1] } };
+        }
+    }
+    std::sort(contactCache.begin(), contactCache.end(), [](const CachedManifold& l, const CachedManifold& r) {
+        return l.key < r.key;
+        });
+}
+
+
+// 接触点をつけて衝突を接触ペアの表に記録する
+void Physics::addCollisions(const ContactManifold& m)
+{
+    ContactPoint points[ContactPairTable::maxContacts];
+    const int count = std::min(m.numContacts, ContactPairTable::maxContacts);
+    for (int i = 0; i < count; ++i)
+    {
+        points[i] = { m.contacts[i].point, m.contacts[i].normal };
+    }
+    contactPairTable.touch(m.a->getId(), m.a->getCollider(), m.b->getId(), m.b->getCollider(), false, points, count);
+}
+
+
+// 動かないシェイプか（Rigidbody がないか、眠っている）
+bool Physics::isResting(const PhysicsShape& shape) const
+{
+    return shape.bodyIndex < 0 || (bodies.flags[shape.bodyIndex] & PhysicsBodyStore::Sleeping) != 0;
+}
+
+
+// 剛体を眠らせる
+void Physics::sleepBody(PhysicsBodyHandle handle)
+{
+    // 非同期のステップ中はステップの完了時に眠らせる
+    if (asyncStepRunning && !onSimulationThread)
+    {
+        pendingBodyWrites.push_back({ handle, pendingSleep });
+        return;
+    }
+    if (!bodies.isValid(handle)) return;
+
+    const uint32_t i = handle.index;
+    if ((bodies.flags[i] & PhysicsBodyStore::Sleeping) == 0)
+    {
+        bodies.flags[i] |= PhysicsBodyStore::Sleeping;
+        bodies.velocities[i] = Vector3::Zero;
+        bodies.islandIds[i] = i;
+        fellAsleepCount++;
+    }
+
+    // 止まっていた時間が足りないと、次のステップの updateSleep() で島ごと起こされてしまう
+    bodies.sleepTimes[i] = std::max(bodies.sleepTimes[i], timeToSleep);
+}
+
+
+// 剛体を同じ島で眠っている剛体ごと起こす
+void Physics::wakeUpBody(PhysicsBodyHandle handle)
+{
+    // 非同期のステップ中はステップの完了時に起こす
+    if (asyncStepRunning && !onSimulationThread)
+    {
+        pendingBodyWrites.push_back({ handle, pendingWakeUp });
+        return;
+    }
+    if (!bodies.isValid(handle)) return;
+
+    bodies.sleepTimes[handle.index] = 0.0f;
+    wakeUpIsland(handle.index);
+}
+
+
+// 指定した剛体と同じ島で眠っている剛体を起こす
+void Physics::wakeUpIsland(uint32_t index)
+{
+    if (index >= bodies.size() || (bodies.flags[index] & PhysicsBodyStore::Sleeping) == 0) return;
+
+    const uint32_t island = bodies.islandIds[index];
+    const uint32_t n = bodies.size();
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        if ((bodies.flags[i] & PhysicsBodyStore::Sleeping) != 0 && bodies.islandIds[i] == island)
+        {
+            bodies.flags[i] &= ~PhysicsBodyStore::Sleeping;
+            bodies.sleepTimes[i] = 0.0f;
+            wokeUpCount++;
+        }
+    }
+}
+
+
+// 範囲と重なるシェイプの剛体を起こす
+void Physics::wakeUpOverlapping(const Bounds& bounds)
+{
+    class WakeUpCallback : public BroadphaseQueryCallback
+    {
+    public:
+        Physics* physics;
+        virtual bool reportShape(int shapeIndex) override
+        {
+            const int body = physics->physicsShapes[shapeIndex].bodyIndex;
+            if (body >= 0) physics->wakeUpIsland(uint32_t(body));
+            return true;
+        }
+    };
+
+    WakeUpCallback callback;
+    callback.physics = this;
+    broadphase->query(bounds, callback);
+}
+
+
+// 島の代表を探す（経路を半分に縮めながらたどる）
+uint32_t Physics::findIsland(uint32_t index)
+{
+    while (islandParents[index] != index)
+    {
+        islandParents[index] = islandParents[islandParents[index]];
+        index = islandParents[index];
+    }
+    return index;
+}
+
+
+// 接触でつながった剛体を島にまとめ、島ごとに眠らせるか起こすかを決める
+void Physics::updateSleep(float step)
+{
+    const uint32_t n = bodies.size();
+    const uint32_t* flags = bodies.flags.data();
+    const float* inverseMasses = bodies.inverseMasses.data();
+    float* sleepTimes = bodies.sleepTimes.data();
+
+    // 力を受けて動く剛体だけが島を作る。静的な物体や kinematic は島をつながない
+    auto isDynamic = [&](int i) { return i >= 0 && (flags[i] & PhysicsBodyStore::Active) != 0 && inverseMasses[i] > 0.0f; };
+
+    // 止まっている時間を数える
+    const float thresholdSqr = sleepThreshold * sleepThreshold;
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        if (!isDynamic(int(i)) || !allowSleep)
+        {
+            sleepTimes[i] = 0.0f;
+        }
+        else if ((flags[i] & PhysicsBodyStore::Sleeping) == 0)
+        {
+            sleepTimes[i] = bodies.velocities[i].LengthSquared() > thresholdSqr ? 0.0f : sleepTimes[i] + step;
+        }
+    }
+
+    islandParents.resize(n);
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        islandParents[i] = i;
+    }
+    auto unite = [this](uint32_t a, uint32_t b) {
+        a = findIsland(a);
+        b = findIsland(b);
+        if (a != b) islandParents[std::max(a, b)] = std::min(a, b);
+    };
+
+    // 一緒に眠った剛体は、判定を省いていても同じ島にする
+    islandFirstBodies.assign(n, -1);
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        if ((flags[i] & PhysicsBodyStore::Sleeping) == 0) continue;
+
+        int& first = islandFirstBodies[bodies.islandIds[i]];
+        if (first < 0) first = int(i);
+        else unite(uint32_t(first), i);
+    }
+
+    // 衝突したペアをつなぐ。動いている kinematic に触れている剛体は眠らせない
+    for (const auto& pair : contactPairs)
+    {
+        const int a = pair.a->bodyIndex;
+        const int b = pair.b->bodyIndex;
+        if (isDynamic(a) && isDynamic(b))
+        {
+            unite(uint32_t(a), uint32_t(b));
+        }
+        else if (isDynamic(a) && b >= 0 && bodies.velocities[b].LengthSquared() > thresholdSqr)
+        {
+            sleepTimes[a] = 0.0f;
+        }
+        else if (isDynamic(b) && a >= 0 && bodies.velocities[a].LengthSquared() > thresholdSqr)
+        {
+            sleepTimes[b] = 0.0f;
+        }
+    }
+
+    // 島の中で一番短い停止時間
+    islandSleepTimes.assign(n, std::numeric_limits<float>::infinity());
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        if (!isDynamic(int(i))) continue;
+
+        float& t = islandSleepTimes[findIsland(i)];
+        t = std::min(t, sleepTimes[i]);
+    }
+
+    // 島の全員が十分止まっていれば眠らせ、そうでなければ起こす
+    SleepStats stats;
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        if (!isDynamic(int(i))) continue;
+
+        const uint32_t island = findIsland(i);
+        const bool sleeping = (bodies.flags[i] & PhysicsBodyStore::Sleeping) != 0;
+        if (islandSleepTimes[island] >= timeToSleep)
+        {
+            if (!sleeping)
+            {
+                bodies.flags[i] |= PhysicsBodyStore::Sleeping;
+                bodies.velocities[i] = Vector3::Zero;
+                fellAsleepCount++;
+            }
+            bodies.islandIds[i] = island;
+            stats.sleepingBodies++;
+        }
+        else
+        {
+            if (sleeping)
+            {
+                bodies.flags[i] &= ~PhysicsBodyStore::Sleeping;
+                sleepTimes[i] = 0.0f;
+                wokeUpCount++;
+            }
+            if (island == i) stats.islands++;
+            stats.awakeBodies++;
+        }
+    }
+
+    stats.fellAsleep = fellAsleepCount;
+    stats.wokeUp = wokeUpCount;
+    fellAsleepCount = 0;
+    wokeUpCount = 0;
+    sleepStats = stats;
+}
+
+
+// レイヤーの組み合わせの衝突を無視するか設定
+void Physics::IgnoreLayerCollision(int layer1, int layer2, bool ignore)
+{
+    completeStep();
+    assert(layer1 >= 0 && layer1 < layerCount && layer2 >= 0 && layer2 < layerCount);
+    if (ignore)
+    {
+        layerCollisionMasks[layer1] &= ~(1u << layer2);
+        layerCollisionMasks[layer2] &= ~(1u << layer1);
+    }
+    else
+    {
+        layerCollisionMasks[layer1] |= 1u << layer2;
+        layerCollisionMasks[layer2] |= 1u << layer1;
+    }
+}
+
+
+// レイヤーの組み合わせの衝突を無視しているか
+bool Physics::GetIgnoreLayerCollision(int layer1, int layer2) const
+{
+    assert(layer1 >= 0 && layer1 < layerCount && layer2 >= 0 && layer2 < layerCount);
+    return (layerCollisionMasks[layer1] & (1u << layer2)) == 0;
+}
+
+
+// レイキャスト
+bool Physics::Raycast(Vector3 origin, Vector3 direction, RaycastHit& hit, float maxDistance, uint32_t layerMask)
+{
+    prepareQueries();
+    return castShapes(origin, 0.0f, direction, maxDistance, layerMask, queriesHitTriggers, nullptr, hit);
+}
+
+
+// 球を動かして最初に当たるコライダーを探す
+bool Physics::SphereCast(Vector3 origin, float radius, Vector3 direction, RaycastHit& hit, float maxDistance, uint32_t layerMask)
+{
+    prepareQueries();
+    return castShapes(origin, radius, direction, maxDistance, layerMask, queriesHitTriggers, nullptr, hit);
+}
+
+
+// 球と重なっているコライダーを集める
+int Physics::OverlapSphere(Vector3 position, float radius, Collider** results, int maxResults, uint32_t layerMask)
+{
+    prepareQueries();
+    return overlapShapes(Bounds(position, Vector3(radius, radius, radius)), &position, radius, layerMask, results, maxResults);
+}
+
+
+// 箱と重なっているコライダーを集める
+int Physics::OverlapBox(Vector3 center, Vector3 halfExtents, Collider** results, int maxResults, uint32_t layerMask)
+{
+    prepareQueries();
+    return overlapShapes(Bounds(center, halfExtents), nullptr, 0.0f, layerMask, results, maxResults);
+}
+
+
+// レイキャストをまとめて並列に実行
+void Physics::RaycastBatch(const RaycastCommand* commands, RaycastHit* results, int count)
+{
+    prepareQueries();
+    const int chunkCount = (count + queryChunkSize - 1) / queryChunkSize;
+    threadPool->parallelFor(chunkCount, [this, commands, results, count](int chunk) {
+        const int end = std::min(count, (chunk + 1) * queryChunkSize);
+        for (int i = chunk * queryChunkSize; i < end; ++i)
+        {
+            results[i] = RaycastHit();
+            castShapes(commands[i].from, 0.0f, commands[i].direction, commands[i].distance, commands[i].layerMask, queriesHitTriggers, nullptr, results[i]);
+        }
+    });
+}
+
+
+// スフィアキャストをまとめて並列に実行
+void Physics::SphereCastBatch(const SpherecastCommand* commands, RaycastHit* results, int count)
+{
+    prepareQueries();
+    const int chunkCount = (count + queryChunkSize - 1) / queryChunkSize;
+    threadPool->parallelFor(chunkCount, [this, commands, results, count](int chunk) {
+        const int end = std::min(count, (chunk + 1) * queryChunkSize);
+        for (int i = chunk * queryChunkSize; i < end; ++i)
+        {
+            results[i] = RaycastHit();
+            castShapes(commands[i].origin, commands[i].radius, commands[i].direction, commands[i].distance, commands[i].layerMask, queriesHitTriggers, nullptr, results[i]);
+        }
+    });
+}
+
+
+// 球との重なりをまとめて並列に調べる
+void Physics::OverlapSphereBatch(const OverlapSphereCommand* commands, Collider** results, int* counts, int count, int maxHits)
+{
+    prepareQueries();
+    const int chunkCount = (count + queryChunkSize - 1) / queryChunkSize;
+    threadPool->parallelFor(chunkCount, [this, commands, results, counts, count, maxHits](int chunk) {
+        const int end = std::min(count, (chunk + 1) * queryChunkSize);
+        for (int i = chunk * queryChunkSize; i < end; ++i)
+        {
+            const float r = commands[i].radius;
+            const Bounds bounds(commands[i].point, Vector3(r, r, r));
+            counts[i] = overlapShapes(bounds, &commands[i].point, r, commands[i].layerMask, results + size_t(i) * maxHits, maxHits);
+        }
+    });
+}
+
+
+// 実行中のステップを完了させ、形状とブロードフェーズを最後のステップの状態にしておく
+// 形状はステップが求めたものを使い、ここでは markShapeMoved() で動かしたと知らされたものだけを求め直す
+// クエリの本体は複数のスレッドから読むだけにする
+void Physics::prepareQueries()
+{
+    completeStep();
+    refreshDirtyShapes();
+}
+
+
+// 線分、または半径 radius の球を動かした範囲で最初に当たるコライダーを探す
+// ignoreBody に属するコライダーは対象にしない
+bool Physics::castShapes(Vector3 origin, float radius, Vector3 direction, float maxDistance, uint32_t layerMask, bool hitTriggers, const Rigidbody* ignoreBody, RaycastHit& hit) const
+{
+    class CastCallback : public BroadphaseRaycastCallback
+    {
+    public:
+        const Physics* physics;
+        Vector3 origin;
+        Vector3 direction;
+        float radius;
+        uint32_t layerMask;
+        bool hitTriggers;
+        const Rigidbody* ignoreBody;
+        RaycastHit* hit;
+        virtual float reportShape(int shapeIndex, float maxDistance) override
+        {
+            const PhysicsShape& shape = physics->physicsShapes[shapeIndex];
+            if (!shape.isValid()) return maxDistance;
+
+            const Collider* collider = shape.getCollider();
+            if (collider->isTrigger && !hitTriggers) return maxDistance;
+            if ((layerMask & shape.filter.layerBit) == 0) return maxDistance;
+            if (ignoreBody != nullptr && collider->attachedRigidbody == ignoreBody) return maxDistance;
+
+            // より近いものが見つかれば、以降はその距離までを調べる
+            RaycastHit h;
+            const bool found = radius > 0.0f
+                ? collider->sphereCast(origin, radius, direction, maxDistance, h)
+                : collider->raycast(origin, direction, maxDistance, h);
+            if (found && (hit->collider == nullptr || h.distance < hit->distance))
+            {
+                *hit = h;
+                return h.distance;
+            }
+            return maxDistance;
+        }
+    };
+
+    const float length = direction.Length();
+    if (length <= 0.0f || maxDistance < 0.0f) return false;
+
+    CastCallback callback;
+    callback.physics = this;
+    callback.origin = origin;
+    callback.direction = direction / length;
+    callback.radius = radius;
+    callback.layerMask = layerMask;
+    callback.hitTriggers = hitTriggers;
+    callback.ignoreBody = ignoreBody;
+    callback.hit = &hit;
+    hit.collider = nullptr;
+    staticTree.raycast(origin, callback.direction, maxDistance, [&](int shapeIndex, float distance) { return callback.reportShape(shapeIndex, distance); }, radius);
+    broadphase->raycast(origin, callback.direction, hit.collider != nullptr ? hit.distance : maxDistance, callback, radius);
+    return hit.collider != nullptr;
+}
+
+
+// bounds と重なるコライダーを集める。sphereCenter を渡すと球との重なりで判定する
+int Physics::overlapShapes(const Bounds& bounds, const Vector3* sphereCenter, float sphereRadius, uint32_t layerMask, Collider** results, int maxResults) const
+{
+    class OverlapCallback : public BroadphaseQueryCallback
+    {
+    public:
+        const Physics* physics;
+        const Bounds* bounds;
+        const Vector3* sphereCenter;
+        float sphereRadius;
+        uint32_t layerMask;
+        Collider** results;
+        int maxResults;
+        int count;
+        virtual bool reportShape(int shapeIndex) override
+        {
+            const PhysicsShape& shape = physics->physicsShapes[shapeIndex];
+            if (!shape.isValid()) return true;
+
+            Collider* collider = shape.getCollider();
+            if (collider->isTrigger && !physics->queriesHitTriggers) return true;
+            if ((layerMask & shape.filter.layerBit) == 0) return true;
+
+            const bool overlap = sphereCenter != nullptr
+                ? collider->overlapSphere(*sphereCenter, sphereRadius)
+                : collider->overlapBox(*bounds);
+            if (overlap)
+            {
+                results[count++] = collider;
+            }
+            return count < maxResults;
+        }
+    };
+
+    if (maxResults <= 0) return 0;
+
+    OverlapCallback callback;
+    callback.physics = this;
+    callback.bounds = &bounds;
+    callback.sphereCenter = sphereCenter;
+    callback.sphereRadius = sphereRadius;
+    callback.layerMask = layerMask;
+    callback.results = results;
+    callback.maxResults = maxResults;
+    callback.count = 0;
+    staticTree.query(bounds, [&](int shapeIndex) { return callback.reportShape(shapeIndex); });
+    if (callback.count < maxResults)
+    {
+        broadphase->query(bounds, callback);
+    }
+    return callback.count;
 }
 
 
@@ -0,0 +1,221 @@
+﻿#include "pch.h"
+#include <UniDx/PhysicsBodyStore.h>
+
+#include <cmath>
+
+#include <UniDx/PhysicsSnapshot.h>
+
+
+namespace
+{
+
+using namespace UniDx;
+
+// 配列を読み出す。all でなければ matches が立っているスロットだけ書き込む
+template<typename T>
+void readArray(PhysicsSnapshotReader& reader, std::vector<T>& values, uint32_t count, const std::vector<uint8_t>& matches, bool all)
+{
+    if (all)
+    {
+        reader.read(values.data(), count);
+        return;
+    }
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (matches[i]) reader.read(&values[i], 1);
+        else reader.skip<T>(1);
+    }
+}
+
+}
+
+
+namespace UniDx
+{
+
+// スロットを確保して状態を書き込む
+PhysicsBodyHandle PhysicsBodyStore::create(Rigidbody* owner, const PhysicsBodyState& state)
+{
+    uint32_t index;
+    if (!freeSlots.empty())
+    {
+        // 解放済みのスロットを再利用
+        index = freeSlots.back();
+        freeSlots.pop_back();
+    }
+    else
+    {
+        index = size();
+        positions.emplace_back();
+        rotations.emplace_back();
+        velocities.emplace_back();
+        moves.emplace_back();
+        gravityScales.emplace_back();
+        masses.emplace_back();
+        inverseMasses.emplace_back();
+        flags.emplace_back();
+        owners.emplace_back();
+        sleepTimes.emplace_back();
+        islandIds.emplace_back();
+        previousPositions.emplace_back();
+        previousRotations.emplace_back();
+        generations.emplace_back(0);
+    }
+
+    owners[index] = owner;
+    sleepTimes[index] = 0.0f;
+    islandIds[index] = index;
+    setState(index, state);
+    previousPositions[index] = state.position;
+    previousRotations[index] = state.rotation;
+    return PhysicsBodyHandle{ index, generations[index] };
+}
+
+
+// スロットを解放
+void PhysicsBodyStore::destroy(PhysicsBodyHandle handle)
+{
+    assert(isValid(handle));
+    const uint32_t i = handle.index;
+
+    // ループで処理されても影響がない値にしておく
+    positions[i] = Vector3::Zero;
+    velocities[i] = Vector3::Zero;
+    moves[i] = Vector3::Zero;
+    gravityScales[i] = 0.0f;
+    inverseMasses[i] = 0.0f;
+    flags[i] = 0;
+    owners[i] = nullptr;
+    sleepTimes[i] = 0.0f;
+
+    // 古いハンドルを無効にする
+    generations[i]++;
+    freeSlots.push_back(i);
+}
+
+
+// 状態を読み出す
+PhysicsBodyState PhysicsBodyStore::getState(uint32_t index) const
+{
+    PhysicsBodyState s;
+    s.position = positions[index];
+    s.rotation = rotations[index];
+    s.velocity = velocities[index];
+    s.move = moves[index];
+    s.gravityScale = gravityScales[index];
+    s.mass = masses[index];
+    s.flags = flags[index] & ~(Active | Sleeping);   // 取り出した状態は起きているものとする
+    return s;
+}
+
+
+// 状態を書き込む
+void PhysicsBodyStore::setState(uint32_t index, const PhysicsBodyState& state)
+{
+    positions[index] = state.position;
+    rotations[index] = state.rotation;
+    velocities[index] = state.velocity;
+    moves[index] = state.move;
+    gravityScales[index] = state.gravityScale;
+    flags[index] = state.flags | Active;
+    setMass(index, state.mass, (state.flags & Kinematic) != 0);
+}
+
+
+// 質量と isKinematic から逆質量を設定
+void PhysicsBodyStore::setMass(uint32_t index, float mass, bool kinematic)
+{
+    masses[index] = mass;
+    inverseMasses[index] = inverseMass(mass, kinematic);
+    if (kinematic) flags[index] |= Kinematic;
+    else flags[index] &= ~Kinematic;
+}
+
+
+// 指定した種類の値だけを写す
+void PhysicsBodyStore::copyFields(const PhysicsBodyStore& from, uint32_t index, uint32_t fields)
+{
+    // フラグは種類ごとに決まったビットだけを写す
+    auto copyFlags = [&](uint32_t bits) { flags[index] = (flags[index] & ~bits) | (from.flags[index] & bits); };
+
+    if (fields & FieldPosition) positions[index] = from.positions[index];
+    if (fields & FieldRotation)
+    {
+        rotations[index] = from.rotations[index];
+        copyFlags(HasMoveRot);
+    }
+    if (fields & FieldVelocity) velocities[index] = from.velocities[index];
+    if (fields & FieldMove)
+    {
+        moves[index] = from.moves[index];
+        copyFlags(HasMovePos);
+    }
+    if (fields & FieldGravityScale) gravityScales[index] = from.gravityScales[index];
+    if (fields & FieldMass)
+    {
+        masses[index] = from.masses[index];
+        inverseMasses[index] = from.inverseMasses[index];
+        copyFlags(Kinematic);
+    }
+    if (fields & FieldFlags) copyFlags(Continuous | Interpolate | Extrapolate);
+}
+
+
+// 質量から逆質量を求める
+float PhysicsBodyStore::inverseMass(float mass, bool kinematic)
+{
+    if (kinematic || std::isinf(mass)) return 0.0f;
+    return mass > 0.0f ? 1.0f / mass : 1.0f;
+}
+
+
+// スナップショットに保存
+void PhysicsBodyStore::save(PhysicsSnapshot& snapshot) const
+{
+    const uint32_t n = size();
+    snapshot.write(n);
+    snapshot.write(generations.data(), n);
+    snapshot.write(flags.data(), n);
+    snapshot.write(positions.data(), n);
+    snapshot.write(rotations.data(), n);
+    snapshot.write(velocities.data(), n);
+    snapshot.write(moves.data(), n);
+    snapshot.write(gravityScales.data(), n);
+    snapshot.write(masses.data(), n);
+    snapshot.write(inverseMasses.data(), n);
+    snapshot.write(sleepTimes.data(), n);
+    snapshot.write(islandIds.data(), n);
+}
+
+
+// スナップショットから復元
+void PhysicsBodyStore::restore(PhysicsSnapshotReader& reader)
+{
+    const uint32_t n = reader.read<uint32_t>();
+    std::vector<uint32_t> savedGenerations(n);
+    std::vector<uint32_t> savedFlags(n);
+    reader.read(savedGenerations.data(), n);
+    reader.read(savedFlags.data(), n);
+
+    // 保存したあとに解放や再利用をされていないスロットだけ戻す
+    std::vector<uint8_t> matches(n);
+    bool all = n == size();
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        matches[i] = i < size() && generations[i] == savedGenerations[i] && (flags[i] & Active) != 0 && (savedFlags[i] & Active) != 0;
+        all = all && (matches[i] || ((flags[i] & Active) == 0 && (savedFlags[i] & Active) == 0));
+        if (matches[i]) flags[i] = savedFlags[i];
+    }
+
+    readArray(reader, positions, n, matches, all);
+    readArray(reader, rotations, n, matches, all);
+    readArray(reader, velocities, n, matches, all);
+    readArray(reader, moves, n, matches, all);
+    readArray(reader, gravityScales, n, matches, all);
+    readArray(reader, masses, n, matches, all);
+    readArray(reader, inverseMasses, n, matches, all);
+    readArray(reader, sleepTimes, n, matches, all);
+    readArray(reader, islandIds, n, matches, all);
+}
+
+} // namespace UniDx
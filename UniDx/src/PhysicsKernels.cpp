@@ -0,0 +1,384 @@
+﻿#include "pch.h"
+#include <UniDx/PhysicsKernels.h>
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <immintrin.h>
+#define UNIDX_KERNEL_SIMD
+#endif
+
+
+namespace
+{
+
+using namespace UniDx;
+using namespace std;
+
+#if defined(UNIDX_KERNEL_SIMD)
+#if defined(__AVX__)
+
+// AVX で8ペアずつ
+struct Lanes
+{
+    static constexpr int width = 8;
+    using F = __m256;
+
+    static F load(const float* p) { return _mm256_loadu_ps(p); }
+    static void store(float* p, F a) { _mm256_storeu_ps(p, a); }
+    static F set(float v) { return _mm256_set1_ps(v); }
+    static F add(F a, F b) { return _mm256_add_ps(a, b); }
+    static F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+    static F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+    static F div(F a, F b) { return _mm256_div_ps(a, b); }
+    static F sqrt(F a) { return _mm256_sqrt_ps(a); }
+    static F min(F a, F b) { return _mm256_min_ps(a, b); }
+    static F max(F a, F b) { return _mm256_max_ps(a, b); }
+    static F lessEqual(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+    static F greater(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static F select(F mask, F a, F b) { return _mm256_blendv_ps(b, a, mask); }
+    static int mask(F a) { return _mm256_movemask_ps(a); }
+};
+
+#else
+
+// SSE で4ペアずつ
+struct Lanes
+{
+    static constexpr int width = 4;
+    using F = __m128;
+
+    static F load(const float* p) { return _mm_loadu_ps(p); }
+    static void store(float* p, F a) { _mm_storeu_ps(p, a); }
+    static F set(float v) { return _mm_set1_ps(v); }
+    static F add(F a, F b) { return _mm_add_ps(a, b); }
+    static F sub(F a, F b) { return _mm_sub_ps(a, b); }
+    static F mul(F a, F b) { return _mm_mul_ps(a, b); }
+    static F div(F a, F b) { return _mm_div_ps(a, b); }
+    static F sqrt(F a) { return _mm_sqrt_ps(a); }
+    static F min(F a, F b) { return _mm_min_ps(a, b); }
+    static F max(F a, F b) { return _mm_max_ps(a, b); }
+    static F lessEqual(F a, F b) { return _mm_cmple_ps(a, b); }
+    static F greater(F a, F b) { return _mm_cmpgt_ps(a, b); }
+    static F select(F mask, F a, F b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+    static int mask(F a) { return _mm_movemask_ps(a); }
+};
+
+#endif
+#endif
+
+
+// 球と球を1ペア判定
+void sphereSphereLane(const SpherePairBatch& b, int i, vector<KernelContact>& out)
+{
+    const float dx = b.bx[i] - b.ax[i];
+    const float dy = b.by[i] - b.ay[i];
+    const float dz = b.bz[i] - b.az[i];
+    const float distSqr = dx * dx + dy * dy + dz * dz;
+    const float radiusAB = b.ar[i] + b.br[i];
+    if (distSqr > radiusAB * radiusAB) return;
+
+    // 中心が重なっているときは上向きで押し出す
+    const float dist = std::sqrt(distSqr);
+    Vector3 normal(0, 1, 0);
+    if (dist > 1e-6f)
+    {
+        const float inv = 1.0f / dist;
+        normal = Vector3(dx * inv, dy * inv, dz * inv);
+    }
+
+    KernelContact c;
+    c.pair = b.pairs[i];
+    c.normal = normal;
+    c.penetration = radiusAB - dist;
+    const float k = b.ar[i] - c.penetration * 0.5f;
+    c.point = Vector3(b.ax[i] + normal.x * k, b.ay[i] + normal.y * k, b.az[i] + normal.z * k);
+    out.push_back(c);
+}
+
+
+// 球と AABB を1ペア判定
+void sphereAABBLane(const SphereAABBBatch& b, int i, vector<KernelContact>& out)
+{
+    const float center[3] = { b.sx[i], b.sy[i], b.sz[i] };
+    const float mn[3] = { b.minX[i], b.minY[i], b.minZ[i] };
+    const float mx[3] = { b.maxX[i], b.maxY[i], b.maxZ[i] };
+    const float radius = b.sr[i];
+
+    float closest[3];
+    float d[3];
+    for (int k = 0; k < 3; ++k)
+    {
+        closest[k] = std::min(std::max(center[k], mn[k]), mx[k]);
+        d[k] = closest[k] - center[k];
+    }
+    const float distSqr = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+    if (distSqr > radius * radius) return;
+
+    KernelContact c;
+    c.pair = b.pairs[i];
+    if (distSqr > 1e-12f)
+    {
+        const float dist = std::sqrt(distSqr);
+        const float inv = 1.0f / dist;
+        c.normal = Vector3(d[0] * inv, d[1] * inv, d[2] * inv);
+        c.penetration = radius - dist;
+        c.point = Vector3(closest[0], closest[1], closest[2]);
+    }
+    else
+    {
+        // 中心が AABB の内側にあるときは、一番近い面から押し出す
+        int axis = 0;
+        bool minSide = true;
+        float depth = center[0] - mn[0];
+        for (int k = 0; k < 3; ++k)
+        {
+            if (center[k] - mn[k] < depth) { depth = center[k] - mn[k]; axis = k; minSide = true; }
+            if (mx[k] - center[k] < depth) { depth = mx[k] - center[k]; axis = k; minSide = false; }
+        }
+
+        Vector3 normal = Vector3::Zero;
+        (&normal.x)[axis] = minSide ? 1.0f : -1.0f;
+        c.normal = normal;
+        c.penetration = radius + depth;
+        c.point = Vector3(center[0], center[1], center[2]) - normal * depth;
+    }
+    out.push_back(c);
+}
+
+}
+
+
+namespace UniDx
+{
+
+// --------------------
+// SpherePairBatch
+// --------------------
+
+// 空にする。確保した領域は残す
+void SpherePairBatch::clear()
+{
+    ax.clear(); ay.clear(); az.clear(); ar.clear();
+    bx.clear(); by.clear(); bz.clear(); br.clear();
+    pairs.clear();
+}
+
+
+// ペアを追加
+void SpherePairBatch::add(int pair, Vector3 centerA, float radiusA, Vector3 centerB, float radiusB)
+{
+    ax.push_back(centerA.x); ay.push_back(centerA.y); az.push_back(centerA.z); ar.push_back(radiusA);
+    bx.push_back(centerB.x); by.push_back(centerB.y); bz.push_back(centerB.z); br.push_back(radiusB);
+    pairs.push_back(pair);
+}
+
+
+// --------------------
+// SphereAABBBatch
+// --------------------
+
+// 空にする。確保した領域は残す
+void SphereAABBBatch::clear()
+{
+    sx.clear(); sy.clear(); sz.clear(); sr.clear();
+    minX.clear(); minY.clear(); minZ.clear();
+    maxX.clear(); maxY.clear(); maxZ.clear();
+    pairs.clear();
+}
+
+
+// ペアを追加
+void SphereAABBBatch::add(int pair, Vector3 center, float radius, Vector3 boxMin, Vector3 boxMax)
+{
+    sx.push_back(center.x); sy.push_back(center.y); sz.push_back(center.z); sr.push_back(radius);
+    minX.push_back(boxMin.x); minY.push_back(boxMin.y); minZ.push_back(boxMin.z);
+    maxX.push_back(boxMax.x); maxY.push_back(boxMax.y); maxZ.push_back(boxMax.z);
+    pairs.push_back(pair);
+}
+
+
+// --------------------
+// PhysicsKernels
+// --------------------
+
+// 球と球をまとめて判定
+void PhysicsKernels::sphereSphere(const SpherePairBatch& b, std::vector<KernelContact>& out)
+{
+    const int n = b.size();
+    int i = 0;
+#if defined(UNIDX_KERNEL_SIMD)
+    using L = Lanes;
+    const L::F zero = L::set(0.0f);
+    const L::F one = L::set(1.0f);
+    const L::F half = L::set(0.5f);
+    const L::F epsilon = L::set(1e-6f);
+    alignas(32) float nx[L::width], ny[L::width], nz[L::width], pen[L::width];
+    alignas(32) float px[L::width], py[L::width], pz[L::width];
+
+    for (; i + L::width <= n; i += L::width)
+    {
+        const L::F ax = L::load(&b.ax[i]), ay = L::load(&b.ay[i]), az = L::load(&b.az[i]), ar = L::load(&b.ar[i]);
+        const L::F dx = L::sub(L::load(&b.bx[i]), ax);
+        const L::F dy = L::sub(L::load(&b.by[i]), ay);
+        const L::F dz = L::sub(L::load(&b.bz[i]), az);
+        const L::F distSqr = L::add(L::add(L::mul(dx, dx), L::mul(dy, dy)), L::mul(dz, dz));
+        const L::F radiusAB = L::add(ar, L::load(&b.br[i]));
+
+        int hits = L::mask(L::lessEqual(distSqr, L::mul(radiusAB, radiusAB)));
+        if (hits == 0) continue;
+
+        // 中心が重なっているレーンは上向き
+        const L::F dist = L::sqrt(distSqr);
+        const L::F valid = L::greater(dist, epsilon);
+        const L::F inv = L::div(one, dist);
+        const L::F normalX = L::select(valid, L::mul(dx, inv), zero);
+        const L::F normalY = L::select(valid, L::mul(dy, inv), one);
+        const L::F normalZ = L::select(valid, L::mul(dz, inv), zero);
+        const L::F penetration = L::sub(radiusAB, dist);
+        const L::F k = L::sub(ar, L::mul(penetration, half));
+
+        L::store(nx, normalX);
+        L::store(ny, normalY);
+        L::store(nz, normalZ);
+        L::store(pen, penetration);
+        L::store(px, L::add(ax, L::mul(normalX, k)));
+        L::store(py, L::add(ay, L::mul(normalY, k)));
+        L::store(pz, L::add(az, L::mul(normalZ, k)));
+
+        // 当たったレーンだけ詰めて書き出す
+        for (int lane = 0; hits != 0; ++lane, hits >>= 1)
+        {
+            if ((hits & 1) == 0) continue;
+            out.push_back({ b.pairs[i + lane], Vector3(px[lane], py[lane], pz[lane]), Vector3(nx[lane], ny[lane], nz[lane]), pen[lane] });
+        }
+    }
+#endif
+
+    // 端数
+    sphereSphereRange(b, i, n, out);
+}
+
+
+// 球と球を1ペアずつ判定
+void PhysicsKernels::sphereSphereScalar(const SpherePairBatch& b, std::vector<KernelContact>& out)
+{
+    sphereSphereRange(b, 0, b.size(), out);
+}
+
+
+// 球と AABB をまとめて判定
+void PhysicsKernels::sphereAABB(const SphereAABBBatch& b, std::vector<KernelContact>& out)
+{
+    const int n = b.size();
+    int i = 0;
+#if defined(UNIDX_KERNEL_SIMD)
+    using L = Lanes;
+    const L::F one = L::set(1.0f);
+    const L::F epsilon = L::set(1e-12f);
+    alignas(32) float nx[L::width], ny[L::width], nz[L::width], pen[L::width];
+    alignas(32) float px[L::width], py[L::width], pz[L::width];
+
+    for (; i + L::width <= n; i += L::width)
+    {
+        const L::F sx = L::load(&b.sx[i]), sy = L::load(&b.sy[i]), sz = L::load(&b.sz[i]), sr = L::load(&b.sr[i]);
+        const L::F cx = L::min(L::max(sx, L::load(&b.minX[i])), L::load(&b.maxX[i]));
+        const L::F cy = L::min(L::max(sy, L::load(&b.minY[i])), L::load(&b.maxY[i]));
+        const L::F cz = L::min(L::max(sz, L::load(&b.minZ[i])), L::load(&b.maxZ[i]));
+        const L::F dx = L::sub(cx, sx);
+        const L::F dy = L::sub(cy, sy);
+        const L::F dz = L::sub(cz, sz);
+        const L::F distSqr = L::add(L::add(L::mul(dx, dx), L::mul(dy, dy)), L::mul(dz, dz));
+
+        int hits = L::mask(L::lessEqual(distSqr, L::mul(sr, sr)));
+        if (hits == 0) continue;
+
+        // 中心が AABB の内側にあるレーンはまれなので1つずつ処理する
+        const int outside = L::mask(L::greater(distSqr, epsilon));
+        const L::F dist = L::sqrt(distSqr);
+        const L::F inv = L::div(one, dist);
+
+        L::store(nx, L::mul(dx, inv));
+        L::store(ny, L::mul(dy, inv));
+        L::store(nz, L::mul(dz, inv));
+        L::store(pen, L::sub(sr, dist));
+        L::store(px, cx);
+        L::store(py, cy);
+        L::store(pz, cz);
+
+        for (int lane = 0; hits != 0; ++lane, hits >>= 1)
+        {
+            if ((hits & 1) == 0) continue;
+            if (outside & (1 << lane))
+            {
+                out.push_back({ b.pairs[i + lane], Vector3(px[lane], py[lane], pz[lane]), Vector3(nx[lane], ny[lane], nz[lane]), pen[lane] });
+            }
+            else
+            {
+                sphereAABBLane(b, i + lane, out);
+            }
+        }
+    }
+#endif
+
+    // 端数
+    sphereAABBRange(b, i, n, out);
+}
+
+
+// 球と AABB を1ペアずつ判定
+void PhysicsKernels::sphereAABBScalar(const SphereAABBBatch& b, std::vector<KernelContact>& out)
+{
+    sphereAABBRange(b, 0, b.size(), out);
+}
+
+
+// 範囲を1ペアずつ判定
+void PhysicsKernels::sphereSphereRange(const SpherePairBatch& b, int begin, int end, std::vector<KernelContact>& out)
+{
+    for (int i = begin; i < end; ++i)
+    {
+        sphereSphereLane(b, i, out);
+    }
+}
+
+
+// 範囲を1ペアずつ判定
+void PhysicsKernels::sphereAABBRange(const SphereAABBBatch& b, int begin, int end, std::vector<KernelContact>& out)
+{
+    for (int i = begin; i < end; ++i)
+    {
+        sphereAABBLane(b, i, out);
+    }
+}
+
+
+// SIMD 版と Scalar 版の結果が許容誤差内で一致するか
+bool PhysicsKernels::sameContacts(const std::vector<KernelContact>& a, const std::vector<KernelContact>& b, float tolerance)
+{
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        if (a[i].pair != b[i].pair) return false;
+        if (Vector3::DistanceSquared(a[i].point, b[i].point) > tolerance * tolerance) return false;
+        if (Vector3::DistanceSquared(a[i].normal, b[i].normal) > tolerance * tolerance) return false;
+        if (std::abs(a[i].penetration - b[i].penetration) > tolerance) return false;
+    }
+    return true;
+}
+
+
+// ビルドで使われる命令セットの名前
+const char* PhysicsKernels::getInstructionSet()
+{
+#if defined(UNIDX_KERNEL_SIMD) && defined(__AVX__)
+    return "AVX";
+#elif defined(UNIDX_KERNEL_SIMD)
+    return "SSE";
+#else
+    return "Scalar";
+#endif
+}
+
+} // namespace UniDx
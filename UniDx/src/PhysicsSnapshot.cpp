@@ -0,0 +1,71 @@
+﻿#include "pch.h"
+#include <UniDx/PhysicsSnapshot.h>
+
+#include <algorithm>
+
+
+namespace UniDx
+{
+
+// 保持する数を変える
+void PhysicsSnapshotRing::setCapacity(int capacity)
+{
+    snapshots.resize(std::max(0, capacity));
+    clear();
+}
+
+
+// 新しいスナップショットの領域を用意する
+PhysicsSnapshot& PhysicsSnapshotRing::push(uint64_t step)
+{
+    assert(!snapshots.empty());
+
+    PhysicsSnapshot& snapshot = snapshots[head];
+    snapshot.begin(step);
+    head = (head + 1) % int(snapshots.size());
+    count_ = std::min(count_ + 1, int(snapshots.size()));
+    return snapshot;
+}
+
+
+// 指定したステップのスナップショットを新しい方から探す
+const PhysicsSnapshot* PhysicsSnapshotRing::find(uint64_t step) const
+{
+    const int capacity = int(snapshots.size());
+    for (int i = 1; i <= count_; ++i)
+    {
+        const PhysicsSnapshot& snapshot = snapshots[(head - i + capacity) % capacity];
+        if (snapshot.getStep() == step) return &snapshot;
+    }
+    return nullptr;
+}
+
+
+// 指定したステップより後のスナップショットを捨てる
+void PhysicsSnapshotRing::discardAfter(uint64_t step)
+{
+    const int capacity = int(snapshots.size());
+    while (count_ > 0)
+    {
+        const int last = (head - 1 + capacity) % capacity;
+        if (snapshots[last].getStep() <= step) break;
+
+        snapshots[last].clear();
+        head = last;
+        count_--;
+    }
+}
+
+
+// 全て捨てる
+void PhysicsSnapshotRing::clear()
+{
+    for (auto& snapshot : snapshots)
+    {
+        snapshot.clear();
+    }
+    head = 0;
+    count_ = 0;
+}
+
+} // namespace UniDx
@@ -0,0 +1,69 @@
+﻿#include "pch.h"
+#include <UniDx/StaticAABBTree.h>
+
+#include <algorithm>
+
+
+namespace UniDx
+{
+
+using namespace std;
+
+// items から作る
+void StaticAABBTree::build(vector<Item>& items)
+{
+    nodes.clear();
+    if (items.empty()) return;
+
+    nodes.reserve(items.size() * 2 - 1);
+    buildNode(items, 0, int(items.size()));
+}
+
+
+// ノードを作って、子を再帰的に作る。戻り値はノードのインデクス
+int StaticAABBTree::buildNode(vector<Item>& items, int begin, int end)
+{
+    const int index = int(nodes.size());
+    nodes.push_back(Node());
+
+    if (end - begin == 1)
+    {
+        nodes[index].bounds = items[begin].bounds;
+        nodes[index].right = nullNode;
+        nodes[index].userData = items[begin].userData;
+        return index;
+    }
+
+    Vector3 mn = items[begin].bounds.min();
+    Vector3 mx = items[begin].bounds.max();
+    Vector3 cmn = items[begin].bounds.Center;
+    Vector3 cmx = cmn;
+    for (int i = begin + 1; i < end; ++i)
+    {
+        const Bounds& b = items[i].bounds;
+        mn = Vector3::Min(mn, b.min());
+        mx = Vector3::Max(mx, b.max());
+        cmn = Vector3::Min(cmn, b.Center);
+        cmx = Vector3::Max(cmx, b.Center);
+    }
+    nodes[index].bounds.SetMinMax(mn, mx);
+    nodes[index].userData = -1;
+
+    // 中心の広がりが一番大きい軸の中央値で分ける。同じ値は userData の順にして、作るたびに同じ木にする
+    const Vector3 extent = cmx - cmn;
+    const int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+    const int mid = begin + (end - begin) / 2;
+    std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end, [axis](const Item& l, const Item& r) {
+        const float lc = (&l.bounds.Center.x)[axis];
+        const float rc = (&r.bounds.Center.x)[axis];
+        return lc < rc || (lc == rc && l.userData < r.userData);
+        });
+
+    // 左の子はすぐ後ろに並ぶ
+    buildNode(items, begin, mid);
+    const int right = buildNode(items, mid, end);
+    nodes[index].right = right;
+    return index;
+}
+
+} // namespace UniDx
@@ -0,0 +1,184 @@
+﻿#include "pch.h"
+#include <UniDx/ThreadPool.h>
+
+
+namespace UniDx
+{
+
+using namespace std;
+
+// コンストラクタ。呼び出し元の分を除いたワーカーを起動する
+ThreadPool::ThreadPool(int threadCount)
+{
+    for (int i = 1; i < threadCount; ++i)
+    {
+        workers.emplace_back([this]() { workerMain(); });
+    }
+}
+
+
+// デストラクタ。ワーカーを終了させて待つ
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        quit = true;
+    }
+    startCondition.notify_all();
+    for (auto& t : workers)
+    {
+        t.join();
+    }
+}
+
+
+// ジョブを取り出せるだけ実行
+void ThreadPool::runJobs()
+{
+    while (true)
+    {
+        int index = nextIndex.fetch_add(1);
+        if (index >= jobCount) break;
+        (*job)(index);
+    }
+}
+
+
+// ワーカースレッドの本体
+void ThreadPool::workerMain()
+{
+    uint64_t seen = 0;
+    while (true)
+    {
+        {
+            unique_lock<mutex> lock(mutex_);
+            startCondition.wait(lock, [&]() { return quit || generation != seen; });
+            if (quit) return;
+            seen = generation;
+        }
+
+        runJobs();
+
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (--runningWorkers == 0)
+            {
+                doneCondition.notify_one();
+            }
+        }
+    }
+}
+
+
+// func(0) 〜 func(count - 1) を並列に実行する
+void ThreadPool::parallelFor(int count, const function<void(int)>& func)
+{
+    if (count <= 0) return;
+
+    // ワーカーがいないかジョブが1つなら呼び出し元で全部実行
+    if (workers.empty() || count == 1)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            func(i);
+        }
+        return;
+    }
+
+    {
+        lock_guard<mutex> lock(mutex_);
+        job = &func;
+        jobCount = count;
+        nextIndex = 0;
+        runningWorkers = int(workers.size());
+        ++generation;
+    }
+    startCondition.notify_all();
+
+    // 呼び出し元も処理に加わる
+    runJobs();
+
+    // 全てのワーカーが手を離すまで待つ
+    unique_lock<mutex> lock(mutex_);
+    doneCondition.wait(lock, [&]() { return runningWorkers == 0; });
+    job = nullptr;
+}
+
+
+// --------------------
+// WorkerThread
+// --------------------
+
+// コンストラクタ。スレッドを起動する
+WorkerThread::WorkerThread()
+{
+    thread = std::thread([this]() { threadMain(); });
+}
+
+
+// デストラクタ。実行中のジョブが終わってからスレッドを終了させる
+WorkerThread::~WorkerThread()
+{
+    {
+        unique_lock<mutex> lock(mutex_);
+        doneCondition.wait(lock, [&]() { return !busy; });
+        quit = true;
+    }
+    startCondition.notify_one();
+    thread.join();
+}
+
+
+// スレッドの本体
+void WorkerThread::threadMain()
+{
+    while (true)
+    {
+        function<void()> func;
+        {
+            unique_lock<mutex> lock(mutex_);
+            startCondition.wait(lock, [&]() { return quit || busy; });
+            if (quit) return;
+            func = std::move(job);
+        }
+
+        func();
+
+        {
+            lock_guard<mutex> lock(mutex_);
+            busy = false;
+        }
+        doneCondition.notify_all();
+    }
+}
+
+
+// ジョブを渡して実行させる
+void WorkerThread::run(function<void()> func)
+{
+    {
+        unique_lock<mutex> lock(mutex_);
+        doneCondition.wait(lock, [&]() { return !busy; });
+        job = std::move(func);
+        busy = true;
+    }
+    startCondition.notify_one();
+}
+
+
+// 渡したジョブが終わるまで待つ
+void WorkerThread::wait()
+{
+    unique_lock<mutex> lock(mutex_);
+    doneCondition.wait(lock, [&]() { return !busy; });
+}
+
+
+// ジョブを実行中か
+bool WorkerThread::isBusy()
+{
+    lock_guard<mutex> lock(mutex_);
+    return busy;
+}
+
+} // namespace UniDx
@@ -0,0 +1,612 @@
+﻿#include "pch.h"
+#include <UniDx/TriangleMeshBVH.h>
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+
+#include <UniDx/Mesh.h>
+#include <UniDx/Debug.h>
+
+
+namespace
+{
+
+using namespace UniDx;
+using namespace std;
+
+constexpr float infinity = numeric_limits<float>::infinity();
+
+// 保存形式
+constexpr uint32_t fileMagic = 0x48564255;  // "UBVH"
+constexpr uint32_t fileVersion = 1;
+
+struct FileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vertexCount;
+    uint32_t triangleCount;
+    uint32_t nodeCount;
+    float boundsMin[3];
+    float boundsMax[3];
+};
+
+// 構築の定数
+constexpr int sahBins = 16;             // 表面積ヒューリスティックで分割位置を探すビンの数
+constexpr int medianSplitDepth = 64;    // これより深いノードは中央で分けて、深さを抑える
+constexpr float quantizeMax = 65535.0f;
+
+// 構築中の三角形の範囲と重心
+struct BuildTriangle
+{
+    Vector3 min;
+    Vector3 max;
+    Vector3 centroid;
+};
+
+struct BuildContext
+{
+    vector<BuildTriangle> triangles;
+    vector<uint32_t> order;
+    vector<TriangleMeshBVH::Node>* nodes;
+    Vector3 origin;
+    Vector3 scale;
+};
+
+
+// 成分を取り出す
+float axisOf(const Vector3& v, int axis)
+{
+    return (&v.x)[axis];
+}
+
+
+// 箱の表面積の半分
+float halfArea(Vector3 mn, Vector3 mx)
+{
+    const Vector3 d = mx - mn;
+    return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+
+// 基準点からの座標を量子化する。最小は切り捨て、最大は切り上げて、元の範囲を必ず含むようにする
+void quantizeRange(Vector3 mn, Vector3 mx, Vector3 origin, Vector3 scale, uint16_t qmin[3], uint16_t qmax[3])
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        const float lo = std::floor((axisOf(mn, i) - axisOf(origin, i)) * axisOf(scale, i));
+        const float hi = std::ceil((axisOf(mx, i) - axisOf(origin, i)) * axisOf(scale, i));
+        qmin[i] = uint16_t(std::clamp(lo, 0.0f, quantizeMax));
+        qmax[i] = uint16_t(std::clamp(hi, 0.0f, quantizeMax));
+    }
+}
+
+
+// ノードを作って、子を再帰的に作る。戻り値はノードのインデクス
+uint32_t buildNode(BuildContext& ctx, int begin, int end, int depth)
+{
+    const uint32_t index = uint32_t(ctx.nodes->size());
+    ctx.nodes->push_back(TriangleMeshBVH::Node());
+
+    Vector3 mn(infinity, infinity, infinity), mx(-infinity, -infinity, -infinity);
+    Vector3 cmn = mn, cmx = mx;
+    for (int i = begin; i < end; ++i)
+    {
+        const BuildTriangle& t = ctx.triangles[ctx.order[i]];
+        mn = Vector3::Min(mn, t.min);
+        mx = Vector3::Max(mx, t.max);
+        cmn = Vector3::Min(cmn, t.centroid);
+        cmx = Vector3::Max(cmx, t.centroid);
+    }
+    quantizeRange(mn, mx, ctx.origin, ctx.scale, (*ctx.nodes)[index].min, (*ctx.nodes)[index].max);
+
+    const int count = end - begin;
+    if (count <= TriangleMeshBVH::maxLeafTriangles)
+    {
+        (*ctx.nodes)[index].data = TriangleMeshBVH::leafFlag | uint32_t(begin) << 4 | uint32_t(count);
+        return index;
+    }
+
+    // 重心の広がりが一番大きい軸で分ける
+    const Vector3 extent = cmx - cmn;
+    const int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+    const float cmin = axisOf(cmn, axis);
+    const float cextent = axisOf(extent, axis);
+
+    int mid = begin;
+    if (cextent > 1e-12f && depth < medianSplitDepth)
+    {
+        // 重心をビンに分け、左右の表面積×三角形数が一番小さくなる境目を探す
+        auto binOf = [&](uint32_t t) {
+            return std::min(int((axisOf(ctx.triangles[t].centroid, axis) - cmin) / cextent * sahBins), sahBins - 1);
+        };
+
+        Vector3 binMin[sahBins], binMax[sahBins];
+        int binCount[sahBins] = {};
+        for (int b = 0; b < sahBins; ++b)
+        {
+            binMin[b] = Vector3(infinity, infinity, infinity);
+            binMax[b] = Vector3(-infinity, -infinity, -infinity);
+        }
+        for (int i = begin; i < end; ++i)
+        {
+            const BuildTriangle& t = ctx.triangles[ctx.order[i]];
+            const int b = binOf(ctx.order[i]);
+            binMin[b] = Vector3::Min(binMin[b], t.min);
+            binMax[b] = Vector3::Max(binMax[b], t.max);
+            binCount[b]++;
+        }
+
+        // 左から累積した表面積と数
+        float leftArea[sahBins];
+        int leftCount[sahBins];
+        Vector3 accMin(infinity, infinity, infinity), accMax(-infinity, -infinity, -infinity);
+        int acc = 0;
+        for (int b = 0; b < sahBins - 1; ++b)
+        {
+            accMin = Vector3::Min(accMin, binMin[b]);
+            accMax = Vector3::Max(accMax, binMax[b]);
+            acc += binCount[b];
+            leftArea[b] = acc > 0 ? halfArea(accMin, accMax) : 0.0f;
+            leftCount[b] = acc;
+        }
+
+        // 右から累積しながら境目ごとの費用を比べる
+        float bestCost = infinity;
+        int bestSplit = -1;
+        accMin = Vector3(infinity, infinity, infinity);
+        accMax = Vector3(-infinity, -infinity, -infinity);
+        acc = 0;
+        for (int b = sahBins - 1; b > 0; --b)
+        {
+            accMin = Vector3::Min(accMin, binMin[b]);
+            accMax = Vector3::Max(accMax, binMax[b]);
+            acc += binCount[b];
+            if (acc == 0 || leftCount[b - 1] == 0) continue;
+
+            const float cost = leftArea[b - 1] * leftCount[b - 1] + halfArea(accMin, accMax) * acc;
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestSplit = b;
+            }
+        }
+
+        if (bestSplit > 0)
+        {
+            mid = int(std::partition(ctx.order.begin() + begin, ctx.order.begin() + end,
+                [&](uint32_t t) { return binOf(t) < bestSplit; }) - ctx.order.begin());
+        }
+    }
+
+    // 分けられなかったときは重心の中央で半分にする
+    if (mid <= begin || mid >= end)
+    {
+        mid = begin + count / 2;
+        std::nth_element(ctx.order.begin() + begin, ctx.order.begin() + mid, ctx.order.begin() + end,
+            [&](uint32_t l, uint32_t r) { return axisOf(ctx.triangles[l].centroid, axis) < axisOf(ctx.triangles[r].centroid, axis); });
+    }
+
+    // 左の子はすぐ後ろに並ぶ
+    buildNode(ctx, begin, mid, depth + 1);
+    const uint32_t right = buildNode(ctx, mid, end, depth + 1);
+    (*ctx.nodes)[index].data = right;
+    return index;
+}
+
+
+// 半直線と箱の交差区間（スラブ法）
+bool rayBox_(Vector3 origin, Vector3 direction, Vector3 mn, Vector3 mx, float maxDistance)
+{
+    float tmin = 0.0f;
+    float tmax = maxDistance;
+    for (int i = 0; i < 3; ++i)
+    {
+        const float o = axisOf(origin, i);
+        const float d = axisOf(direction, i);
+        const float lo = axisOf(mn, i);
+        const float hi = axisOf(mx, i);
+        if (std::abs(d) < 1e-12f)
+        {
+            if (o < lo || o > hi) return false;
+            continue;
+        }
+        const float inv = 1.0f / d;
+        float t1 = (lo - o) * inv;
+        float t2 = (hi - o) * inv;
+        if (t1 > t2) std::swap(t1, t2);
+        tmin = std::max(tmin, t1);
+        tmax = std::min(tmax, t2);
+        if (tmin > tmax) return false;
+    }
+    return true;
+}
+
+}
+
+
+namespace UniDx
+{
+
+// サブメッシュの三角形から作る
+void TriangleMeshBVH::build(const std::vector<std::shared_ptr<SubMesh>>& submeshes)
+{
+    clear();
+    for (const auto& sub : submeshes)
+    {
+        if (sub == nullptr || sub->topology != D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST) continue;
+        addTriangles(sub->positions, sub->indices);
+    }
+    buildTree();
+}
+
+
+// 頂点とインデクスから作る
+void TriangleMeshBVH::build(std::span<const Vector3> positions, std::span<const uint32_t> indices)
+{
+    clear();
+    addTriangles(positions, indices);
+    buildTree();
+}
+
+
+// 三角形を加える。範囲外のインデクスと面積のない三角形は除く
+void TriangleMeshBVH::addTriangles(std::span<const Vector3> positions, std::span<const uint32_t> indices)
+{
+    const uint32_t base = uint32_t(vertices.size());
+    vertices.insert(vertices.end(), positions.begin(), positions.end());
+
+    const size_t count = indices.empty() ? positions.size() / 3 : indices.size() / 3;
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint32_t t[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            t[k] = indices.empty() ? uint32_t(i * 3 + k) : indices[i * 3 + k];
+        }
+        if (t[0] >= positions.size() || t[1] >= positions.size() || t[2] >= positions.size()) continue;
+
+        const Vector3 n = (positions[t[1]] - positions[t[0]]).Cross(positions[t[2]] - positions[t[0]]);
+        if (n.LengthSquared() < 1e-20f) continue;
+
+        triangles.push_back(base + t[0]);
+        triangles.push_back(base + t[1]);
+        triangles.push_back(base + t[2]);
+    }
+}
+
+
+// 木を作り、三角形を葉の順に並べ替える
+void TriangleMeshBVH::buildTree()
+{
+    nodes.clear();
+    const int count = getTriangleCount();
+    if (count == 0)
+    {
+        boundsMin = boundsMax = Vector3::Zero;
+        return;
+    }
+    assert(uint32_t(count) < (1u << 27));
+
+    BuildContext ctx;
+    ctx.triangles.resize(count);
+    ctx.order.resize(count);
+    boundsMin = Vector3(infinity, infinity, infinity);
+    boundsMax = Vector3(-infinity, -infinity, -infinity);
+    for (int i = 0; i < count; ++i)
+    {
+        Vector3 a, b, c;
+        getTriangle(i, a, b, c);
+        BuildTriangle& t = ctx.triangles[i];
+        t.min = Vector3::Min(a, Vector3::Min(b, c));
+        t.max = Vector3::Max(a, Vector3::Max(b, c));
+        t.centroid = (a + b + c) / 3.0f;
+        boundsMin = Vector3::Min(boundsMin, t.min);
+        boundsMax = Vector3::Max(boundsMax, t.max);
+        ctx.order[i] = uint32_t(i);
+    }
+
+    const Vector3 extent = boundsMax - boundsMin;
+    quantizeScale = Vector3(
+        quantizeMax / std::max(extent.x, 1e-6f),
+        quantizeMax / std::max(extent.y, 1e-6f),
+        quantizeMax / std::max(extent.z, 1e-6f));
+
+    nodes.reserve(size_t(count) * 2 / maxLeafTriangles + 1);
+    ctx.nodes = &nodes;
+    ctx.origin = boundsMin;
+    ctx.scale = quantizeScale;
+    buildNode(ctx, 0, count, 0);
+
+    // 葉から連続して読めるように三角形を並べ替える
+    std::vector<uint32_t> sorted(triangles.size());
+    for (int i = 0; i < count; ++i)
+    {
+        const uint32_t* t = &triangles[size_t(ctx.order[i]) * 3];
+        sorted[size_t(i) * 3 + 0] = t[0];
+        sorted[size_t(i) * 3 + 1] = t[1];
+        sorted[size_t(i) * 3 + 2] = t[2];
+    }
+    triangles.swap(sorted);
+}
+
+
+// 空にする
+void TriangleMeshBVH::clear()
+{
+    vertices.clear();
+    triangles.clear();
+    nodes.clear();
+    boundsMin = boundsMax = Vector3::Zero;
+    quantizeScale = Vector3::One;
+}
+
+
+// ローカル空間の範囲を量子化する。メッシュの範囲と重ならなければ false
+bool TriangleMeshBVH::quantize(const Bounds& bounds, uint16_t qmin[3], uint16_t qmax[3]) const
+{
+    const Vector3 mn = bounds.min();
+    const Vector3 mx = bounds.max();
+    if (mx.x < boundsMin.x || mx.y < boundsMin.y || mx.z < boundsMin.z ||
+        mn.x > boundsMax.x || mn.y > boundsMax.y || mn.z > boundsMax.z) return false;
+
+    quantizeRange(mn, mx, boundsMin, quantizeScale, qmin, qmax);
+    return true;
+}
+
+
+// ノードの範囲をローカル座標に戻す
+void TriangleMeshBVH::dequantize(const Node& node, Vector3& mn, Vector3& mx) const
+{
+    mn = boundsMin + Vector3(node.min[0] / quantizeScale.x, node.min[1] / quantizeScale.y, node.min[2] / quantizeScale.z);
+    mx = boundsMin + Vector3(node.max[0] / quantizeScale.x, node.max[1] / quantizeScale.y, node.max[2] / quantizeScale.z);
+}
+
+
+// 線分と最初に交わる三角形
+bool TriangleMeshBVH::raycast(Vector3 origin, Vector3 direction, float maxDistance, float& t, int& triangle) const
+{
+    if (nodes.empty()) return false;
+
+    float best = maxDistance;
+    triangle = -1;
+
+    uint32_t stack[maxDepth];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        const Node& node = nodes[stack[--top]];
+        Vector3 mn, mx;
+        dequantize(node, mn, mx);
+        if (!rayBox_(origin, direction, mn, mx, best)) continue;
+
+        if (node.data & leafFlag)
+        {
+            const int first = int((node.data & ~leafFlag) >> 4);
+            const int count = int(node.data & 0xF);
+            for (int i = first; i < first + count; ++i)
+            {
+                Vector3 a, b, c;
+                getTriangle(i, a, b, c);
+                float hit;
+                if (raycastTriangle(origin, direction, a, b, c, best, hit))
+                {
+                    best = hit;
+                    triangle = i;
+                }
+            }
+        }
+        else
+        {
+            stack[top++] = node.data;
+            stack[top++] = uint32_t(&node - nodes.data()) + 1;
+        }
+    }
+
+    if (triangle < 0) return false;
+    t = best;
+    return true;
+}
+
+
+// 三角形の上で point に一番近い点
+Vector3 TriangleMeshBVH::closestPointOnTriangle(Vector3 p, Vector3 a, Vector3 b, Vector3 c)
+{
+    const Vector3 ab = b - a;
+    const Vector3 ac = c - a;
+    const Vector3 ap = p - a;
+    const float d1 = ab.Dot(ap);
+    const float d2 = ac.Dot(ap);
+    if (d1 <= 0.0f && d2 <= 0.0f) return a;
+
+    const Vector3 bp = p - b;
+    const float d3 = ab.Dot(bp);
+    const float d4 = ac.Dot(bp);
+    if (d3 >= 0.0f && d4 <= d3) return b;
+
+    const float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) return a + ab * (d1 / (d1 - d3));
+
+    const Vector3 cp = p - c;
+    const float d5 = ab.Dot(cp);
+    const float d6 = ac.Dot(cp);
+    if (d6 >= 0.0f && d5 <= d6) return c;
+
+    const float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) return a + ac * (d2 / (d2 - d6));
+
+    const float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+    const float denom = 1.0f / (va + vb + vc);
+    return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+
+// 線分と三角形の交差
+bool TriangleMeshBVH::raycastTriangle(Vector3 origin, Vector3 direction, Vector3 a, Vector3 b, Vector3 c, float maxDistance, float& t)
+{
+    const Vector3 e1 = b - a;
+    const Vector3 e2 = c - a;
+    const Vector3 p = direction.Cross(e2);
+    const float det = e1.Dot(p);
+    if (std::abs(det) < 1e-12f) return false;
+
+    const float invDet = 1.0f / det;
+    const Vector3 s = origin - a;
+    const float u = s.Dot(p) * invDet;
+    if (u < 0.0f || u > 1.0f) return false;
+
+    const Vector3 q = s.Cross(e1);
+    const float v = direction.Dot(q) * invDet;
+    if (v < 0.0f || u + v > 1.0f) return false;
+
+    const float hit = e2.Dot(q) * invDet;
+    if (hit < 0.0f || hit > maxDistance) return false;
+
+    t = hit;
+    return true;
+}
+
+
+// バイト列に保存
+void TriangleMeshBVH::save(std::vector<uint8_t>& out) const
+{
+    FileHeader header;
+    header.magic = fileMagic;
+    header.version = fileVersion;
+    header.vertexCount = uint32_t(vertices.size());
+    header.triangleCount = uint32_t(getTriangleCount());
+    header.nodeCount = uint32_t(nodes.size());
+    for (int i = 0; i < 3; ++i)
+    {
+        header.boundsMin[i] = axisOf(boundsMin, i);
+        header.boundsMax[i] = axisOf(boundsMax, i);
+    }
+
+    const size_t vertexBytes = sizeof(float) * 3 * vertices.size();
+    const size_t triangleBytes = sizeof(uint32_t) * triangles.size();
+    const size_t nodeBytes = sizeof(Node) * nodes.size();
+    out.resize(sizeof(header) + vertexBytes + triangleBytes + nodeBytes);
+
+    uint8_t* p = out.data();
+    std::memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    for (const auto& v : vertices)
+    {
+        const float xyz[3] = { v.x, v.y, v.z };
+        std::memcpy(p, xyz, sizeof(xyz));
+        p += sizeof(xyz);
+    }
+    if (triangleBytes > 0) std::memcpy(p, triangles.data(), triangleBytes);
+    p += triangleBytes;
+    if (nodeBytes > 0) std::memcpy(p, nodes.data(), nodeBytes);
+}
+
+
+// バイト列から読み込む
+bool TriangleMeshBVH::load(const uint8_t* data, size_t size)
+{
+    clear();
+
+    FileHeader header;
+    if (size < sizeof(header)) return false;
+    std::memcpy(&header, data, sizeof(header));
+    if (header.magic != fileMagic || header.version != fileVersion) return false;
+
+    const size_t vertexBytes = sizeof(float) * 3 * size_t(header.vertexCount);
+    const size_t triangleBytes = sizeof(uint32_t) * 3 * size_t(header.triangleCount);
+    const size_t nodeBytes = sizeof(Node) * size_t(header.nodeCount);
+    if (size != sizeof(header) + vertexBytes + triangleBytes + nodeBytes) return false;
+
+    const uint8_t* p = data + sizeof(header);
+    vertices.resize(header.vertexCount);
+    for (auto& v : vertices)
+    {
+        float xyz[3];
+        std::memcpy(xyz, p, sizeof(xyz));
+        p += sizeof(xyz);
+        v = Vector3(xyz[0], xyz[1], xyz[2]);
+    }
+    triangles.resize(size_t(header.triangleCount) * 3);
+    if (triangleBytes > 0) std::memcpy(triangles.data(), p, triangleBytes);
+    p += triangleBytes;
+    nodes.resize(header.nodeCount);
+    if (nodeBytes > 0) std::memcpy(nodes.data(), p, nodeBytes);
+
+    // 壊れたデータで範囲外を読まないよう、インデクスを確かめる
+    bool valid = true;
+    for (uint32_t index : triangles)
+    {
+        valid = valid && index < header.vertexCount;
+    }
+    for (size_t i = 0; i < nodes.size() && valid; ++i)
+    {
+        const uint32_t d = nodes[i].data;
+        if (d & leafFlag)
+        {
+            const uint32_t first = (d & ~leafFlag) >> 4;
+            valid = first + (d & 0xF) <= header.triangleCount;
+        }
+        else
+        {
+            valid = d > i + 1 && d < nodes.size();
+        }
+    }
+    if (!valid)
+    {
+        clear();
+        return false;
+    }
+
+    boundsMin = Vector3(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+    boundsMax = Vector3(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]);
+    const Vector3 extent = boundsMax - boundsMin;
+    quantizeScale = Vector3(
+        quantizeMax / std::max(extent.x, 1e-6f),
+        quantizeMax / std::max(extent.y, 1e-6f),
+        quantizeMax / std::max(extent.z, 1e-6f));
+    return true;
+}
+
+
+// ファイルに保存
+bool TriangleMeshBVH::saveFile(const std::wstring& filePath) const
+{
+    std::vector<uint8_t> bytes;
+    save(bytes);
+
+    std::ofstream file(std::filesystem::path(filePath), std::ios::binary);
+    if (!file || !file.write(reinterpret_cast<const char*>(bytes.data()), std::streamsize(bytes.size())))
+    {
+        Debug::Log(L"TriangleMeshBVH: failed to write " + filePath);
+        return false;
+    }
+    return true;
+}
+
+
+// ファイルから読み込む
+bool TriangleMeshBVH::loadFile(const std::wstring& filePath)
+{
+    std::ifstream file(std::filesystem::path(filePath), std::ios::binary);
+    if (!file)
+    {
+        Debug::Log(L"TriangleMeshBVH: failed to open " + filePath);
+        clear();
+        return false;
+    }
+    std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (!load(bytes.data(), bytes.size()))
+    {
+        Debug::Log(L"TriangleMeshBVH: invalid data in " + filePath);
+        return false;
+    }
+    return true;
+}
+
+} // namespace UniDx